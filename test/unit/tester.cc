@@ -2,6 +2,7 @@
 #define CATCH_CONFIG_MAIN  // This tells Catch to provide a main() - only do
                            // this in one cpp file
 
+#include <atomic>
 #include <cassert>
 #include <cstdio>
 #include <cstdlib>
@@ -1307,6 +1308,7 @@ TEST_CASE("Compressed is smaller than uncompressed", "[Issue40]") {
   const char* err;
   int const ret = SaveEXRImageToFile(&image, &header, "issue40.exr", &err);
   REQUIRE(ret == TINYEXR_SUCCESS);
+  remove("issue40.exr");
 
   free(header.channels);
   free(header.requested_pixel_types);
@@ -1743,3 +1745,2913 @@ TEST_CASE("Regression: Issue194|Piz", "[issue194]") {
   FreeEXRHeader(&header);
   FreeEXRImage(&image);
 }
+
+TEST_CASE("ThreadPool", "[ThreadPool]") {
+  EXRThreadPool* pool = CreateEXRThreadPool(3);
+#if TINYEXR_USE_THREAD
+  REQUIRE(NULL != pool);
+  REQUIRE(3 == EXRThreadPoolNumThreads(pool));
+#else
+  REQUIRE(NULL == pool);
+  REQUIRE(1 == EXRThreadPoolNumThreads(pool));
+#endif
+
+  EXRSetGlobalThreadPool(pool);
+
+  // Load twice to reuse the pool.
+  for (int i = 0; i < 2; i++) {
+    float* rgba = NULL;
+    int width, height;
+    const char* err = NULL;
+    int ret = LoadEXR(&rgba, &width, &height, "../../asakusa.exr", &err);
+    REQUIRE(TINYEXR_SUCCESS == ret);
+    REQUIRE(660 == width);
+    REQUIRE(440 == height);
+    free(rgba);
+  }
+
+  EXRSetGlobalThreadPool(NULL);
+  FreeEXRThreadPool(pool);
+
+  REQUIRE(1 <= EXRThreadPoolNumThreads(NULL));
+}
+
+static int g_parallel_for_calls = 0;
+
+// Serial executor for testing.
+static void SerialParallelFor(void* ctx, int begin, int end,
+                              void (*fn)(void*, int)) {
+  g_parallel_for_calls++;
+  for (int i = begin; i < end; i++) {
+    fn(ctx, i);
+  }
+}
+
+TEST_CASE("ParallelOptions", "[ParallelOptions]") {
+  const char* filepath = "../../asakusa.exr";
+  EXRVersion exr_version;
+  int ret = ParseEXRVersionFromFile(&exr_version, filepath);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRHeader header;
+  InitEXRHeader(&header);
+  const char* err = NULL;
+  ret = ParseEXRHeaderFromFile(&header, &exr_version, filepath, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRParallelOptions options;
+  InitEXRParallelOptions(&options);
+  options.parallel_for = SerialParallelFor;
+
+  EXRImage image;
+  InitEXRImage(&image);
+  g_parallel_for_calls = 0;
+  ret = LoadEXRImageFromFileWithOptions(&image, &header, filepath, &options,
+                                        &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  REQUIRE(0 < g_parallel_for_calls);
+
+  unsigned char* mem = NULL;
+  g_parallel_for_calls = 0;
+  size_t mem_size =
+      SaveEXRImageToMemoryWithOptions(&image, &header, &mem, &options, &err);
+  REQUIRE(0 < mem_size);
+  REQUIRE(0 < g_parallel_for_calls);
+
+  // Single-threaded load of the saved image.
+  InitEXRParallelOptions(&options);
+  options.max_threads = 1;
+
+  EXRHeader header2;
+  InitEXRHeader(&header2);
+  ret = ParseEXRHeaderFromMemory(&header2, &exr_version, mem, mem_size, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRImage image2;
+  InitEXRImage(&image2);
+  ret = LoadEXRImageFromMemoryWithOptions(&image2, &header2, mem, mem_size,
+                                          &options, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  REQUIRE(image.width == image2.width);
+  REQUIRE(image.height == image2.height);
+  REQUIRE(image.num_channels == image2.num_channels);
+
+  free(mem);
+  FreeEXRImage(&image);
+  FreeEXRImage(&image2);
+  FreeEXRHeader(&header);
+  FreeEXRHeader(&header2);
+}
+
+TEST_CASE("LoadEXRImageRegion", "[Region]") {
+  const char* filepath = "../../asakusa.exr";
+  EXRVersion exr_version;
+  int ret = ParseEXRVersionFromFile(&exr_version, filepath);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRHeader header;
+  InitEXRHeader(&header);
+  const char* err = NULL;
+  ret = ParseEXRHeaderFromFile(&header, &exr_version, filepath, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRImage image;
+  InitEXRImage(&image);
+  ret = LoadEXRImageFromFile(&image, &header, filepath, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRHeader region_header;
+  InitEXRHeader(&region_header);
+  ret = ParseEXRHeaderFromFile(&region_header, &exr_version, filepath, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRBox2i roi;
+  roi.min_x = header.data_window.min_x + 13;
+  roi.min_y = header.data_window.min_y + 37;
+  roi.max_x = header.data_window.min_x + 200;
+  roi.max_y = header.data_window.min_y + 101;
+
+  EXRImage region;
+  InitEXRImage(&region);
+  ret = LoadEXRImageRegionFromFile(&region, &region_header, filepath, &roi,
+                                   &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  REQUIRE(188 == region.width);
+  REQUIRE(65 == region.height);
+  REQUIRE(image.num_channels == region.num_channels);
+
+  // Region must be identical to the crop of the whole image.
+  for (int c = 0; c < image.num_channels; c++) {
+    size_t pixel_size =
+        (header.pixel_types[c] == TINYEXR_PIXELTYPE_HALF) ? 2 : 4;
+    for (int y = 0; y < region.height; y++) {
+      const unsigned char* src =
+          image.images[c] +
+          pixel_size * (size_t(y + 37) * size_t(image.width) + 13);
+      const unsigned char* dst =
+          region.images[c] + pixel_size * size_t(y) * size_t(region.width);
+      REQUIRE(0 == memcmp(src, dst, pixel_size * size_t(region.width)));
+    }
+  }
+
+  FreeEXRImage(&image);
+  FreeEXRImage(&region);
+  FreeEXRHeader(&header);
+  FreeEXRHeader(&region_header);
+}
+
+TEST_CASE("LoadEXRImageToFrameBuffer", "[FrameBuffer]") {
+  const char* filepath = "../../asakusa.exr";
+  EXRVersion exr_version;
+  int ret = ParseEXRVersionFromFile(&exr_version, filepath);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRHeader header;
+  InitEXRHeader(&header);
+  const char* err = NULL;
+  ret = ParseEXRHeaderFromFile(&header, &exr_version, filepath, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  for (int c = 0; c < header.num_channels; c++) {
+    if (header.pixel_types[c] == TINYEXR_PIXELTYPE_HALF) {
+      header.requested_pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+    }
+  }
+
+  EXRImage image;
+  InitEXRImage(&image);
+  ret = LoadEXRImageFromFile(&image, &header, filepath, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  // Decode interleaved into the sub rectangle at (5, 3) of a larger atlas.
+  const size_t num_channels = size_t(header.num_channels);
+  const size_t atlas_width = size_t(image.width) + 16;
+  const size_t atlas_height = size_t(image.height) + 8;
+  std::vector<float> atlas(atlas_width * atlas_height * num_channels, -1.0f);
+  float* origin = &atlas[(3 * atlas_width + 5) * num_channels];
+
+  std::vector<EXRFrameBufferSlice> slices(num_channels);
+  for (size_t c = 0; c < num_channels; c++) {
+    slices[c].base = reinterpret_cast<unsigned char*>(origin + c);
+    slices[c].x_stride = sizeof(float) * num_channels;
+    slices[c].y_stride = sizeof(float) * num_channels * atlas_width;
+    slices[c].pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+    slices[c].pad0 = 0;
+  }
+
+  ret = LoadEXRImageToFrameBufferFromFile(&header, filepath, slices.data(),
+                                          &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  // Must be identical to the image loaded by `LoadEXRImageFromFile`.
+  for (size_t c = 0; c < num_channels; c++) {
+    const float* src = reinterpret_cast<const float*>(image.images[c]);
+    for (int y = 0; y < image.height; y++) {
+      for (int x = 0; x < image.width; x++) {
+        REQUIRE(src[size_t(y) * size_t(image.width) + size_t(x)] ==
+                origin[(size_t(y) * atlas_width + size_t(x)) * num_channels +
+                       c]);
+      }
+    }
+  }
+  // Outside of the sub rectangle must not be touched.
+  REQUIRE(-1.0f == atlas[0]);
+  REQUIRE(-1.0f == atlas[atlas.size() - 1]);
+
+  FreeEXRImage(&image);
+  FreeEXRHeader(&header);
+}
+
+TEST_CASE("LoadEXRImageToFrameBuffer|Tiled|LineOrder", "[FrameBuffer]") {
+  // 2x2 tiles, partial at the right and the bottom.
+  const int width = 5;
+  const int height = 7;
+  const int tile_size = 4;
+  std::vector<float> pixels(size_t(width * height));
+  for (size_t i = 0; i < pixels.size(); i++) {
+    pixels[i] = float(i);
+  }
+
+  EXRTile tiles[4];
+  std::vector<float> tile_pixels[4];
+  unsigned char* tile_images[4];
+  for (int t = 0; t < 4; t++) {
+    EXRTile& tile = tiles[t];
+    memset(&tile, 0, sizeof(EXRTile));
+    tile.offset_x = t % 2;
+    tile.offset_y = t / 2;
+    tile.width = (std::min)(tile_size, width - tile.offset_x * tile_size);
+    tile.height = (std::min)(tile_size, height - tile.offset_y * tile_size);
+    tile_pixels[t].resize(size_t(tile_size * tile_size));
+    for (int y = 0; y < tile.height; y++) {
+      for (int x = 0; x < tile.width; x++) {
+        tile_pixels[t][size_t(y * tile_size + x)] =
+            pixels[size_t((tile.offset_y * tile_size + y) * width +
+                          tile.offset_x * tile_size + x)];
+      }
+    }
+    tile_images[t] = reinterpret_cast<unsigned char*>(&tile_pixels[t].at(0));
+    tile.images = &tile_images[t];
+  }
+
+  EXRHeader header;
+  InitEXRHeader(&header);
+  EXRChannelInfo channel;
+  memset(&channel, 0, sizeof(channel));
+  strcpy(channel.name, "R");
+  int pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+  header.num_channels = 1;
+  header.channels = &channel;
+  header.pixel_types = &pixel_type;
+  header.requested_pixel_types = &pixel_type;
+  header.compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;
+  header.tiled = 1;
+  header.tile_size_x = tile_size;
+  header.tile_size_y = tile_size;
+  header.tile_level_mode = TINYEXR_TILE_ONE_LEVEL;
+  header.data_window.max_x = width - 1;
+  header.data_window.max_y = height - 1;
+
+  EXRImage image;
+  InitEXRImage(&image);
+  image.num_channels = 1;
+  image.width = width;
+  image.height = height;
+  image.tiles = tiles;
+  image.num_tiles = 4;
+
+  const char* err = NULL;
+  unsigned char* mem = NULL;
+  size_t size = SaveEXRImageToMemory(&image, &header, &mem, &err);
+  REQUIRE(0 < size);
+
+  for (int line_order = 0; line_order < 2; line_order++) {
+    // The writer always stores INCREASING_Y. For a tiled file, line order
+    // only specifies the order of tiles, so the tile data stays valid.
+    const char kLineOrder[] = "lineOrder\0lineOrder\0";
+    unsigned char* value = NULL;
+    for (size_t i = 0; i + sizeof(kLineOrder) + 4 < size; i++) {
+      if (0 == memcmp(mem + i, kLineOrder, sizeof(kLineOrder) - 1)) {
+        value = mem + i + sizeof(kLineOrder) - 1 + 4;  // skip the size
+        break;
+      }
+    }
+    REQUIRE(NULL != value);
+    *value = static_cast<unsigned char>(line_order);
+
+    EXRVersion version;
+    REQUIRE(TINYEXR_SUCCESS == ParseEXRVersionFromMemory(&version, mem, size));
+    EXRHeader loaded_header;
+    InitEXRHeader(&loaded_header);
+    REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromMemory(
+                                   &loaded_header, &version, mem, size, &err));
+    REQUIRE(line_order == loaded_header.line_order);
+    REQUIRE(1 == loaded_header.tiled);
+
+    EXRImage loaded;
+    InitEXRImage(&loaded);
+    REQUIRE(TINYEXR_SUCCESS ==
+            LoadEXRImageFromMemory(&loaded, &loaded_header, mem, size, &err));
+    REQUIRE(4 == loaded.num_tiles);
+
+    std::vector<float> frame_buffer(pixels.size(), -1.0f);
+    EXRFrameBufferSlice slice;
+    memset(&slice, 0, sizeof(slice));
+    slice.base = reinterpret_cast<unsigned char*>(&frame_buffer.at(0));
+    slice.x_stride = sizeof(float);
+    slice.y_stride = sizeof(float) * size_t(width);
+    slice.pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+    REQUIRE(TINYEXR_SUCCESS ==
+            LoadEXRImageToFrameBufferFromMemory(&loaded_header, mem, size,
+                                                &slice, &err));
+
+    // Rows are never flipped in the frame buffer.
+    REQUIRE(pixels == frame_buffer);
+
+    // `LoadEXRImageFromMemory` flips the rows of each tile of a DECREASING_Y
+    // image within `tile_size_y` rows.
+    for (int t = 0; t < loaded.num_tiles; t++) {
+      const EXRTile& tile = loaded.tiles[t];
+      const float* src = reinterpret_cast<const float*>(tile.images[0]);
+      for (int y = 0; y < tile.height; y++) {
+        int row = line_order ? (tile_size - 1 - y) : y;
+        for (int x = 0; x < tile.width; x++) {
+          REQUIRE(src[size_t(row * tile_size + x)] ==
+                  frame_buffer[size_t((tile.offset_y * tile_size + y) * width +
+                                      tile.offset_x * tile_size + x)]);
+        }
+      }
+    }
+
+    FreeEXRImage(&loaded);
+    FreeEXRHeader(&loaded_header);
+  }
+
+  free(mem);
+}
+
+TEST_CASE("LoadEXRChannelMask", "[ChannelMask]") {
+  const char* filepath = "../../asakusa.exr";
+  EXRVersion exr_version;
+  int ret = ParseEXRVersionFromFile(&exr_version, filepath);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRHeader header;
+  InitEXRHeader(&header);
+  const char* err = NULL;
+  ret = ParseEXRHeaderFromFile(&header, &exr_version, filepath, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  REQUIRE(1 < header.num_channels);
+
+  EXRImage image;
+  InitEXRImage(&image);
+  ret = LoadEXRImageFromFile(&image, &header, filepath, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  // Store uncompressed so that the masked load reads the raw chunks too.
+  header.compression_type = TINYEXR_COMPRESSIONTYPE_NONE;
+  unsigned char* mem = NULL;
+  size_t size = SaveEXRImageToMemory(&image, &header, &mem, &err);
+  REQUIRE(0 < size);
+
+  const char* paths[2] = {filepath, NULL};
+  for (int p = 0; p < 2; p++) {
+    EXRHeader masked_header;
+    InitEXRHeader(&masked_header);
+    if (paths[p]) {
+      ret = ParseEXRHeaderFromFile(&masked_header, &exr_version, paths[p],
+                                   &err);
+    } else {
+      ret = ParseEXRHeaderFromMemory(&masked_header, &exr_version, mem, size,
+                                     &err);
+    }
+    REQUIRE(TINYEXR_SUCCESS == ret);
+
+    // Decode every other channel only.
+    std::vector<unsigned char> mask(size_t(masked_header.num_channels));
+    for (size_t c = 0; c < mask.size(); c++) {
+      mask[c] = (c % 2) ? 0 : 1;
+    }
+    masked_header.channel_mask = mask.data();
+
+    EXRImage masked;
+    InitEXRImage(&masked);
+    if (paths[p]) {
+      ret = LoadEXRImageFromFile(&masked, &masked_header, paths[p], &err);
+    } else {
+      ret = LoadEXRImageFromMemory(&masked, &masked_header, mem, size, &err);
+    }
+    REQUIRE(TINYEXR_SUCCESS == ret);
+    REQUIRE(image.num_channels == masked.num_channels);
+
+    for (int c = 0; c < masked.num_channels; c++) {
+      if (!mask[size_t(c)]) {
+        REQUIRE(NULL == masked.images[c]);
+        continue;
+      }
+      size_t pixel_size =
+          (masked_header.pixel_types[c] == TINYEXR_PIXELTYPE_HALF) ? 2 : 4;
+      REQUIRE(0 == memcmp(image.images[c], masked.images[c],
+                          pixel_size * size_t(image.width) *
+                              size_t(image.height)));
+    }
+
+    FreeEXRImage(&masked);
+    FreeEXRHeader(&masked_header);
+  }
+
+  free(mem);
+  FreeEXRImage(&image);
+  FreeEXRHeader(&header);
+
+  // Tiled: masked out channels get no tile buffer.
+  std::string tiled_path = "./regression/tiled_half_1x1_alpha.exr";
+  ret = ParseEXRVersionFromFile(&exr_version, tiled_path.c_str());
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  InitEXRHeader(&header);
+  ret = ParseEXRHeaderFromFile(&header, &exr_version, tiled_path.c_str(),
+                               &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  std::vector<unsigned char> mask(size_t(header.num_channels), 0);
+  header.channel_mask = mask.data();
+
+  InitEXRImage(&image);
+  ret = LoadEXRImageFromFile(&image, &header, tiled_path.c_str(), &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  REQUIRE(0 < image.num_tiles);
+  for (int i = 0; i < image.num_tiles; i++) {
+    for (int c = 0; c < image.num_channels; c++) {
+      REQUIRE(NULL == image.tiles[i].images[c]);
+    }
+  }
+
+  FreeEXRImage(&image);
+  FreeEXRHeader(&header);
+}
+
+TEST_CASE("EXRFile", "[File]") {
+  const char* filepath = "../../asakusa.exr";
+  EXRVersion exr_version;
+  int ret = ParseEXRVersionFromFile(&exr_version, filepath);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRHeader header;
+  InitEXRHeader(&header);
+  const char* err = NULL;
+  ret = ParseEXRHeaderFromFile(&header, &exr_version, filepath, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRImage image;
+  InitEXRImage(&image);
+  ret = LoadEXRImageFromFile(&image, &header, filepath, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRFile* file = NULL;
+  ret = OpenEXRFile(&file, filepath, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  REQUIRE(0 == memcmp(&exr_version, EXRFileVersion(file),
+                      sizeof(EXRVersion)));
+  size_t size = 0;
+  REQUIRE(NULL != EXRFileData(file, &size));
+  REQUIRE(0 < size);
+
+  EXRHeader file_header;
+  InitEXRHeader(&file_header);
+  ret = EXRFileParseHeader(file, &file_header, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  REQUIRE(header.num_channels == file_header.num_channels);
+  REQUIRE(header.header_len == file_header.header_len);
+
+  EXRImage file_image;
+  InitEXRImage(&file_image);
+  ret = EXRFileLoadImage(file, &file_image, &file_header, NULL, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  CloseEXRFile(file);
+
+  // Loaded images stay valid after the file is closed.
+  REQUIRE(image.width == file_image.width);
+  REQUIRE(image.height == file_image.height);
+  for (int c = 0; c < image.num_channels; c++) {
+    size_t pixel_size =
+        (header.pixel_types[c] == TINYEXR_PIXELTYPE_HALF) ? 2 : 4;
+    REQUIRE(0 == memcmp(image.images[c], file_image.images[c],
+                        pixel_size * size_t(image.width) *
+                            size_t(image.height)));
+  }
+  FreeEXRImage(&file_image);
+  FreeEXRHeader(&file_header);
+
+  // Multipart.
+  const char* multipart_path = "exr_file.exr";
+  EXRHeader header2 = header;
+  const EXRHeader* headers[2] = {&header, &header2};
+  EXRImage images[2] = {image, image};
+  strncpy(header.name, "part0", 255);
+  strncpy(header2.name, "part1", 255);
+  ret = SaveEXRMultipartImageToFile(images, headers, 2, multipart_path, &err);
+  header.name[0] = '\0';
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  ret = OpenEXRFile(&file, multipart_path, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  REQUIRE(EXRFileVersion(file)->multipart);
+
+  EXRHeader** part_headers = NULL;
+  int num_parts = 0;
+  ret = EXRFileParseMultipartHeader(file, &part_headers, &num_parts, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  REQUIRE(2 == num_parts);
+
+  std::vector<EXRImage> part_images(2);
+  for (size_t i = 0; i < part_images.size(); i++) {
+    InitEXRImage(&part_images[i]);
+  }
+  ret = EXRFileLoadMultipartImage(
+      file, part_images.data(), const_cast<const EXRHeader**>(part_headers),
+      2, NULL, &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  CloseEXRFile(file);
+  std::remove(multipart_path);
+
+  for (int i = 0; i < num_parts; i++) {
+    REQUIRE(image.width == part_images[size_t(i)].width);
+    for (int c = 0; c < image.num_channels; c++) {
+      size_t pixel_size =
+          (header.pixel_types[c] == TINYEXR_PIXELTYPE_HALF) ? 2 : 4;
+      REQUIRE(0 == memcmp(image.images[c], part_images[size_t(i)].images[c],
+                          pixel_size * size_t(image.width) *
+                              size_t(image.height)));
+    }
+    FreeEXRImage(&part_images[size_t(i)]);
+    FreeEXRHeader(part_headers[i]);
+    free(part_headers[i]);
+  }
+  free(part_headers);
+
+  FreeEXRImage(&image);
+  FreeEXRHeader(&header);
+
+  // Not an EXR file.
+  ret = OpenEXRFile(&file, "tester.cc", &err);
+  REQUIRE(TINYEXR_ERROR_INVALID_MAGIC_NUMBER == ret);
+  FreeEXRErrorMessage(err);
+  err = NULL;
+  ret = OpenEXRFile(&file, "not_found.exr", &err);
+  REQUIRE(TINYEXR_ERROR_CANT_OPEN_FILE == ret);
+  FreeEXRErrorMessage(err);
+}
+
+TEST_CASE("MmapAdvice", "[File]") {
+  EXRParallelOptions options;
+  InitEXRParallelOptions(&options);
+  options.mmap_advice = TINYEXR_MMAP_ADVICE_WILLNEED |
+                        TINYEXR_MMAP_ADVICE_SEQUENTIAL |
+                        TINYEXR_MMAP_ADVICE_DONTNEED;
+
+  // Scanline and tiled.
+  const char* paths[2] = {"../../asakusa.exr",
+                          "./regression/tiled_half_1x1_alpha.exr"};
+  for (int p = 0; p < 2; p++) {
+    const char* err = NULL;
+    EXRVersion exr_version;
+    REQUIRE(TINYEXR_SUCCESS == ParseEXRVersionFromFile(&exr_version, paths[p]));
+    EXRHeader header;
+    InitEXRHeader(&header);
+    REQUIRE(TINYEXR_SUCCESS ==
+            ParseEXRHeaderFromFile(&header, &exr_version, paths[p], &err));
+
+    EXRImage image;
+    InitEXRImage(&image);
+    REQUIRE(TINYEXR_SUCCESS ==
+            LoadEXRImageFromFile(&image, &header, paths[p], &err));
+
+    // Loading twice from the same mapping: the pages released after the
+    // first load are read again.
+    EXRFile* file = NULL;
+    REQUIRE(TINYEXR_SUCCESS == OpenEXRFile(&file, paths[p], &err));
+    EXRImage advised_images[3];
+    for (int i = 0; i < 3; i++) {
+      InitEXRImage(&advised_images[i]);
+      if (i < 2) {
+        REQUIRE(TINYEXR_SUCCESS == EXRFileLoadImage(file, &advised_images[i],
+                                                    &header, &options, &err));
+      } else {
+        REQUIRE(TINYEXR_SUCCESS ==
+                LoadEXRImageFromFileWithOptions(&advised_images[i], &header,
+                                                paths[p], &options, &err));
+      }
+    }
+    CloseEXRFile(file);
+
+    for (int i = 0; i < 3; i++) {
+      CompareImages(image, advised_images[i]);
+      for (int c = 0; c < header.num_channels; c++) {
+        size_t pixel_size =
+            (header.pixel_types[c] == TINYEXR_PIXELTYPE_HALF) ? 2 : 4;
+        if (header.tiled) {
+          for (int t = 0; t < image.num_tiles; t++) {
+            REQUIRE(0 == memcmp(image.tiles[t].images[c],
+                                advised_images[i].tiles[t].images[c],
+                                pixel_size * size_t(header.tile_size_x) *
+                                    size_t(header.tile_size_y)));
+          }
+        } else {
+          REQUIRE(0 == memcmp(image.images[c], advised_images[i].images[c],
+                              pixel_size * size_t(image.width) *
+                                  size_t(image.height)));
+        }
+      }
+      FreeEXRImage(&advised_images[i]);
+    }
+
+    FreeEXRImage(&image);
+    FreeEXRHeader(&header);
+  }
+
+  // Hints are not applied to the application's memory, even when it is page
+  // aligned.
+  std::ifstream f(paths[0], std::ifstream::binary);
+  REQUIRE(f.good());
+  f.seekg(0, f.end);
+  size_t size = static_cast<size_t>(f.tellg());
+  f.seekg(0, f.beg);
+  const size_t alignment = 65536;
+  std::vector<unsigned char> buffer(size + alignment);
+  unsigned char* memory =
+      &buffer.at(0) +
+      (alignment - reinterpret_cast<size_t>(&buffer.at(0)) % alignment);
+  f.read(reinterpret_cast<char*>(memory), static_cast<std::streamsize>(size));
+  f.close();
+  std::vector<unsigned char> copy(memory, memory + size);
+
+  const char* err = NULL;
+  EXRVersion exr_version;
+  REQUIRE(TINYEXR_SUCCESS ==
+          ParseEXRVersionFromMemory(&exr_version, memory, size));
+  EXRHeader header;
+  InitEXRHeader(&header);
+  REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromMemory(&header, &exr_version,
+                                                      memory, size, &err));
+  EXRImage image;
+  InitEXRImage(&image);
+  REQUIRE(TINYEXR_SUCCESS == LoadEXRImageFromMemoryWithOptions(
+                                 &image, &header, memory, size, &options,
+                                 &err));
+  REQUIRE(0 == memcmp(memory, &copy.at(0), size));
+  FreeEXRImage(&image);
+  FreeEXRHeader(&header);
+}
+
+TEST_CASE("LoadEXRMultipartImageParts", "[Multipart]") {
+  // 3 parts: scanline, tiled, scanline.
+  const char* paths[3] = {"../../asakusa.exr",
+                          "./regression/tiled_half_1x1_alpha.exr",
+                          "./regression/2by2.exr"};
+  EXRHeader src_headers[3];
+  EXRImage src_images[3];
+  const EXRHeader* src_header_ptrs[3];
+  const char* err = NULL;
+  for (int i = 0; i < 3; i++) {
+    EXRVersion exr_version;
+    REQUIRE(TINYEXR_SUCCESS == ParseEXRVersionFromFile(&exr_version, paths[i]));
+    InitEXRHeader(&src_headers[i]);
+    REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromFile(&src_headers[i],
+                                                      &exr_version, paths[i],
+                                                      &err));
+    InitEXRImage(&src_images[i]);
+    REQUIRE(TINYEXR_SUCCESS ==
+            LoadEXRImageFromFile(&src_images[i], &src_headers[i], paths[i],
+                                 &err));
+    snprintf(src_headers[i].name, 255, "part%d", i);
+    src_header_ptrs[i] = &src_headers[i];
+  }
+
+  unsigned char* mem = NULL;
+  size_t size = SaveEXRMultipartImageToMemory(src_images, src_header_ptrs, 3,
+                                              &mem, &err);
+  REQUIRE(0 < size);
+  for (int i = 0; i < 3; i++) {
+    src_headers[i].name[0] = '\0';
+    FreeEXRImage(&src_images[i]);
+    FreeEXRHeader(&src_headers[i]);
+  }
+
+  EXRVersion exr_version;
+  REQUIRE(TINYEXR_SUCCESS == ParseEXRVersionFromMemory(&exr_version, mem, size));
+  EXRHeader** headers = NULL;
+  int num_headers = 0;
+  REQUIRE(TINYEXR_SUCCESS ==
+          ParseEXRMultipartHeaderFromMemory(&headers, &num_headers,
+                                            &exr_version, mem, size, &err));
+  REQUIRE(3 == num_headers);
+  const EXRHeader** header_ptrs = const_cast<const EXRHeader**>(headers);
+
+  std::vector<EXRImage> images(3);
+  for (size_t i = 0; i < images.size(); i++) {
+    InitEXRImage(&images[i]);
+  }
+  REQUIRE(TINYEXR_SUCCESS == LoadEXRMultipartImageFromMemory(
+                                 images.data(), header_ptrs, 3, mem, size,
+                                 &err));
+
+  REQUIRE(2 == EXRFindPartByName(header_ptrs, 3, "part2"));
+  REQUIRE(-1 == EXRFindPartByName(header_ptrs, 3, "part3"));
+
+  // Load parts 2 and 1 only. The chunk offset table of part 0 is broken, so
+  // it must not be read.
+  std::vector<unsigned char> broken(mem, mem + size);
+  size_t table_offset = 8;
+  for (int i = 0; i < 3; i++) {
+    table_offset += headers[i]->header_len;
+  }
+  table_offset += 1;
+  memset(&broken[table_offset], 0xff, 8);
+
+  std::vector<EXRImage> parts(3);
+  for (size_t i = 0; i < parts.size(); i++) {
+    InitEXRImage(&parts[i]);
+  }
+  int part_indices[2] = {EXRFindPartByName(header_ptrs, 3, "part2"), 1};
+  REQUIRE(TINYEXR_SUCCESS == LoadEXRMultipartImagePartsFromMemory(
+                                 parts.data(), header_ptrs, 3, part_indices, 2,
+                                 broken.data(), broken.size(), NULL, &err));
+  REQUIRE(NULL == parts[0].images);
+  REQUIRE(NULL == parts[0].tiles);
+
+  // Scanline part.
+  REQUIRE(images[2].width == parts[2].width);
+  REQUIRE(images[2].height == parts[2].height);
+  for (int c = 0; c < headers[2]->num_channels; c++) {
+    size_t pixel_size =
+        (headers[2]->pixel_types[c] == TINYEXR_PIXELTYPE_HALF) ? 2 : 4;
+    REQUIRE(0 == memcmp(images[2].images[c], parts[2].images[c],
+                        pixel_size * size_t(images[2].width) *
+                            size_t(images[2].height)));
+  }
+
+  // Tiled part.
+  REQUIRE(images[1].num_tiles == parts[1].num_tiles);
+  for (int t = 0; t < images[1].num_tiles; t++) {
+    const EXRTile& a = images[1].tiles[t];
+    const EXRTile& b = parts[1].tiles[t];
+    REQUIRE(a.offset_x == b.offset_x);
+    REQUIRE(a.offset_y == b.offset_y);
+    REQUIRE(a.width == b.width);
+    REQUIRE(a.height == b.height);
+    for (int c = 0; c < headers[1]->num_channels; c++) {
+      size_t pixel_size =
+          (headers[1]->pixel_types[c] == TINYEXR_PIXELTYPE_HALF) ? 2 : 4;
+      REQUIRE(0 == memcmp(a.images[c], b.images[c],
+                          pixel_size * size_t(headers[1]->tile_size_x) *
+                              size_t(b.height)));
+    }
+  }
+
+  // Loading all parts reads the broken table.
+  std::vector<EXRImage> all(3);
+  for (size_t i = 0; i < all.size(); i++) {
+    InitEXRImage(&all[i]);
+  }
+  REQUIRE(TINYEXR_ERROR_INVALID_DATA == LoadEXRMultipartImageFromMemory(
+                                            all.data(), header_ptrs, 3,
+                                            broken.data(), broken.size(),
+                                            &err));
+  FreeEXRErrorMessage(err);
+  err = NULL;
+
+  // Invalid or duplicated part index.
+  int invalid_indices[2] = {1, 1};
+  REQUIRE(TINYEXR_ERROR_INVALID_ARGUMENT ==
+          LoadEXRMultipartImagePartsFromMemory(all.data(), header_ptrs, 3,
+                                               invalid_indices, 2, mem, size,
+                                               NULL, &err));
+  FreeEXRErrorMessage(err);
+  err = NULL;
+  invalid_indices[1] = 3;
+  REQUIRE(TINYEXR_ERROR_INVALID_ARGUMENT ==
+          LoadEXRMultipartImagePartsFromMemory(all.data(), header_ptrs, 3,
+                                               invalid_indices, 2, mem, size,
+                                               NULL, &err));
+  FreeEXRErrorMessage(err);
+
+  for (int i = 0; i < 3; i++) {
+    FreeEXRImage(&images[size_t(i)]);
+    FreeEXRImage(&parts[size_t(i)]);
+    FreeEXRImage(&all[size_t(i)]);
+    FreeEXRHeader(headers[i]);
+    free(headers[i]);
+  }
+  free(headers);
+  free(mem);
+}
+
+TEST_CASE("EXRTiledReader", "[TiledReader]") {
+  std::string filepath = "./regression/tiled_half_1x1_alpha.exr";
+
+  EXRVersion exr_version;
+  int ret = ParseEXRVersionFromFile(&exr_version, filepath.c_str());
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  REQUIRE(true == exr_version.tiled);
+
+  EXRHeader header;
+  InitEXRHeader(&header);
+  const char* err = NULL;
+  ret = ParseEXRHeaderFromFile(&header, &exr_version, filepath.c_str(), &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRTiledReader* reader = NULL;
+  ret = CreateEXRTiledReaderFromFile(&reader, &header, filepath.c_str(), &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRHeader full_header;
+  InitEXRHeader(&full_header);
+  ret = ParseEXRHeaderFromFile(&full_header, &exr_version, filepath.c_str(),
+                               &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  EXRImage image;
+  InitEXRImage(&image);
+  ret = LoadEXRImageFromFile(&image, &full_header, filepath.c_str(), &err);
+  REQUIRE(TINYEXR_SUCCESS == ret);
+
+  int num_x_levels = 0, num_y_levels = 0;
+  EXRTiledReaderNumLevels(reader, &num_x_levels, &num_y_levels);
+  REQUIRE(0 < num_x_levels);
+  REQUIRE(0 < num_y_levels);
+
+  size_t tile_pixels = size_t(header.tile_size_x) * size_t(header.tile_size_y);
+  std::vector<std::vector<unsigned char> > buffers(
+      size_t(header.num_channels), std::vector<unsigned char>(tile_pixels * 4));
+  std::vector<unsigned char*> images(size_t(header.num_channels));
+  for (size_t c = 0; c < images.size(); c++) {
+    images[c] = buffers[c].data();
+  }
+
+  // Tiles read on demand must be identical to the ones of the whole image.
+  int level = 0;
+  for (const EXRImage* level_image = &image; level_image;
+       level_image = level_image->next_level, level++) {
+    int width = 0, height = 0, num_x_tiles = 0, num_y_tiles = 0;
+    ret = EXRTiledReaderLevelInfo(reader, level, level, &width, &height,
+                                  &num_x_tiles, &num_y_tiles);
+    REQUIRE(TINYEXR_SUCCESS == ret);
+    REQUIRE(level_image->width == width);
+    REQUIRE(level_image->height == height);
+    REQUIRE(level_image->num_tiles == num_x_tiles * num_y_tiles);
+
+    for (int i = 0; i < level_image->num_tiles; i++) {
+      const EXRTile& tile = level_image->tiles[i];
+      int tile_width = 0, tile_height = 0;
+      ret = EXRTiledReaderReadTile(reader, level, level, tile.offset_x,
+                                   tile.offset_y, images.data(), &tile_width,
+                                   &tile_height, &err);
+      REQUIRE(TINYEXR_SUCCESS == ret);
+      REQUIRE(tile.width == tile_width);
+      REQUIRE(tile.height == tile_height);
+
+      for (int c = 0; c < header.num_channels; c++) {
+        size_t pixel_size =
+            (header.requested_pixel_types[c] == TINYEXR_PIXELTYPE_HALF) ? 2
+                                                                        : 4;
+        for (int y = 0; y < tile_height; y++) {
+          size_t offset = pixel_size * size_t(y) * size_t(header.tile_size_x);
+          REQUIRE(0 == memcmp(tile.images[c] + offset,
+                              images[size_t(c)] + offset,
+                              pixel_size * size_t(tile_width)));
+        }
+      }
+    }
+  }
+
+  int tile_width = 0, tile_height = 0;
+  ret = EXRTiledReaderReadTile(reader, num_x_levels, num_y_levels, 0, 0,
+                               images.data(), &tile_width, &tile_height, &err);
+  REQUIRE(TINYEXR_ERROR_INVALID_ARGUMENT == ret);
+  FreeEXRErrorMessage(err);
+
+  FreeEXRTiledReader(reader);
+  FreeEXRImage(&image);
+  FreeEXRHeader(&header);
+  FreeEXRHeader(&full_header);
+}
+
+TEST_CASE("HalfFloatLineConversion", "[HalfFloat]") {
+  // All half values, at an unaligned address.
+  std::vector<unsigned char> halfs(65536 * 2 + 1);
+  for (size_t i = 0; i < 65536; i++) {
+    halfs[1 + 2 * i] = static_cast<unsigned char>(i & 0xff);
+    halfs[2 + 2 * i] = static_cast<unsigned char>(i >> 8);
+  }
+
+  std::vector<float> floats(65536);
+  tinyexr::HalfToFloatLine(floats.data(), halfs.data() + 1, floats.size());
+  for (size_t i = 0; i < 65536; i++) {
+    tinyexr::FP16 h;
+    h.u = static_cast<unsigned short>(i);
+    tinyexr::FP32 f = tinyexr::half_to_float(h);
+    REQUIRE(0 == memcmp(&f.f, &floats[i], sizeof(float)));
+  }
+
+  // Rounding boundaries, denormals, overflow, Inf and NaN.
+  const unsigned int bits[] = {
+      0x00000000, 0x80000000, 0x00000001, 0x32ffffff, 0x33000000,
+      0x33000001, 0x387fefff, 0x387ff000, 0x38800000, 0x3f800fff,
+      0x3f801000, 0x3f802000, 0x477fe000, 0x477fefff, 0x477ff000,
+      0x7f7fffff, 0x7f800000, 0xff800000, 0x7f800001, 0x7fc00000,
+      0xbf801000, 0x42f6e979, 0x00800000, 0x387fffff, 0x3c000000};
+  const size_t num_bits = sizeof(bits) / sizeof(bits[0]);
+  std::vector<float> values(num_bits);
+  memcpy(values.data(), bits, sizeof(bits));
+
+  std::vector<unsigned char> out(num_bits * 2);
+  tinyexr::FloatToHalfLine(out.data(), values.data(), num_bits);
+  for (size_t i = 0; i < num_bits; i++) {
+    tinyexr::FP32 f;
+    f.f = values[i];
+    tinyexr::FP16 h = tinyexr::float_to_half_full(f);
+    unsigned short u = static_cast<unsigned short>(out[2 * i] |
+                                                   (out[2 * i + 1] << 8));
+    REQUIRE(h.u == u);
+  }
+}
+
+TEST_CASE("ZipReorderAndPredictor", "[ZipPredictor]") {
+  // Sizes around SIMD block boundaries, at an unaligned address.
+  for (size_t n = 0; n < 100; n++) {
+    std::vector<unsigned char> src(n + 1);
+    for (size_t i = 0; i < src.size(); i++) {
+      src[i] = static_cast<unsigned char>((i * 167 + n * 13) ^ (i >> 2));
+    }
+
+    // Reference: byte-by-byte reorder and predictor from OpenEXR.
+    std::vector<unsigned char> expected(n);
+    for (size_t i = 0; i < n; i++) {
+      size_t j = (i % 2 == 0) ? (i / 2) : ((n + 1) / 2 + i / 2);
+      expected[j] = src[1 + i];
+    }
+    for (size_t i = n; i > 1; i--) {
+      expected[i - 1] = static_cast<unsigned char>(
+          int(expected[i - 1]) - int(expected[i - 2]) + (128 + 256));
+    }
+
+    std::vector<unsigned char> encoded(n + 1);
+    tinyexr::SplitEvenOddBytes(encoded.data() + 1, src.data() + 1, n);
+    tinyexr::EncodeDeltaPredictor(encoded.data() + 1, n);
+    REQUIRE(std::equal(expected.begin(), expected.end(), encoded.begin() + 1));
+
+    std::vector<unsigned char> decoded(n + 1);
+    tinyexr::DecodeDeltaPredictor(encoded.data() + 1, n);
+    tinyexr::InterleaveBytes(decoded.data() + 1, encoded.data() + 1, n);
+    REQUIRE(std::equal(src.begin() + 1, src.end(), decoded.begin() + 1));
+  }
+}
+
+TEST_CASE("CodecScratchReuse", "[Scratch]") {
+  // Work buffers are reused across chunks and images on the same thread.
+  // Encode/decode images of different sizes and channel counts alternately.
+  const int compressions[] = {TINYEXR_COMPRESSIONTYPE_RLE,
+                              TINYEXR_COMPRESSIONTYPE_ZIP,
+                              TINYEXR_COMPRESSIONTYPE_PIZ};
+  const int sizes[][3] = {{131, 67, 4}, {7, 3, 1}, {64, 40, 3}};
+
+  for (size_t ci = 0; ci < 3; ci++) {
+    for (size_t si = 0; si < 3; si++) {
+      int width = sizes[si][0];
+      int height = sizes[si][1];
+      int num_channels = sizes[si][2];
+
+      EXRHeader header;
+      InitEXRHeader(&header);
+      header.compression_type = compressions[ci];
+      header.num_channels = num_channels;
+      header.channels = static_cast<EXRChannelInfo*>(
+          malloc(sizeof(EXRChannelInfo) * size_t(num_channels)));
+      header.pixel_types =
+          static_cast<int*>(malloc(sizeof(int) * size_t(num_channels)));
+      header.requested_pixel_types =
+          static_cast<int*>(malloc(sizeof(int) * size_t(num_channels)));
+
+      std::vector<std::vector<float> > planes(static_cast<size_t>(num_channels));
+      std::vector<float*> image_ptrs(static_cast<size_t>(num_channels));
+      const char* names[] = {"A", "B", "G", "R"};
+      for (int c = 0; c < num_channels; c++) {
+        strncpy(header.channels[c].name, names[c], 255);
+        header.pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+        header.requested_pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+        planes[size_t(c)].resize(size_t(width) * size_t(height));
+        for (size_t i = 0; i < planes[size_t(c)].size(); i++) {
+          planes[size_t(c)][i] = float((i * 7 + size_t(c) * 31) % 97) * 0.25f;
+        }
+        image_ptrs[size_t(c)] = planes[size_t(c)].data();
+      }
+
+      EXRImage image;
+      InitEXRImage(&image);
+      image.images = reinterpret_cast<unsigned char**>(image_ptrs.data());
+      image.width = width;
+      image.height = height;
+      image.num_channels = num_channels;
+
+      unsigned char* mem = NULL;
+      const char* err = NULL;
+      size_t size = SaveEXRImageToMemory(&image, &header, &mem, &err);
+      REQUIRE(0 < size);
+
+      EXRVersion version;
+      REQUIRE(TINYEXR_SUCCESS == ParseEXRVersionFromMemory(&version, mem, size));
+      EXRHeader loaded_header;
+      InitEXRHeader(&loaded_header);
+      REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromMemory(&loaded_header,
+                                                          &version, mem, size,
+                                                          &err));
+      EXRImage loaded;
+      InitEXRImage(&loaded);
+      REQUIRE(TINYEXR_SUCCESS ==
+              LoadEXRImageFromMemory(&loaded, &loaded_header, mem, size, &err));
+
+      for (int c = 0; c < num_channels; c++) {
+        REQUIRE(0 == memcmp(planes[size_t(c)].data(), loaded.images[c],
+                            sizeof(float) * planes[size_t(c)].size()));
+      }
+
+      FreeEXRImage(&loaded);
+      FreeEXRHeader(&loaded_header);
+      free(mem);
+      free(header.channels);
+      free(header.pixel_types);
+      free(header.requested_pixel_types);
+    }
+  }
+}
+
+TEST_CASE("HuffmanDecode", "[PIZ]") {
+  // Round trip through the PIZ Huffman coder. Skewed distributions produce
+  // long codes(> HUF_DECBITS) and runs.
+  tinyexr::PizScratch scratch;
+  for (int mode = 0; mode < 4; mode++) {
+    const size_t n = 50000;
+    std::vector<unsigned short> raw(n);
+    unsigned int seed = 12345;
+    for (size_t i = 0; i < n; i++) {
+      seed = seed * 1103515245u + 12345u;
+      unsigned int r = seed >> 8;
+      if (mode == 0) {
+        raw[i] = static_cast<unsigned short>(r);
+      } else if (mode == 1) {
+        // Geometric distribution: code lengths up to ~30 bits.
+        int k = 0;
+        while ((r & 1) && (k < 24)) {
+          r >>= 1;
+          k++;
+        }
+        raw[i] = static_cast<unsigned short>(k * 1000 + 3);
+      } else if (mode == 2) {
+        raw[i] = (r % 100 < 97) ? 7 : static_cast<unsigned short>(r % 5);
+      } else {
+        raw[i] = static_cast<unsigned short>(i < n / 2 ? 0 : (r & 63));
+      }
+    }
+
+    std::vector<char> compressed(n * 3 + 65536 * 8);
+    int compressed_size = tinyexr::hufCompress(
+        raw.data(), static_cast<int>(n), compressed.data(), &scratch);
+    REQUIRE(0 < compressed_size);
+
+    std::vector<unsigned short> decoded(n);
+    REQUIRE(tinyexr::hufUncompress(compressed.data(), compressed_size,
+                                   &decoded, &scratch));
+    REQUIRE(raw == decoded);
+
+    // Truncated data must be rejected.
+    REQUIRE_FALSE(tinyexr::hufUncompress(compressed.data(),
+                                         compressed_size / 2, &decoded,
+                                         &scratch));
+  }
+}
+
+TEST_CASE("PizWavelet", "[PIZ]") {
+  // Sizes around SIMD/block boundaries, 14-bit and 16-bit modes.
+  const int sizes[][2] = {{1, 1}, {2, 2}, {17, 9}, {64, 5}, {1029, 7}};
+  for (size_t si = 0; si < 5; si++) {
+    for (int w14 = 0; w14 < 2; w14++) {
+      int nx = sizes[si][0];
+      int ny = sizes[si][1];
+      std::vector<unsigned short> src(size_t(nx) * size_t(ny) * 2);
+      unsigned int seed = 777;
+      unsigned short mx = 0;
+      for (size_t i = 0; i < src.size(); i++) {
+        seed = seed * 1103515245u + 12345u;
+        src[i] = static_cast<unsigned short>(
+            (seed >> 8) & (w14 ? 0x3fffu : 0xffffu));
+        mx = (std::max)(mx, src[i]);
+      }
+
+      // Two interleaved planes transformed at once must match each plane
+      // transformed separately.
+      std::vector<unsigned short> a = src;
+      std::vector<unsigned short> b = src;
+      tinyexr::wav2Encode(a.data(), nx, 2, ny, nx * 2, mx, 2);
+      tinyexr::wav2Encode(b.data(), nx, 2, ny, nx * 2, mx, 1);
+      tinyexr::wav2Encode(b.data() + 1, nx, 2, ny, nx * 2, mx, 1);
+      REQUIRE(a == b);
+
+      tinyexr::wav2Decode(a.data(), nx, 2, ny, nx * 2, mx, 2);
+      REQUIRE(a == src);
+
+      // Single plane.
+      std::vector<unsigned short> c(src.begin(),
+                                    src.begin() + std::ptrdiff_t(nx * ny));
+      tinyexr::wav2Encode(c.data(), nx, 1, ny, nx, mx, 1);
+      tinyexr::wav2Decode(c.data(), nx, 1, ny, nx, mx, 1);
+      REQUIRE(std::equal(c.begin(), c.end(), src.begin()));
+    }
+  }
+}
+
+TEST_CASE("PizWavelet|Kernels", "[PIZ]") {
+  // The SIMD loops(AVX2, SSE2/NEON and their tails) must match the scalar
+  // basis functions.
+  for (int n = 0; n < 41; n++) {
+    for (int w14 = 0; w14 < 2; w14++) {
+      std::vector<unsigned short> src(size_t(n) * 2);
+      unsigned int seed = 1234u + unsigned(n);
+      for (size_t i = 0; i < src.size(); i++) {
+        seed = seed * 1103515245u + 12345u;
+        src[i] = static_cast<unsigned short>(
+            (seed >> 8) & (w14 ? 0x3fffu : 0xffffu));
+      }
+
+      for (int dec = 0; dec < 2; dec++) {
+        std::vector<unsigned short> pairs = src;
+        std::vector<unsigned short> adjacent = src;
+        unsigned short *a = pairs.data();
+        unsigned short *b = pairs.data() + n;
+        if (dec) {
+          tinyexr::wdecPairs(a, b, n, w14 != 0);
+          tinyexr::wdecAdjacentPairs(adjacent.data(), n, w14 != 0);
+        } else {
+          tinyexr::wencPairs(a, b, n, w14 != 0);
+          tinyexr::wencAdjacentPairs(adjacent.data(), n, w14 != 0);
+        }
+
+        for (int i = 0; i < n; i++) {
+          unsigned short x = src[size_t(i)];
+          unsigned short y = src[size_t(n + i)];
+          unsigned short u, v;
+          if (dec) {
+            if (w14)
+              tinyexr::wdec14(x, y, u, v);
+            else
+              tinyexr::wdec16(x, y, u, v);
+          } else {
+            if (w14)
+              tinyexr::wenc14(x, y, u, v);
+            else
+              tinyexr::wenc16(x, y, u, v);
+          }
+          REQUIRE(pairs[size_t(i)] == u);
+          REQUIRE(pairs[size_t(n + i)] == v);
+
+          x = src[size_t(2 * i)];
+          y = src[size_t(2 * i + 1)];
+          if (dec) {
+            if (w14)
+              tinyexr::wdec14(x, y, u, v);
+            else
+              tinyexr::wdec16(x, y, u, v);
+          } else {
+            if (w14)
+              tinyexr::wenc14(x, y, u, v);
+            else
+              tinyexr::wenc16(x, y, u, v);
+          }
+          REQUIRE(adjacent[size_t(2 * i)] == u);
+          REQUIRE(adjacent[size_t(2 * i + 1)] == v);
+        }
+      }
+    }
+  }
+}
+
+// Half bits of `v`(rounded as in the writer).
+static unsigned short TestFloatToHalf(float v) {
+  tinyexr::FP32 f;
+  f.f = v;
+  return tinyexr::float_to_half_full(f).u;
+}
+
+TEST_CASE("B44Chunk", "[B44]") {
+  // HALF, FLOAT and p_linear HALF channels. Sizes are not multiples of 4, and
+  // wide enough for the 8-block SIMD path.
+  const int width = 77;
+  const int num_lines = 11;
+  const int types[3] = {TINYEXR_PIXELTYPE_HALF, TINYEXR_PIXELTYPE_FLOAT,
+                        TINYEXR_PIXELTYPE_HALF};
+  std::vector<tinyexr::ChannelInfo> channels(3);
+  EXRChannelInfo exr_channels[3];
+  memset(exr_channels, 0, sizeof(exr_channels));
+  size_t line_size = 0;
+  for (size_t c = 0; c < 3; c++) {
+    channels[c].requested_pixel_type = types[c];
+    channels[c].p_linear = (c == 2) ? 1 : 0;
+    exr_channels[c].pixel_type = types[c];
+    exr_channels[c].p_linear = channels[c].p_linear;
+    line_size += size_t(width) * ((types[c] == TINYEXR_PIXELTYPE_HALF) ? 2 : 4);
+  }
+
+  for (int flat = 0; flat < 2; flat++) {
+    std::vector<unsigned char> src(line_size * size_t(num_lines));
+    unsigned int seed = 1234;
+    for (int y = 0; y < num_lines; y++) {
+      unsigned char* line = &src.at(size_t(y) * line_size);
+      for (int x = 0; x < width; x++) {
+        seed = seed * 1103515245u + 12345u;
+        float v = flat ? 0.5f
+                       : (0.25f + 0.01f * float(x + y) +
+                          0.001f * float((seed >> 16) & 0xff));
+        tinyexr::FP32 f;
+        f.f = v;
+        unsigned short h = tinyexr::float_to_half_full(f).u;
+        memcpy(line + 2 * size_t(x), &h, 2);
+        memcpy(line + size_t(width) * 2 + 4 * size_t(x), &v, 4);
+        memcpy(line + size_t(width) * 6 + 2 * size_t(x), &h, 2);
+      }
+    }
+
+    for (int b44a = 0; b44a < 2; b44a++) {
+      std::vector<unsigned char> compressed(
+          tinyexr::B44CompressBound(width, num_lines, channels));
+      size_t compressed_size = tinyexr::CompressB44(
+          &compressed.at(0), &src.at(0), width, num_lines, channels,
+          b44a != 0);
+      REQUIRE(compressed_size <= compressed.size());
+      if (flat && b44a) {
+        // 3-byte blocks.
+        REQUIRE(compressed_size == 2 * 20 * 3 * 3 + size_t(width) *
+                                                        size_t(num_lines) * 4);
+      }
+
+      std::vector<unsigned char> dst(src.size());
+      REQUIRE(tinyexr::DecompressB44(&dst.at(0), dst.size(),
+                                     &compressed.at(0), compressed_size,
+                                     width, num_lines, 3, exr_channels));
+      REQUIRE(false == tinyexr::DecompressB44(&dst.at(0), dst.size(),
+                                              &compressed.at(0),
+                                              compressed_size - 1, width,
+                                              num_lines, 3, exr_channels));
+
+      // p_linear channels are quantized in log space.
+      double max_error[2] = {0.0, 0.0};
+      for (int y = 0; y < num_lines; y++) {
+        const unsigned char* a = &src.at(size_t(y) * line_size);
+        const unsigned char* b = &dst.at(size_t(y) * line_size);
+        // FLOAT channel is stored as is.
+        REQUIRE(0 == memcmp(a + size_t(width) * 2, b + size_t(width) * 2,
+                            size_t(width) * 4));
+        for (int x = 0; x < width; x++) {
+          for (size_t i = 0; i < 2; i++) {
+            const size_t offset = i * size_t(width) * 6 + 2 * size_t(x);
+            tinyexr::FP16 ha, hb;
+            memcpy(&ha.u, a + offset, 2);
+            memcpy(&hb.u, b + offset, 2);
+            double fa = double(tinyexr::half_to_float(ha).f);
+            double fb = double(tinyexr::half_to_float(hb).f);
+            max_error[i] = (std::max)(max_error[i], std::fabs(fa - fb) / fa);
+          }
+        }
+      }
+      if (flat) {
+        REQUIRE(0.0 == max_error[0]);
+        // exp/log tables do not round trip exactly.
+        REQUIRE(max_error[1] < 0.001);
+      } else {
+        REQUIRE(max_error[0] < 0.02);
+        REQUIRE(max_error[1] < 0.04);
+      }
+    }
+  }
+}
+
+TEST_CASE("B44Compression", "[B44]") {
+  EXRVersion version;
+  REQUIRE(TINYEXR_SUCCESS ==
+          ParseEXRVersionFromFile(&version, "../../asakusa.exr"));
+  EXRHeader header;
+  InitEXRHeader(&header);
+  const char* err = NULL;
+  REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromFile(&header, &version,
+                                                    "../../asakusa.exr", &err));
+  EXRImage image;
+  InitEXRImage(&image);
+  REQUIRE(TINYEXR_SUCCESS ==
+          LoadEXRImageFromFile(&image, &header, "../../asakusa.exr", &err));
+
+  const size_t num_pixels = size_t(image.width) * size_t(image.height);
+  size_t sizes[2];
+  for (int ct = 0; ct < 2; ct++) {
+    header.compression_type =
+        ct ? TINYEXR_COMPRESSIONTYPE_B44A : TINYEXR_COMPRESSIONTYPE_B44;
+    unsigned char* mem = NULL;
+    sizes[ct] = SaveEXRImageToMemory(&image, &header, &mem, &err);
+    REQUIRE(0 < sizes[ct]);
+    // Fixed rate: 14 bytes per 4x4 block.
+    REQUIRE(sizes[ct] < num_pixels * size_t(header.num_channels));
+
+    EXRHeader loaded_header;
+    InitEXRHeader(&loaded_header);
+    REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromMemory(&loaded_header,
+                                                        &version, mem,
+                                                        sizes[ct], &err));
+    REQUIRE(header.compression_type == loaded_header.compression_type);
+    EXRImage loaded;
+    InitEXRImage(&loaded);
+    REQUIRE(TINYEXR_SUCCESS == LoadEXRImageFromMemory(&loaded, &loaded_header,
+                                                      mem, sizes[ct], &err));
+
+    for (int c = 0; c < header.num_channels; c++) {
+      const unsigned short* a =
+          reinterpret_cast<const unsigned short*>(image.images[c]);
+      const unsigned short* b =
+          reinterpret_cast<const unsigned short*>(loaded.images[c]);
+      double sum_error = 0.0;
+      for (size_t i = 0; i < num_pixels; i++) {
+        tinyexr::FP16 ha, hb;
+        ha.u = a[i];
+        hb.u = b[i];
+        float fa = tinyexr::half_to_float(ha).f;
+        float fb = tinyexr::half_to_float(hb).f;
+        sum_error += std::fabs(double(fa) - double(fb)) /
+                     (std::max)(double(std::fabs(fa)), 1e-3);
+      }
+      REQUIRE(sum_error / double(num_pixels) < 0.01);
+    }
+
+    FreeEXRImage(&loaded);
+    FreeEXRHeader(&loaded_header);
+    free(mem);
+  }
+  REQUIRE(sizes[1] <= sizes[0]);
+
+  FreeEXRImage(&image);
+  FreeEXRHeader(&header);
+}
+
+// Channels of the DWA test chunks: RLE(A), Y'CbCr(B, G, R), single lossy
+// channel(Y, p_linear) and UNKNOWN(Z).
+static const char* const kDwaTestChannelNames[6] = {"A", "B", "G",
+                                                    "R", "Y", "Z"};
+static const int kDwaTestChannelTypes[6] = {
+    TINYEXR_PIXELTYPE_HALF, TINYEXR_PIXELTYPE_HALF, TINYEXR_PIXELTYPE_HALF,
+    TINYEXR_PIXELTYPE_HALF, TINYEXR_PIXELTYPE_FLOAT, TINYEXR_PIXELTYPE_FLOAT};
+
+static unsigned int DwaTestRandom(unsigned int* seed) {
+  *seed = *seed * 1103515245u + 12345u;
+  return (*seed >> 16) & 0x7fff;
+}
+
+static double DwaTestHalfValue(unsigned short h) {
+  tinyexr::FP16 f;
+  f.u = h;
+  return double(tinyexr::half_to_float(f).f);
+}
+
+static void DwaTestAppend(std::vector<unsigned char>* dst,
+                          tinyexr::tinyexr_uint64 v, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    dst->push_back(static_cast<unsigned char>(v >> (8 * i)));
+  }
+}
+
+static std::vector<unsigned char> DwaTestDeflate(
+    const std::vector<unsigned char>& src) {
+  std::vector<unsigned char> dst(tinyexr::ZipCompressBound(src.size()));
+  tinyexr::tinyexr_uint64 size = dst.size();
+  REQUIRE(tinyexr::DeflateZlib(&dst.at(0), &size, &src.at(0),
+                               static_cast<unsigned long>(src.size()),
+                               TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT));
+  dst.resize(size_t(size));
+  return dst;
+}
+
+// Builds a DWA chunk of `width` x `height` pixels from random DCT
+// coefficients, and stores the expected pixel values of each channel in
+// `expected`.
+static std::vector<unsigned char> BuildDwaTestChunk(
+    int width, int height, int version, int ac_compression, unsigned int seed,
+    std::vector<double> expected[6]) {
+  // Position in the zig-zag order of each coefficient.
+  int zigzag[64];
+  int n = 0;
+  for (int s = 0; s < 15; s++) {
+    for (int i = 0; i < 8; i++) {
+      const int row = (s & 1) ? i : (s - i);
+      const int col = s - row;
+      if ((row >= 0) && (row < 8) && (col >= 0) && (col < 8)) {
+        zigzag[row * 8 + col] = n++;
+      }
+    }
+  }
+
+  const size_t w = size_t(width);
+  const size_t h = size_t(height);
+  const int num_blocks_x = (width + 7) / 8;
+  const int num_blocks_y = (height + 7) / 8;
+  const int num_blocks = num_blocks_x * num_blocks_y;
+
+  // Coefficients(zig-zag order) of Y', Cb, Cr and the Y channel.
+  std::vector<unsigned short> coefs[4];
+  std::vector<double> spatial[4];
+  std::vector<unsigned short> ac;
+  for (int comp = 0; comp < 4; comp++) {
+    coefs[comp].assign(size_t(num_blocks) * 64, 0);
+    spatial[comp].assign(w * h, 0.0);
+  }
+  // Last non-zero coefficients on both sides of the first coefficient of each
+  // row.
+  static const int kLimits[12] = {1, 2, 3, 8, 9, 10, 19, 20, 21, 34, 35, 63};
+  int num_ac_blocks = 0;
+  for (int b = 0; b < num_blocks; b++) {
+    for (int comp = 0; comp < 4; comp++) {
+      unsigned short* zig = &coefs[comp][size_t(b) * 64];
+      const float dc_scale = (comp == 0) ? 8.0f : ((comp == 3) ? 20.0f : 2.0f);
+      const float dc_offset = (comp == 0) ? 2.0f : 0.0f;
+      zig[0] = TestFloatToHalf(
+          dc_offset +
+          dc_scale * (float(DwaTestRandom(&seed)) / 16384.0f - 1.0f));
+
+      // The first block is constant in all channels.
+      const int k = b * 3 + comp;
+      if ((b == 0) || ((k % 4) == 0)) {
+        continue;
+      }
+      const int limit = kLimits[num_ac_blocks++ % 12];
+      for (int i = 1; i <= limit; i++) {
+        if ((i == limit) || (DwaTestRandom(&seed) & 1)) {
+          float v = 0.05f + float(DwaTestRandom(&seed)) / 32768.0f;
+          zig[i] = TestFloatToHalf((DwaTestRandom(&seed) & 1) ? -v : v);
+        }
+      }
+    }
+  }
+
+  // Reference inverse DCT.
+  const double pi = 3.14159265358979323846;
+  for (int comp = 0; comp < 4; comp++) {
+    for (int b = 0; b < num_blocks; b++) {
+      const unsigned short* zig = &coefs[comp][size_t(b) * 64];
+      const int bx = b % num_blocks_x;
+      const int by = b / num_blocks_x;
+      for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+          double sum = 0.0;
+          for (int v = 0; v < 8; v++) {
+            for (int u = 0; u < 8; u++) {
+              const double cu = u ? 0.5 : 0.5 / std::sqrt(2.0);
+              const double cv = v ? 0.5 : 0.5 / std::sqrt(2.0);
+              sum += cu * cv * DwaTestHalfValue(zig[zigzag[v * 8 + u]]) *
+                     std::cos((2 * x + 1) * u * pi / 16.0) *
+                     std::cos((2 * y + 1) * v * pi / 16.0);
+            }
+          }
+          const size_t px = size_t(bx * 8 + x);
+          const size_t py = size_t(by * 8 + y);
+          if ((px < w) && (py < h)) {
+            spatial[comp][py * w + px] = sum;
+          }
+        }
+      }
+    }
+  }
+
+  for (int c = 0; c < 6; c++) {
+    expected[c].resize(w * h);
+  }
+  std::vector<unsigned char> unknown;
+  std::vector<unsigned char> rle_raw(w * h * 2);
+  for (size_t i = 0; i < w * h; i++) {
+    // Y'CbCr to RGB(Rec. 709) and to linear.
+    const double yy = spatial[0][i];
+    const double cb = spatial[1][i];
+    const double cr = spatial[2][i];
+    const double rgb[3] = {yy + 1.5747 * cr, yy - 0.1873 * cb - 0.4682 * cr,
+                           yy + 1.8556 * cb};
+    for (int j = 0; j < 3; j++) {
+      const double a = std::fabs(rgb[j]);
+      const double l =
+          (a <= 1.0) ? std::pow(a, 2.2) : std::exp(2.2 * (a - 1.0));
+      expected[3 - j][i] = (rgb[j] < 0.0) ? -l : l;
+    }
+    expected[4][i] = spatial[3][i];
+
+    // Runs in A.
+    const unsigned short a = TestFloatToHalf(
+        ((i / 5) % 3) ? 1.0f : float(DwaTestRandom(&seed)) / 32768.0f);
+    expected[0][i] = DwaTestHalfValue(a);
+    rle_raw[i] = static_cast<unsigned char>(a & 0xff);
+    rle_raw[w * h + i] = static_cast<unsigned char>(a >> 8);
+
+    const float z = float(DwaTestRandom(&seed)) - 1000.0f;
+    expected[5][i] = double(z);
+  }
+  // UNKNOWN data is planar per line.
+  for (size_t i = 0; i < w * h; i++) {
+    tinyexr::FP32 z;
+    z.f = float(expected[5][i]);
+    DwaTestAppend(&unknown, z.u, 4);
+  }
+
+  // AC: 0xff00 ends the block and 0xffXX skips XX zeros. Y'CbCr blocks are
+  // interleaved.
+  for (int pass = 0; pass < 2; pass++) {
+    for (int b = 0; b < num_blocks; b++) {
+      for (int comp = pass ? 3 : 0; comp < (pass ? 4 : 3); comp++) {
+        const unsigned short* zig = &coefs[comp][size_t(b) * 64];
+        int run = 0;
+        for (int i = 1; i < 64; i++) {
+          if (zig[i] == 0) {
+            run++;
+            continue;
+          }
+          if (run) {
+            ac.push_back(static_cast<unsigned short>(0xff00 | run));
+            run = 0;
+          }
+          ac.push_back(zig[i]);
+        }
+        if (run) {
+          ac.push_back(0xff00);
+        }
+      }
+    }
+  }
+  std::vector<unsigned char> ac_compressed;
+  if (ac_compression == tinyexr::DWA_AC_DEFLATE) {
+    std::vector<unsigned char> raw;
+    for (size_t i = 0; i < ac.size(); i++) {
+      DwaTestAppend(&raw, ac[i], 2);
+    }
+    ac_compressed = DwaTestDeflate(raw);
+  } else {
+#if TINYEXR_USE_PIZ
+    tinyexr::PizScratch scratch;
+    ac_compressed.resize(ac.size() * 4 + 65536);
+    int size = tinyexr::hufCompress(
+        &ac.at(0), int(ac.size()),
+        reinterpret_cast<char*>(&ac_compressed.at(0)), &scratch);
+    ac_compressed.resize(size_t(size));
+#endif
+  }
+
+  // DC: per channel, with the ZIP predictor and byte reordering.
+  std::vector<unsigned char> dc_raw;
+  for (int comp = 0; comp < 4; comp++) {
+    for (int b = 0; b < num_blocks; b++) {
+      DwaTestAppend(&dc_raw, coefs[comp][size_t(b) * 64], 2);
+    }
+  }
+  std::vector<unsigned char> dc_tmp(dc_raw.size());
+  tinyexr::SplitEvenOddBytes(&dc_tmp.at(0), &dc_raw.at(0), dc_raw.size());
+  tinyexr::EncodeDeltaPredictor(&dc_tmp.at(0), dc_tmp.size());
+  std::vector<unsigned char> dc_compressed = DwaTestDeflate(dc_tmp);
+
+  // RLE: byte planes, run length encoded, then zlib.
+  std::vector<signed char> rle(rle_raw.size() * 2 + 16);
+  int rle_size = tinyexr::rleCompress(
+      int(rle_raw.size()), reinterpret_cast<const char*>(&rle_raw.at(0)),
+      &rle.at(0));
+  std::vector<unsigned char> rle_bytes(
+      reinterpret_cast<unsigned char*>(&rle.at(0)),
+      reinterpret_cast<unsigned char*>(&rle.at(0)) + rle_size);
+  std::vector<unsigned char> rle_compressed = DwaTestDeflate(rle_bytes);
+
+  std::vector<unsigned char> unknown_compressed = DwaTestDeflate(unknown);
+
+  std::vector<unsigned char> chunk;
+  DwaTestAppend(&chunk, tinyexr::tinyexr_uint64(version), 8);
+  DwaTestAppend(&chunk, unknown.size(), 8);
+  DwaTestAppend(&chunk, unknown_compressed.size(), 8);
+  DwaTestAppend(&chunk, ac_compressed.size(), 8);
+  DwaTestAppend(&chunk, dc_compressed.size(), 8);
+  DwaTestAppend(&chunk, rle_compressed.size(), 8);
+  DwaTestAppend(&chunk, rle_bytes.size(), 8);
+  DwaTestAppend(&chunk, rle_raw.size(), 8);
+  DwaTestAppend(&chunk, ac.size(), 8);
+  DwaTestAppend(&chunk, dc_raw.size() / 2, 8);
+  DwaTestAppend(&chunk, tinyexr::tinyexr_uint64(ac_compression), 8);
+  if (version >= 2) {
+    // Suffix, flags(csc index + 1, scheme and case insensitivity) and type.
+    static const unsigned char kRules[] = {
+        'R', 0, (1 << 4) | (1 << 2), TINYEXR_PIXELTYPE_HALF,
+        'G', 0, (2 << 4) | (1 << 2), TINYEXR_PIXELTYPE_HALF,
+        'B', 0, (3 << 4) | (1 << 2), TINYEXR_PIXELTYPE_HALF,
+        'Y', 0, (1 << 2),            TINYEXR_PIXELTYPE_FLOAT,
+        'a', 0, (2 << 2) | 1,        TINYEXR_PIXELTYPE_HALF};
+    DwaTestAppend(&chunk, sizeof(kRules) + 2, 2);
+    chunk.insert(chunk.end(), kRules, kRules + sizeof(kRules));
+  }
+  chunk.insert(chunk.end(), unknown_compressed.begin(),
+               unknown_compressed.end());
+  chunk.insert(chunk.end(), ac_compressed.begin(), ac_compressed.end());
+  chunk.insert(chunk.end(), dc_compressed.begin(), dc_compressed.end());
+  chunk.insert(chunk.end(), rle_compressed.begin(), rle_compressed.end());
+  return chunk;
+}
+
+TEST_CASE("DWAChunk", "[DWA]") {
+  // Partial blocks in both directions.
+  const int width = 21;
+  const int num_lines = 11;
+  EXRChannelInfo channels[6];
+  memset(channels, 0, sizeof(channels));
+  size_t line_size = 0;
+  size_t offsets[6];
+  for (int c = 0; c < 6; c++) {
+    strcpy(channels[c].name, kDwaTestChannelNames[c]);
+    channels[c].pixel_type = kDwaTestChannelTypes[c];
+    channels[c].p_linear = (c == 4) ? 1 : 0;
+    offsets[c] = line_size;
+    line_size +=
+        size_t(width) * tinyexr::B44PixelTypeSize(channels[c].pixel_type);
+  }
+
+  tinyexr::DwaScratch scratch;
+  for (int version = 1; version <= 2; version++) {
+    for (int ac_compression = 0; ac_compression < 2; ac_compression++) {
+#if !TINYEXR_USE_PIZ
+      if (ac_compression == tinyexr::DWA_AC_STATIC_HUFFMAN) {
+        continue;
+      }
+#endif
+      std::vector<double> expected[6];
+      std::vector<unsigned char> chunk = BuildDwaTestChunk(
+          width, num_lines, version, ac_compression, 77u, expected);
+
+      std::vector<unsigned char> dst(line_size * size_t(num_lines));
+      REQUIRE(tinyexr::DecompressDwa(&dst.at(0), dst.size(), &chunk.at(0),
+                                     chunk.size(), width, num_lines, 6,
+                                     channels, &scratch));
+
+      for (int c = 0; c < 6; c++) {
+        for (int y = 0; y < num_lines; y++) {
+          for (int x = 0; x < width; x++) {
+            const unsigned char* p =
+                &dst.at(size_t(y) * line_size + offsets[c]);
+            double v;
+            if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
+              unsigned short h;
+              memcpy(&h, p + 2 * size_t(x), 2);
+              v = DwaTestHalfValue(h);
+            } else {
+              float f;
+              memcpy(&f, p + 4 * size_t(x), 4);
+              v = double(f);
+            }
+            const double e = expected[c][size_t(y * width + x)];
+            if ((c == 0) || (c == 5)) {
+              REQUIRE(v == e);
+            } else {
+              // Rounded to half before and after the conversion to linear.
+              REQUIRE(std::fabs(v - e) <= 4e-3 * std::fabs(e) + 1e-3);
+            }
+          }
+        }
+      }
+
+      // Truncated and corrupted chunks.
+      REQUIRE(false == tinyexr::DecompressDwa(&dst.at(0), dst.size(),
+                                              &chunk.at(0), chunk.size() - 1,
+                                              width, num_lines, 6, channels,
+                                              &scratch));
+      std::vector<unsigned char> bad = chunk;
+      bad[0] = 3;  // version
+      REQUIRE(false == tinyexr::DecompressDwa(&dst.at(0), dst.size(),
+                                              &bad.at(0), bad.size(), width,
+                                              num_lines, 6, channels,
+                                              &scratch));
+      bad = chunk;
+      bad[8 * tinyexr::DWA_AC_UNCOMPRESSED_COUNT] -= 1;
+      REQUIRE(false == tinyexr::DecompressDwa(&dst.at(0), dst.size(),
+                                              &bad.at(0), bad.size(), width,
+                                              num_lines, 6, channels,
+                                              &scratch));
+    }
+  }
+}
+
+TEST_CASE("DWACompression", "[DWA]") {
+  // Replaces the chunks of an uncompressed image with DWA chunks.
+  const int width = 19;
+  const int height = 40;
+  std::vector<std::vector<unsigned char> > planes(6);
+  EXRHeader header;
+  InitEXRHeader(&header);
+  EXRImage image;
+  InitEXRImage(&image);
+  EXRChannelInfo channels[6];
+  memset(channels, 0, sizeof(channels));
+  int pixel_types[6];
+  unsigned char* images[6];
+  for (int c = 0; c < 6; c++) {
+    strcpy(channels[c].name, kDwaTestChannelNames[c]);
+    channels[c].pixel_type = kDwaTestChannelTypes[c];
+    pixel_types[c] = kDwaTestChannelTypes[c];
+    planes[c].assign(size_t(width * height) *
+                         tinyexr::B44PixelTypeSize(pixel_types[c]),
+                     0);
+    images[c] = &planes[c].at(0);
+  }
+  header.num_channels = 6;
+  header.channels = channels;
+  header.pixel_types = pixel_types;
+  header.requested_pixel_types = pixel_types;
+  image.num_channels = 6;
+  image.width = width;
+  image.height = height;
+  image.images = images;
+  const char* err = NULL;
+  unsigned char* mem = NULL;
+  size_t size = SaveEXRImageToMemory(&image, &header, &mem, &err);
+  REQUIRE(0 < size);
+  std::vector<unsigned char> file(mem, mem + size);
+  free(mem);
+
+  // Offset table of the scanline chunks follows the header.
+  size_t table = 0;
+  for (size_t i = 8; i + 8 <= file.size(); i++) {
+    tinyexr::tinyexr_uint64 offset;
+    memcpy(&offset, &file.at(i), 8);
+    tinyexr::swap8(&offset);
+    if (offset == i + 8 * size_t(height)) {
+      table = i;
+      break;
+    }
+  }
+  REQUIRE(0 < table);
+  file.resize(table);
+  const char kCompression[] = "compression\0compression";
+  std::vector<unsigned char>::iterator it =
+      std::search(file.begin(), file.end(), kCompression,
+                  kCompression + sizeof(kCompression));
+  REQUIRE(it != file.end());
+  const size_t compression_offset =
+      size_t(it - file.begin()) + sizeof(kCompression) + 4;
+  REQUIRE(TINYEXR_COMPRESSIONTYPE_NONE == file[compression_offset]);
+
+  for (int dwab = 0; dwab < 2; dwab++) {
+    const int lines_per_chunk = dwab ? 256 : 32;
+    const int num_chunks = (height + lines_per_chunk - 1) / lines_per_chunk;
+    std::vector<unsigned char> dwa(file);
+    dwa[compression_offset] = static_cast<unsigned char>(
+        dwab ? TINYEXR_COMPRESSIONTYPE_DWAB : TINYEXR_COMPRESSIONTYPE_DWAA);
+    std::vector<std::vector<double> > expected(6);
+    std::vector<unsigned char> chunks;
+    for (int i = 0; i < num_chunks; i++) {
+      const int y = i * lines_per_chunk;
+      const int num_lines = (std::min)(lines_per_chunk, height - y);
+      std::vector<double> chunk_expected[6];
+      std::vector<unsigned char> chunk =
+          BuildDwaTestChunk(width, num_lines, 2, tinyexr::DWA_AC_DEFLATE,
+                            unsigned(i), chunk_expected);
+      for (int c = 0; c < 6; c++) {
+        expected[size_t(c)].insert(expected[size_t(c)].end(),
+                                   chunk_expected[c].begin(),
+                                   chunk_expected[c].end());
+      }
+      DwaTestAppend(&dwa,
+                    table + 8 * size_t(num_chunks) + chunks.size(), 8);
+      DwaTestAppend(&chunks, tinyexr::tinyexr_uint64(y), 4);
+      DwaTestAppend(&chunks, chunk.size(), 4);
+      chunks.insert(chunks.end(), chunk.begin(), chunk.end());
+    }
+    dwa.insert(dwa.end(), chunks.begin(), chunks.end());
+
+    EXRVersion version;
+    REQUIRE(TINYEXR_SUCCESS ==
+            ParseEXRVersionFromMemory(&version, &dwa.at(0), dwa.size()));
+    EXRHeader loaded_header;
+    InitEXRHeader(&loaded_header);
+    REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromMemory(&loaded_header,
+                                                        &version, &dwa.at(0),
+                                                        dwa.size(), &err));
+    REQUIRE(dwa[compression_offset] == loaded_header.compression_type);
+    EXRImage loaded;
+    InitEXRImage(&loaded);
+    REQUIRE(TINYEXR_SUCCESS == LoadEXRImageFromMemory(&loaded, &loaded_header,
+                                                      &dwa.at(0), dwa.size(),
+                                                      &err));
+    for (int c = 0; c < 6; c++) {
+      for (size_t i = 0; i < size_t(width * height); i++) {
+        double v;
+        if (pixel_types[c] == TINYEXR_PIXELTYPE_HALF) {
+          v = DwaTestHalfValue(
+              reinterpret_cast<unsigned short*>(loaded.images[c])[i]);
+        } else {
+          v = double(reinterpret_cast<float*>(loaded.images[c])[i]);
+        }
+        const double e = expected[size_t(c)][i];
+        if ((c == 0) || (c == 5)) {
+          REQUIRE(v == e);
+        } else if (c == 4) {
+          // Not perceptually linear in the file.
+          const double a = std::fabs(e);
+          const double l =
+              (a <= 1.0) ? std::pow(a, 2.2) : std::exp(2.2 * (a - 1.0));
+          REQUIRE(std::fabs(v - ((e < 0.0) ? -l : l)) <=
+                  4e-3 * l + 1e-3);
+        } else {
+          REQUIRE(std::fabs(v - e) <= 4e-3 * std::fabs(e) + 1e-3);
+        }
+      }
+    }
+    header.compression_type = loaded_header.compression_type;
+    FreeEXRImage(&loaded);
+    FreeEXRHeader(&loaded_header);
+
+    // Saving DWA is not supported.
+    mem = NULL;
+    REQUIRE(0 == SaveEXRImageToMemory(&image, &header, &mem, &err));
+    FreeEXRErrorMessage(err);
+    err = NULL;
+    header.compression_type = TINYEXR_COMPRESSIONTYPE_NONE;
+  }
+}
+
+TEST_CASE("DWAFloatToHalf", "[DWA]") {
+  // The SIMD conversion of 64 values must match the scalar one, including the
+  // ties, denormals, overflow and NaN.
+  std::vector<unsigned int> bits;
+  for (unsigned int h = 0; h < 0x8000; h++) {
+    tinyexr::FP16 f;
+    f.u = static_cast<unsigned short>(h);
+    tinyexr::FP32 v = tinyexr::half_to_float(f);
+    bits.push_back(v.u);
+    bits.push_back(v.u + 1);
+    bits.push_back(v.u - 1);
+    // Midpoint to the next half.
+    tinyexr::FP32 m;
+    m.f = v.f + 2.98023224e-8f;  // 2^-25
+    bits.push_back((h < 0x400) ? m.u : (v.u + 0x1000));
+  }
+  for (unsigned int u = 0; u < 0x7fffffff - 0x12345; u += 0x12345) {
+    bits.push_back(u);
+  }
+  bits.push_back(0x7f800000);
+  bits.push_back(0x7fc00000);
+  bits.push_back(0x7f800001);
+  bits.push_back(0x477ff000);  // 65520
+  bits.push_back(0x33000000);  // 2^-25
+  bits.push_back(0x33000001);
+  while (bits.size() % 32) {
+    bits.push_back(0);
+  }
+  for (size_t i = 0; i < bits.size(); i += 32) {
+    float src[64];
+    for (int j = 0; j < 32; j++) {
+      tinyexr::FP32 f;
+      f.u = bits[i + size_t(j)];
+      src[j] = f.f;
+      f.u |= 0x80000000u;
+      src[32 + j] = f.f;
+    }
+    unsigned short dst[64];
+    tinyexr::DwaFloatToHalf64(dst, src);
+    for (int j = 0; j < 64; j++) {
+      REQUIRE(tinyexr::FloatToHalfRne(src[j]) == dst[j]);
+    }
+  }
+}
+
+TEST_CASE("PXR24Chunk", "[PXR24]") {
+  // Rounding to 24 bits.
+  REQUIRE(0x3f8000u == tinyexr::FloatToFloat24(1.0f));
+  tinyexr::FP32 f;
+  f.u = 0x3f80007f;
+  REQUIRE(0x3f8000u == tinyexr::FloatToFloat24(f.f));
+  f.u = 0xbf800080;
+  REQUIRE(0xbf8001u == tinyexr::FloatToFloat24(f.f));
+  f.u = 0x7f7fffff;  // Truncated instead of rounding to infinity.
+  REQUIRE(0x7f7fffu == tinyexr::FloatToFloat24(f.f));
+  f.u = 0x7f800000;
+  REQUIRE(0x7f8000u == tinyexr::FloatToFloat24(f.f));
+  f.u = 0x7f800001;  // Still NaN.
+  REQUIRE(0x7f8001u == tinyexr::FloatToFloat24(f.f));
+
+  const int width = 37;
+  const int num_lines = 16;
+  const int types[3] = {TINYEXR_PIXELTYPE_UINT, TINYEXR_PIXELTYPE_HALF,
+                        TINYEXR_PIXELTYPE_FLOAT};
+  std::vector<tinyexr::ChannelInfo> channels(3);
+  EXRChannelInfo exr_channels[3];
+  memset(exr_channels, 0, sizeof(exr_channels));
+  for (size_t c = 0; c < 3; c++) {
+    channels[c].requested_pixel_type = types[c];
+    exr_channels[c].pixel_type = types[c];
+  }
+  const size_t line_size = size_t(width) * (4 + 2 + 4);
+
+  std::vector<unsigned char> src(line_size * size_t(num_lines));
+  unsigned int seed = 4321;
+  for (int y = 0; y < num_lines; y++) {
+    unsigned char* line = &src.at(size_t(y) * line_size);
+    for (int x = 0; x < width; x++) {
+      seed = seed * 1103515245u + 12345u;
+      unsigned int u = (x & 1) ? seed : unsigned(x * y);
+      float v = 100.0f * float(y) + 0.37f * float(x) +
+                float((seed >> 16) & 0xff) * 1e-3f;
+      if (x == 3) {
+        f.u = 0x7fc00000 + unsigned(y);  // NaN
+        v = f.f;
+      } else if (x == 5) {
+        v = -std::numeric_limits<float>::infinity();
+      } else if (x == 7) {
+        f.u = 0x00000001u + unsigned(y);  // denormal
+        v = f.f;
+      }
+      unsigned short h = TestFloatToHalf(v);
+      memcpy(line + 4 * size_t(x), &u, 4);
+      memcpy(line + size_t(width) * 4 + 2 * size_t(x), &h, 2);
+      memcpy(line + size_t(width) * 6 + 4 * size_t(x), &v, 4);
+    }
+  }
+
+  std::vector<unsigned char> compressed(tinyexr::ZipCompressBound(src.size()));
+  tinyexr::tinyexr_uint64 compressed_size = compressed.size();
+  std::vector<unsigned char> tmp;
+  REQUIRE(tinyexr::CompressPxr24(&compressed.at(0), &compressed_size,
+                                 &src.at(0), width, num_lines, channels, &tmp,
+                                 TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT));
+  REQUIRE(compressed_size < src.size());
+
+  std::vector<unsigned char> dst(src.size());
+  REQUIRE(tinyexr::DecompressPxr24(&dst.at(0), dst.size(), &compressed.at(0),
+                                   size_t(compressed_size), width, num_lines,
+                                   3, exr_channels, &tmp));
+  for (int y = 0; y < num_lines; y++) {
+    const unsigned char* a = &src.at(size_t(y) * line_size);
+    const unsigned char* b = &dst.at(size_t(y) * line_size);
+    // UINT and HALF are lossless.
+    REQUIRE(0 == memcmp(a, b, size_t(width) * 6));
+    for (int x = 0; x < width; x++) {
+      float fa, fb;
+      memcpy(&fa, a + size_t(width) * 6 + 4 * size_t(x), 4);
+      memcpy(&fb, b + size_t(width) * 6 + 4 * size_t(x), 4);
+      tinyexr::FP32 ub;
+      ub.f = fb;
+      REQUIRE((tinyexr::FloatToFloat24(fa) << 8) == ub.u);
+    }
+  }
+
+  // Truncated and corrupted chunks.
+  REQUIRE(false == tinyexr::DecompressPxr24(&dst.at(0), dst.size(),
+                                            &compressed.at(0),
+                                            size_t(compressed_size) - 1, width,
+                                            num_lines, 3, exr_channels, &tmp));
+  REQUIRE(false == tinyexr::DecompressPxr24(&dst.at(0), dst.size(),
+                                            &compressed.at(0),
+                                            size_t(compressed_size), width,
+                                            num_lines - 1, 3, exr_channels,
+                                            &tmp));
+}
+
+TEST_CASE("PXR24Compression", "[PXR24]") {
+  // Smooth FLOAT depth and HALF color, as in AOVs.
+  const int width = 123;
+  const int height = 45;
+  const size_t num_pixels = size_t(width * height);
+  std::vector<float> depth(num_pixels);
+  std::vector<unsigned short> color(num_pixels);
+  for (int y = 0; y < height; y++) {
+    for (int x = 0; x < width; x++) {
+      const size_t i = size_t(y * width + x);
+      depth[i] =
+          10.0f + std::sin(0.05f * float(x)) * std::cos(0.07f * float(y));
+      color[i] = TestFloatToHalf(float(x) / float(width));
+    }
+  }
+
+  EXRHeader header;
+  InitEXRHeader(&header);
+  EXRImage image;
+  InitEXRImage(&image);
+  EXRChannelInfo channels[2];
+  memset(channels, 0, sizeof(channels));
+  strcpy(channels[0].name, "G");
+  strcpy(channels[1].name, "Z");
+  int pixel_types[2] = {TINYEXR_PIXELTYPE_HALF, TINYEXR_PIXELTYPE_FLOAT};
+  unsigned char* images[2] = {reinterpret_cast<unsigned char*>(&color.at(0)),
+                              reinterpret_cast<unsigned char*>(&depth.at(0))};
+  header.num_channels = 2;
+  header.channels = channels;
+  header.pixel_types = pixel_types;
+  header.requested_pixel_types = pixel_types;
+  image.num_channels = 2;
+  image.width = width;
+  image.height = height;
+  image.images = images;
+
+  const int kCompressions[3] = {TINYEXR_COMPRESSIONTYPE_ZIP,
+                                TINYEXR_COMPRESSIONTYPE_PXR24,
+                                TINYEXR_COMPRESSIONTYPE_PXR24};
+  size_t sizes[3];
+  for (int i = 0; i < 3; i++) {
+    header.compression_type = kCompressions[i];
+    header.zip_compression_level =
+        (i == 2) ? TINYEXR_ZIP_COMPRESSION_LEVEL_STORE
+                 : TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT;
+    const char* err = NULL;
+    unsigned char* mem = NULL;
+    sizes[i] = SaveEXRImageToMemory(&image, &header, &mem, &err);
+    REQUIRE(0 < sizes[i]);
+
+    EXRVersion version;
+    REQUIRE(TINYEXR_SUCCESS ==
+            ParseEXRVersionFromMemory(&version, mem, sizes[i]));
+    EXRHeader loaded_header;
+    InitEXRHeader(&loaded_header);
+    REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromMemory(
+                                   &loaded_header, &version, mem, sizes[i],
+                                   &err));
+    REQUIRE(kCompressions[i] == loaded_header.compression_type);
+    EXRImage loaded;
+    InitEXRImage(&loaded);
+    REQUIRE(TINYEXR_SUCCESS == LoadEXRImageFromMemory(&loaded, &loaded_header,
+                                                      mem, sizes[i], &err));
+    REQUIRE(0 == memcmp(loaded.images[0], &color.at(0), num_pixels * 2));
+    const float* z = reinterpret_cast<const float*>(loaded.images[1]);
+    for (size_t p = 0; p < num_pixels; p++) {
+      if (i == 2) {
+        // Stored uncompressed.
+        REQUIRE(depth[p] == z[p]);
+      } else {
+        REQUIRE(std::fabs(depth[p] - z[p]) <= depth[p] * (1.0f / 32768.0f));
+      }
+    }
+    FreeEXRImage(&loaded);
+    FreeEXRHeader(&loaded_header);
+    free(mem);
+  }
+  REQUIRE(sizes[1] < sizes[0]);
+  REQUIRE(sizes[2] > sizes[0]);
+}
+
+TEST_CASE("SaveToFileMatchesMemory", "[Save]") {
+  // Files are written directly(without assembling them in memory), and must
+  // be identical to the memory output.
+  EXRVersion version;
+  REQUIRE(TINYEXR_SUCCESS ==
+          ParseEXRVersionFromFile(&version, "../../asakusa.exr"));
+  EXRHeader header;
+  InitEXRHeader(&header);
+  const char* err = NULL;
+  REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromFile(&header, &version,
+                                                    "../../asakusa.exr", &err));
+  EXRImage image;
+  InitEXRImage(&image);
+  REQUIRE(TINYEXR_SUCCESS ==
+          LoadEXRImageFromFile(&image, &header, "../../asakusa.exr", &err));
+
+  EXRHeader header2 = header;
+  const EXRHeader* headers[2] = {&header, &header2};
+  EXRImage images[2] = {image, image};
+
+  for (int multipart = 0; multipart < 2; multipart++) {
+    const char* filename = "save_to_file.exr";
+    unsigned char* mem = NULL;
+    size_t size;
+    int ret;
+    if (multipart) {
+      strncpy(header.name, "part0", 255);
+      strncpy(header2.name, "part1", 255);
+      size = SaveEXRMultipartImageToMemory(images, headers, 2, &mem, &err);
+      ret = SaveEXRMultipartImageToFile(images, headers, 2, filename, &err);
+    } else {
+      size = SaveEXRImageToMemory(&image, &header, &mem, &err);
+      ret = SaveEXRImageToFile(&image, &header, filename, &err);
+    }
+    REQUIRE(0 < size);
+    REQUIRE(TINYEXR_SUCCESS == ret);
+
+    std::ifstream f(filename, std::ifstream::binary);
+    REQUIRE(f.good());
+    std::vector<char> file_data((std::istreambuf_iterator<char>(f)),
+                                std::istreambuf_iterator<char>());
+    f.close();
+    remove(filename);
+    REQUIRE(file_data.size() == size);
+    REQUIRE(memcmp(file_data.data(), mem, size) == 0);
+    free(mem);
+  }
+
+  header.name[0] = '\0';
+  FreeEXRImage(&image);
+  FreeEXRHeader(&header);
+}
+
+TEST_CASE("ZipCompressionLevel", "[Save]") {
+  EXRVersion version;
+  REQUIRE(TINYEXR_SUCCESS ==
+          ParseEXRVersionFromFile(&version, "../../asakusa.exr"));
+  EXRHeader header;
+  InitEXRHeader(&header);
+  const char* err = NULL;
+  REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromFile(&header, &version,
+                                                    "../../asakusa.exr", &err));
+  EXRImage image;
+  InitEXRImage(&image);
+  REQUIRE(TINYEXR_SUCCESS ==
+          LoadEXRImageFromFile(&image, &header, "../../asakusa.exr", &err));
+
+  const int levels[] = {TINYEXR_ZIP_COMPRESSION_LEVEL_STORE, 1,
+                        TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT, 9};
+  size_t sizes[4];
+  for (int ct = 0; ct < 2; ct++) {
+    header.compression_type =
+        ct ? TINYEXR_COMPRESSIONTYPE_ZIPS : TINYEXR_COMPRESSIONTYPE_ZIP;
+    for (size_t li = 0; li < 4; li++) {
+      header.zip_compression_level = levels[li];
+      unsigned char* mem = NULL;
+      sizes[li] = SaveEXRImageToMemory(&image, &header, &mem, &err);
+      REQUIRE(0 < sizes[li]);
+
+      // Every level decodes to the same pixels.
+      EXRHeader loaded_header;
+      InitEXRHeader(&loaded_header);
+      REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromMemory(&loaded_header,
+                                                          &version, mem,
+                                                          sizes[li], &err));
+      EXRImage loaded;
+      InitEXRImage(&loaded);
+      REQUIRE(TINYEXR_SUCCESS == LoadEXRImageFromMemory(&loaded,
+                                                        &loaded_header, mem,
+                                                        sizes[li], &err));
+      for (int c = 0; c < header.num_channels; c++) {
+        REQUIRE(0 == memcmp(loaded.images[c], image.images[c],
+                            size_t(image.width) * size_t(image.height) *
+                                sizeof(unsigned short)));
+      }
+      FreeEXRImage(&loaded);
+      FreeEXRHeader(&loaded_header);
+      free(mem);
+    }
+    REQUIRE(sizes[1] < sizes[0]);
+    REQUIRE(sizes[3] <= sizes[1]);
+  }
+
+  FreeEXRImage(&image);
+  FreeEXRHeader(&header);
+}
+
+// Loads an image with one ZIP chunk(4 lines) whose zlib stream inflates to
+// fewer bytes than the chunk, right after an image with non-zero pixels.
+static int LoadShortZipChunk(const EXRParallelOptions* options) {
+  const int width = 4;
+  const int height = 4;
+  std::vector<float> pixels(size_t(width * height), 7.0f);
+
+  EXRHeader header;
+  InitEXRHeader(&header);
+  EXRImage image;
+  InitEXRImage(&image);
+  EXRChannelInfo channel;
+  memset(&channel, 0, sizeof(channel));
+  strcpy(channel.name, "R");
+  int pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+  unsigned char* images[1] = {reinterpret_cast<unsigned char*>(&pixels.at(0))};
+  header.num_channels = 1;
+  header.channels = &channel;
+  header.pixel_types = &pixel_type;
+  header.requested_pixel_types = &pixel_type;
+  header.compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;
+  image.num_channels = 1;
+  image.width = width;
+  image.height = height;
+  image.images = images;
+
+  const char* err = NULL;
+  unsigned char* mem = NULL;
+  size_t size = SaveEXRImageToMemory(&image, &header, &mem, &err);
+  REQUIRE(0 < size);
+
+  EXRVersion version;
+  REQUIRE(TINYEXR_SUCCESS == ParseEXRVersionFromMemory(&version, mem, size));
+  EXRHeader loaded_header;
+  InitEXRHeader(&loaded_header);
+  REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromMemory(&loaded_header, &version,
+                                                      mem, size, &err));
+  EXRImage loaded;
+  InitEXRImage(&loaded);
+  // Fills the decode buffers of the thread with 7.0.
+  REQUIRE(TINYEXR_SUCCESS ==
+          LoadEXRImageFromMemoryWithOptions(&loaded, &loaded_header, mem, size,
+                                            options, &err));
+  REQUIRE(7.0f == reinterpret_cast<float*>(loaded.images[0])[15]);
+  FreeEXRImage(&loaded);
+
+  // Replace the chunk with a zlib stream of 4 bytes less than the chunk.
+  const size_t offset_table = 8 + loaded_header.header_len;
+  tinyexr::tinyexr_uint64 chunk_offset = 0;
+  memcpy(&chunk_offset, mem + offset_table, sizeof(chunk_offset));
+  REQUIRE(chunk_offset < size);
+  std::vector<unsigned char> short_data(
+      size_t(width * height) * sizeof(float) - 4, 0);
+  std::vector<unsigned char> zlib_data(
+      tinyexr::ZipCompressBound(short_data.size()));
+  tinyexr::tinyexr_uint64 zlib_size = zlib_data.size();
+  REQUIRE(tinyexr::DeflateZlib(&zlib_data.at(0), &zlib_size, &short_data.at(0),
+                               static_cast<unsigned long>(short_data.size()),
+                               TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT));
+  // y and data size(little endian) of the chunk.
+  int chunk_header[2] = {0, static_cast<int>(zlib_size)};
+  tinyexr::swap4(&chunk_header[0]);
+  tinyexr::swap4(&chunk_header[1]);
+  std::vector<unsigned char> crafted(mem, mem + size_t(chunk_offset));
+  const unsigned char* header_bytes =
+      reinterpret_cast<const unsigned char*>(chunk_header);
+  crafted.insert(crafted.end(), header_bytes,
+                 header_bytes + sizeof(chunk_header));
+  crafted.insert(crafted.end(), zlib_data.begin(),
+                 zlib_data.begin() + std::ptrdiff_t(zlib_size));
+
+  InitEXRImage(&loaded);
+  int ret = LoadEXRImageFromMemoryWithOptions(&loaded, &loaded_header,
+                                              &crafted.at(0), crafted.size(),
+                                              options, &err);
+  if (ret == TINYEXR_SUCCESS) {
+    FreeEXRImage(&loaded);
+  } else if (err) {
+    FreeEXRErrorMessage(err);
+  }
+  FreeEXRHeader(&loaded_header);
+  free(mem);
+  return ret;
+}
+
+TEST_CASE("Regression: ShortZipChunk", "[Load]") {
+  EXRParallelOptions options;
+  InitEXRParallelOptions(&options);
+  options.max_threads = 1;
+  REQUIRE(TINYEXR_SUCCESS != LoadShortZipChunk(&options));
+  InitEXRParallelOptions(&options);
+  REQUIRE(TINYEXR_SUCCESS != LoadShortZipChunk(&options));
+}
+
+#if defined(TINYEXR_USE_MINIZ) && (TINYEXR_USE_MINIZ == 1)
+struct ZipCodecCounter {
+  std::atomic<int> num_deflate;
+  std::atomic<int> num_inflate;
+};
+
+static int CountingDeflate(unsigned char* dst, size_t* dst_size,
+                           const unsigned char* src, size_t src_size,
+                           int level, void* userdata) {
+  static_cast<ZipCodecCounter*>(userdata)->num_deflate++;
+  mz_ulong out_size = mz_ulong(*dst_size);
+  if (MZ_OK != mz_compress2(dst, &out_size, src, mz_ulong(src_size),
+                            level ? level : MZ_DEFAULT_COMPRESSION)) {
+    return -1;
+  }
+  *dst_size = out_size;
+  return 0;
+}
+
+static int CountingInflate(unsigned char* dst, size_t* dst_size,
+                           const unsigned char* src, size_t src_size,
+                           void* userdata) {
+  static_cast<ZipCodecCounter*>(userdata)->num_inflate++;
+  mz_ulong out_size = mz_ulong(*dst_size);
+  if (MZ_OK != mz_uncompress(dst, &out_size, src, mz_ulong(src_size))) {
+    return -1;
+  }
+  *dst_size = out_size;
+  return 0;
+}
+
+TEST_CASE("ZipCodecHook", "[Save]") {
+  EXRVersion version;
+  REQUIRE(TINYEXR_SUCCESS ==
+          ParseEXRVersionFromFile(&version, "../../asakusa.exr"));
+  EXRHeader header;
+  InitEXRHeader(&header);
+  const char* err = NULL;
+  REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromFile(&header, &version,
+                                                    "../../asakusa.exr", &err));
+  EXRImage image;
+  InitEXRImage(&image);
+  REQUIRE(TINYEXR_SUCCESS ==
+          LoadEXRImageFromFile(&image, &header, "../../asakusa.exr", &err));
+  header.compression_type = TINYEXR_COMPRESSIONTYPE_ZIP;
+
+  // Output of the compiled-in backend.
+  unsigned char* expected = NULL;
+  size_t expected_size = SaveEXRImageToMemory(&image, &header, &expected, &err);
+  REQUIRE(0 < expected_size);
+
+  ZipCodecCounter counter;
+  counter.num_deflate = 0;
+  counter.num_inflate = 0;
+  EXRSetZipCodec(CountingDeflate, CountingInflate, &counter);
+
+  unsigned char* mem = NULL;
+  size_t size = SaveEXRImageToMemory(&image, &header, &mem, &err);
+
+  EXRHeader loaded_header;
+  InitEXRHeader(&loaded_header);
+  EXRImage loaded;
+  InitEXRImage(&loaded);
+  int ret = ParseEXRHeaderFromMemory(&loaded_header, &version, mem, size, &err);
+  if (ret == TINYEXR_SUCCESS) {
+    ret = LoadEXRImageFromMemory(&loaded, &loaded_header, mem, size, &err);
+  }
+  EXRSetZipCodec(NULL, NULL, NULL);
+
+  REQUIRE(TINYEXR_SUCCESS == ret);
+  REQUIRE(0 < counter.num_deflate);
+  REQUIRE(0 < counter.num_inflate);
+#if !TINYEXR_USE_LIBDEFLATE
+  // Same zlib implementation, so the file is identical.
+  REQUIRE(expected_size == size);
+  REQUIRE(0 == memcmp(expected, mem, size));
+#endif
+  for (int c = 0; c < header.num_channels; c++) {
+    REQUIRE(0 == memcmp(loaded.images[c], image.images[c],
+                        size_t(image.width) * size_t(image.height) *
+                            sizeof(unsigned short)));
+  }
+
+  FreeEXRImage(&loaded);
+  FreeEXRHeader(&loaded_header);
+  free(mem);
+  free(expected);
+  FreeEXRImage(&image);
+  FreeEXRHeader(&header);
+}
+
+// Registered codec which deflates a chunk with miniz.
+struct TestCodecState {
+  std::atomic<int> num_compress;
+  std::atomic<int> num_decompress;
+  std::atomic<int> num_bad_chunks;
+};
+
+static size_t TestCodecChunkSize(const EXRCodecChunk* chunk) {
+  size_t pixel_size = 0;
+  for (int c = 0; c < chunk->num_channels; c++) {
+    pixel_size +=
+        (chunk->channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) ? 2 : 4;
+  }
+  return size_t(chunk->width) * size_t(chunk->num_lines) * pixel_size;
+}
+
+static int TestCodecCompress(unsigned char* dst, size_t* dst_size,
+                             const unsigned char* src, size_t src_size,
+                             const EXRCodecChunk* chunk, void* userdata) {
+  TestCodecState* state = static_cast<TestCodecState*>(userdata);
+  state->num_compress++;
+  if (TestCodecChunkSize(chunk) != src_size || chunk->num_lines > 8) {
+    state->num_bad_chunks++;
+  }
+  mz_ulong out_size = mz_ulong(src_size);
+  if (MZ_OK != mz_compress(dst, &out_size, src, mz_ulong(src_size))) {
+    *dst_size = 0;  // does not fit: store uncompressed
+    return 0;
+  }
+  *dst_size = out_size;
+  return 0;
+}
+
+static int TestCodecDecompress(unsigned char* dst, size_t dst_size,
+                               const unsigned char* src, size_t src_size,
+                               const EXRCodecChunk* chunk, void* userdata) {
+  TestCodecState* state = static_cast<TestCodecState*>(userdata);
+  state->num_decompress++;
+  if (TestCodecChunkSize(chunk) != dst_size) {
+    state->num_bad_chunks++;
+  }
+  mz_ulong out_size = mz_ulong(dst_size);
+  if (MZ_OK != mz_uncompress(dst, &out_size, src, mz_ulong(src_size)) ||
+      out_size != dst_size) {
+    return -1;
+  }
+  return 0;
+}
+
+TEST_CASE("RegisteredCodec", "[Save]") {
+  const int kCompressionType = 200;
+
+  EXRVersion version;
+  REQUIRE(TINYEXR_SUCCESS ==
+          ParseEXRVersionFromFile(&version, "../../asakusa.exr"));
+  EXRHeader header;
+  InitEXRHeader(&header);
+  const char* err = NULL;
+  REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromFile(&header, &version,
+                                                    "../../asakusa.exr", &err));
+  EXRImage image;
+  InitEXRImage(&image);
+  REQUIRE(TINYEXR_SUCCESS ==
+          LoadEXRImageFromFile(&image, &header, "../../asakusa.exr", &err));
+
+  TestCodecState state;
+  state.num_compress = 0;
+  state.num_decompress = 0;
+  state.num_bad_chunks = 0;
+
+  EXRCodec codec;
+  codec.lines_per_block = 8;
+  codec.compress_func = TestCodecCompress;
+  codec.decompress_func = TestCodecDecompress;
+  codec.userdata = &state;
+  REQUIRE(TINYEXR_ERROR_INVALID_ARGUMENT ==
+          EXRRegisterCodec(TINYEXR_COMPRESSIONTYPE_NONE, &codec));
+  REQUIRE(TINYEXR_ERROR_INVALID_ARGUMENT == EXRRegisterCodec(256, &codec));
+  REQUIRE(TINYEXR_SUCCESS == EXRRegisterCodec(kCompressionType, &codec));
+
+  // Round trip with half and float channels.
+  for (int as_float = 0; as_float < 2; as_float++) {
+    header.compression_type = kCompressionType;
+    for (int c = 0; c < header.num_channels; c++) {
+      header.requested_pixel_types[c] =
+          as_float ? TINYEXR_PIXELTYPE_FLOAT : TINYEXR_PIXELTYPE_HALF;
+    }
+    unsigned char* mem = NULL;
+    size_t size = SaveEXRImageToMemory(&image, &header, &mem, &err);
+    REQUIRE(0 < size);
+
+    EXRHeader loaded_header;
+    InitEXRHeader(&loaded_header);
+    REQUIRE(TINYEXR_SUCCESS == ParseEXRHeaderFromMemory(&loaded_header,
+                                                        &version, mem, size,
+                                                        &err));
+    REQUIRE(kCompressionType == loaded_header.compression_type);
+    EXRImage loaded;
+    InitEXRImage(&loaded);
+    REQUIRE(TINYEXR_SUCCESS ==
+            LoadEXRImageFromMemory(&loaded, &loaded_header, mem, size, &err));
+    REQUIRE(image.num_channels == loaded.num_channels);
+    for (int c = 0; c < header.num_channels; c++) {
+      const unsigned short* src =
+          reinterpret_cast<const unsigned short*>(image.images[c]);
+      size_t num_mismatches = 0;
+      for (size_t i = 0; i < size_t(image.width) * size_t(image.height); i++) {
+        if (as_float) {
+          tinyexr::FP16 h;
+          h.u = src[i];
+          float f = reinterpret_cast<const float*>(loaded.images[c])[i];
+          num_mismatches += (tinyexr::half_to_float(h).f != f) ? 1 : 0;
+        } else {
+          unsigned short v =
+              reinterpret_cast<const unsigned short*>(loaded.images[c])[i];
+          num_mismatches += (src[i] != v) ? 1 : 0;
+        }
+      }
+      REQUIRE(0 == num_mismatches);
+    }
+    FreeEXRImage(&loaded);
+    FreeEXRHeader(&loaded_header);
+
+    if (as_float) {
+      // Unregistered id is rejected.
+      REQUIRE(TINYEXR_SUCCESS == EXRRegisterCodec(kCompressionType, NULL));
+      InitEXRHeader(&loaded_header);
+      REQUIRE(TINYEXR_ERROR_UNSUPPORTED_FORMAT ==
+              ParseEXRHeaderFromMemory(&loaded_header, &version, mem, size,
+                                       &err));
+      FreeEXRErrorMessage(err);
+      err = NULL;
+      FreeEXRHeader(&loaded_header);
+    }
+    free(mem);
+  }
+
+  REQUIRE(0 < state.num_compress);
+  REQUIRE(0 < state.num_decompress);
+  REQUIRE(0 == state.num_bad_chunks);
+
+  FreeEXRImage(&image);
+  FreeEXRHeader(&header);
+}
+#endif
+
+TEST_CASE("ScanlineWriter", "[Writer]") {
+  const int width = 67;
+  const int height = 53;
+  const char* filename = "scanline_writer.exr";
+
+  // Interleaved RGBA float source.
+  std::vector<float> rgba(size_t(width) * size_t(height) * 4);
+  for (size_t i = 0; i < rgba.size(); i++) {
+    rgba[i] = float((i * 13) % 251) / 7.0f;
+  }
+
+  const int compressions[] = {
+      TINYEXR_COMPRESSIONTYPE_NONE, TINYEXR_COMPRESSIONTYPE_RLE,
+      TINYEXR_COMPRESSIONTYPE_ZIPS, TINYEXR_COMPRESSIONTYPE_ZIP,
+      TINYEXR_COMPRESSIONTYPE_PIZ};
+  // Written in strips of various heights(not aligned to the chunk height).
+  const int strips[] = {1, 5, 20, 3, 24};
+
+  for (size_t ci = 0; ci < 5; ci++) {
+    EXRHeader header;
+    InitEXRHeader(&header);
+    header.compression_type = compressions[ci];
+    header.num_channels = 4;
+    header.channels =
+        static_cast<EXRChannelInfo*>(malloc(sizeof(EXRChannelInfo) * 4));
+    header.pixel_types = static_cast<int*>(malloc(sizeof(int) * 4));
+    header.requested_pixel_types = static_cast<int*>(malloc(sizeof(int) * 4));
+    const char* names[] = {"A", "B", "G", "R"};
+    const int order[] = {3, 2, 1, 0};  // channel -> RGBA component
+    for (int c = 0; c < 4; c++) {
+      strncpy(header.channels[c].name, names[c], 255);
+      header.pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+      header.requested_pixel_types[c] =
+          (c == 0) ? TINYEXR_PIXELTYPE_FLOAT : TINYEXR_PIXELTYPE_HALF;
+    }
+
+    const char* err = NULL;
+    EXRScanlineWriter* writer = NULL;
+    REQUIRE(TINYEXR_SUCCESS == CreateEXRScanlineWriter(&writer, &header,
+                                                       width, height, filename,
+                                                       NULL, &err));
+
+    int y = 0;
+    for (size_t s = 0; s < 5; s++) {
+      EXRFrameBufferSlice slices[4];
+      for (int c = 0; c < 4; c++) {
+        slices[c].base = reinterpret_cast<unsigned char*>(
+            &rgba[(size_t(y) * size_t(width)) * 4 + size_t(order[c])]);
+        slices[c].x_stride = 4 * sizeof(float);
+        slices[c].y_stride = size_t(width) * 4 * sizeof(float);
+        slices[c].pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+        slices[c].pad0 = 0;
+      }
+      if (s == 1) {
+        // Out of order
+        REQUIRE(TINYEXR_SUCCESS !=
+                EXRScanlineWriterWriteScanlines(writer, y + 1, strips[s],
+                                                slices, &err));
+        FreeEXRErrorMessage(err);
+      }
+      REQUIRE(TINYEXR_SUCCESS == EXRScanlineWriterWriteScanlines(
+                                     writer, y, strips[s], slices, &err));
+      y += strips[s];
+    }
+    REQUIRE(height == y);
+    REQUIRE(TINYEXR_SUCCESS == CloseEXRScanlineWriter(writer, &err));
+
+    // Reference: the same image saved with SaveEXRImageToMemory.
+    std::vector<std::vector<float> > planes(4);
+    std::vector<float*> image_ptrs(4);
+    for (int c = 0; c < 4; c++) {
+      planes[size_t(c)].resize(size_t(width) * size_t(height));
+      for (size_t i = 0; i < planes[size_t(c)].size(); i++) {
+        planes[size_t(c)][i] = rgba[i * 4 + size_t(order[c])];
+      }
+      image_ptrs[size_t(c)] = planes[size_t(c)].data();
+    }
+    EXRImage image;
+    InitEXRImage(&image);
+    image.images = reinterpret_cast<unsigned char**>(image_ptrs.data());
+    image.width = width;
+    image.height = height;
+    image.num_channels = 4;
+    unsigned char* mem = NULL;
+    size_t size = SaveEXRImageToMemory(&image, &header, &mem, &err);
+    REQUIRE(0 < size);
+
+    EXRVersion version;
+    REQUIRE(TINYEXR_SUCCESS == ParseEXRVersionFromFile(&version, filename));
+    EXRHeader loaded_header;
+    InitEXRHeader(&loaded_header);
+    REQUIRE(TINYEXR_SUCCESS ==
+            ParseEXRHeaderFromFile(&loaded_header, &version, filename, &err));
+    REQUIRE(width == loaded_header.data_window.max_x + 1);
+    REQUIRE(height == loaded_header.data_window.max_y + 1);
+    EXRImage loaded;
+    InitEXRImage(&loaded);
+    REQUIRE(TINYEXR_SUCCESS ==
+            LoadEXRImageFromFile(&loaded, &loaded_header, filename, &err));
+
+    EXRHeader ref_header;
+    InitEXRHeader(&ref_header);
+    REQUIRE(TINYEXR_SUCCESS ==
+            ParseEXRHeaderFromMemory(&ref_header, &version, mem, size, &err));
+    EXRImage ref;
+    InitEXRImage(&ref);
+    REQUIRE(TINYEXR_SUCCESS ==
+            LoadEXRImageFromMemory(&ref, &ref_header, mem, size, &err));
+
+    for (int c = 0; c < 4; c++) {
+      REQUIRE(loaded_header.pixel_types[c] == ref_header.pixel_types[c]);
+      size_t type_size =
+          (ref_header.pixel_types[c] == TINYEXR_PIXELTYPE_HALF) ? 2 : 4;
+      REQUIRE(0 == memcmp(loaded.images[c], ref.images[c],
+                          type_size * size_t(width) * size_t(height)));
+    }
+
+    FreeEXRImage(&ref);
+    FreeEXRHeader(&ref_header);
+    FreeEXRImage(&loaded);
+    FreeEXRHeader(&loaded_header);
+    free(mem);
+
+    // Closing before all scanlines are written is an error.
+    REQUIRE(TINYEXR_SUCCESS == CreateEXRScanlineWriter(&writer, &header,
+                                                       width, height, filename,
+                                                       NULL, &err));
+    REQUIRE(TINYEXR_SUCCESS != CloseEXRScanlineWriter(writer, &err));
+    FreeEXRErrorMessage(err);
+
+    free(header.channels);
+    free(header.pixel_types);
+    free(header.requested_pixel_types);
+  }
+
+  remove(filename);
+}
+
+namespace {
+
+struct MemoryStream {
+  const unsigned char* data;
+  size_t size;
+  size_t num_reads;
+};
+
+size_t ReadMemoryStream(void* userdata, unsigned long long offset,
+                        unsigned char* dst, size_t size) {
+  MemoryStream* stream = static_cast<MemoryStream*>(userdata);
+  stream->num_reads++;
+  if (offset >= stream->size) {
+    return 0;
+  }
+  size_t n = (std::min)(size, stream->size - size_t(offset));
+  memcpy(dst, stream->data + offset, n);
+  return n;
+}
+
+}  // namespace
+
+TEST_CASE("StreamReader", "[Reader]") {
+  const int width = 71;
+  const int height = 45;
+  const int compressions[] = {TINYEXR_COMPRESSIONTYPE_NONE,
+                              TINYEXR_COMPRESSIONTYPE_ZIP,
+                              TINYEXR_COMPRESSIONTYPE_PIZ};
+  const int strips[] = {3, 30, 12};
+
+  for (size_t ci = 0; ci < 3; ci++) {
+    EXRHeader header;
+    InitEXRHeader(&header);
+    header.compression_type = compressions[ci];
+    header.num_channels = 3;
+    header.channels =
+        static_cast<EXRChannelInfo*>(malloc(sizeof(EXRChannelInfo) * 3));
+    header.pixel_types = static_cast<int*>(malloc(sizeof(int) * 3));
+    header.requested_pixel_types = static_cast<int*>(malloc(sizeof(int) * 3));
+    const char* names[] = {"B", "G", "R"};
+    std::vector<std::vector<float> > planes(3);
+    std::vector<float*> image_ptrs(3);
+    for (int c = 0; c < 3; c++) {
+      strncpy(header.channels[c].name, names[c], 255);
+      header.pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+      header.requested_pixel_types[c] =
+          (c == 1) ? TINYEXR_PIXELTYPE_FLOAT : TINYEXR_PIXELTYPE_HALF;
+      planes[size_t(c)].resize(size_t(width) * size_t(height));
+      for (size_t i = 0; i < planes[size_t(c)].size(); i++) {
+        planes[size_t(c)][i] = float((i * 3 + size_t(c) * 17) % 113) * 0.5f;
+      }
+      image_ptrs[size_t(c)] = planes[size_t(c)].data();
+    }
+    EXRImage image;
+    InitEXRImage(&image);
+    image.images = reinterpret_cast<unsigned char**>(image_ptrs.data());
+    image.width = width;
+    image.height = height;
+    image.num_channels = 3;
+
+    const char* err = NULL;
+    unsigned char* mem = NULL;
+    size_t size = SaveEXRImageToMemory(&image, &header, &mem, &err);
+    REQUIRE(0 < size);
+    free(header.channels);
+    free(header.pixel_types);
+    free(header.requested_pixel_types);
+
+    // Reference
+    EXRVersion version;
+    REQUIRE(TINYEXR_SUCCESS == ParseEXRVersionFromMemory(&version, mem, size));
+    EXRHeader ref_header;
+    InitEXRHeader(&ref_header);
+    REQUIRE(TINYEXR_SUCCESS ==
+            ParseEXRHeaderFromMemory(&ref_header, &version, mem, size, &err));
+    for (int c = 0; c < 3; c++) {
+      ref_header.requested_pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+    }
+    EXRImage ref;
+    InitEXRImage(&ref);
+    REQUIRE(TINYEXR_SUCCESS ==
+            LoadEXRImageFromMemory(&ref, &ref_header, mem, size, &err));
+
+    MemoryStream stream = {mem, size, 0};
+    EXRHeader stream_header;
+    InitEXRHeader(&stream_header);
+    EXRStreamReader* reader = NULL;
+    REQUIRE(TINYEXR_SUCCESS == CreateEXRStreamReader(&reader, &stream_header,
+                                                     ReadMemoryStream, &stream,
+                                                     NULL, &err));
+    REQUIRE(3 == stream_header.num_channels);
+    REQUIRE(width == stream_header.data_window.max_x + 1);
+
+    // Decode strips into an interleaved RGB buffer.
+    std::vector<float> strip(size_t(width) * 30 * 3);
+    int y = 0;
+    for (size_t s = 0; s < 3; s++) {
+      EXRFrameBufferSlice slices[3];
+      for (int c = 0; c < 3; c++) {
+        slices[c].base = reinterpret_cast<unsigned char*>(&strip[size_t(c)]);
+        slices[c].x_stride = 3 * sizeof(float);
+        slices[c].y_stride = size_t(width) * 3 * sizeof(float);
+        slices[c].pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+        slices[c].pad0 = 0;
+      }
+      REQUIRE(TINYEXR_SUCCESS == EXRStreamReaderReadScanlines(
+                                     reader, y, strips[s], slices, &err));
+      for (int v = 0; v < strips[s]; v++) {
+        for (int x = 0; x < width; x++) {
+          for (int c = 0; c < 3; c++) {
+            float expected = reinterpret_cast<float**>(
+                ref.images)[c][size_t(y + v) * size_t(width) + size_t(x)];
+            REQUIRE(expected ==
+                    strip[(size_t(v) * size_t(width) + size_t(x)) * 3 +
+                          size_t(c)]);
+          }
+        }
+      }
+      y += strips[s];
+    }
+    REQUIRE(height == y);
+
+    // Out of the data window
+    {
+      EXRFrameBufferSlice slices[3];
+      memset(slices, 0, sizeof(slices));
+      REQUIRE(TINYEXR_SUCCESS !=
+              EXRStreamReaderReadScanlines(reader, height - 1, 2, slices,
+                                           &err));
+      FreeEXRErrorMessage(err);
+    }
+
+    FreeEXRStreamReader(reader);
+    FreeEXRHeader(&stream_header);
+
+    // Truncated data
+    {
+      MemoryStream truncated = {mem, size - 10, 0};
+      EXRHeader h;
+      InitEXRHeader(&h);
+      REQUIRE(TINYEXR_SUCCESS == CreateEXRStreamReader(&reader, &h,
+                                                       ReadMemoryStream,
+                                                       &truncated, NULL,
+                                                       &err));
+      std::vector<float> all(size_t(width) * size_t(height));
+      EXRFrameBufferSlice slices[3];
+      memset(slices, 0, sizeof(slices));
+      slices[0].base = reinterpret_cast<unsigned char*>(all.data());
+      slices[0].x_stride = sizeof(float);
+      slices[0].y_stride = size_t(width) * sizeof(float);
+      slices[0].pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+      REQUIRE(TINYEXR_SUCCESS !=
+              EXRStreamReaderReadScanlines(reader, 0, height, slices, &err));
+      FreeEXRErrorMessage(err);
+      FreeEXRStreamReader(reader);
+      FreeEXRHeader(&h);
+    }
+
+    FreeEXRImage(&ref);
+    FreeEXRHeader(&ref_header);
+    free(mem);
+  }
+}
+
+namespace {
+
+// Endless stream: EXR version header followed by zeros, so the EXR header
+// never becomes valid.
+size_t ReadEndlessStream(void* userdata, unsigned long long offset,
+                         unsigned char* dst, size_t size) {
+  static const unsigned char kVersion[8] = {0x76, 0x2f, 0x31, 0x01,
+                                            2,    0,    0,    0};
+  *static_cast<size_t*>(userdata) += size;
+  memset(dst, 0, size);
+  for (size_t i = 0; i < size; i++) {
+    if (offset + i < sizeof(kVersion)) {
+      dst[i] = kVersion[size_t(offset) + i];
+    }
+  }
+  return size;
+}
+
+}  // namespace
+
+TEST_CASE("StreamReader|InvalidHeader", "[Reader]") {
+  size_t num_read_bytes = 0;
+  EXRHeader header;
+  InitEXRHeader(&header);
+  EXRStreamReader* reader = NULL;
+  const char* err = NULL;
+  REQUIRE(TINYEXR_SUCCESS != CreateEXRStreamReader(&reader, &header,
+                                                   ReadEndlessStream,
+                                                   &num_read_bytes, NULL,
+                                                   &err));
+  if (err) {
+    FreeEXRErrorMessage(err);
+  }
+  // Bytes already read are not read again while looking for the end of the
+  // header(up to 64 MB).
+  REQUIRE(num_read_bytes <= 64 * 1024 * 1024 + 8);
+}
+
+TEST_CASE("StreamReaderFromFile", "[Reader]") {
+  const char* filepath = "../../asakusa.exr";
+  const char* err = NULL;
+
+  // Reference
+  EXRVersion version;
+  REQUIRE(TINYEXR_SUCCESS == ParseEXRVersionFromFile(&version, filepath));
+  EXRHeader ref_header;
+  InitEXRHeader(&ref_header);
+  REQUIRE(TINYEXR_SUCCESS ==
+          ParseEXRHeaderFromFile(&ref_header, &version, filepath, &err));
+  for (int c = 0; c < ref_header.num_channels; c++) {
+    ref_header.requested_pixel_types[c] = TINYEXR_PIXELTYPE_FLOAT;
+  }
+  EXRImage ref;
+  InitEXRImage(&ref);
+  REQUIRE(TINYEXR_SUCCESS ==
+          LoadEXRImageFromFile(&ref, &ref_header, filepath, &err));
+  const int width = ref.width;
+  const int height = ref.height;
+  const int num_channels = ref.num_channels;
+
+  EXRParallelOptions options;
+  InitEXRParallelOptions(&options);
+  options.max_threads = 3;
+
+  EXRHeader header;
+  InitEXRHeader(&header);
+  EXRStreamReader* reader = NULL;
+  REQUIRE(TINYEXR_SUCCESS == CreateEXRStreamReaderFromFile(
+                                 &reader, &header, filepath, &options, &err));
+  REQUIRE(num_channels == header.num_channels);
+
+  // The whole image, then a strip in the middle.
+  std::vector<std::vector<float> > planes(static_cast<size_t>(num_channels));
+  std::vector<EXRFrameBufferSlice> slices(static_cast<size_t>(num_channels));
+  for (size_t c = 0; c < size_t(num_channels); c++) {
+    planes[c].resize(size_t(width) * size_t(height));
+    slices[c].base = reinterpret_cast<unsigned char*>(planes[c].data());
+    slices[c].x_stride = sizeof(float);
+    slices[c].y_stride = size_t(width) * sizeof(float);
+    slices[c].pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+    slices[c].pad0 = 0;
+  }
+  REQUIRE(TINYEXR_SUCCESS == EXRStreamReaderReadScanlines(
+                                 reader, 0, height, slices.data(), &err));
+  for (size_t c = 0; c < size_t(num_channels); c++) {
+    REQUIRE(0 == memcmp(ref.images[c], planes[c].data(),
+                        planes[c].size() * sizeof(float)));
+    std::fill(planes[c].begin(), planes[c].end(), 0.0f);
+  }
+
+  const int y = height / 3;
+  const int num_lines = 37;
+  REQUIRE(TINYEXR_SUCCESS == EXRStreamReaderReadScanlines(
+                                 reader, y, num_lines, slices.data(), &err));
+  for (size_t c = 0; c < size_t(num_channels); c++) {
+    REQUIRE(0 == memcmp(reinterpret_cast<float**>(ref.images)[c] +
+                            size_t(y) * size_t(width),
+                        planes[c].data(),
+                        size_t(num_lines) * size_t(width) * sizeof(float)));
+  }
+
+  FreeEXRStreamReader(reader);
+  FreeEXRHeader(&header);
+  FreeEXRImage(&ref);
+  FreeEXRHeader(&ref_header);
+
+  InitEXRHeader(&header);
+  REQUIRE(TINYEXR_ERROR_CANT_OPEN_FILE ==
+          CreateEXRStreamReaderFromFile(&reader, &header, "not_found.exr",
+                                        NULL, &err));
+  FreeEXRErrorMessage(err);
+
+  // Tiled image is not supported.
+  InitEXRHeader(&header);
+  REQUIRE(TINYEXR_ERROR_UNSUPPORTED_FEATURE ==
+          CreateEXRStreamReaderFromFile(
+              &reader, &header, "./regression/tiled_half_1x1_alpha.exr", NULL,
+              &err));
+  FreeEXRErrorMessage(err);
+}
@@ -119,6 +119,13 @@ extern "C" {
 #define TINYEXR_USE_NANOZLIB (0)
 #endif
 
+// Use libdeflate(https://github.com/ebiggers/libdeflate) to compress and
+// decompress ZIP/ZIPS chunks. Takes precedence over the other zlib backends.
+// `libdeflate.h` must be in the include path.
+#ifndef TINYEXR_USE_LIBDEFLATE
+#define TINYEXR_USE_LIBDEFLATE (0)
+#endif
+
 // Disable PIZ compression when applying cpplint.
 #ifndef TINYEXR_USE_PIZ
 #define TINYEXR_USE_PIZ (1)
@@ -134,6 +141,11 @@ extern "C" {
 // http://computation.llnl.gov/projects/floating-point-compression
 #endif
 
+// Use SIMD(SSE2/F16C/NEON) for half <-> float conversion.
+#ifndef TINYEXR_USE_SIMD
+#define TINYEXR_USE_SIMD (1)
+#endif
+
 #ifndef TINYEXR_USE_OPENMP
 #ifdef _OPENMP
 #define TINYEXR_USE_OPENMP (1)
@@ -173,12 +185,23 @@ extern "C" {
 #define TINYEXR_COMPRESSIONTYPE_ZIPS (2)
 #define TINYEXR_COMPRESSIONTYPE_ZIP (3)
 #define TINYEXR_COMPRESSIONTYPE_PIZ (4)
+#define TINYEXR_COMPRESSIONTYPE_PXR24 (5)
+#define TINYEXR_COMPRESSIONTYPE_B44 (6)
+#define TINYEXR_COMPRESSIONTYPE_B44A (7)
+#define TINYEXR_COMPRESSIONTYPE_DWAA (8)  // load only
+#define TINYEXR_COMPRESSIONTYPE_DWAB (9)  // load only
 #define TINYEXR_COMPRESSIONTYPE_ZFP (128)  // TinyEXR extension
 
 #define TINYEXR_ZFP_COMPRESSIONTYPE_RATE (0)
 #define TINYEXR_ZFP_COMPRESSIONTYPE_PRECISION (1)
 #define TINYEXR_ZFP_COMPRESSIONTYPE_ACCURACY (2)
 
+// Values of `EXRHeader::zip_compression_level` other than 1(fastest) ~
+// 9(best compression).
+#define TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT (0)
+// Stores ZIP/ZIPS/PXR24 chunks uncompressed(readable by any OpenEXR reader).
+#define TINYEXR_ZIP_COMPRESSION_LEVEL_STORE (-1)
+
 #define TINYEXR_TILE_ONE_LEVEL (0)
 #define TINYEXR_TILE_MIPMAP_LEVELS (1)
 #define TINYEXR_TILE_RIPMAP_LEVELS (2)
@@ -186,6 +209,14 @@ extern "C" {
 #define TINYEXR_TILE_ROUND_DOWN (0)
 #define TINYEXR_TILE_ROUND_UP (1)
 
+// Values of `EXRParallelOptions::mmap_advice`(POSIX madvise()).
+// Prefetch the chunks to be decoded before decoding(MADV_WILLNEED).
+#define TINYEXR_MMAP_ADVICE_WILLNEED (1)
+// Read ahead aggressively on page faults(MADV_SEQUENTIAL).
+#define TINYEXR_MMAP_ADVICE_SEQUENTIAL (2)
+// Release the pages of the decoded chunks after decoding(MADV_DONTNEED).
+#define TINYEXR_MMAP_ADVICE_DONTNEED (4)
+
 typedef struct TEXRVersion {
   int version;    // this must be 2
   // tile format image;
@@ -276,6 +307,19 @@ typedef struct TEXRHeader {
                                // ParseEXRHeaderFrom(Meomory|File), then users
                                // can edit it(only valid for HALF pixel type
                                // channel)
+  // Compression level of ZIP/ZIPS/PXR24 used when saving: 1(fastest) ~
+  // 9(best), TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT(the default level of the
+  // zlib backend) or TINYEXR_ZIP_COMPRESSION_LEVEL_STORE. Not stored in the
+  // file.
+  int zip_compression_level;
+
+  // Optional channel mask for loading: `num_channels` flags, nonzero to decode
+  // the channel. Masked out channels get no buffer(`images[c]` is NULL) and
+  // are not unpacked. NULL decodes all channels. Set it after
+  // ParseEXRHeaderFrom(Memory|File). Owned by the caller(FreeEXRHeader does
+  // not free it). Ignored when loading into a user frame buffer.
+  const unsigned char *channel_mask;
+
   // name attribute required for multipart files;
   // must be unique and non empty (according to spec.);
   // use EXRSetNameAttr for setting value;
@@ -323,6 +367,66 @@ typedef struct TDeepImage {
   int pad0;
 } DeepImage;
 
+// Opaque handle of a persistent thread pool(see `CreateEXRThreadPool`).
+typedef struct TEXRThreadPool EXRThreadPool;
+
+// Opaque handle of a tiled image reader(see `CreateEXRTiledReaderFromFile`).
+typedef struct TEXRTiledReader EXRTiledReader;
+
+// Opaque handle of a streaming scanline writer(see
+// `CreateEXRScanlineWriter`).
+typedef struct TEXRScanlineWriter EXRScanlineWriter;
+
+// Opaque handle of a streaming scanline reader(see `CreateEXRStreamReader`).
+typedef struct TEXRStreamReader EXRStreamReader;
+
+// Opaque handle of an opened EXR file(see `OpenEXRFile`).
+typedef struct TEXRFile EXRFile;
+
+// User I/O callback for `EXRStreamReader`.
+// Reads `size` bytes at byte offset `offset` of the EXR data into `dst` and
+// returns the number of bytes read(less than `size` only at the end of the
+// data or on error).
+typedef size_t (*EXRReadFunc)(void *userdata, unsigned long long offset,
+                              unsigned char *dst, size_t size);
+
+// Per-call threading options for `*WithOptions` load/save functions.
+// Initialize with `InitEXRParallelOptions`.
+typedef struct TEXRParallelOptions {
+  // Maximum number of threads used for decoding/encoding chunks.
+  // <= 0: no limit(use all threads of the thread pool or OpenMP).
+  // 1: decode/encode in the calling thread only.
+  int max_threads;
+
+  // Access hints(TINYEXR_MMAP_ADVICE_*, OR'ed) for the chunks to be decoded
+  // when loading from a file(`LoadEXRImageFromFileWithOptions`,
+  // `EXRFileLoad*`). 0: no hints. Ignored by `*FromMemory` functions and
+  // when the file is not memory mapped(e.g. on Windows). Hints are reset
+  // (MADV_NORMAL) after decoding. Not used by `LoadEXRImageToFrameBuffer*`.
+  int mmap_advice;
+
+  // Optional user executor. When non-NULL, tinyexr does not use its own
+  // threads(thread pool or OpenMP) but calls
+  // `parallel_for(ctx, begin, end, fn)` for each parallel loop.
+  // The executor must call `fn(ctx, i)` exactly once for each `i` in
+  // [begin, end) (possibly concurrently) and return after all calls have
+  // finished. `max_threads` is not used in this case.
+  void (*parallel_for)(void *ctx, int begin, int end,
+                       void (*fn)(void *ctx, int i));
+} EXRParallelOptions;
+
+// Destination of a channel for `LoadEXRImageToFrameBuffer*`.
+// Pixel (x, y)(relative to the data window) of the channel is written to
+// `base + y * y_stride + x * x_stride`.
+typedef struct TEXRFrameBufferSlice {
+  unsigned char *base;  // NULL: the channel is not decoded.
+  size_t x_stride;      // in bytes
+  size_t y_stride;      // in bytes
+  int pixel_type;       // TINYEXR_PIXELTYPE_*. Converted from the pixel type
+                        // in the file when different.
+  int pad0;
+} EXRFrameBufferSlice;
+
 // @deprecated { For backward compatibility. Not recommended to use. }
 // Loads single-frame OpenEXR image. Assume EXR image contains A(single channel
 // alpha) or RGB(A) channels.
@@ -594,6 +698,434 @@ extern int LoadEXRFromMemory(float **out_rgba, int *width, int *height,
                              const unsigned char *memory, size_t size,
                              const char **err);
 
+// Creates a persistent thread pool which is reused by scanline/tile
+// decoding and encoding, instead of spawning threads for each call.
+// `num_threads` is the number of threads including the calling thread.
+// `num_threads` <= 0 uses std::thread::hardware_concurrency().
+// Returns NULL when threading is disabled(TINYEXR_USE_THREAD == 0).
+// Application must free the pool with `FreeEXRThreadPool`.
+extern EXRThreadPool *CreateEXRThreadPool(int num_threads);
+
+// Frees the thread pool created by `CreateEXRThreadPool`.
+// If `pool` is the global thread pool, the global thread pool is reset to the
+// default one. Application must not free the pool while load/save functions
+// are using it.
+extern void FreeEXRThreadPool(EXRThreadPool *pool);
+
+// Sets the thread pool used by all load/save functions.
+// NULL restores the default pool(created on first use with
+// std::thread::hardware_concurrency() threads).
+extern void EXRSetGlobalThreadPool(EXRThreadPool *pool);
+
+// Returns the number of threads of `pool`(including the calling thread).
+// NULL returns the number of threads of the current global thread pool.
+// Returns 1 when threading is disabled.
+extern int EXRThreadPoolNumThreads(const EXRThreadPool *pool);
+
+// Initialize EXRParallelOptions struct(no thread limit, no executor).
+extern void InitEXRParallelOptions(EXRParallelOptions *options);
+
+// Same as `LoadEXRImageFromFile`, but with threading options.
+// `options` may be NULL(same as `LoadEXRImageFromFile`).
+extern int LoadEXRImageFromFileWithOptions(EXRImage *image,
+                                           const EXRHeader *header,
+                                           const char *filename,
+                                           const EXRParallelOptions *options,
+                                           const char **err);
+
+// Same as `LoadEXRImageFromMemory`, but with threading options.
+// `options` may be NULL(same as `LoadEXRImageFromMemory`).
+extern int LoadEXRImageFromMemoryWithOptions(EXRImage *image,
+                                             const EXRHeader *header,
+                                             const unsigned char *memory,
+                                             const size_t size,
+                                             const EXRParallelOptions *options,
+                                             const char **err);
+
+// Same as `LoadEXRMultipartImageFromMemory`, but with threading options.
+// `options` may be NULL(same as `LoadEXRMultipartImageFromMemory`).
+extern int LoadEXRMultipartImageFromMemoryWithOptions(
+    EXRImage *images, const EXRHeader **headers, unsigned int num_parts,
+    const unsigned char *memory, const size_t size,
+    const EXRParallelOptions *options, const char **err);
+
+// Same as `LoadEXRMultipartImageFromMemoryWithOptions`, but loads only the
+// parts `part_indices[0 .. num_selected)`(indices into `headers`, e.g. found
+// by `EXRFindPartByName`). `images` and `headers` have `num_parts` entries(all
+// parts in the file). Images of the other parts are not touched, and their
+// offset tables and chunks are not read.
+// Chunks of the selected parts are decoded in a single parallel loop.
+extern int LoadEXRMultipartImagePartsFromMemory(
+    EXRImage *images, const EXRHeader **headers, unsigned int num_parts,
+    const int *part_indices, unsigned int num_selected,
+    const unsigned char *memory, const size_t size,
+    const EXRParallelOptions *options, const char **err);
+
+// Returns the index of the part whose `name` attribute is `name` in
+// `headers`, or -1 when not found.
+extern int EXRFindPartByName(const EXRHeader **headers, unsigned int num_parts,
+                             const char *name);
+
+// Loads only the region `roi` of single-part scanline EXR image from a file.
+// `roi` is in data window coordinates(bounds are inclusive) and is clipped by
+// the data window. Only scanline blocks which intersect with `roi` are
+// decompressed.
+// The resulting `image` has the size of the clipped region and is identical
+// to the corresponding part of the image loaded by `LoadEXRImageFromFile`.
+// Tiled image is not supported(returns TINYEXR_ERROR_UNSUPPORTED_FEATURE).
+// Application must free EXRImage using `FreeEXRImage`
+// When there was an error message, Application must free `err` with
+// FreeEXRErrorMessage()
+// Returns negative value and may set error string in `err` when there's an
+// error
+extern int LoadEXRImageRegionFromFile(EXRImage *image, const EXRHeader *header,
+                                      const char *filename,
+                                      const EXRBox2i *roi, const char **err);
+
+// Same as `LoadEXRImageRegionFromFile`, but loads from memory.
+extern int LoadEXRImageRegionFromMemory(EXRImage *image,
+                                        const EXRHeader *header,
+                                        const unsigned char *memory,
+                                        const size_t size, const EXRBox2i *roi,
+                                        const char **err);
+
+// Decodes single-part EXR image from a file directly into application
+// provided buffers, without allocating intermediate images.
+// `slices` is an array of `header->num_channels` entries(in the order of
+// `header->channels`). Each slice can point into an interleaved buffer(e.g.
+// RGBA), a GPU staging buffer or a sub rectangle of a larger atlas.
+// Each buffer must have room for the whole data window.
+// `header->requested_pixel_types` is not used; pixel data is converted to
+// `slices[c].pixel_type`(FLOAT to UINT is clamped to [0, 4294967295]).
+// For tiled image, only the first level(level 0) is decoded.
+// For scanline image, the result is identical to `LoadEXRImageFromFile`
+// (including the flip for line order). For tiled image, line order only
+// specifies the order of tiles in the file(as in OpenEXR) and rows are never
+// flipped, whereas `LoadEXRImageFromFile` flips the rows of each tile of a
+// DECREASING_Y image within its `tile_size_y` rows.
+// When there was an error message, Application must free `err` with
+// FreeEXRErrorMessage()
+// Returns negative value and may set error string in `err` when there's an
+// error
+extern int LoadEXRImageToFrameBufferFromFile(const EXRHeader *header,
+                                             const char *filename,
+                                             const EXRFrameBufferSlice *slices,
+                                             const char **err);
+
+// Same as `LoadEXRImageToFrameBufferFromFile`, but loads from memory.
+extern int LoadEXRImageToFrameBufferFromMemory(
+    const EXRHeader *header, const unsigned char *memory, const size_t size,
+    const EXRFrameBufferSlice *slices, const char **err);
+
+// Opens single-part tiled EXR image for reading tiles on demand.
+// Only the offset table is read here. Tiles are decoded by
+// `EXRTiledReaderReadTile`, so an application(e.g. texture cache) can decode
+// only the tiles it needs instead of loading the whole mip/rip pyramid.
+// `header` must be parsed with `ParseEXRHeaderFromFile` and must be kept alive
+// until the reader is freed. Set `header->requested_pixel_types` before
+// opening the reader to get HALF channels as FLOAT.
+// Application must free the reader with `FreeEXRTiledReader`.
+// Returns negative value and may set error string in `err` when there's an
+// error
+extern int CreateEXRTiledReaderFromFile(EXRTiledReader **reader,
+                                        const EXRHeader *header,
+                                        const char *filename,
+                                        const char **err);
+
+// Same as `CreateEXRTiledReaderFromFile`, but reads from memory.
+// `memory` must be kept alive until the reader is freed.
+extern int CreateEXRTiledReaderFromMemory(EXRTiledReader **reader,
+                                          const EXRHeader *header,
+                                          const unsigned char *memory,
+                                          const size_t size, const char **err);
+
+// Frees the reader created by `CreateEXRTiledReaderFrom*`.
+extern void FreeEXRTiledReader(EXRTiledReader *reader);
+
+// Returns the number of levels in x and y direction.
+// (1, 1) for TINYEXR_TILE_ONE_LEVEL. num_x_levels == num_y_levels for
+// TINYEXR_TILE_MIPMAP_LEVELS.
+extern void EXRTiledReaderNumLevels(const EXRTiledReader *reader,
+                                    int *num_x_levels, int *num_y_levels);
+
+// Returns the size of level (`level_x`, `level_y`) and the number of tiles in
+// the level.
+// For TINYEXR_TILE_MIPMAP_LEVELS, `level_x` must be equal to `level_y`.
+// Returns TINYEXR_ERROR_INVALID_ARGUMENT for invalid level.
+extern int EXRTiledReaderLevelInfo(const EXRTiledReader *reader, int level_x,
+                                   int level_y, int *width, int *height,
+                                   int *num_x_tiles, int *num_y_tiles);
+
+// Decodes a tile (`tile_x`, `tile_y`) of level (`level_x`, `level_y`) into
+// `images`, an array of `header->num_channels` buffers. Each buffer must have
+// room for `tile_size_x` * `tile_size_y` pixels of requested pixel type, and
+// the tile is stored with the row stride of `tile_size_x`.
+// The actual size of the tile(smaller than the tile size at the image border)
+// is returned to `width` and `height`.
+// This function can be called from multiple threads at the same time.
+// When there was an error message, Application must free `err` with
+// FreeEXRErrorMessage()
+// Returns negative value and may set error string in `err` when there's an
+// error
+extern int EXRTiledReaderReadTile(const EXRTiledReader *reader, int level_x,
+                                  int level_y, int tile_x, int tile_y,
+                                  unsigned char **images, int *width,
+                                  int *height, const char **err);
+
+// Same as `SaveEXRImageToMemory`, but with threading options.
+// `options` may be NULL(same as `SaveEXRImageToMemory`).
+extern size_t SaveEXRImageToMemoryWithOptions(const EXRImage *image,
+                                              const EXRHeader *exr_header,
+                                              unsigned char **memory,
+                                              const EXRParallelOptions *options,
+                                              const char **err);
+
+// Same as `SaveEXRImageToFile`, but with threading options.
+// `options` may be NULL(same as `SaveEXRImageToFile`).
+extern int SaveEXRImageToFileWithOptions(const EXRImage *image,
+                                         const EXRHeader *exr_header,
+                                         const char *filename,
+                                         const EXRParallelOptions *options,
+                                         const char **err);
+
+// Opens a single-part scanline EXR file for writing scanlines incrementally.
+// Unlike `SaveEXRImageToFile`, the whole image is never held in memory:
+// each scanline block is compressed and written to the file as soon as all
+// of its scanlines are given, and the offset table(reserved right after the
+// header) is filled in by `CloseEXRScanlineWriter`.
+// `header` is set up as for `SaveEXRImageToFile`(`requested_pixel_types` is
+// the pixel type stored in the file). Tiled image is not supported.
+// The data window is (0, 0) - (width - 1, height - 1).
+// `options` may be NULL.
+// Application must close the writer with `CloseEXRScanlineWriter`.
+// Returns negative value and may set error string in `err` when there's an
+// error
+extern int CreateEXRScanlineWriter(EXRScanlineWriter **writer,
+                                   const EXRHeader *header, int width,
+                                   int height, const char *filename,
+                                   const EXRParallelOptions *options,
+                                   const char **err);
+
+// Writes scanlines [y, y + num_lines) from `slices`, an array of
+// `header->num_channels` entries(in the order of `header->channels`).
+// Pixel (x, y + v) of the channel is read from
+// `base + v * y_stride + x * x_stride`, i.e. `base` points to the first pixel
+// of scanline `y`, so a renderer can reuse a small strip buffer.
+// Pixel data is converted from `slices[c].pixel_type` to the pixel type in
+// the file.
+// Scanlines must be written in increasing y order without gaps(`y` must be
+// the first scanline not written yet). Any number of scanlines can be
+// written at a time; when `num_lines` covers several scanline blocks, they
+// are compressed in parallel.
+// Returns negative value and may set error string in `err` when there's an
+// error
+extern int EXRScanlineWriterWriteScanlines(EXRScanlineWriter *writer, int y,
+                                           int num_lines,
+                                           const EXRFrameBufferSlice *slices,
+                                           const char **err);
+
+// Writes the offset table, closes the file and frees the writer.
+// Returns an error when not all scanlines were written(the file is left
+// incomplete).
+// Returns negative value and may set error string in `err` when there's an
+// error
+extern int CloseEXRScanlineWriter(EXRScanlineWriter *writer, const char **err);
+
+// Opens single-part scanline EXR data through the user I/O callback `read`,
+// e.g. for network filesystems, archives or pipes(with a read-ahead buffer).
+// Only the header and the offset table are read here and `header` is filled
+// with the parsed header(`header` must be initialized with `InitEXRHeader`,
+// must be kept alive until the reader is freed and must be freed with
+// `FreeEXRHeader` by the application).
+// Scanlines are decoded by `EXRStreamReaderReadScanlines`, which reads one
+// chunk at a time, so the memory used by the reader does not depend on the
+// image size. `options` may be NULL.
+// Application must free the reader with `FreeEXRStreamReader`.
+// Returns negative value and may set error string in `err` when there's an
+// error
+extern int CreateEXRStreamReader(EXRStreamReader **reader, EXRHeader *header,
+                                 EXRReadFunc read, void *userdata,
+                                 const EXRParallelOptions *options,
+                                 const char **err);
+
+// Same as `CreateEXRStreamReader`, but reads the file `filename` without
+// memory mapping it, e.g. for files not in the page cache, where decoding
+// threads of `LoadEXRImageFromFile` stall on page faults.
+// With pread()(`TINYEXR_USE_PREAD`, default on POSIX systems) chunks are read
+// concurrently from the decoding threads, and the next chunks are prefetched
+// with posix_fadvise(POSIX_FADV_WILLNEED) where available, so reading the
+// chunks ahead overlaps with decoding. Reading all scanlines [0, height)
+// loads the whole image.
+// Only this reader(single-part scanline image) reads files this way.
+// `LoadEXRImageFromFile*`, `EXRFileLoad*`, tiled and multipart loads always
+// memory map the file(see also `EXRParallelOptions::mmap_advice`).
+extern int CreateEXRStreamReaderFromFile(EXRStreamReader **reader,
+                                         EXRHeader *header,
+                                         const char *filename,
+                                         const EXRParallelOptions *options,
+                                         const char **err);
+
+// Decodes scanlines [y, y + num_lines)(relative to the data window) into
+// `slices`, an array of `header->num_channels` entries(in the order of
+// `header->channels`). Scanline `y + v` of the channel is written to
+// `base + v * y_stride + x * x_stride`, i.e. `base` points to the first
+// pixel of scanline `y`. Channels whose slice has NULL `base` are skipped.
+// The scanlines are identical to the rows of `LoadEXRImageFromFile`.
+// Chunks are decoded in parallel while the next chunks are read. `read` is
+// never called concurrently, and chunks are read in increasing offset order
+// for a file written in increasing y order(the reader of
+// `CreateEXRStreamReaderFromFile` may read chunks concurrently).
+// Returns negative value and may set error string in `err` when there's an
+// error
+extern int EXRStreamReaderReadScanlines(EXRStreamReader *reader, int y,
+                                        int num_lines,
+                                        const EXRFrameBufferSlice *slices,
+                                        const char **err);
+
+// Frees the reader created by `CreateEXRStreamReader`.
+extern void FreeEXRStreamReader(EXRStreamReader *reader);
+
+// Opens an EXR file once for parsing its version, headers and images.
+// `*FromFile` functions open(and map) the file on each call, so e.g.
+// `ParseEXRVersionFromFile` + `ParseEXRHeaderFromFile` +
+// `LoadEXRImageFromFile` opens the same file three times. This costs a
+// metadata round trip per open on network filesystems.
+// The file is memory mapped(or read into memory when mmap is not available)
+// and the version is parsed here(returns an error when the file is not an
+// EXR file).
+// `EXRFile*` functions can be called from multiple threads at the same time.
+// Application must close the file with `CloseEXRFile`.
+// Returns negative value and may set error string in `err` when there's an
+// error
+extern int OpenEXRFile(EXRFile **file, const char *filename, const char **err);
+
+// Closes the file opened by `OpenEXRFile`. Headers and images loaded from the
+// file are not freed.
+extern void CloseEXRFile(EXRFile *file);
+
+// Returns the version of the file.
+extern const EXRVersion *EXRFileVersion(const EXRFile *file);
+
+// Returns the contents of the file and its size, e.g. for
+// `LoadEXRImageRegionFromMemory` or `CreateEXRTiledReaderFromMemory`.
+// Valid until the file is closed.
+extern const unsigned char *EXRFileData(const EXRFile *file, size_t *size);
+
+// Same as `ParseEXRHeaderFromFile`, but parses the opened file.
+extern int EXRFileParseHeader(const EXRFile *file, EXRHeader *header,
+                              const char **err);
+
+// Same as `ParseEXRMultipartHeaderFromFile`, but parses the opened file.
+extern int EXRFileParseMultipartHeader(const EXRFile *file,
+                                       EXRHeader ***headers, int *num_headers,
+                                       const char **err);
+
+// Same as `LoadEXRImageFromFileWithOptions`, but loads from the opened file.
+// `options` may be NULL.
+extern int EXRFileLoadImage(const EXRFile *file, EXRImage *image,
+                            const EXRHeader *header,
+                            const EXRParallelOptions *options,
+                            const char **err);
+
+// Same as `LoadEXRMultipartImageFromFile`, but loads from the opened file.
+// `options` may be NULL.
+extern int EXRFileLoadMultipartImage(const EXRFile *file, EXRImage *images,
+                                     const EXRHeader **headers,
+                                     unsigned int num_parts,
+                                     const EXRParallelOptions *options,
+                                     const char **err);
+
+// Same as `LoadEXRMultipartImagePartsFromMemory`, but loads from the opened
+// file.
+extern int EXRFileLoadMultipartImageParts(const EXRFile *file,
+                                          EXRImage *images,
+                                          const EXRHeader **headers,
+                                          unsigned int num_parts,
+                                          const int *part_indices,
+                                          unsigned int num_selected,
+                                          const EXRParallelOptions *options,
+                                          const char **err);
+
+// Same as `SaveEXRMultipartImageToMemory`, but with threading options.
+// `options` may be NULL(same as `SaveEXRMultipartImageToMemory`).
+extern size_t SaveEXRMultipartImageToMemoryWithOptions(
+    const EXRImage *images, const EXRHeader **exr_headers,
+    unsigned int num_parts, unsigned char **memory,
+    const EXRParallelOptions *options, const char **err);
+
+// Deflate function for `EXRSetZipCodec`.
+// Compresses `src` into a zlib stream in `dst`. `*dst_size` is the capacity
+// of `dst`(at least zlib's compressBound(src_size)) on input, and the
+// compressed size on output. `level` is
+// TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT or 1 ~ 9.
+// Returns 0 on success.
+typedef int (*EXRDeflateFunc)(unsigned char *dst, size_t *dst_size,
+                              const unsigned char *src, size_t src_size,
+                              int level, void *userdata);
+
+// Inflate function for `EXRSetZipCodec`.
+// Decompresses the zlib stream `src` into `dst`. `*dst_size` is the capacity
+// of `dst`(the uncompressed size known from the chunk) on input, and must be
+// set to the decompressed size on output. Returns 0 on success.
+// A chunk whose stream does not fill `dst` exactly is rejected.
+typedef int (*EXRInflateFunc)(unsigned char *dst, size_t *dst_size,
+                              const unsigned char *src, size_t src_size,
+                              void *userdata);
+
+// Replaces the compiled-in zlib backend used for ZIP/ZIPS(and deep) chunks,
+// e.g. with a whole-buffer deflate library. `deflate_func` or `inflate_func`
+// may be NULL to keep the compiled-in one. Functions are called from
+// multiple threads concurrently with the same `userdata`.
+// Must not be called while load/save functions are running.
+extern void EXRSetZipCodec(EXRDeflateFunc deflate_func,
+                           EXRInflateFunc inflate_func, void *userdata);
+
+// Layout of a chunk(scanline block or tile) passed to a registered codec.
+// Uncompressed pixel data is stored line by line, and each line holds the
+// `width` values of each channel in turn(in the order of `channels`), as in
+// the EXR file. Values are little endian.
+typedef struct TEXRCodecChunk {
+  int width;      // width of the chunk in pixels
+  int num_lines;  // number of lines in the chunk
+  int num_channels;
+  const EXRChannelInfo *channels;  // `pixel_type` is the type in the file
+} EXRCodecChunk;
+
+// Compresses an uncompressed chunk `src` into `dst`, whose capacity is
+// `src_size`. Stores the compressed size to `*dst_size`, or 0 when the
+// compressed data would not be smaller than `src_size`(the chunk is then
+// stored uncompressed). Returns 0 on success.
+typedef int (*EXRCodecCompressFunc)(unsigned char *dst, size_t *dst_size,
+                                    const unsigned char *src, size_t src_size,
+                                    const EXRCodecChunk *chunk,
+                                    void *userdata);
+
+// Decompresses `src` into `dst`, which must be filled exactly(`dst_size` is
+// the uncompressed size of the chunk). Not called for chunks stored
+// uncompressed. Returns 0 on success.
+typedef int (*EXRCodecDecompressFunc)(unsigned char *dst, size_t dst_size,
+                                      const unsigned char *src,
+                                      size_t src_size,
+                                      const EXRCodecChunk *chunk,
+                                      void *userdata);
+
+typedef struct TEXRCodec {
+  int lines_per_block;  // number of scanlines in a scanline block(e.g. 16 for
+                        // ZIP). Must match other readers/writers of the id.
+  EXRCodecCompressFunc compress_func;      // NULL: decode only
+  EXRCodecDecompressFunc decompress_func;  // NULL: encode only
+  void *userdata;
+} EXRCodec;
+
+// Registers `codec` for `compression_type`(1 ~ 255) of scanline and tiled
+// images(deep images are not supported). The codec is copied. A registered
+// codec takes precedence over the built-in one with the same id, so it can
+// also replace a built-in codec(e.g. with a faster implementation).
+// `codec` = NULL unregisters it. Functions are called from multiple threads
+// concurrently. Must not be called while load/save functions are running.
+// Returns TINYEXR_SUCCESS or TINYEXR_ERROR_INVALID_ARGUMENT.
+extern int EXRRegisterCodec(int compression_type, const EXRCodec *codec);
+
 #ifdef __cplusplus
 }
 #endif
@@ -624,9 +1156,24 @@ extern int LoadEXRFromMemory(float **out_rgba, int *width, int *height,
 #include <sys/stat.h>  // for stat
 #include <unistd.h>    // for close()
 #define TINYEXR_USE_POSIX_MMAP (1)
+#elif defined(__APPLE__)
+#include <fcntl.h>     // for open()
+#include <sys/stat.h>  // for fstat()
+#include <unistd.h>    // for pread()
+#endif
+
+// Read files with pread()(POSIX.1-2001) in `CreateEXRStreamReaderFromFile`,
+// so chunks can be read concurrently. Otherwise fread() is used.
+#ifndef TINYEXR_USE_PREAD
+#if !defined(_WIN32) && defined(_POSIX_VERSION) && (_POSIX_VERSION >= 200112L)
+#define TINYEXR_USE_PREAD (1)
+#else
+#define TINYEXR_USE_PREAD (0)
+#endif
 #endif
 
 #include <algorithm>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -644,9 +1191,12 @@ extern int LoadEXRFromMemory(float **out_rgba, int *width, int *height,
 #define TINYEXR_HAS_CXX11 (1)
 // C++11
 #include <cstdint>
+#include <atomic>
+#include <mutex>
 
 #if TINYEXR_USE_THREAD
-#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <thread>
 #endif
 
@@ -658,6 +1208,42 @@ extern int LoadEXRFromMemory(float **out_rgba, int *width, int *height,
 #include <omp.h>
 #endif
 
+#if TINYEXR_USE_SIMD && TINYEXR_LITTLE_ENDIAN
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define TINYEXR_SIMD_SSE2 (1)
+#include <emmintrin.h>
+// F16C and AVX2 are detected at runtime.
+#if defined(_MSC_VER) && !defined(__clang__)
+#define TINYEXR_SIMD_F16C (1)
+#define TINYEXR_SIMD_AVX2 (1)
+#include <immintrin.h>
+#include <intrin.h>
+#elif (defined(__GNUC__) && (__GNUC__ >= 5)) || defined(__clang__)
+#define TINYEXR_SIMD_F16C (1)
+#define TINYEXR_SIMD_AVX2 (1)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#elif defined(__aarch64__) || defined(_M_ARM64)
+#define TINYEXR_SIMD_NEON (1)
+#include <arm_neon.h>
+#endif
+#endif
+
+#ifndef TINYEXR_SIMD_SSE2
+#define TINYEXR_SIMD_SSE2 (0)
+#endif
+#ifndef TINYEXR_SIMD_F16C
+#define TINYEXR_SIMD_F16C (0)
+#endif
+#ifndef TINYEXR_SIMD_AVX2
+#define TINYEXR_SIMD_AVX2 (0)
+#endif
+#ifndef TINYEXR_SIMD_NEON
+#define TINYEXR_SIMD_NEON (0)
+#endif
+
 #if defined(TINYEXR_USE_MINIZ) && (TINYEXR_USE_MINIZ==1)
 #include <miniz.h>
 #else
@@ -671,6 +1257,10 @@ extern int LoadEXRFromMemory(float **out_rgba, int *width, int *height,
 #include "nanozlib.h"
 #endif
 
+#if TINYEXR_USE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
 #if TINYEXR_USE_STB_ZLIB
 // Since we don't know where a project has stb_image.h and stb_image_write.h
 // and whether they are in the include path, we don't include them here, and
@@ -771,6 +1361,193 @@ static void SetWarningMessage(const std::string &msg, const char **warn) {
 
 static const int kEXRVersionSize = 8;
 
+#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
+// Persistent thread pool.
+//
+// `Run(max_threads, func)` invokes `func` on the calling thread and on up to
+// `max_threads - 1` pool threads concurrently, and returns when all
+// invocations have finished. `func` pulls work items(blocks, tiles) from a
+// shared atomic counter, so threads which become idle keep taking the
+// remaining items. Since the calling thread always participates, `Run` can be
+// called concurrently(or recursively) from any thread without deadlock.
+class ThreadPool {
+ public:
+  explicit ThreadPool(int n) : num_threads_(n), stop_(false) {
+    if (num_threads_ < 1) {
+      num_threads_ = std::max(1, int(std::thread::hardware_concurrency()));
+    }
+    for (int t = 1; t < num_threads_; t++) {
+      workers_.emplace_back(std::thread([this]() { WorkerLoop(); }));
+    }
+  }
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    job_cv_.notify_all();
+    for (auto &t : workers_) {
+      t.join();
+    }
+  }
+
+  int num_threads() const { return num_threads_; }
+
+  template <typename Func>
+  void Run(int max_threads, const Func &func) {
+    Job job;
+    job.fn = &Invoke<Func>;
+    job.ctx = &func;
+    job.max_helpers = std::min(max_threads, num_threads_) - 1;
+    job.num_helpers = 0;
+    job.num_running = 0;
+
+    if (job.max_helpers > 0) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs_.push_back(&job);
+      }
+      job_cv_.notify_all();
+    }
+
+    func();
+
+    if (job.max_helpers > 0) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      // No more threads can join the job after it is removed from the queue.
+      std::deque<Job *>::iterator it =
+          std::find(jobs_.begin(), jobs_.end(), &job);
+      if (it != jobs_.end()) {
+        jobs_.erase(it);
+      }
+      done_cv_.wait(lock, [&job]() { return job.num_running == 0; });
+    }
+  }
+
+ private:
+  struct Job {
+    void (*fn)(const void *ctx);
+    const void *ctx;
+    int max_helpers;
+    int num_helpers;  // guarded by `mutex_`
+    int num_running;  // guarded by `mutex_`
+  };
+
+  template <typename Func>
+  static void Invoke(const void *ctx) {
+    (*static_cast<const Func *>(ctx))();
+  }
+
+  void WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    for (;;) {
+      job_cv_.wait(lock, [this]() { return stop_ || !jobs_.empty(); });
+      if (stop_) {
+        return;
+      }
+
+      Job *job = jobs_.front();
+      job->num_helpers++;
+      job->num_running++;
+      if (job->num_helpers >= job->max_helpers) {
+        jobs_.pop_front();
+      }
+
+      lock.unlock();
+      job->fn(job->ctx);
+      lock.lock();
+
+      job->num_running--;
+      if (job->num_running == 0) {
+        done_cv_.notify_all();
+      }
+    }
+  }
+
+  ThreadPool(const ThreadPool &);
+  ThreadPool &operator=(const ThreadPool &);
+
+  int num_threads_;
+  bool stop_;  // guarded by `mutex_`
+  std::vector<std::thread> workers_;
+  std::deque<Job *> jobs_;
+  std::mutex mutex_;
+  std::condition_variable job_cv_;
+  std::condition_variable done_cv_;
+};
+
+static std::atomic<ThreadPool *> g_thread_pool(NULL);
+
+// Returns the thread pool set by `EXRSetGlobalThreadPool`, or the default
+// pool.
+static ThreadPool *GetThreadPool() {
+  ThreadPool *pool = g_thread_pool.load();
+  if (pool) {
+    return pool;
+  }
+
+  // Intentionally leaked so that worker threads are not joined at exit.
+  static ThreadPool *default_pool = new ThreadPool(0);
+  return default_pool;
+}
+#endif
+
+template <typename Func>
+static void ParallelForInvoke(void *ctx, int i) {
+  (*static_cast<const Func *>(ctx))(i);
+}
+
+// Calls `func(i)` for each i in [0, n) in parallel, using the user executor
+// in `options`(if any), the thread pool or OpenMP.
+// `options` may be NULL.
+template <typename Func>
+static void ParallelFor(int n, const EXRParallelOptions *options,
+                        const Func &func) {
+  if (n <= 0) {
+    return;
+  }
+
+  if (options && options->parallel_for) {
+    options->parallel_for(const_cast<void *>(static_cast<const void *>(&func)),
+                          0, n, &ParallelForInvoke<Func>);
+    return;
+  }
+
+  int max_threads = options ? options->max_threads : 0;
+
+#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
+  ThreadPool *pool = GetThreadPool();
+  int num_threads = pool->num_threads();
+  if (max_threads > 0) {
+    num_threads = std::min(num_threads, max_threads);
+  }
+  num_threads = std::min(num_threads, n);
+
+  std::atomic<int> count(0);
+  auto worker = [&]() {
+    int i = 0;
+    while ((i = count++) < n) {
+      func(i);
+    }
+  };
+
+  pool->Run(num_threads, worker);
+#else
+#if TINYEXR_USE_OPENMP
+  int num_threads = (max_threads > 0) ? max_threads : omp_get_max_threads();
+  // Use signed int since some OpenMP compiler doesn't allow unsigned type for
+  // `parallel for`
+#pragma omp parallel for num_threads(num_threads)
+#else
+  (void)max_threads;
+#endif
+  for (int i = 0; i < n; i++) {
+    func(i);
+  }
+#endif
+}
+
 static void cpy2(unsigned short *dst_val, const unsigned short *src_val) {
   unsigned char *dst = reinterpret_cast<unsigned char *>(dst_val);
   const unsigned char *src = reinterpret_cast<const unsigned char *>(src_val);
@@ -1019,6 +1796,312 @@ static FP16 float_to_half_full(FP32 f) {
   return o;
 }
 
+// Batch half <-> float conversion for whole scanline spans.
+// SIMD versions produce exactly the same bits as `half_to_float` and
+// `float_to_half_full`(including their rounding and NaN handling), so the
+// result does not depend on the CPU.
+
+static void HalfToFloatLineScalar(float *dst, const unsigned char *src,
+                                  size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    tinyexr::FP16 h;
+    // address may not be aligned. use byte-wise copy for safety.#76
+    tinyexr::cpy2(&(h.u), reinterpret_cast<const unsigned short *>(src) + i);
+    tinyexr::swap2(&(h.u));
+    dst[i] = half_to_float(h).f;
+  }
+}
+
+static void FloatToHalfLineScalar(unsigned char *dst, const float *src,
+                                  size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    tinyexr::FP32 f;
+    f.f = src[i];
+    tinyexr::FP16 h = float_to_half_full(f);
+    tinyexr::swap2(&(h.u));
+    tinyexr::cpy2(reinterpret_cast<unsigned short *>(dst) + i, &(h.u));
+  }
+}
+
+#if TINYEXR_SIMD_SSE2
+// 4 halves(in the lower 16 bits of each lane) -> 4 floats.
+static __m128 HalfToFloat4SSE2(__m128i h) {
+  const __m128i shifted_exp = _mm_set1_epi32(0x7c00 << 13);
+  __m128i o = _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x7fff)), 13);
+  __m128i exp_ = _mm_and_si128(shifted_exp, o);
+  o = _mm_add_epi32(o, _mm_set1_epi32((127 - 15) << 23));
+
+  // Inf/NaN
+  __m128i infnan = _mm_cmpeq_epi32(exp_, shifted_exp);
+  o = _mm_add_epi32(
+      o, _mm_and_si128(infnan, _mm_set1_epi32((128 - 16) << 23)));
+
+  // Zero/Denormal
+  __m128i zero = _mm_cmpeq_epi32(exp_, _mm_setzero_si128());
+  __m128 renorm =
+      _mm_sub_ps(_mm_castsi128_ps(_mm_add_epi32(o, _mm_set1_epi32(1 << 23))),
+                 _mm_castsi128_ps(_mm_set1_epi32(113 << 23)));
+  o = _mm_or_si128(_mm_andnot_si128(zero, o),
+                   _mm_and_si128(zero, _mm_castps_si128(renorm)));
+
+  o = _mm_or_si128(
+      o, _mm_slli_epi32(_mm_and_si128(h, _mm_set1_epi32(0x8000)), 16));
+  return _mm_castsi128_ps(o);
+}
+
+// 4 floats -> 4 halves(in the lower 16 bits of each lane).
+static __m128i FloatToHalf4SSE2(__m128 f) {
+  __m128i bits = _mm_castps_si128(f);
+  __m128i sign =
+      _mm_and_si128(_mm_srli_epi32(bits, 16), _mm_set1_epi32(0x8000));
+  __m128i a = _mm_and_si128(bits, _mm_set1_epi32(0x7fffffff));
+
+  // Normalized half: rebias exponent, truncate mantissa and round.
+  __m128i hn = _mm_add_epi32(
+      _mm_sub_epi32(_mm_srli_epi32(a, 13), _mm_set1_epi32(112 << 10)),
+      _mm_and_si128(_mm_srli_epi32(a, 12), _mm_set1_epi32(1)));
+  // Overflow -> Inf
+  __m128i overflow = _mm_cmpgt_epi32(hn, _mm_set1_epi32(0x7c00));
+  hn = _mm_or_si128(_mm_andnot_si128(overflow, hn),
+                    _mm_and_si128(overflow, _mm_set1_epi32(0x7c00)));
+
+  // Denormalized half: round(|f| * 2^24). |f| < 2^-25 underflows to zero
+  // (`+ 0.5` may round up to 1.0 for such a value).
+  __m128i hd = _mm_cvttps_epi32(
+      _mm_add_ps(_mm_mul_ps(_mm_castsi128_ps(a), _mm_set1_ps(16777216.0f)),
+                 _mm_set1_ps(0.5f)));
+  hd = _mm_and_si128(hd, _mm_cmpgt_epi32(a, _mm_set1_epi32(0x32ffffff)));
+
+  __m128i normal = _mm_cmpgt_epi32(a, _mm_set1_epi32(0x387fffff));
+  __m128i h = _mm_or_si128(_mm_andnot_si128(normal, hd),
+                           _mm_and_si128(normal, hn));
+
+  // Inf/NaN(NaN -> qNaN)
+  __m128i infnan = _mm_cmpgt_epi32(a, _mm_set1_epi32(0x7f7fffff));
+  __m128i nan = _mm_cmpgt_epi32(a, _mm_set1_epi32(0x7f800000));
+  __m128i special = _mm_or_si128(_mm_set1_epi32(0x7c00),
+                                 _mm_and_si128(nan, _mm_set1_epi32(0x200)));
+  h = _mm_or_si128(_mm_andnot_si128(infnan, h),
+                   _mm_and_si128(infnan, special));
+
+  return _mm_or_si128(h, sign);
+}
+
+static void HalfToFloatLineSSE2(float *dst, const unsigned char *src,
+                                size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i));
+    _mm_storeu_ps(dst + i, HalfToFloat4SSE2(_mm_unpacklo_epi16(
+                               h, _mm_setzero_si128())));
+    _mm_storeu_ps(dst + i + 4, HalfToFloat4SSE2(_mm_unpackhi_epi16(
+                                   h, _mm_setzero_si128())));
+  }
+  HalfToFloatLineScalar(dst + i, src + 2 * i, n - i);
+}
+
+static void FloatToHalfLineSSE2(unsigned char *dst, const float *src,
+                                size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i lo = FloatToHalf4SSE2(_mm_loadu_ps(src + i));
+    __m128i hi = FloatToHalf4SSE2(_mm_loadu_ps(src + i + 4));
+    // Sign extend 16bit values so that `packs` does not saturate.
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 2 * i),
+                     _mm_packs_epi32(lo, hi));
+  }
+  FloatToHalfLineScalar(dst + 2 * i, src + i, n - i);
+}
+#endif  // TINYEXR_SIMD_SSE2
+
+#if TINYEXR_SIMD_F16C
+// vcvtph2ps is exact except that it quiets signaling NaN, so blocks
+// containing signaling NaN are converted with the scalar code.
+// vcvtps2ph is not used since it rounds to nearest even, whereas
+// `float_to_half_full` rounds half away from zero.
+#if defined(__GNUC__) || defined(__clang__)
+__attribute__((target("avx,f16c")))
+#endif
+static void HalfToFloatLineF16C(float *dst, const unsigned char *src,
+                                size_t n) {
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m128i h = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + 2 * i));
+    __m128i a = _mm_and_si128(h, _mm_set1_epi16(0x7fff));
+    __m128i snan = _mm_andnot_si128(
+        _mm_cmpeq_epi16(_mm_and_si128(a, _mm_set1_epi16(0x200)),
+                        _mm_set1_epi16(0x200)),
+        _mm_cmpgt_epi16(a, _mm_set1_epi16(0x7c00)));
+    if (_mm_movemask_epi8(snan)) {
+      HalfToFloatLineScalar(dst + i, src + 2 * i, 8);
+    } else {
+      _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(h));
+    }
+  }
+  HalfToFloatLineScalar(dst + i, src + 2 * i, n - i);
+}
+
+// `ecx_mask` bits of CPUID leaf 1 ECX must be set in addition to OSXSAVE and
+// AVX, and the OS must save XMM and YMM state.
+static bool CPUSupportsAVXWith(unsigned int ecx_mask) {
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 1);
+  unsigned int ecx = static_cast<unsigned int>(info[2]);
+#else
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+    return false;
+  }
+#endif
+  // OSXSAVE and AVX
+  const unsigned int mask = (1u << 27) | (1u << 28) | ecx_mask;
+  if ((ecx & mask) != mask) {
+    return false;
+  }
+
+#if defined(_MSC_VER) && !defined(__clang__)
+  unsigned long long xcr0 = _xgetbv(0);
+#else
+  unsigned int xcr0_lo, xcr0_hi;
+  __asm__ __volatile__("xgetbv" : "=a"(xcr0_lo), "=d"(xcr0_hi) : "c"(0));
+  unsigned long long xcr0 = xcr0_lo;
+#endif
+  return (xcr0 & 6) == 6;
+}
+
+static bool CPUSupportsF16C() {
+  return CPUSupportsAVXWith(1u << 29);
+}
+#endif  // TINYEXR_SIMD_F16C
+
+#if TINYEXR_SIMD_AVX2
+static bool CPUSupportsAVX2() {
+  if (!CPUSupportsAVXWith(0)) {
+    return false;
+  }
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7) {
+    return false;
+  }
+  __cpuidex(info, 7, 0);
+  unsigned int ebx = static_cast<unsigned int>(info[1]);
+#else
+  if (__get_cpuid_max(0, NULL) < 7) {
+    return false;
+  }
+  unsigned int eax, ebx, ecx, edx;
+  __cpuid_count(7, 0, eax, ebx, ecx, edx);
+  (void)eax;
+  (void)ecx;
+  (void)edx;
+#endif
+  return (ebx & (1u << 5)) != 0;
+}
+
+// CPU feature is detected once.
+static bool UseAVX2() {
+  static const bool avx2 = CPUSupportsAVX2();
+  return avx2;
+}
+#endif  // TINYEXR_SIMD_AVX2
+
+#if TINYEXR_SIMD_NEON
+static void HalfToFloatLineNEON(float *dst, const unsigned char *src,
+                                size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint16x4_t h = vreinterpret_u16_u8(vld1_u8(src + 2 * i));
+    uint16x4_t a = vand_u16(h, vdup_n_u16(0x7fff));
+    // fcvt quiets signaling NaN. Use the scalar code for such a block.
+    uint16x4_t snan =
+        vand_u16(vcgt_u16(a, vdup_n_u16(0x7c00)),
+                 vceq_u16(vand_u16(a, vdup_n_u16(0x200)), vdup_n_u16(0)));
+    if (vget_lane_u64(vreinterpret_u64_u16(snan), 0)) {
+      HalfToFloatLineScalar(dst + i, src + 2 * i, 4);
+    } else {
+      vst1q_f32(dst + i, vcvt_f32_f16(vreinterpret_f16_u16(h)));
+    }
+  }
+  HalfToFloatLineScalar(dst + i, src + 2 * i, n - i);
+}
+
+// Same algorithm as `FloatToHalf4SSE2`(fcvt rounds to nearest even).
+static void FloatToHalfLineNEON(unsigned char *dst, const float *src,
+                                size_t n) {
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint32x4_t bits = vreinterpretq_u32_f32(vld1q_f32(src + i));
+    uint32x4_t sign = vandq_u32(vshrq_n_u32(bits, 16), vdupq_n_u32(0x8000));
+    uint32x4_t a = vandq_u32(bits, vdupq_n_u32(0x7fffffff));
+
+    uint32x4_t hn = vaddq_u32(
+        vsubq_u32(vshrq_n_u32(a, 13), vdupq_n_u32(112 << 10)),
+        vandq_u32(vshrq_n_u32(a, 12), vdupq_n_u32(1)));
+    hn = vminq_u32(hn, vdupq_n_u32(0x7c00));
+
+    uint32x4_t hd = vcvtq_u32_f32(vaddq_f32(
+        vmulq_f32(vreinterpretq_f32_u32(a), vdupq_n_f32(16777216.0f)),
+        vdupq_n_f32(0.5f)));
+    hd = vandq_u32(hd, vcgtq_u32(a, vdupq_n_u32(0x32ffffff)));
+
+    uint32x4_t h = vbslq_u32(vcgtq_u32(a, vdupq_n_u32(0x387fffff)), hn, hd);
+
+    uint32x4_t special =
+        vorrq_u32(vdupq_n_u32(0x7c00),
+                  vandq_u32(vcgtq_u32(a, vdupq_n_u32(0x7f800000)),
+                            vdupq_n_u32(0x200)));
+    h = vbslq_u32(vcgtq_u32(a, vdupq_n_u32(0x7f7fffff)), special, h);
+    h = vorrq_u32(h, sign);
+
+    vst1_u8(dst + 2 * i, vreinterpret_u8_u16(vmovn_u32(h)));
+  }
+  FloatToHalfLineScalar(dst + 2 * i, src + i, n - i);
+}
+#endif  // TINYEXR_SIMD_NEON
+
+typedef void (*HalfToFloatLineFunc)(float *dst, const unsigned char *src,
+                                    size_t n);
+
+static HalfToFloatLineFunc SelectHalfToFloatLine() {
+#if TINYEXR_SIMD_F16C
+  if (CPUSupportsF16C()) {
+    return HalfToFloatLineF16C;
+  }
+#endif
+#if TINYEXR_SIMD_SSE2
+  return HalfToFloatLineSSE2;
+#elif TINYEXR_SIMD_NEON
+  return HalfToFloatLineNEON;
+#else
+  return HalfToFloatLineScalar;
+#endif
+}
+
+// Converts `n` little-endian half values at `src`(no alignment requirement)
+// to float.
+static void HalfToFloatLine(float *dst, const unsigned char *src, size_t n) {
+  // CPU feature is detected once.
+  static const HalfToFloatLineFunc func = SelectHalfToFloatLine();
+  func(dst, src, n);
+}
+
+// Converts `n` float values to little-endian half values at `dst`(no
+// alignment requirement).
+static void FloatToHalfLine(unsigned char *dst, const float *src, size_t n) {
+#if TINYEXR_SIMD_SSE2
+  FloatToHalfLineSSE2(dst, src, n);
+#elif TINYEXR_SIMD_NEON
+  FloatToHalfLineNEON(dst, src, n);
+#else
+  FloatToHalfLineScalar(dst, src, n);
+#endif
+}
+
 // NOTE: From OpenEXR code
 // #define IMF_INCREASING_Y  0
 // #define IMF_DECREASING_Y  1
@@ -1032,6 +2115,8 @@ static FP16 float_to_half_full(FP32 f) {
 // #define IMF_PXR24_COMPRESSION 5
 // #define IMF_B44_COMPRESSION 6
 // #define IMF_B44A_COMPRESSION  7
+// #define IMF_DWAA_COMPRESSION  8
+// #define IMF_DWAB_COMPRESSION  9
 
 #ifdef __clang__
 #pragma clang diagnostic push
@@ -1306,85 +2391,323 @@ static void WriteChannelInfo(std::vector<unsigned char> &data,
   (*p) = '\0';
 }
 
-static bool CompressZip(unsigned char *dst,
-                        tinyexr::tinyexr_uint64 &compressedSize,
-                        const unsigned char *src, unsigned long src_size) {
-  std::vector<unsigned char> tmpBuf(src_size);
+//
+// Byte reordering and delta predictor used by ZIP and RLE compression.
+// Grabbed from OpenEXR's ImfZipCompressor.cpp/ImfRleCompressor.cpp, with
+// SIMD(SSE2/NEON) versions. All versions produce the same result.
+//
 
-  //
-  // Apply EXR-specific? postprocess. Grabbed from OpenEXR's
-  // ImfZipCompressor.cpp
-  //
+// Moves even bytes of `src` to the first half of `dst` and odd bytes to the
+// second half of `dst`.
+static void SplitEvenOddBytes(unsigned char *dst, const unsigned char *src,
+                              size_t n) {
+  unsigned char *t1 = dst;
+  unsigned char *t2 = dst + (n + 1) / 2;
+  size_t i = 0;
+
+#if TINYEXR_SIMD_SSE2
+  const __m128i mask = _mm_set1_epi16(0x00ff);
+  for (; i + 32 <= n; i += 32) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    __m128i b =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i + 16));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(t1),
+                     _mm_packus_epi16(_mm_and_si128(a, mask),
+                                      _mm_and_si128(b, mask)));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(t2),
+                     _mm_packus_epi16(_mm_srli_epi16(a, 8),
+                                      _mm_srli_epi16(b, 8)));
+    t1 += 16;
+    t2 += 16;
+  }
+#elif TINYEXR_SIMD_NEON
+  for (; i + 32 <= n; i += 32) {
+    uint8x16x2_t v = vld2q_u8(src + i);
+    vst1q_u8(t1, v.val[0]);
+    vst1q_u8(t2, v.val[1]);
+    t1 += 16;
+    t2 += 16;
+  }
+#endif
 
-  //
-  // Reorder the pixel data.
-  //
+  for (; i + 1 < n; i += 2) {
+    *(t1++) = src[i];
+    *(t2++) = src[i + 1];
+  }
+  if (i < n) {
+    *t1 = src[i];
+  }
+}
 
-  const char *srcPtr = reinterpret_cast<const char *>(src);
+// Inverse of `SplitEvenOddBytes`.
+static void InterleaveBytes(unsigned char *dst, const unsigned char *src,
+                            size_t n) {
+  const unsigned char *t1 = src;
+  const unsigned char *t2 = src + (n + 1) / 2;
+  size_t i = 0;
+
+#if TINYEXR_SIMD_SSE2
+  for (; i + 32 <= n; i += 32) {
+    __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(t1));
+    __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i *>(t2));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     _mm_unpacklo_epi8(a, b));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i + 16),
+                     _mm_unpackhi_epi8(a, b));
+    t1 += 16;
+    t2 += 16;
+  }
+#elif TINYEXR_SIMD_NEON
+  for (; i + 32 <= n; i += 32) {
+    uint8x16x2_t v;
+    v.val[0] = vld1q_u8(t1);
+    v.val[1] = vld1q_u8(t2);
+    vst2q_u8(dst + i, v);
+    t1 += 16;
+    t2 += 16;
+  }
+#endif
 
-  {
-    char *t1 = reinterpret_cast<char *>(&tmpBuf.at(0));
-    char *t2 = reinterpret_cast<char *>(&tmpBuf.at(0)) + (src_size + 1) / 2;
-    const char *stop = srcPtr + src_size;
+  for (; i + 1 < n; i += 2) {
+    dst[i] = *(t1++);
+    dst[i + 1] = *(t2++);
+  }
+  if (i < n) {
+    dst[i] = *t1;
+  }
+}
 
-    for (;;) {
-      if (srcPtr < stop)
-        *(t1++) = *(srcPtr++);
-      else
-        break;
+// p[i] = p[i] - p[i - 1] + 128 (in place).
+static void EncodeDeltaPredictor(unsigned char *p, size_t n) {
+  if (n < 2) {
+    return;
+  }
 
-      if (srcPtr < stop)
-        *(t2++) = *(srcPtr++);
-      else
-        break;
-    }
+  size_t i = 1;
+  unsigned char prev = p[0];
+
+#if TINYEXR_SIMD_SSE2
+  const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80));
+  for (; i + 16 <= n; i += 16) {
+    __m128i cur = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+    // p[i - 1 .. i + 14] before being overwritten.
+    __m128i shifted = _mm_or_si128(_mm_slli_si128(cur, 1),
+                                   _mm_cvtsi32_si128(int(prev)));
+    prev = p[i + 15];
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p + i),
+                     _mm_add_epi8(_mm_sub_epi8(cur, shifted), bias));
   }
+#elif TINYEXR_SIMD_NEON
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t cur = vld1q_u8(p + i);
+    uint8x16_t shifted = vextq_u8(vdupq_n_u8(prev), cur, 15);
+    prev = p[i + 15];
+    vst1q_u8(p + i, vaddq_u8(vsubq_u8(cur, shifted), vdupq_n_u8(0x80)));
+  }
+#endif
 
-  //
-  // Predictor.
-  //
+  for (; i < n; i++) {
+    unsigned char cur = p[i];
+    p[i] = static_cast<unsigned char>(int(cur) - int(prev) + (128 + 256));
+    prev = cur;
+  }
+}
 
-  {
-    unsigned char *t = &tmpBuf.at(0) + 1;
-    unsigned char *stop = &tmpBuf.at(0) + src_size;
-    int p = t[-1];
+// p[i] = p[i - 1] + p[i] - 128 (in place). Inverse of
+// `EncodeDeltaPredictor`. SIMD versions compute prefix sums of 16 bytes with
+// log2(16) shift-and-add steps.
+static void DecodeDeltaPredictor(unsigned char *p, size_t n) {
+  if (n < 2) {
+    return;
+  }
 
-    while (t < stop) {
-      int d = int(t[0]) - p + (128 + 256);
-      p = t[0];
-      t[0] = static_cast<unsigned char>(d);
-      ++t;
-    }
+  size_t i = 1;
+
+#if TINYEXR_SIMD_SSE2
+  const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80));
+  for (; i + 16 <= n; i += 16) {
+    __m128i x = _mm_sub_epi8(
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i)), bias);
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 1));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 2));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi8(x, _mm_set1_epi8(static_cast<char>(p[i - 1])));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(p + i), x);
+  }
+#elif TINYEXR_SIMD_NEON
+  const uint8x16_t zero = vdupq_n_u8(0);
+  for (; i + 16 <= n; i += 16) {
+    uint8x16_t x = vsubq_u8(vld1q_u8(p + i), vdupq_n_u8(0x80));
+    x = vaddq_u8(x, vextq_u8(zero, x, 15));
+    x = vaddq_u8(x, vextq_u8(zero, x, 14));
+    x = vaddq_u8(x, vextq_u8(zero, x, 12));
+    x = vaddq_u8(x, vextq_u8(zero, x, 8));
+    x = vaddq_u8(x, vdupq_n_u8(p[i - 1]));
+    vst1q_u8(p + i, x);
   }
+#endif
 
-#if defined(TINYEXR_USE_MINIZ) && (TINYEXR_USE_MINIZ==1)
-  //
-  // Compress the data using miniz
-  //
+  for (; i < n; i++) {
+    p[i] = static_cast<unsigned char>(int(p[i - 1]) + int(p[i]) - 128);
+  }
+}
+
+// User deflate/inflate functions set by `EXRSetZipCodec`.
+struct ZipCodec {
+  EXRDeflateFunc deflate_func;
+  EXRInflateFunc inflate_func;
+  void *userdata;
+};
+
+static ZipCodec g_zip_codec = {NULL, NULL, NULL};
+
+#if TINYEXR_USE_LIBDEFLATE
+// libdeflate compressor/decompressor, created on first use and reused across
+// chunks. A compressor is created for each compression level.
+struct LibdeflateContext {
+  libdeflate_compressor *compressor;
+  int compressor_level;
+  libdeflate_decompressor *decompressor;
+
+  LibdeflateContext()
+      : compressor(NULL), compressor_level(-1), decompressor(NULL) {}
+  ~LibdeflateContext() {
+    if (compressor) {
+      libdeflate_free_compressor(compressor);
+    }
+    if (decompressor) {
+      libdeflate_free_decompressor(decompressor);
+    }
+  }
+
+  libdeflate_compressor *GetCompressor(int level) {
+    if (compressor && (compressor_level != level)) {
+      libdeflate_free_compressor(compressor);
+      compressor = NULL;
+    }
+    if (!compressor) {
+      compressor = libdeflate_alloc_compressor(level);
+      compressor_level = level;
+    }
+    return compressor;
+  }
+
+  libdeflate_decompressor *GetDecompressor() {
+    if (!decompressor) {
+      decompressor = libdeflate_alloc_decompressor();
+    }
+    return decompressor;
+  }
+
+ private:
+  LibdeflateContext(const LibdeflateContext &);
+  LibdeflateContext &operator=(const LibdeflateContext &);
+};
+
+// Returns the context of the calling thread.
+// Without C++11(thread_local), a single context is shared and guarded by
+// nothing, so the libdeflate backend requires C++11 for multithreading.
+static LibdeflateContext &GetLibdeflateContext() {
+#if TINYEXR_HAS_CXX11
+  static thread_local LibdeflateContext ctx;
+#else
+  static LibdeflateContext ctx;
+#endif
+  return ctx;
+}
+#endif
+
+// Upper bound of the size of a compressed ZIP/ZIPS chunk of `src_size` bytes.
+static size_t ZipCompressBound(size_t src_size) {
+  if (g_zip_codec.deflate_func) {
+    // Same bound as zlib's compressBound(), plus some headroom.
+    return src_size + (src_size >> 12) + (src_size >> 14) + (src_size >> 25) +
+           64;
+  }
+#if TINYEXR_USE_LIBDEFLATE
+  return libdeflate_zlib_compress_bound(NULL, src_size);
+#elif defined(TINYEXR_USE_MINIZ) && (TINYEXR_USE_MINIZ==1)
+  return mz_compressBound(static_cast<unsigned long>(src_size));
+#elif TINYEXR_USE_STB_ZLIB
+  // there is no compressBound() function, so we use a value that
+  // is grossly overestimated, but should always work
+  return 256 + 2 * src_size;
+#elif defined(TINYEXR_USE_NANOZLIB) && (TINYEXR_USE_NANOZLIB == 1)
+  return nanoz_compressBound(static_cast<unsigned long>(src_size));
+#else
+  return compressBound(static_cast<uLong>(src_size));
+#endif
+}
+
+// Compresses `src` into a zlib stream with the user deflate function or the
+// compiled-in zlib backend.
+// `compressed_size` is the capacity of `dst`(at least
+// `ZipCompressBound(src_size)`) on input.
+static bool DeflateZlib(unsigned char *dst,
+                        tinyexr::tinyexr_uint64 *compressed_size,
+                        const unsigned char *src, unsigned long src_size,
+                        int level) {
+  if (g_zip_codec.deflate_func) {
+    size_t outSize = static_cast<size_t>(*compressed_size);
+    if (g_zip_codec.deflate_func(dst, &outSize, src, src_size, level,
+                                 g_zip_codec.userdata) != 0) {
+      return false;
+    }
+    if (outSize > static_cast<size_t>(*compressed_size)) {
+      return false;
+    }
+    (*compressed_size) = outSize;
+    return true;
+  }
+
+#if TINYEXR_USE_LIBDEFLATE
+  LibdeflateContext &ctx = GetLibdeflateContext();
+  libdeflate_compressor *compressor = ctx.GetCompressor(
+      (level == TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT) ? 6 : level);
+  if (!compressor) {
+    return false;
+  }
+  size_t outSize = libdeflate_zlib_compress(
+      compressor, src, src_size, dst, static_cast<size_t>(*compressed_size));
+  if (outSize == 0) {
+    return false;
+  }
 
+  (*compressed_size) = outSize;
+#elif defined(TINYEXR_USE_MINIZ) && (TINYEXR_USE_MINIZ==1)
   mz_ulong outSize = mz_compressBound(src_size);
-  int ret = mz_compress(
-      dst, &outSize, static_cast<const unsigned char *>(&tmpBuf.at(0)),
-      src_size);
+  int ret = mz_compress2(
+      dst, &outSize, src, src_size,
+      (level == TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT) ? MZ_DEFAULT_COMPRESSION
+                                                       : level);
   if (ret != MZ_OK) {
     return false;
   }
 
-  compressedSize = outSize;
+  (*compressed_size) = outSize;
 #elif defined(TINYEXR_USE_STB_ZLIB) && (TINYEXR_USE_STB_ZLIB==1)
+  // `quality`(>= 5) is the length of hash chains.
+  int quality = (level == TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT)
+                    ? 8
+                    : (std::max)(5, 2 * level);
   int outSize;
-  unsigned char* ret = stbi_zlib_compress(const_cast<unsigned char*>(&tmpBuf.at(0)), src_size, &outSize, 8);
+  unsigned char* ret = stbi_zlib_compress(const_cast<unsigned char*>(src), src_size, &outSize, quality);
   if (!ret) {
     return false;
   }
   memcpy(dst, ret, outSize);
   free(ret);
 
-  compressedSize = outSize;
+  (*compressed_size) = outSize;
 #elif defined(TINYEXR_USE_NANOZLIB) && (TINYEXR_USE_NANOZLIB==1)
   uint64_t dstSize = nanoz_compressBound(static_cast<uint64_t>(src_size));
+  // `quality`(>= 5) is the length of hash chains.
+  int quality = (level == TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT)
+                    ? 8
+                    : (std::max)(5, 2 * level);
   int outSize{0};
-  unsigned char *ret = nanoz_compress(&tmpBuf.at(0), src_size, &outSize, /* quality */8);
+  unsigned char *ret = nanoz_compress(const_cast<unsigned char *>(src), src_size, &outSize, quality);
   if (!ret) {
     return false;
   }
@@ -1392,105 +2715,178 @@ static bool CompressZip(unsigned char *dst,
   memcpy(dst, ret, outSize);
   free(ret);
   
-  compressedSize = outSize;
+  (*compressed_size) = outSize;
 #else
   uLong outSize = compressBound(static_cast<uLong>(src_size));
-  int ret = compress(dst, &outSize, static_cast<const Bytef *>(&tmpBuf.at(0)),
-                     src_size);
+  int ret = compress2(dst, &outSize, static_cast<const Bytef *>(src),
+                      src_size,
+                      (level == TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT)
+                          ? Z_DEFAULT_COMPRESSION
+                          : level);
   if (ret != Z_OK) {
     return false;
   }
 
-  compressedSize = outSize;
+  (*compressed_size) = outSize;
 #endif
 
-  // Use uncompressed data when compressed data is larger than uncompressed.
-  // (Issue 40)
-  if (compressedSize >= src_size) {
-    compressedSize = src_size;
-    memcpy(dst, src, src_size);
-  }
 
   return true;
 }
 
-static bool DecompressZip(unsigned char *dst,
-                          unsigned long *uncompressed_size /* inout */,
-                          const unsigned char *src, unsigned long src_size) {
-  if ((*uncompressed_size) == src_size) {
-    // Data is not compressed(Issue 40).
-    memcpy(dst, src, src_size);
-    return true;
+// Decompresses the zlib stream `src` with the user inflate function or the
+// compiled-in zlib backend. Fails unless the stream inflates to exactly
+// `*uncompressed_size` bytes, so a short stream never leaves part of `dst`
+// (a reused buffer) with data of a previous chunk.
+static bool InflateZlib(unsigned char *dst,
+                        unsigned long *uncompressed_size /* inout */,
+                        const unsigned char *src, unsigned long src_size) {
+  const unsigned long expected_size = (*uncompressed_size);
+
+  if (g_zip_codec.inflate_func) {
+    size_t out_size = expected_size;
+    if (g_zip_codec.inflate_func(dst, &out_size, src, src_size,
+                                 g_zip_codec.userdata) != 0) {
+      return false;
+    }
+    return out_size == expected_size;
   }
-  std::vector<unsigned char> tmpBuf(*uncompressed_size);
 
-#if defined(TINYEXR_USE_MINIZ) && (TINYEXR_USE_MINIZ==1)
-  int ret =
-      mz_uncompress(&tmpBuf.at(0), uncompressed_size, src, src_size);
-  if (MZ_OK != ret) {
+#if TINYEXR_USE_LIBDEFLATE
+  LibdeflateContext &ctx = GetLibdeflateContext();
+  libdeflate_decompressor *decompressor = ctx.GetDecompressor();
+  if (!decompressor) {
+    return false;
+  }
+  // NULL for `actual_out_nbytes_ret`: libdeflate fails with
+  // LIBDEFLATE_SHORT_OUTPUT unless the stream fills `dst` exactly.
+  libdeflate_result ret =
+      libdeflate_zlib_decompress(decompressor, src, src_size, dst,
+                                 (*uncompressed_size), NULL);
+  if (ret != LIBDEFLATE_SUCCESS) {
+    return false;
+  }
+#elif defined(TINYEXR_USE_MINIZ) && (TINYEXR_USE_MINIZ==1)
+  // Inflate with the decompressor on the stack. Unlike `mz_uncompress`, this
+  // does not allocate the inflate state on the heap for each chunk.
+  size_t ret = tinfl_decompress_mem_to_mem(
+      dst, (*uncompressed_size), src, src_size,
+      TINFL_FLAG_PARSE_ZLIB_HEADER);
+  if (ret == TINFL_DECOMPRESS_MEM_TO_MEM_FAILED) {
     return false;
   }
+  (*uncompressed_size) = static_cast<unsigned long>(ret);
 #elif TINYEXR_USE_STB_ZLIB
-  int ret = stbi_zlib_decode_buffer(reinterpret_cast<char*>(&tmpBuf.at(0)),
+  int ret = stbi_zlib_decode_buffer(reinterpret_cast<char*>(dst),
       *uncompressed_size, reinterpret_cast<const char*>(src), src_size);
   if (ret < 0) {
     return false;
   }
+  (*uncompressed_size) = static_cast<unsigned long>(ret);
 #elif defined(TINYEXR_USE_NANOZLIB) && (TINYEXR_USE_NANOZLIB==1)
   uint64_t dest_size = (*uncompressed_size);
   uint64_t uncomp_size{0};
   nanoz_status_t ret =
-      nanoz_uncompress(src, src_size, dest_size, &tmpBuf.at(0), &uncomp_size);
+      nanoz_uncompress(src, src_size, dest_size, dst, &uncomp_size);
   if (NANOZ_SUCCESS != ret) {
     return false;
   }
-  if ((*uncompressed_size) != uncomp_size) {
-    return false;
-  }
+  (*uncompressed_size) = static_cast<unsigned long>(uncomp_size);
 #else
-  int ret = uncompress(&tmpBuf.at(0), uncompressed_size, src, src_size);
+  int ret = uncompress(dst, uncompressed_size, src, src_size);
   if (Z_OK != ret) {
     return false;
   }
 #endif
 
+  if ((*uncompressed_size) != expected_size) {
+    return false;
+  }
+
+  return true;
+}
+
+// `tmp_buf` is a work buffer(resized as needed) which can be reused across
+// calls.
+// `level` is TINYEXR_ZIP_COMPRESSION_LEVEL_*, or 1 ~ 9.
+static bool CompressZip(unsigned char *dst,
+                        tinyexr::tinyexr_uint64 &compressedSize,
+                        const unsigned char *src, unsigned long src_size,
+                        std::vector<unsigned char> *tmp_buf,
+                        int level) {
+  if (level == TINYEXR_ZIP_COMPRESSION_LEVEL_STORE) {
+    // Same as the fallback for incompressible data below.
+    compressedSize = src_size;
+    memcpy(dst, src, src_size);
+    return true;
+  }
+
+  if (level != TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT) {
+    level = (std::min)((std::max)(level, 1), 9);
+  }
+
+  std::vector<unsigned char> &tmpBuf = *tmp_buf;
+  tmpBuf.resize(src_size);
+
   //
   // Apply EXR-specific? postprocess. Grabbed from OpenEXR's
   // ImfZipCompressor.cpp
   //
 
+  //
+  // Reorder the pixel data.
+  //
+
+  SplitEvenOddBytes(&tmpBuf.at(0), src, src_size);
+
+  //
   // Predictor.
-  {
-    unsigned char *t = &tmpBuf.at(0) + 1;
-    unsigned char *stop = &tmpBuf.at(0) + (*uncompressed_size);
+  //
 
-    while (t < stop) {
-      int d = int(t[-1]) + int(t[0]) - 128;
-      t[0] = static_cast<unsigned char>(d);
-      ++t;
-    }
+  EncodeDeltaPredictor(&tmpBuf.at(0), src_size);
+
+  if (!DeflateZlib(dst, &compressedSize, &tmpBuf.at(0), src_size, level)) {
+    return false;
   }
 
-  // Reorder the pixel data.
-  {
-    const char *t1 = reinterpret_cast<const char *>(&tmpBuf.at(0));
-    const char *t2 = reinterpret_cast<const char *>(&tmpBuf.at(0)) +
-                     (*uncompressed_size + 1) / 2;
-    char *s = reinterpret_cast<char *>(dst);
-    char *stop = s + (*uncompressed_size);
+  // Use uncompressed data when compressed data is larger than uncompressed.
+  // (Issue 40)
+  if (compressedSize >= src_size) {
+    compressedSize = src_size;
+    memcpy(dst, src, src_size);
+  }
 
-    for (;;) {
-      if (s < stop)
-        *(s++) = *(t1++);
-      else
-        break;
+  return true;
+}
 
-      if (s < stop)
-        *(s++) = *(t2++);
-      else
-        break;
-    }
+// `tmp_buf` is a work buffer(resized as needed) which can be reused across
+// calls.
+static bool DecompressZip(unsigned char *dst,
+                          unsigned long *uncompressed_size /* inout */,
+                          const unsigned char *src, unsigned long src_size,
+                          std::vector<unsigned char> *tmp_buf) {
+  if ((*uncompressed_size) == src_size) {
+    // Data is not compressed(Issue 40).
+    memcpy(dst, src, src_size);
+    return true;
   }
+  std::vector<unsigned char> &tmpBuf = *tmp_buf;
+  tmpBuf.resize(*uncompressed_size);
+
+  if (!InflateZlib(&tmpBuf.at(0), uncompressed_size, src, src_size)) {
+    return false;
+  }
+
+  //
+  // Apply EXR-specific? postprocess. Grabbed from OpenEXR's
+  // ImfZipCompressor.cpp
+  //
+
+  // Predictor.
+  DecodeDeltaPredictor(&tmpBuf.at(0), (*uncompressed_size));
+
+  // Reorder the pixel data.
+  InterleaveBytes(dst, &tmpBuf.at(0), (*uncompressed_size));
 
   return true;
 }
@@ -1617,8 +3013,10 @@ static int rleUncompress(int inLength, int maxLength, const signed char in[],
 
 static bool CompressRle(unsigned char *dst,
                         tinyexr::tinyexr_uint64 &compressedSize,
-                        const unsigned char *src, unsigned long src_size) {
-  std::vector<unsigned char> tmpBuf(src_size);
+                        const unsigned char *src, unsigned long src_size,
+                        std::vector<unsigned char> *tmp_buf) {
+  std::vector<unsigned char> &tmpBuf = *tmp_buf;
+  tmpBuf.resize(src_size);
 
   //
   // Apply EXR-specific? postprocess. Grabbed from OpenEXR's
@@ -1629,42 +3027,13 @@ static bool CompressRle(unsigned char *dst,
   // Reorder the pixel data.
   //
 
-  const char *srcPtr = reinterpret_cast<const char *>(src);
-
-  {
-    char *t1 = reinterpret_cast<char *>(&tmpBuf.at(0));
-    char *t2 = reinterpret_cast<char *>(&tmpBuf.at(0)) + (src_size + 1) / 2;
-    const char *stop = srcPtr + src_size;
-
-    for (;;) {
-      if (srcPtr < stop)
-        *(t1++) = *(srcPtr++);
-      else
-        break;
-
-      if (srcPtr < stop)
-        *(t2++) = *(srcPtr++);
-      else
-        break;
-    }
-  }
+  SplitEvenOddBytes(&tmpBuf.at(0), src, src_size);
 
   //
   // Predictor.
   //
 
-  {
-    unsigned char *t = &tmpBuf.at(0) + 1;
-    unsigned char *stop = &tmpBuf.at(0) + src_size;
-    int p = t[-1];
-
-    while (t < stop) {
-      int d = int(t[0]) - p + (128 + 256);
-      p = t[0];
-      t[0] = static_cast<unsigned char>(d);
-      ++t;
-    }
-  }
+  EncodeDeltaPredictor(&tmpBuf.at(0), src_size);
 
   // outSize will be (srcSiz * 3) / 2 at max.
   int outSize = rleCompress(static_cast<int>(src_size),
@@ -1686,7 +3055,8 @@ static bool CompressRle(unsigned char *dst,
 
 static bool DecompressRle(unsigned char *dst,
                           const unsigned long uncompressed_size,
-                          const unsigned char *src, unsigned long src_size) {
+                          const unsigned char *src, unsigned long src_size,
+                          std::vector<unsigned char> *tmp_buf) {
   if (uncompressed_size == src_size) {
     // Data is not compressed(Issue 40).
     memcpy(dst, src, src_size);
@@ -1699,7 +3069,8 @@ static bool DecompressRle(unsigned char *dst,
     return false;
   }
 
-  std::vector<unsigned char> tmpBuf(uncompressed_size);
+  std::vector<unsigned char> &tmpBuf = *tmp_buf;
+  tmpBuf.resize(uncompressed_size);
 
   int ret = rleUncompress(static_cast<int>(src_size),
                           static_cast<int>(uncompressed_size),
@@ -1715,37 +3086,10 @@ static bool DecompressRle(unsigned char *dst,
   //
 
   // Predictor.
-  {
-    unsigned char *t = &tmpBuf.at(0) + 1;
-    unsigned char *stop = &tmpBuf.at(0) + uncompressed_size;
-
-    while (t < stop) {
-      int d = int(t[-1]) + int(t[0]) - 128;
-      t[0] = static_cast<unsigned char>(d);
-      ++t;
-    }
-  }
+  DecodeDeltaPredictor(&tmpBuf.at(0), uncompressed_size);
 
   // Reorder the pixel data.
-  {
-    const char *t1 = reinterpret_cast<const char *>(&tmpBuf.at(0));
-    const char *t2 = reinterpret_cast<const char *>(&tmpBuf.at(0)) +
-                     (uncompressed_size + 1) / 2;
-    char *s = reinterpret_cast<char *>(dst);
-    char *stop = s + uncompressed_size;
-
-    for (;;) {
-      if (s < stop)
-        *(s++) = *(t1++);
-      else
-        break;
-
-      if (s < stop)
-        *(s++) = *(t2++);
-      else
-        break;
-    }
-  }
+  InterleaveBytes(dst, &tmpBuf.at(0), uncompressed_size);
 
   return true;
 }
@@ -1870,222 +3214,638 @@ inline void wdec16(unsigned short l, unsigned short h, unsigned short &a,
 }
 
 //
-// 2D Wavelet encoding:
+// SIMD versions of the basis functions above(8 values at once). They
+// produce the same result as the scalar versions.
 //
 
-static void wav2Encode(
-    unsigned short *in,  // io: values are transformed in place
-    int nx,              // i : x size
-    int ox,              // i : x offset
-    int ny,              // i : y size
-    int oy,              // i : y offset
-    unsigned short mx)   // i : maximum in[x][y] value
-{
-  bool w14 = (mx < (1 << 14));
-  int n = (nx > ny) ? ny : nx;
-  int p = 1;   // == 1 <<  level
-  int p2 = 2;  // == 1 << (level+1)
-
-  //
-  // Hierarchical loop on smaller dimension n
-  //
-
-  while (p2 <= n) {
-    unsigned short *py = in;
-    unsigned short *ey = in + oy * (ny - p2);
-    int oy1 = oy * p;
-    int oy2 = oy * p2;
-    int ox1 = ox * p;
-    int ox2 = ox * p2;
-    unsigned short i00, i01, i10, i11;
-
-    //
-    // Y loop
-    //
+#if TINYEXR_SIMD_SSE2
+typedef __m128i WavVec;
 
-    for (; py <= ey; py += oy2) {
-      unsigned short *px = py;
-      unsigned short *ex = py + ox * (nx - p2);
+inline WavVec wavLoad(const unsigned short *p) {
+  return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+}
 
-      //
-      // X loop
-      //
+inline void wavStore(unsigned short *p, WavVec v) {
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(p), v);
+}
 
-      for (; px <= ex; px += ox2) {
-        unsigned short *p01 = px + ox1;
-        unsigned short *p10 = px + oy1;
-        unsigned short *p11 = p10 + ox1;
+// Loads p[0], p[2], ..., p[14] to `e` and p[1], p[3], ..., p[15] to `o`.
+inline void wavLoadPairs(const unsigned short *p, WavVec *e, WavVec *o) {
+  __m128i a = wavLoad(p);
+  __m128i b = wavLoad(p + 8);
+  // Sign extension makes `packs` lossless.
+  *e = _mm_packs_epi32(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16),
+                       _mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+  *o = _mm_packs_epi32(_mm_srai_epi32(a, 16), _mm_srai_epi32(b, 16));
+}
 
-        //
-        // 2D wavelet encoding
-        //
+// Inverse of `wavLoadPairs`.
+inline void wavStorePairs(unsigned short *p, WavVec e, WavVec o) {
+  wavStore(p, _mm_unpacklo_epi16(e, o));
+  wavStore(p + 8, _mm_unpackhi_epi16(e, o));
+}
 
-        if (w14) {
-          wenc14(*px, *p01, i00, i01);
-          wenc14(*p10, *p11, i10, i11);
-          wenc14(i00, i10, *px, *p10);
-          wenc14(i01, i11, *p01, *p11);
-        } else {
-          wenc16(*px, *p01, i00, i01);
-          wenc16(*p10, *p11, i10, i11);
-          wenc16(i00, i10, *px, *p10);
-          wenc16(i01, i11, *p01, *p11);
-        }
-      }
+inline void wenc14x8(WavVec a, WavVec b, WavVec *l, WavVec *h) {
+  // (a + b) >> 1 without 17-bit intermediate.
+  *l = _mm_add_epi16(
+      _mm_add_epi16(_mm_srai_epi16(a, 1), _mm_srai_epi16(b, 1)),
+      _mm_and_si128(_mm_and_si128(a, b), _mm_set1_epi16(1)));
+  *h = _mm_sub_epi16(a, b);
+}
 
-      //
-      // Encode (1D) odd column (still in Y loop)
-      //
+inline void wdec14x8(WavVec l, WavVec h, WavVec *a, WavVec *b) {
+  __m128i ai = _mm_add_epi16(
+      _mm_add_epi16(l, _mm_and_si128(h, _mm_set1_epi16(1))),
+      _mm_srai_epi16(h, 1));
+  *a = ai;
+  *b = _mm_sub_epi16(ai, h);
+}
 
-      if (nx & p) {
-        unsigned short *p10 = px + oy1;
+inline void wenc16x8(WavVec a, WavVec b, WavVec *l, WavVec *h) {
+  const __m128i offset = _mm_set1_epi16(static_cast<short>(A_OFFSET));
+  __m128i ao = _mm_xor_si128(a, offset);
+  __m128i m = _mm_add_epi16(
+      _mm_add_epi16(_mm_srli_epi16(ao, 1), _mm_srli_epi16(b, 1)),
+      _mm_and_si128(_mm_and_si128(ao, b), _mm_set1_epi16(1)));
+  // ao < b(unsigned), i.e. d < 0.
+  __m128i neg = _mm_cmplt_epi16(a, _mm_xor_si128(b, offset));
+  *l = _mm_xor_si128(m, _mm_and_si128(neg, offset));
+  *h = _mm_sub_epi16(ao, b);
+}
 
-        if (w14)
-          wenc14(*px, *p10, i00, *p10);
-        else
-          wenc16(*px, *p10, i00, *p10);
+inline void wdec16x8(WavVec l, WavVec h, WavVec *a, WavVec *b) {
+  __m128i bb = _mm_sub_epi16(l, _mm_srli_epi16(h, 1));
+  *a = _mm_xor_si128(_mm_add_epi16(h, bb),
+                     _mm_set1_epi16(static_cast<short>(A_OFFSET)));
+  *b = bb;
+}
+#elif TINYEXR_SIMD_NEON
+typedef uint16x8_t WavVec;
 
-        *px = i00;
-      }
-    }
+inline WavVec wavLoad(const unsigned short *p) { return vld1q_u16(p); }
 
-    //
-    // Encode (1D) odd line (must loop in X)
-    //
+inline void wavStore(unsigned short *p, WavVec v) { vst1q_u16(p, v); }
 
-    if (ny & p) {
-      unsigned short *px = py;
-      unsigned short *ex = py + ox * (nx - p2);
+inline void wavLoadPairs(const unsigned short *p, WavVec *e, WavVec *o) {
+  uint16x8x2_t v = vld2q_u16(p);
+  *e = v.val[0];
+  *o = v.val[1];
+}
 
-      for (; px <= ex; px += ox2) {
-        unsigned short *p01 = px + ox1;
+inline void wavStorePairs(unsigned short *p, WavVec e, WavVec o) {
+  uint16x8x2_t v;
+  v.val[0] = e;
+  v.val[1] = o;
+  vst2q_u16(p, v);
+}
 
-        if (w14)
-          wenc14(*px, *p01, i00, *p01);
-        else
-          wenc16(*px, *p01, i00, *p01);
+inline void wenc14x8(WavVec a, WavVec b, WavVec *l, WavVec *h) {
+  *l = vreinterpretq_u16_s16(
+      vhaddq_s16(vreinterpretq_s16_u16(a), vreinterpretq_s16_u16(b)));
+  *h = vsubq_u16(a, b);
+}
 
-        *px = i00;
-      }
-    }
+inline void wdec14x8(WavVec l, WavVec h, WavVec *a, WavVec *b) {
+  uint16x8_t ai = vaddq_u16(
+      vaddq_u16(l, vandq_u16(h, vdupq_n_u16(1))),
+      vreinterpretq_u16_s16(vshrq_n_s16(vreinterpretq_s16_u16(h), 1)));
+  *a = ai;
+  *b = vsubq_u16(ai, h);
+}
 
-    //
-    // Next level
-    //
+inline void wenc16x8(WavVec a, WavVec b, WavVec *l, WavVec *h) {
+  const uint16x8_t offset = vdupq_n_u16(static_cast<unsigned short>(A_OFFSET));
+  uint16x8_t ao = veorq_u16(a, offset);
+  uint16x8_t m = vhaddq_u16(ao, b);
+  *l = veorq_u16(m, vandq_u16(vcltq_u16(ao, b), offset));
+  *h = vsubq_u16(ao, b);
+}
 
-    p = p2;
-    p2 <<= 1;
-  }
+inline void wdec16x8(WavVec l, WavVec h, WavVec *a, WavVec *b) {
+  uint16x8_t bb = vsubq_u16(l, vshrq_n_u16(h, 1));
+  *a = veorq_u16(vaddq_u16(h, bb), vdupq_n_u16(static_cast<unsigned short>(A_OFFSET)));
+  *b = bb;
 }
+#endif
 
 //
-// 2D Wavelet decoding:
+// AVX2 versions(16 values at once), selected at runtime. Each loop returns
+// the number of values(or pairs) processed, and the rest is done by the
+// SSE2 and scalar code below.
 //
 
-static void wav2Decode(
-    unsigned short *in,  // io: values are transformed in place
-    int nx,              // i : x size
-    int ox,              // i : x offset
-    int ny,              // i : y size
-    int oy,              // i : y offset
-    unsigned short mx)   // i : maximum in[x][y] value
-{
-  bool w14 = (mx < (1 << 14));
-  int n = (nx > ny) ? ny : nx;
-  int p = 1;
-  int p2;
+#if TINYEXR_SIMD_AVX2
+#if defined(__GNUC__) || defined(__clang__)
+#define TINYEXR_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TINYEXR_TARGET_AVX2
+#endif
 
-  //
-  // Search max level
-  //
+TINYEXR_TARGET_AVX2
+static inline void wavLoadPairsAVX2(const unsigned short *p, __m256i *e,
+                                    __m256i *o) {
+  __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+  __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 16));
+  // `packs` works on each 128-bit lane, so 64-bit blocks are reordered
+  // afterwards.
+  __m256i ev =
+      _mm256_packs_epi32(_mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16),
+                         _mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16));
+  __m256i ov = _mm256_packs_epi32(_mm256_srai_epi32(a, 16),
+                                  _mm256_srai_epi32(b, 16));
+  *e = _mm256_permute4x64_epi64(ev, 0xd8);
+  *o = _mm256_permute4x64_epi64(ov, 0xd8);
+}
 
-  while (p <= n) p <<= 1;
+TINYEXR_TARGET_AVX2
+static inline void wavStorePairsAVX2(unsigned short *p, __m256i e, __m256i o) {
+  __m256i lo = _mm256_unpacklo_epi16(e, o);  // p[0..7], p[16..23]
+  __m256i hi = _mm256_unpackhi_epi16(e, o);  // p[8..15], p[24..31]
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(p),
+                      _mm256_permute2x128_si256(lo, hi, 0x20));
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(p + 16),
+                      _mm256_permute2x128_si256(lo, hi, 0x31));
+}
 
-  p >>= 1;
-  p2 = p;
-  p >>= 1;
+TINYEXR_TARGET_AVX2
+static inline void wenc14x16(__m256i a, __m256i b, __m256i *l, __m256i *h) {
+  *l = _mm256_add_epi16(
+      _mm256_add_epi16(_mm256_srai_epi16(a, 1), _mm256_srai_epi16(b, 1)),
+      _mm256_and_si256(_mm256_and_si256(a, b), _mm256_set1_epi16(1)));
+  *h = _mm256_sub_epi16(a, b);
+}
 
-  //
-  // Hierarchical loop on smaller dimension n
-  //
+TINYEXR_TARGET_AVX2
+static inline void wdec14x16(__m256i l, __m256i h, __m256i *a, __m256i *b) {
+  __m256i ai = _mm256_add_epi16(
+      _mm256_add_epi16(l, _mm256_and_si256(h, _mm256_set1_epi16(1))),
+      _mm256_srai_epi16(h, 1));
+  *a = ai;
+  *b = _mm256_sub_epi16(ai, h);
+}
 
-  while (p >= 1) {
-    unsigned short *py = in;
-    unsigned short *ey = in + oy * (ny - p2);
-    int oy1 = oy * p;
-    int oy2 = oy * p2;
-    int ox1 = ox * p;
-    int ox2 = ox * p2;
-    unsigned short i00, i01, i10, i11;
+TINYEXR_TARGET_AVX2
+static inline void wenc16x16(__m256i a, __m256i b, __m256i *l, __m256i *h) {
+  const __m256i offset = _mm256_set1_epi16(static_cast<short>(A_OFFSET));
+  __m256i ao = _mm256_xor_si256(a, offset);
+  __m256i m = _mm256_add_epi16(
+      _mm256_add_epi16(_mm256_srli_epi16(ao, 1), _mm256_srli_epi16(b, 1)),
+      _mm256_and_si256(_mm256_and_si256(ao, b), _mm256_set1_epi16(1)));
+  // ao < b(unsigned), i.e. d < 0.
+  __m256i neg = _mm256_cmpgt_epi16(_mm256_xor_si256(b, offset), a);
+  *l = _mm256_xor_si256(m, _mm256_and_si256(neg, offset));
+  *h = _mm256_sub_epi16(ao, b);
+}
 
-    //
-    // Y loop
-    //
+TINYEXR_TARGET_AVX2
+static inline void wdec16x16(__m256i l, __m256i h, __m256i *a, __m256i *b) {
+  __m256i bb = _mm256_sub_epi16(l, _mm256_srli_epi16(h, 1));
+  *a = _mm256_xor_si256(_mm256_add_epi16(h, bb),
+                        _mm256_set1_epi16(static_cast<short>(A_OFFSET)));
+  *b = bb;
+}
 
-    for (; py <= ey; py += oy2) {
-      unsigned short *px = py;
-      unsigned short *ex = py + ox * (nx - p2);
+TINYEXR_TARGET_AVX2
+static int wencPairsAVX2(unsigned short *a, unsigned short *b, int n,
+                         bool w14) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+    __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+    __m256i l, h;
+    if (w14)
+      wenc14x16(va, vb, &l, &h);
+    else
+      wenc16x16(va, vb, &l, &h);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(a + i), l);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(b + i), h);
+  }
+  return i;
+}
 
-      //
-      // X loop
-      //
+TINYEXR_TARGET_AVX2
+static int wdecPairsAVX2(unsigned short *a, unsigned short *b, int n,
+                         bool w14) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i l = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(a + i));
+    __m256i h = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(b + i));
+    __m256i va, vb;
+    if (w14)
+      wdec14x16(l, h, &va, &vb);
+    else
+      wdec16x16(l, h, &va, &vb);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(a + i), va);
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(b + i), vb);
+  }
+  return i;
+}
 
-      for (; px <= ex; px += ox2) {
-        unsigned short *p01 = px + ox1;
-        unsigned short *p10 = px + oy1;
-        unsigned short *p11 = p10 + ox1;
+TINYEXR_TARGET_AVX2
+static int wencAdjacentPairsAVX2(unsigned short *p, int n, bool w14) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i a, b, l, h;
+    wavLoadPairsAVX2(p + 2 * i, &a, &b);
+    if (w14)
+      wenc14x16(a, b, &l, &h);
+    else
+      wenc16x16(a, b, &l, &h);
+    wavStorePairsAVX2(p + 2 * i, l, h);
+  }
+  return i;
+}
 
-        //
-        // 2D wavelet decoding
-        //
+TINYEXR_TARGET_AVX2
+static int wdecAdjacentPairsAVX2(unsigned short *p, int n, bool w14) {
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m256i l, h, a, b;
+    wavLoadPairsAVX2(p + 2 * i, &l, &h);
+    if (w14)
+      wdec14x16(l, h, &a, &b);
+    else
+      wdec16x16(l, h, &a, &b);
+    wavStorePairsAVX2(p + 2 * i, a, b);
+  }
+  return i;
+}
 
-        if (w14) {
-          wdec14(*px, *p10, i00, i10);
-          wdec14(*p01, *p11, i01, i11);
-          wdec14(i00, i01, *px, *p01);
-          wdec14(i10, i11, *p10, *p11);
-        } else {
-          wdec16(*px, *p10, i00, i10);
-          wdec16(*p01, *p11, i01, i11);
-          wdec16(i00, i01, *px, *p01);
-          wdec16(i10, i11, *p10, *p11);
+#undef TINYEXR_TARGET_AVX2
+#endif  // TINYEXR_SIMD_AVX2
+
+//
+// 1D wavelet encoding/decoding of `n` pairs (a[i], b[i]) in place.
+//
+
+static void wencPairs(unsigned short *a, unsigned short *b, int n, bool w14) {
+  int i = 0;
+
+#if TINYEXR_SIMD_AVX2
+  if (UseAVX2()) i = wencPairsAVX2(a, b, n, w14);
+#endif
+
+#if TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+  for (; i + 8 <= n; i += 8) {
+    WavVec l, h;
+    if (w14)
+      wenc14x8(wavLoad(a + i), wavLoad(b + i), &l, &h);
+    else
+      wenc16x8(wavLoad(a + i), wavLoad(b + i), &l, &h);
+    wavStore(a + i, l);
+    wavStore(b + i, h);
+  }
+#endif
+
+  for (; i < n; i++) {
+    if (w14)
+      wenc14(a[i], b[i], a[i], b[i]);
+    else
+      wenc16(a[i], b[i], a[i], b[i]);
+  }
+}
+
+static void wdecPairs(unsigned short *a, unsigned short *b, int n, bool w14) {
+  int i = 0;
+
+#if TINYEXR_SIMD_AVX2
+  if (UseAVX2()) i = wdecPairsAVX2(a, b, n, w14);
+#endif
+
+#if TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+  for (; i + 8 <= n; i += 8) {
+    WavVec va, vb;
+    if (w14)
+      wdec14x8(wavLoad(a + i), wavLoad(b + i), &va, &vb);
+    else
+      wdec16x8(wavLoad(a + i), wavLoad(b + i), &va, &vb);
+    wavStore(a + i, va);
+    wavStore(b + i, vb);
+  }
+#endif
+
+  for (; i < n; i++) {
+    if (w14)
+      wdec14(a[i], b[i], a[i], b[i]);
+    else
+      wdec16(a[i], b[i], a[i], b[i]);
+  }
+}
+
+//
+// 1D wavelet encoding/decoding of `n` adjacent pairs (p[2i], p[2i + 1]) in
+// place.
+//
+
+static void wencAdjacentPairs(unsigned short *p, int n, bool w14) {
+  int i = 0;
+
+#if TINYEXR_SIMD_AVX2
+  if (UseAVX2()) i = wencAdjacentPairsAVX2(p, n, w14);
+#endif
+
+#if TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+  for (; i + 8 <= n; i += 8) {
+    WavVec a, b, l, h;
+    wavLoadPairs(p + 2 * i, &a, &b);
+    if (w14)
+      wenc14x8(a, b, &l, &h);
+    else
+      wenc16x8(a, b, &l, &h);
+    wavStorePairs(p + 2 * i, l, h);
+  }
+#endif
+
+  for (; i < n; i++) {
+    if (w14)
+      wenc14(p[2 * i], p[2 * i + 1], p[2 * i], p[2 * i + 1]);
+    else
+      wenc16(p[2 * i], p[2 * i + 1], p[2 * i], p[2 * i + 1]);
+  }
+}
+
+static void wdecAdjacentPairs(unsigned short *p, int n, bool w14) {
+  int i = 0;
+
+#if TINYEXR_SIMD_AVX2
+  if (UseAVX2()) i = wdecAdjacentPairsAVX2(p, n, w14);
+#endif
+
+#if TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+  for (; i + 8 <= n; i += 8) {
+    WavVec l, h, a, b;
+    wavLoadPairs(p + 2 * i, &l, &h);
+    if (w14)
+      wdec14x8(l, h, &a, &b);
+    else
+      wdec16x8(l, h, &a, &b);
+    wavStorePairs(p + 2 * i, a, b);
+  }
+#endif
+
+  for (; i < n; i++) {
+    if (w14)
+      wdec14(p[2 * i], p[2 * i + 1], p[2 * i], p[2 * i + 1]);
+    else
+      wdec16(p[2 * i], p[2 * i + 1], p[2 * i], p[2 * i + 1]);
+  }
+}
+
+//
+// A level of the 2D wavelet transform is done for each pair of lines, in
+// blocks of WAV_BLOCK_SIZE values, so that both lines of a block stay in L1
+// cache during the vertical and horizontal steps.
+// `nc` images are interleaved(e.g. 2 for FLOAT and UINT channels). Values of
+// a line are `stride` apart and are copied to a contiguous work buffer for
+// each image unless they are already contiguous.
+//
+
+const int WAV_BLOCK_SIZE = 512;  // must be even
+
+// dst[c][k] = src[k * stride + c] (c < nc, nc <= 2)
+static void wavGather(unsigned short *const *dst, int nc,
+                      const unsigned short *src, int n, int stride) {
+  int k = 0;
+
+#if TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+  if ((nc == 2) && (stride == 2)) {
+    for (; k + 8 <= n; k += 8) {
+      WavVec e, o;
+      wavLoadPairs(src + 2 * k, &e, &o);
+      wavStore(dst[0] + k, e);
+      wavStore(dst[1] + k, o);
+    }
+  }
+#endif
+
+  if (nc == 1) {
+    for (; k < n; k++) {
+      dst[0][k] = src[k * stride];
+    }
+  } else {
+    for (; k < n; k++) {
+      dst[0][k] = src[k * stride];
+      dst[1][k] = src[k * stride + 1];
+    }
+  }
+}
+
+// Inverse of `wavGather`.
+static void wavScatter(unsigned short *dst, const unsigned short *const *src,
+                       int nc, int n, int stride) {
+  int k = 0;
+
+#if TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+  if ((nc == 2) && (stride == 2)) {
+    for (; k + 8 <= n; k += 8) {
+      wavStorePairs(dst + 2 * k, wavLoad(src[0] + k), wavLoad(src[1] + k));
+    }
+  }
+#endif
+
+  if (nc == 1) {
+    for (; k < n; k++) {
+      dst[k * stride] = src[0][k];
+    }
+  } else {
+    for (; k < n; k++) {
+      dst[k * stride] = src[0][k];
+      dst[k * stride + 1] = src[1][k];
+    }
+  }
+}
+
+static void wav2EncodeLines(unsigned short *l0,
+                            unsigned short *l1,  // NULL: odd line
+                            int n, int stride, int nc, bool w14) {
+  unsigned short t0[2][WAV_BLOCK_SIZE];
+  unsigned short t1[2][WAV_BLOCK_SIZE];
+
+  for (int i = 0; i < n; i += WAV_BLOCK_SIZE) {
+    int m = (std::min)(WAV_BLOCK_SIZE, n - i);
+
+    for (int j = 0; j < nc; j += 2) {
+      int g = (std::min)(2, nc - j);  // number of images processed at once
+      unsigned short *b0[2] = {t0[0], t0[1]};
+      unsigned short *b1[2] = {t1[0], t1[1]};
+      bool contiguous = (g == 1) && (stride == 1);
+
+      if (contiguous) {
+        b0[0] = l0 + i;
+        b1[0] = l1 ? (l1 + i) : NULL;
+      } else {
+        wavGather(b0, g, l0 + i * stride + j, m, stride);
+        if (l1) wavGather(b1, g, l1 + i * stride + j, m, stride);
+      }
+
+      for (int c = 0; c < g; c++) {
+        wencAdjacentPairs(b0[c], m / 2, w14);
+        if (l1) {
+          wencAdjacentPairs(b1[c], m / 2, w14);
+          wencPairs(b0[c], b1[c], m, w14);
         }
       }
 
-      //
-      // Decode (1D) odd column (still in Y loop)
-      //
+      if (!contiguous) {
+        wavScatter(l0 + i * stride + j, b0, g, m, stride);
+        if (l1) wavScatter(l1 + i * stride + j, b1, g, m, stride);
+      }
+    }
+  }
+}
 
-      if (nx & p) {
-        unsigned short *p10 = px + oy1;
+static void wav2DecodeLines(unsigned short *l0,
+                            unsigned short *l1,  // NULL: odd line
+                            int n, int stride, int nc, bool w14) {
+  unsigned short t0[2][WAV_BLOCK_SIZE];
+  unsigned short t1[2][WAV_BLOCK_SIZE];
+
+  for (int i = 0; i < n; i += WAV_BLOCK_SIZE) {
+    int m = (std::min)(WAV_BLOCK_SIZE, n - i);
+
+    for (int j = 0; j < nc; j += 2) {
+      int g = (std::min)(2, nc - j);  // number of images processed at once
+      unsigned short *b0[2] = {t0[0], t0[1]};
+      unsigned short *b1[2] = {t1[0], t1[1]};
+      bool contiguous = (g == 1) && (stride == 1);
+
+      if (contiguous) {
+        b0[0] = l0 + i;
+        b1[0] = l1 ? (l1 + i) : NULL;
+      } else {
+        wavGather(b0, g, l0 + i * stride + j, m, stride);
+        if (l1) wavGather(b1, g, l1 + i * stride + j, m, stride);
+      }
 
-        if (w14)
-          wdec14(*px, *p10, i00, *p10);
-        else
-          wdec16(*px, *p10, i00, *p10);
+      for (int c = 0; c < g; c++) {
+        if (l1) {
+          wdecPairs(b0[c], b1[c], m, w14);
+          wdecAdjacentPairs(b1[c], m / 2, w14);
+        }
+        wdecAdjacentPairs(b0[c], m / 2, w14);
+      }
 
-        *px = i00;
+      if (!contiguous) {
+        wavScatter(l0 + i * stride + j, b0, g, m, stride);
+        if (l1) wavScatter(l1 + i * stride + j, b1, g, m, stride);
       }
     }
+  }
+}
+
+//
+// 2D Wavelet encoding:
+//
+
+static void wav2Encode(
+    unsigned short *in,  // io: values are transformed in place
+    int nx,              // i : x size
+    int ox,              // i : x offset
+    int ny,              // i : y size
+    int oy,              // i : y offset
+    unsigned short mx,   // i : maximum in[x][y] value
+    int nc)              // i : number of interleaved images(<= ox)
+{
+  bool w14 = (mx < (1 << 14));
+  int n = (nx > ny) ? ny : nx;
+  int p = 1;   // == 1 <<  level
+  int p2 = 2;  // == 1 << (level+1)
+
+  //
+  // Hierarchical loop on smaller dimension n
+  //
+
+  while (p2 <= n) {
+    unsigned short *py = in;
+    unsigned short *ey = in + oy * (ny - p2);
+    int oy1 = oy * p;
+    int oy2 = oy * p2;
+
+    // Number of values in a line at this level. The last value of an odd
+    // count is only encoded vertically(odd column).
+    int nl = nx / p;
+
+    //
+    // Y loop
+    //
+
+    for (; py <= ey; py += oy2) {
+      wav2EncodeLines(py, py + oy1, nl, ox * p, nc, w14);
+    }
 
     //
-    // Decode (1D) odd line (must loop in X)
+    // Encode (1D) odd line
     //
 
     if (ny & p) {
-      unsigned short *px = py;
-      unsigned short *ex = py + ox * (nx - p2);
+      wav2EncodeLines(py, NULL, nl, ox * p, nc, w14);
+    }
 
-      for (; px <= ex; px += ox2) {
-        unsigned short *p01 = px + ox1;
+    //
+    // Next level
+    //
 
-        if (w14)
-          wdec14(*px, *p01, i00, *p01);
-        else
-          wdec16(*px, *p01, i00, *p01);
+    p = p2;
+    p2 <<= 1;
+  }
+}
 
-        *px = i00;
-      }
+//
+// 2D Wavelet decoding:
+//
+
+static void wav2Decode(
+    unsigned short *in,  // io: values are transformed in place
+    int nx,              // i : x size
+    int ox,              // i : x offset
+    int ny,              // i : y size
+    int oy,              // i : y offset
+    unsigned short mx,   // i : maximum in[x][y] value
+    int nc)              // i : number of interleaved images(<= ox)
+{
+  bool w14 = (mx < (1 << 14));
+  int n = (nx > ny) ? ny : nx;
+  int p = 1;
+  int p2;
+
+  //
+  // Search max level
+  //
+
+  while (p <= n) p <<= 1;
+
+  p >>= 1;
+  p2 = p;
+  p >>= 1;
+
+  //
+  // Hierarchical loop on smaller dimension n
+  //
+
+  while (p >= 1) {
+    unsigned short *py = in;
+    unsigned short *ey = in + oy * (ny - p2);
+    int oy1 = oy * p;
+    int oy2 = oy * p2;
+
+    // Number of values in a line at this level. The last value of an odd
+    // count is only decoded vertically(odd column).
+    int nl = nx / p;
+
+    //
+    // Y loop
+    //
+
+    for (; py <= ey; py += oy2) {
+      wav2DecodeLines(py, py + oy1, nl, ox * p, nc, w14);
+    }
+
+    //
+    // Decode (1D) odd line
+    //
+
+    if (ny & p) {
+      wav2DecodeLines(py, NULL, nl, ox * p, nc, w14);
     }
 
     //
@@ -2111,16 +3871,45 @@ static void wav2Decode(
 
 const int HUF_ENCBITS = 16;  // literal (value) bit length
 const int HUF_DECBITS = 14;  // decoding bit size (>= 8)
+// Max code length of the decoder. Canonical codes longer than 56 bits
+// need more than fib(56) symbols in a chunk, which never happens.
+const int HUF_DECMAXLEN = 56;
 
 const int HUF_ENCSIZE = (1 << HUF_ENCBITS) + 1;  // encoding table size
 const int HUF_DECSIZE = 1 << HUF_DECBITS;        // decoding table size
-const int HUF_DECMASK = HUF_DECSIZE - 1;
 
-struct HufDec {  // short code    long code
-  //-------------------------------
-  unsigned int len : 8;   // code length    0
-  unsigned int lit : 24;  // lit      p size
-  unsigned int *p;        // 0      lits
+// Decoding tables built by hufBuildDecTable():
+//  - codes of length <= HUF_DECBITS are resolved with a single access to
+//    `table`(entry: symbol << 8 | code length, 0: long code);
+//  - long codes of length l are canonical, i.e. they are the consecutive
+//    values [first[l], first[l] + count[l]) in the order of symbols, and
+//    left-justified longer codes are numerically lower than shorter codes.
+//    So a long code is found by comparing the bit buffer with the
+//    left-justified first code of each length(`lj_base`).
+// All tables are flat arrays reused across chunks.
+struct HufDec {
+  std::vector<unsigned int> table;  // [HUF_DECSIZE]
+  std::vector<int> symbols;         // long code symbols, sorted by code
+  unsigned long long lj_base[HUF_DECMAXLEN + 1];
+  long long first[HUF_DECMAXLEN + 1];
+  int count[HUF_DECMAXLEN + 1];
+  int offset[HUF_DECMAXLEN + 1];     // index to `symbols`
+  int long_lens[HUF_DECMAXLEN + 1];  // lengths of long codes, ascending
+  int num_long_lens;
+};
+
+// Work buffers of PIZ compression(range compression, wavelet and Huffman
+// tables). They are resized as needed and reused across chunks.
+struct PizScratch {
+  std::vector<unsigned char> bitmap;
+  std::vector<unsigned short> lut;
+  std::vector<unsigned short> tmp_buffer;
+  std::vector<PIZChannelData> channel_data;
+  std::vector<long long> freq;
+  HufDec hdec;
+  std::vector<int> hlink;
+  std::vector<long long *> fheap;
+  std::vector<long long> scode;
 };
 
 inline long long hufLength(long long code) { return code & 63; }
@@ -2224,7 +4013,8 @@ struct FHeapCompare {
 static bool hufBuildEncTable(
     long long *frq,  // io: input frequencies [HUF_ENCSIZE], output table
     int *im,         //  o: min frq index
-    int *iM)         //  o: max frq index
+    int *iM,         //  o: max frq index
+    PizScratch *scratch)  // work buffers
 {
   //
   // This function assumes that when it is called, array frq
@@ -2247,8 +4037,10 @@ static bool hufBuildEncTable(
   //    for all array entries.
   //
 
-  std::vector<int> hlink(HUF_ENCSIZE);
-  std::vector<long long *> fHeap(HUF_ENCSIZE);
+  std::vector<int> &hlink = scratch->hlink;
+  std::vector<long long *> &fHeap = scratch->fheap;
+  hlink.resize(HUF_ENCSIZE);
+  fHeap.resize(HUF_ENCSIZE);
 
   *im = 0;
 
@@ -2307,7 +4099,8 @@ static bool hufBuildEncTable(
 
   std::make_heap(&fHeap[0], &fHeap[nf], FHeapCompare());
 
-  std::vector<long long> scode(HUF_ENCSIZE);
+  std::vector<long long> &scode = scratch->scode;
+  scode.resize(HUF_ENCSIZE);
   memset(scode.data(), 0, sizeof(long long) * HUF_ENCSIZE);
 
   while (nf > 1) {
@@ -2510,44 +4303,33 @@ static bool hufUnpackEncTable(
 //
 
 //
-// Clear a newly allocated decoding table so that it contains only zeroes.
-//
-
-static void hufClearDecTable(HufDec *hdecod)  // io: (allocated by caller)
-//     decoding table [HUF_DECSIZE]
-{
-  for (int i = 0; i < HUF_DECSIZE; i++) {
-    hdecod[i].len = 0;
-    hdecod[i].lit = 0;
-    hdecod[i].p = NULL;
-  }
-  // memset(hdecod, 0, sizeof(HufDec) * HUF_DECSIZE);
-}
-
-//
-// Build a decoding hash table based on the encoding table hcode:
-//  - short codes (<= HUF_DECBITS) are resolved with a single table access;
-//  - long code entry allocations are not optimized, because long codes are
-//    unfrequent;
-//  - decoding tables are used by hufDecode();
+// Build decoding tables based on the encoding table hcode(see HufDec).
+// Unlike the original implementation, no memory is allocated for each
+// long code entry.
 //
 
 static bool hufBuildDecTable(const long long *hcode,  // i : encoding table
                              int im,                  // i : min index in hcode
                              int iM,                  // i : max index in hcode
-                             HufDec *hdecod)  //  o: (allocated by caller)
-//     decoding table [HUF_DECSIZE]
+                             HufDec *hdec)            //  o: decoding tables
 {
-  //
-  // Init hashtable & loop on all codes.
-  // Assumes that hufClearDecTable(hdecod) has already been called.
-  //
+  std::vector<unsigned int> &table = hdec->table;
+  table.assign(HUF_DECSIZE, 0);
 
-  for (; im <= iM; im++) {
-    long long c = hufCode(hcode[im]);
-    int l = hufLength(hcode[im]);
+  for (int l = 0; l <= HUF_DECMAXLEN; l++) {
+    hdec->first[l] = 0;
+    hdec->count[l] = 0;
+  }
+
+  for (int i = im; i <= iM; i++) {
+    long long c = hufCode(hcode[i]);
+    int l = static_cast<int>(hufLength(hcode[i]));
+
+    if (l == 0) {
+      continue;
+    }
 
-    if (c >> l) {
+    if ((l > HUF_DECMAXLEN) || (c >> l)) {
       //
       // Error: c is supposed to be an l-bit code,
       // but c contains a value that is greater
@@ -2560,82 +4342,85 @@ static bool hufBuildDecTable(const long long *hcode,  // i : encoding table
 
     if (l > HUF_DECBITS) {
       //
-      // Long code: add a secondary entry
+      // Long code: codes of the same length must be consecutive
       //
 
-      HufDec *pl = hdecod + (c >> (l - HUF_DECBITS));
-
-      if (pl->len) {
-        //
-        // Error: a short code has already
-        // been stored in table entry *pl.
-        //
-
-        // invalidTableEntry();
+      if (hdec->count[l] == 0) {
+        hdec->first[l] = c;
+      } else if (c != hdec->first[l] + hdec->count[l]) {
         return false;
       }
-
-      pl->lit++;
-
-      if (pl->p) {
-        unsigned int *p = pl->p;
-        pl->p = new unsigned int[pl->lit];
-
-        for (unsigned int i = 0; i < pl->lit - 1u; ++i) pl->p[i] = p[i];
-
-        delete[] p;
-      } else {
-        pl->p = new unsigned int[1];
-      }
-
-      pl->p[pl->lit - 1] = im;
-    } else if (l) {
+      hdec->count[l]++;
+    } else {
       //
       // Short code: init all primary entries
       //
 
-      HufDec *pl = hdecod + (c << (HUF_DECBITS - l));
+      unsigned int *pl = &table[static_cast<size_t>(c << (HUF_DECBITS - l))];
+      unsigned int entry =
+          (static_cast<unsigned int>(i) << 8) | static_cast<unsigned int>(l);
 
-      for (long long i = 1ULL << (HUF_DECBITS - l); i > 0; i--, pl++) {
-        if (pl->len || pl->p) {
+      for (long long n = 1LL << (HUF_DECBITS - l); n > 0; n--, pl++) {
+        if (*pl) {
           //
-          // Error: a short code or a long code has
-          // already been stored in table entry *pl.
+          // Error: a short code has already
+          // been stored in table entry *pl.
           //
 
           // invalidTableEntry();
           return false;
         }
 
-        pl->len = l;
-        pl->lit = im;
+        *pl = entry;
       }
     }
   }
 
-  return true;
-}
-
-//
-// Free the long code entries of a decoding table built by hufBuildDecTable()
-//
-
-static void hufFreeDecTable(HufDec *hdecod)  // io: Decoding table
-{
-  for (int i = 0; i < HUF_DECSIZE; i++) {
-    if (hdecod[i].p) {
-      delete[] hdecod[i].p;
-      hdecod[i].p = 0;
+  int num_long_codes = 0;
+  hdec->num_long_lens = 0;
+  for (int l = HUF_DECBITS + 1; l <= HUF_DECMAXLEN; l++) {
+    hdec->offset[l] = num_long_codes;
+    if (hdec->count[l]) {
+      num_long_codes += hdec->count[l];
+      hdec->lj_base[l] = static_cast<unsigned long long>(hdec->first[l])
+                         << (64 - l);
+      hdec->long_lens[hdec->num_long_lens++] = l;
     }
   }
-}
 
-//
-// ENCODING
-//
+  hdec->symbols.resize(static_cast<size_t>(num_long_codes));
+  if (num_long_codes > 0) {
+    for (int i = im; i <= iM; i++) {
+      int l = static_cast<int>(hufLength(hcode[i]));
+      if (l <= HUF_DECBITS) {
+        continue;
+      }
 
-inline void outputCode(long long code, long long &c, int &lc, char *&out) {
-  outputBits(hufLength(code), hufCode(code), c, lc, out);
+      long long c = hufCode(hcode[i]);
+      if (table[static_cast<size_t>(c >> (l - HUF_DECBITS))]) {
+        //
+        // Error: a short code has already
+        // been stored in the primary entry of the long code.
+        //
+
+        // invalidTableEntry();
+        return false;
+      }
+
+      hdec->symbols[static_cast<size_t>(hdec->offset[l] +
+                                        (c - hdec->first[l]))] = i;
+    }
+  }
+
+  return true;
+}
+
+//
+// ENCODING
+//
+
+inline void outputCode(long long code, long long &c, int &lc, char *&out) {
+  outputBits(hufLength(code), hufCode(code), c, lc, out);
 }
 
 inline void sendCode(long long sCode, int runCount, long long runCode,
@@ -2708,185 +4493,143 @@ static int hufEncode            // return: output size (in bits)
 //
 
 //
-// In order to force the compiler to inline them,
-// getChar() and getCode() are implemented as macros
-// instead of "inline" functions.
+// Reads bits MSB first through a 64-bit bit buffer. Zero bits are returned
+// after the end of the input.
 //
 
-#define getChar(c, lc, in)                   \
-  {                                          \
-    c = (c << 8) | *(unsigned char *)(in++); \
-    lc += 8;                                 \
-  }
-
-#if 0
-#define getCode(po, rlc, c, lc, in, out, ob, oe) \
-  {                                              \
-    if (po == rlc) {                             \
-      if (lc < 8) getChar(c, lc, in);            \
-                                                 \
-      lc -= 8;                                   \
-                                                 \
-      unsigned char cs = (c >> lc);              \
-                                                 \
-      if (out + cs > oe) return false;           \
-                                                 \
-      /* TinyEXR issue 78 */                     \
-      unsigned short s = out[-1];                \
-                                                 \
-      while (cs-- > 0) *out++ = s;               \
-    } else if (out < oe) {                       \
-      *out++ = po;                               \
-    } else {                                     \
-      return false;                              \
-    }                                            \
-  }
-#else
-static bool getCode(int po, int rlc, long long &c, int &lc, const char *&in,
-                    const char *in_end, unsigned short *&out,
-                    const unsigned short *ob, const unsigned short *oe) {
-  (void)ob;
-  if (po == rlc) {
-    if (lc < 8) {
-      /* TinyEXR issue 78 */
-      /* TinyEXR issue 160. in + 1 -> in */
-      if (in >= in_end) {
-        return false;
+struct HufBitReader {
+  const unsigned char *in;
+  const unsigned char *ie;
+  unsigned long long buf;  // left-justified
+  int bits;                // number of valid bits in `buf`
+
+  // Refills `buf` to contain at least 56 bits.
+  inline void refill() {
+    if (ie - in >= 8) {
+      // Bits past `bits` may already contain the next input bits; they are
+      // OR'ed again at the same position.
+      unsigned long long v =
+          (static_cast<unsigned long long>(in[0]) << 56) |
+          (static_cast<unsigned long long>(in[1]) << 48) |
+          (static_cast<unsigned long long>(in[2]) << 40) |
+          (static_cast<unsigned long long>(in[3]) << 32) |
+          (static_cast<unsigned long long>(in[4]) << 24) |
+          (static_cast<unsigned long long>(in[5]) << 16) |
+          (static_cast<unsigned long long>(in[6]) << 8) |
+          static_cast<unsigned long long>(in[7]);
+      buf |= v >> bits;
+      int n = (63 - bits) >> 3;
+      in += n;
+      bits += n << 3;
+    } else {
+      while (bits <= 56) {
+        unsigned long long v = (in < ie) ? *in++ : 0;
+        buf |= v << (56 - bits);
+        bits += 8;
       }
-
-      getChar(c, lc, in);
     }
+  }
 
-    lc -= 8;
-
-    unsigned char cs = (c >> lc);
-
-    if (out + cs > oe) return false;
-
-    // Bounds check for safety
-    // Issue 100.
-    if ((out - 1) < ob) return false;
-    unsigned short s = out[-1];
-
-    while (cs-- > 0) *out++ = s;
-  } else if (out < oe) {
-    *out++ = po;
-  } else {
-    return false;
+  inline void skip(int n) {
+    buf <<= n;
+    bits -= n;
   }
-  return true;
-}
-#endif
+};
 
 //
-// Decode (uncompress) ni bits based on encoding & decoding tables:
+// Decode (uncompress) ni bits based on the decoding tables.
+// Short codes are decoded with a single table access, and several codes
+// are decoded per refill of the 64-bit bit buffer.
 //
 
-static bool hufDecode(const long long *hcode,  // i : encoding table
-                      const HufDec *hdecod,    // i : decoding table
-                      const char *in,          // i : compressed input buffer
-                      int ni,                  // i : input size (in bits)
-                      int rlc,                 // i : run-length code
+static bool hufDecode(const HufDec *hdec,  // i : decoding tables
+                      const char *in,      // i : compressed input buffer
+                      int ni,              // i : input size (in bits)
+                      int rlc,             // i : run-length code
                       int no,  // i : expected output size (in bytes)
                       unsigned short *out)  //  o: uncompressed output buffer
 {
-  long long c = 0;
-  int lc = 0;
-  unsigned short *outb = out;          // begin
-  unsigned short *oe = out + no;       // end
-  const char *ie = in + (ni + 7) / 8;  // input byte size
-
-  //
-  // Loop on input bytes
-  //
-
-  while (in < ie) {
-    getChar(c, lc, in);
-
-    //
-    // Access decoding table
-    //
-
-    while (lc >= HUF_DECBITS) {
-      const HufDec pl = hdecod[(c >> (lc - HUF_DECBITS)) & HUF_DECMASK];
-
-      if (pl.len) {
-        //
-        // Get short code
-        //
-
-        lc -= pl.len;
-        // std::cout << "lit = " << pl.lit << std::endl;
-        // std::cout << "rlc = " << rlc << std::endl;
-        // std::cout << "c = " << c << std::endl;
-        // std::cout << "lc = " << lc << std::endl;
-        // std::cout << "in = " << in << std::endl;
-        // std::cout << "out = " << out << std::endl;
-        // std::cout << "oe = " << oe << std::endl;
-        if (!getCode(pl.lit, rlc, c, lc, in, ie, out, outb, oe)) {
-          return false;
-        }
+  const unsigned int *table = &hdec->table.at(0);
+  unsigned short *outb = out;     // begin
+  unsigned short *oe = out + no;  // end
+
+  HufBitReader br;
+  br.in = reinterpret_cast<const unsigned char *>(in);
+  br.ie = br.in + (ni + 7) / 8;  // input byte size
+  br.buf = 0;
+  br.bits = 0;
+
+  long long remaining = ni;  // number of bits not decoded yet
+
+  while (remaining > 0) {
+    br.refill();
+
+    // A short code and the run length following it are in `buf`.
+    while ((br.bits >= HUF_DECBITS + 8) && (remaining > 0)) {
+      unsigned int entry = table[br.buf >> (64 - HUF_DECBITS)];
+      int l;
+      int sym;
+
+      if (entry) {
+        l = static_cast<int>(entry & 0xff);
+        sym = static_cast<int>(entry >> 8);
       } else {
-        if (!pl.p) {
-          return false;
-        }
-        // invalidCode(); // wrong code
-
         //
         // Search long code
         //
 
-        unsigned int j;
-
-        for (j = 0; j < pl.lit; j++) {
-          int l = hufLength(hcode[pl.p[j]]);
-
-          while (lc < l && in < ie)  // get more bits
-            getChar(c, lc, in);
-
-          if (lc >= l) {
-            if (hufCode(hcode[pl.p[j]]) ==
-                ((c >> (lc - l)) & (((long long)(1) << l) - 1))) {
-              //
-              // Found : get long code
-              //
+        if (br.bits < HUF_DECMAXLEN) {
+          br.refill();
+        }
 
-              lc -= l;
-              if (!getCode(pl.p[j], rlc, c, lc, in, ie, out, outb, oe)) {
-                return false;
-              }
-              break;
-            }
-          }
+        int k = 0;
+        while ((k < hdec->num_long_lens) &&
+               (br.buf < hdec->lj_base[hdec->long_lens[k]])) {
+          k++;
+        }
+        if (k == hdec->num_long_lens) {
+          return false;
+          // invalidCode(); // wrong code
         }
 
-        if (j == pl.lit) {
+        l = hdec->long_lens[k];
+        long long idx = static_cast<long long>(br.buf >> (64 - l)) -
+                        hdec->first[l];
+        if (idx >= hdec->count[l]) {
           return false;
           // invalidCode(); // Not found
         }
+        sym = hdec->symbols[static_cast<size_t>(hdec->offset[l] + idx)];
       }
-    }
-  }
 
-  //
-  // Get remaining (short) codes
-  //
+      remaining -= l;
+      if (remaining < 0) {
+        return false;
+      }
+      br.skip(l);
+
+      if (sym == rlc) {
+        if ((remaining < 8) || (out == outb)) {
+          return false;
+        }
+        if (br.bits < 8) {
+          br.refill();
+        }
+
+        unsigned int cs = static_cast<unsigned int>(br.buf >> 56);
+        remaining -= 8;
+        br.skip(8);
 
-  int i = (8 - ni) & 7;
-  c >>= i;
-  lc -= i;
+        if (out + cs > oe) return false;
 
-  while (lc > 0) {
-    const HufDec pl = hdecod[(c << (HUF_DECBITS - lc)) & HUF_DECMASK];
+        unsigned short s = out[-1];
 
-    if (pl.len) {
-      lc -= pl.len;
-      if (!getCode(pl.lit, rlc, c, lc, in, ie, out, outb, oe)) {
+        while (cs-- > 0) *out++ = s;
+      } else if (out < oe) {
+        *out++ = static_cast<unsigned short>(sym);
+      } else {
         return false;
       }
-    } else {
-      return false;
-      // invalidCode(); // wrong (long) code
     }
   }
 
@@ -2926,16 +4669,17 @@ static unsigned int readUInt(const char buf[4]) {
 //
 
 static int hufCompress(const unsigned short raw[], int nRaw,
-                       char compressed[]) {
+                       char compressed[], PizScratch *scratch) {
   if (nRaw == 0) return 0;
 
-  std::vector<long long> freq(HUF_ENCSIZE);
+  std::vector<long long> &freq = scratch->freq;
+  freq.resize(HUF_ENCSIZE);
 
   countFrequencies(freq, raw, nRaw);
 
   int im = 0;
   int iM = 0;
-  hufBuildEncTable(freq.data(), &im, &iM);
+  hufBuildEncTable(freq.data(), &im, &iM, scratch);
 
   char *tableStart = compressed + 20;
   char *tableEnd = tableStart;
@@ -2956,7 +4700,8 @@ static int hufCompress(const unsigned short raw[], int nRaw,
 }
 
 static bool hufUncompress(const char compressed[], int nCompressed,
-                          std::vector<unsigned short> *raw) {
+                          std::vector<unsigned short> *raw,
+                          PizScratch *scratch) {
   if (nCompressed == 0) {
     if (raw->size() != 0) return false;
 
@@ -2985,30 +4730,30 @@ static bool hufUncompress(const char compressed[], int nCompressed,
   //}
   // else
   {
-    std::vector<long long> freq(HUF_ENCSIZE);
-    std::vector<HufDec> hdec(HUF_DECSIZE);
+    std::vector<long long> &freq = scratch->freq;
+    freq.resize(HUF_ENCSIZE);
 
-    hufClearDecTable(&hdec.at(0));
+    // Work buffers are reused, so a failure must not be ignored(otherwise
+    // stale data of a previous chunk would be decoded).
+    bool ok = hufUnpackEncTable(&ptr, nCompressed - (ptr - compressed), im,
+                                iM, &freq.at(0));
 
-    hufUnpackEncTable(&ptr, nCompressed - (ptr - compressed), im, iM,
-                      &freq.at(0));
+    if (ok && (nBits > 8 * (nCompressed - (ptr - compressed)))) {
+      ok = false;
+    }
 
-    {
-      if (nBits > 8 * (nCompressed - (ptr - compressed))) {
-        return false;
-      }
+    if (ok) {
+      ok = hufBuildDecTable(&freq.at(0), im, iM, &scratch->hdec);
+    }
 
-      hufBuildDecTable(&freq.at(0), im, iM, &hdec.at(0));
-      hufDecode(&freq.at(0), &hdec.at(0), ptr, nBits, iM, raw->size(),
-                raw->data());
+    if (ok) {
+      ok = hufDecode(&scratch->hdec, ptr, nBits, iM, raw->size(),
+                     raw->data());
     }
-    // catch (...)
-    //{
-    //    hufFreeDecTable (hdec);
-    //    throw;
-    //}
 
-    hufFreeDecTable(&hdec.at(0));
+    if (!ok) {
+      return false;
+    }
   }
 
   return true;
@@ -3088,8 +4833,9 @@ static void applyLut(const unsigned short lut[USHORT_RANGE],
 static bool CompressPiz(unsigned char *outPtr, unsigned int *outSize,
                         const unsigned char *inPtr, size_t inSize,
                         const std::vector<ChannelInfo> &channelInfo,
-                        int data_width, int num_lines) {
-  std::vector<unsigned char> bitmap(BITMAP_SIZE);
+                        int data_width, int num_lines, PizScratch *scratch) {
+  std::vector<unsigned char> &bitmap = scratch->bitmap;
+  bitmap.resize(BITMAP_SIZE);
   unsigned short minNonZero;
   unsigned short maxNonZero;
 
@@ -3099,9 +4845,11 @@ static bool CompressPiz(unsigned char *outPtr, unsigned int *outSize,
 #endif
 
   // Assume `inSize` is multiple of 2 or 4.
-  std::vector<unsigned short> tmpBuffer(inSize / sizeof(unsigned short));
+  std::vector<unsigned short> &tmpBuffer = scratch->tmp_buffer;
+  tmpBuffer.resize(inSize / sizeof(unsigned short));
 
-  std::vector<PIZChannelData> channelData(channelInfo.size());
+  std::vector<PIZChannelData> &channelData = scratch->channel_data;
+  channelData.resize(channelInfo.size());
   unsigned short *tmpBufferEnd = &tmpBuffer.at(0);
 
   for (size_t c = 0; c < channelData.size(); c++) {
@@ -3142,7 +4890,8 @@ static bool CompressPiz(unsigned char *outPtr, unsigned int *outSize,
   bitmapFromData(&tmpBuffer.at(0), static_cast<int>(tmpBuffer.size()),
                  bitmap.data(), minNonZero, maxNonZero);
 
-  std::vector<unsigned short> lut(USHORT_RANGE);
+  std::vector<unsigned short> &lut = scratch->lut;
+  lut.resize(USHORT_RANGE);
   unsigned short maxValue = forwardLutFromBitmap(bitmap.data(), lut.data());
   applyLut(lut.data(), &tmpBuffer.at(0), static_cast<int>(tmpBuffer.size()));
 
@@ -3170,10 +4919,9 @@ static bool CompressPiz(unsigned char *outPtr, unsigned int *outSize,
   for (size_t i = 0; i < channelData.size(); ++i) {
     PIZChannelData &cd = channelData[i];
 
-    for (int j = 0; j < cd.size; ++j) {
-      wav2Encode(cd.start + j, cd.nx, cd.size, cd.ny, cd.nx * cd.size,
-                 maxValue);
-    }
+    // Transforms `cd.size` interleaved 16-bit planes at once.
+    wav2Encode(cd.start, cd.nx, cd.size, cd.ny, cd.nx * cd.size, maxValue,
+               cd.size);
   }
 
   //
@@ -3188,7 +4936,8 @@ static bool CompressPiz(unsigned char *outPtr, unsigned int *outSize,
   buf += sizeof(int);
 
   int length =
-      hufCompress(&tmpBuffer.at(0), static_cast<int>(tmpBuffer.size()), buf);
+      hufCompress(&tmpBuffer.at(0), static_cast<int>(tmpBuffer.size()), buf,
+                  scratch);
   memcpy(lengthPtr, &length, sizeof(int));
 
   (*outSize) = static_cast<unsigned int>(
@@ -3207,14 +4956,15 @@ static bool CompressPiz(unsigned char *outPtr, unsigned int *outSize,
 static bool DecompressPiz(unsigned char *outPtr, const unsigned char *inPtr,
                           size_t tmpBufSizeInBytes, size_t inLen, int num_channels,
                           const EXRChannelInfo *channels, int data_width,
-                          int num_lines) {
+                          int num_lines, PizScratch *scratch) {
   if (inLen == tmpBufSizeInBytes) {
     // Data is not compressed(Issue 40).
     memcpy(outPtr, inPtr, inLen);
     return true;
   }
 
-  std::vector<unsigned char> bitmap(BITMAP_SIZE);
+  std::vector<unsigned char> &bitmap = scratch->bitmap;
+  bitmap.resize(BITMAP_SIZE);
   unsigned short minNonZero;
   unsigned short maxNonZero;
 
@@ -3268,7 +5018,8 @@ static bool DecompressPiz(unsigned char *outPtr, const unsigned char *inPtr,
     }
   }
 
-  std::vector<unsigned short> lut(USHORT_RANGE);
+  std::vector<unsigned short> &lut = scratch->lut;
+  lut.resize(USHORT_RANGE);
   memset(lut.data(), 0, sizeof(unsigned short) * USHORT_RANGE);
   unsigned short maxValue = reverseLutFromBitmap(bitmap.data(), lut.data());
 
@@ -3290,14 +5041,19 @@ static bool DecompressPiz(unsigned char *outPtr, const unsigned char *inPtr,
     return false;
   }
 
-  std::vector<unsigned short> tmpBuffer(tmpBufSizeInBytes / sizeof(unsigned short));
-  hufUncompress(reinterpret_cast<const char *>(ptr), length, &tmpBuffer);
+  std::vector<unsigned short> &tmpBuffer = scratch->tmp_buffer;
+  tmpBuffer.resize(tmpBufSizeInBytes / sizeof(unsigned short));
+  if (!hufUncompress(reinterpret_cast<const char *>(ptr), length, &tmpBuffer,
+                     scratch)) {
+    return false;
+  }
 
   //
   // Wavelet decoding
   //
 
-  std::vector<PIZChannelData> channelData(static_cast<size_t>(num_channels));
+  std::vector<PIZChannelData> &channelData = scratch->channel_data;
+  channelData.resize(static_cast<size_t>(num_channels));
 
   unsigned short *tmpBufferEnd = &tmpBuffer.at(0);
 
@@ -3322,10 +5078,9 @@ static bool DecompressPiz(unsigned char *outPtr, const unsigned char *inPtr,
   for (size_t i = 0; i < channelData.size(); ++i) {
     PIZChannelData &cd = channelData[i];
 
-    for (int j = 0; j < cd.size; ++j) {
-      wav2Decode(cd.start + j, cd.nx, cd.size, cd.ny, cd.nx * cd.size,
-                 maxValue);
-    }
+    // Transforms `cd.size` interleaved 16-bit planes at once.
+    wav2Decode(cd.start, cd.nx, cd.size, cd.ny, cd.nx * cd.size, maxValue,
+               cd.size);
   }
 
   //
@@ -3352,4727 +5107,8594 @@ static bool DecompressPiz(unsigned char *outPtr, const unsigned char *inPtr,
 }
 #endif  // TINYEXR_USE_PIZ
 
-#if TINYEXR_USE_ZFP
+// B44 code from OpenEXR --------------------------------------
+
+// B44 compresses each 4x4 block of a HALF channel into 14 bytes(or 3 bytes
+// for a flat block with B44A). Other channels are stored uncompressed.
+// Grabbed from OpenEXR's ImfB44Compressor.cpp.
+
+// Converts with round-to-nearest-even, as `half(float)` of Imath.
+static unsigned short FloatToHalfRne(float f) {
+  FP32 in;
+  in.f = f;
+  unsigned int sign = (in.u >> 16) & 0x8000u;
+  unsigned int a = in.u & 0x7fffffffu;
+  if (a >= 0x7f800000u) {  // Inf or NaN
+    return static_cast<unsigned short>(sign | 0x7c00u |
+                                       ((a > 0x7f800000u) ? 0x200u : 0u));
+  }
+  if (a >= 0x477ff000u) {  // Overflow
+    return static_cast<unsigned short>(sign | 0x7c00u);
+  }
+  if (a < 0x38800000u) {  // Denormal or zero
+    if (a < 0x33000000u) {
+      return static_cast<unsigned short>(sign);
+    }
+    unsigned int e = a >> 23;
+    unsigned int m = (a & 0x7fffffu) | 0x800000u;
+    unsigned int s = 126 - e;
+    m = (m + (1u << (s - 1)) - 1u + ((m >> s) & 1u)) >> s;
+    return static_cast<unsigned short>(sign | m);
+  }
+  a -= 0x38000000u;
+  a = (a + 0xfffu + ((a >> 13) & 1u)) >> 13;
+  return static_cast<unsigned short>(sign | a);
+}
 
-struct ZFPCompressionParam {
-  double rate;
-  unsigned int precision;
-  unsigned int __pad0;
-  double tolerance;
-  int type;  // TINYEXR_ZFP_COMPRESSIONTYPE_*
-  unsigned int __pad1;
+// Lookup tables for y = exp(x / 8) and x = 8 * log(y), applied to the values
+// of perceptually linear(`p_linear`) channels before compression and after
+// decompression. Same as OpenEXR's b44ExpLogTable.h.
+struct B44ExpLogTables {
+  unsigned short exp_table[65536];
+  unsigned short log_table[65536];
+
+  B44ExpLogTables() {
+    const float kHalfMax = 65504.0f;
+    for (unsigned int i = 0; i < 65536; i++) {
+      FP16 h;
+      h.u = static_cast<unsigned short>(i);
+      float f = half_to_float(h).f;
+      bool finite = (i & 0x7c00) != 0x7c00;
+
+      float e = 0.0f;
+      if (!finite) {
+        e = 0.0f;
+      } else if (f >= 8.0f * std::log(kHalfMax)) {
+        e = kHalfMax;
+      } else {
+        e = std::exp(f / 8.0f);
+      }
+      exp_table[i] = FloatToHalfRne(e);
 
-  ZFPCompressionParam() {
-    type = TINYEXR_ZFP_COMPRESSIONTYPE_RATE;
-    rate = 2.0;
-    precision = 0;
-    tolerance = 0.0;
+      float l = 0.0f;
+      if (finite && !(f < 0.0f)) {
+        l = 8.0f * std::log(f);
+      }
+      log_table[i] = FloatToHalfRne(l);
+    }
   }
 };
 
-static bool FindZFPCompressionParam(ZFPCompressionParam *param,
-                                    const EXRAttribute *attributes,
-                                    int num_attributes, std::string *err) {
-  bool foundType = false;
+static const B44ExpLogTables &GetB44ExpLogTables() {
+  // Intentionally leaked. Built on first use(512KB).
+  static const B44ExpLogTables *tables = new B44ExpLogTables();
+  return *tables;
+}
 
-  for (int i = 0; i < num_attributes; i++) {
-    if ((strcmp(attributes[i].name, "zfpCompressionType") == 0)) {
-      if (attributes[i].size == 1) {
-        param->type = static_cast<int>(attributes[i].value[0]);
-        foundType = true;
-        break;
-      } else {
-        if (err) {
-          (*err) +=
-              "zfpCompressionType attribute must be uchar(1 byte) type.\n";
-        }
-        return false;
-      }
-    }
-  }
+static int b44ShiftAndRound(int x, int shift) {
+  //
+  // Compute
+  //
+  //     y = x * pow (2, -shift),
+  //
+  // then round y to the nearest integer.
+  // In case of a tie, where y is exactly
+  // halfway between two integers, round
+  // to the even one.
+  //
 
-  if (!foundType) {
-    if (err) {
-      (*err) += "`zfpCompressionType` attribute not found.\n";
-    }
-    return false;
+  x <<= 1;
+  int a = (1 << shift) - 1;
+  shift += 1;
+  int b = (x >> shift) & 1;
+  return (x + a + b) >> shift;
+}
+
+//
+// Pack a block of 4 by 4 16-bit pixels (32 bytes) into
+// either 14 or 3 bytes.
+//
+static int b44Pack(const unsigned short s[16], unsigned char b[14],
+                   bool optFlatFields, bool exactMax) {
+  int d[16];
+  int r[15];
+  int rMin;
+  int rMax;
+
+  const int bias = 0x20;
+
+  //
+  // Convert s[0] through s[15] from sign-magnitude to 2's complement
+  // representation(with the sign bit flipped), so that their order matches
+  // the order of the half values. Inf and NaN are mapped to 0x8000.
+  //
+
+  unsigned short t[16];
+
+  for (int i = 0; i < 16; ++i) {
+    if ((s[i] & 0x7c00) == 0x7c00)
+      t[i] = 0x8000;
+    else if (s[i] & 0x8000)
+      t[i] = static_cast<unsigned short>(~s[i]);
+    else
+      t[i] = static_cast<unsigned short>(s[i] | 0x8000);
   }
 
-  if (param->type == TINYEXR_ZFP_COMPRESSIONTYPE_RATE) {
-    for (int i = 0; i < num_attributes; i++) {
-      if ((strcmp(attributes[i].name, "zfpCompressionRate") == 0) &&
-          (attributes[i].size == 8)) {
-        param->rate = *(reinterpret_cast<double *>(attributes[i].value));
-        return true;
-      }
-    }
+  //
+  // Find the maximum, tMax, of t[0] ... t[15].
+  //
 
-    if (err) {
-      (*err) += "`zfpCompressionRate` attribute not found.\n";
-    }
+  unsigned short tMax = 0;
 
-  } else if (param->type == TINYEXR_ZFP_COMPRESSIONTYPE_PRECISION) {
-    for (int i = 0; i < num_attributes; i++) {
-      if ((strcmp(attributes[i].name, "zfpCompressionPrecision") == 0) &&
-          (attributes[i].size == 4)) {
-        param->rate = *(reinterpret_cast<int *>(attributes[i].value));
-        return true;
-      }
-    }
+  for (int i = 0; i < 16; ++i)
+    if (tMax < t[i]) tMax = t[i];
 
-    if (err) {
-      (*err) += "`zfpCompressionPrecision` attribute not found.\n";
-    }
+  //
+  // Compute a set of running differences, r[0] ... r[14]:
+  // Find a shift value such that after rounding off the
+  // rightmost bits and shifting all differences are between
+  // -32 and +31.  Then bias the differences so that they
+  // end up between 0 and 63.
+  //
 
-  } else if (param->type == TINYEXR_ZFP_COMPRESSIONTYPE_ACCURACY) {
-    for (int i = 0; i < num_attributes; i++) {
-      if ((strcmp(attributes[i].name, "zfpCompressionTolerance") == 0) &&
-          (attributes[i].size == 8)) {
-        param->tolerance = *(reinterpret_cast<double *>(attributes[i].value));
-        return true;
-      }
-    }
+  int shift = -1;
 
-    if (err) {
-      (*err) += "`zfpCompressionTolerance` attribute not found.\n";
-    }
-  } else {
-    if (err) {
-      (*err) += "Unknown value specified for `zfpCompressionType`.\n";
-    }
-  }
+  do {
+    shift += 1;
 
-  return false;
-}
+    //
+    // Compute absolute differences, d[0] ... d[15],
+    // between tMax and t[0] ... t[15].
+    //
+    // Shift and round the absolute differences.
+    //
 
-// Assume pixel format is FLOAT for all channels.
-static bool DecompressZfp(float *dst, int dst_width, int dst_num_lines,
-                          size_t num_channels, const unsigned char *src,
-                          unsigned long src_size,
-                          const ZFPCompressionParam &param) {
-  size_t uncompressed_size =
-      size_t(dst_width) * size_t(dst_num_lines) * num_channels;
+    for (int i = 0; i < 16; ++i) d[i] = b44ShiftAndRound(tMax - t[i], shift);
 
-  if (uncompressed_size == src_size) {
-    // Data is not compressed(Issue 40).
-    memcpy(dst, src, src_size);
-  }
+    //
+    // Convert d[0] .. d[15] into running differences
+    //
 
-  zfp_stream *zfp = NULL;
-  zfp_field *field = NULL;
+    r[0] = d[0] - d[4] + bias;
+    r[1] = d[4] - d[8] + bias;
+    r[2] = d[8] - d[12] + bias;
 
-  TINYEXR_CHECK_AND_RETURN_C((dst_width % 4) == 0, false);
-  TINYEXR_CHECK_AND_RETURN_C((dst_num_lines % 4) == 0, false);
+    r[3] = d[0] - d[1] + bias;
+    r[4] = d[4] - d[5] + bias;
+    r[5] = d[8] - d[9] + bias;
+    r[6] = d[12] - d[13] + bias;
 
-  if ((size_t(dst_width) & 3U) || (size_t(dst_num_lines) & 3U)) {
-    return false;
+    r[7] = d[1] - d[2] + bias;
+    r[8] = d[5] - d[6] + bias;
+    r[9] = d[9] - d[10] + bias;
+    r[10] = d[13] - d[14] + bias;
+
+    r[11] = d[2] - d[3] + bias;
+    r[12] = d[6] - d[7] + bias;
+    r[13] = d[10] - d[11] + bias;
+    r[14] = d[14] - d[15] + bias;
+
+    rMin = r[0];
+    rMax = r[0];
+
+    for (int i = 1; i < 15; ++i) {
+      if (rMin > r[i]) rMin = r[i];
+
+      if (rMax < r[i]) rMax = r[i];
+    }
+  } while (rMin < 0 || rMax > 0x3f);
+
+  if (rMin == bias && rMax == bias && optFlatFields) {
+    //
+    // Special case - all pixels have the same value.
+    // We encode this in 3 instead of 14 bytes by
+    // storing the value 0xfc in the third output byte,
+    // which cannot occur in the 14-byte encoding.
+    //
+
+    b[0] = static_cast<unsigned char>(t[0] >> 8);
+    b[1] = static_cast<unsigned char>(t[0]);
+    b[2] = 0xfc;
+
+    return 3;
   }
 
-  field =
-      zfp_field_2d(reinterpret_cast<void *>(const_cast<unsigned char *>(src)),
-                   zfp_type_float, static_cast<unsigned int>(dst_width),
-                   static_cast<unsigned int>(dst_num_lines) *
-                       static_cast<unsigned int>(num_channels));
-  zfp = zfp_stream_open(NULL);
+  if (exactMax) {
+    //
+    // Adjust t[0] so that the pixel whose value is equal
+    // to tMax gets represented as accurately as possible.
+    //
 
-  if (param.type == TINYEXR_ZFP_COMPRESSIONTYPE_RATE) {
-    zfp_stream_set_rate(zfp, param.rate, zfp_type_float, /* dimension */ 2,
-                        /* write random access */ 0);
-  } else if (param.type == TINYEXR_ZFP_COMPRESSIONTYPE_PRECISION) {
-    zfp_stream_set_precision(zfp, param.precision);
-  } else if (param.type == TINYEXR_ZFP_COMPRESSIONTYPE_ACCURACY) {
-    zfp_stream_set_accuracy(zfp, param.tolerance);
-  } else {
-    return false;
+    t[0] = static_cast<unsigned short>(tMax - (d[0] << shift));
   }
 
-  size_t buf_size = zfp_stream_maximum_size(zfp, field);
-  std::vector<unsigned char> buf(buf_size);
-  memcpy(&buf.at(0), src, src_size);
+  //
+  // Pack t[0], shift and r[0] ... r[14] into 14 bytes:
+  //
 
-  bitstream *stream = stream_open(&buf.at(0), buf_size);
-  zfp_stream_set_bit_stream(zfp, stream);
-  zfp_stream_rewind(zfp);
+  b[0] = static_cast<unsigned char>(t[0] >> 8);
+  b[1] = static_cast<unsigned char>(t[0]);
 
-  size_t image_size = size_t(dst_width) * size_t(dst_num_lines);
+  b[2] = static_cast<unsigned char>((shift << 2) | (r[0] >> 4));
+  b[3] = static_cast<unsigned char>((r[0] << 4) | (r[1] >> 2));
+  b[4] = static_cast<unsigned char>((r[1] << 6) | r[2]);
 
-  for (size_t c = 0; c < size_t(num_channels); c++) {
-    // decompress 4x4 pixel block.
-    for (size_t y = 0; y < size_t(dst_num_lines); y += 4) {
-      for (size_t x = 0; x < size_t(dst_width); x += 4) {
-        float fblock[16];
-        zfp_decode_block_float_2(zfp, fblock);
-        for (size_t j = 0; j < 4; j++) {
-          for (size_t i = 0; i < 4; i++) {
-            dst[c * image_size + ((y + j) * size_t(dst_width) + (x + i))] =
-                fblock[j * 4 + i];
-          }
-        }
-      }
-    }
-  }
+  b[5] = static_cast<unsigned char>((r[3] << 2) | (r[4] >> 4));
+  b[6] = static_cast<unsigned char>((r[4] << 4) | (r[5] >> 2));
+  b[7] = static_cast<unsigned char>((r[5] << 6) | r[6]);
 
-  zfp_field_free(field);
-  zfp_stream_close(zfp);
-  stream_close(stream);
+  b[8] = static_cast<unsigned char>((r[7] << 2) | (r[8] >> 4));
+  b[9] = static_cast<unsigned char>((r[8] << 4) | (r[9] >> 2));
+  b[10] = static_cast<unsigned char>((r[9] << 6) | r[10]);
 
-  return true;
-}
+  b[11] = static_cast<unsigned char>((r[11] << 2) | (r[12] >> 4));
+  b[12] = static_cast<unsigned char>((r[12] << 4) | (r[13] >> 2));
+  b[13] = static_cast<unsigned char>((r[13] << 6) | r[14]);
 
-// Assume pixel format is FLOAT for all channels.
-static bool CompressZfp(std::vector<unsigned char> *outBuf,
-                        unsigned int *outSize, const float *inPtr, int width,
-                        int num_lines, int num_channels,
-                        const ZFPCompressionParam &param) {
-  zfp_stream *zfp = NULL;
-  zfp_field *field = NULL;
+  return 14;
+}
 
-  TINYEXR_CHECK_AND_RETURN_C((width % 4) == 0, false);
-  TINYEXR_CHECK_AND_RETURN_C((num_lines % 4) == 0, false);
+// Converts a value decoded by b44Unpack14/b44Unpack3 back to the half
+// representation.
+static inline unsigned short b44ToHalf(unsigned int t) {
+  return static_cast<unsigned short>((t & 0x8000) ? (t & 0x7fff) : ~t);
+}
 
-  if ((size_t(width) & 3U) || (size_t(num_lines) & 3U)) {
-    return false;
+//
+// Unpack a 14-byte block into 4 by 4 16-bit pixels.
+//
+static void b44Unpack14(const unsigned char b[14], unsigned short s[16]) {
+  s[0] = static_cast<unsigned short>((b[0] << 8) | b[1]);
+
+  unsigned int shift = (b[2] >> 2);
+  unsigned int bias = (0x20u << shift);
+
+#define TINYEXR_B44_DELTA(r) ((static_cast<unsigned int>(r) << shift) - bias)
+  s[4] = static_cast<unsigned short>(
+      s[0] + TINYEXR_B44_DELTA(((b[2] << 4) | (b[3] >> 4)) & 0x3f));
+  s[8] = static_cast<unsigned short>(
+      s[4] + TINYEXR_B44_DELTA(((b[3] << 2) | (b[4] >> 6)) & 0x3f));
+  s[12] = static_cast<unsigned short>(s[8] + TINYEXR_B44_DELTA(b[4] & 0x3f));
+
+  s[1] = static_cast<unsigned short>(s[0] + TINYEXR_B44_DELTA(b[5] >> 2));
+  s[5] = static_cast<unsigned short>(
+      s[4] + TINYEXR_B44_DELTA(((b[5] << 4) | (b[6] >> 4)) & 0x3f));
+  s[9] = static_cast<unsigned short>(
+      s[8] + TINYEXR_B44_DELTA(((b[6] << 2) | (b[7] >> 6)) & 0x3f));
+  s[13] = static_cast<unsigned short>(s[12] + TINYEXR_B44_DELTA(b[7] & 0x3f));
+
+  s[2] = static_cast<unsigned short>(s[1] + TINYEXR_B44_DELTA(b[8] >> 2));
+  s[6] = static_cast<unsigned short>(
+      s[5] + TINYEXR_B44_DELTA(((b[8] << 4) | (b[9] >> 4)) & 0x3f));
+  s[10] = static_cast<unsigned short>(
+      s[9] + TINYEXR_B44_DELTA(((b[9] << 2) | (b[10] >> 6)) & 0x3f));
+  s[14] = static_cast<unsigned short>(s[13] + TINYEXR_B44_DELTA(b[10] & 0x3f));
+
+  s[3] = static_cast<unsigned short>(s[2] + TINYEXR_B44_DELTA(b[11] >> 2));
+  s[7] = static_cast<unsigned short>(
+      s[6] + TINYEXR_B44_DELTA(((b[11] << 4) | (b[12] >> 4)) & 0x3f));
+  s[11] = static_cast<unsigned short>(
+      s[10] + TINYEXR_B44_DELTA(((b[12] << 2) | (b[13] >> 6)) & 0x3f));
+  s[15] = static_cast<unsigned short>(s[14] + TINYEXR_B44_DELTA(b[13] & 0x3f));
+#undef TINYEXR_B44_DELTA
+
+  for (int i = 0; i < 16; ++i) {
+    s[i] = b44ToHalf(s[i]);
   }
+}
 
-  // create input array.
-  field = zfp_field_2d(reinterpret_cast<void *>(const_cast<float *>(inPtr)),
-                       zfp_type_float, static_cast<unsigned int>(width),
-                       static_cast<unsigned int>(num_lines * num_channels));
+//
+// Unpack a 3-byte block into 4 by 4 identical 16-bit pixels.
+//
+static void b44Unpack3(const unsigned char b[3], unsigned short s[16]) {
+  s[0] = b44ToHalf(static_cast<unsigned int>((b[0] << 8) | b[1]));
 
-  zfp = zfp_stream_open(NULL);
+  for (int i = 1; i < 16; ++i) s[i] = s[0];
+}
 
-  if (param.type == TINYEXR_ZFP_COMPRESSIONTYPE_RATE) {
-    zfp_stream_set_rate(zfp, param.rate, zfp_type_float, 2, 0);
-  } else if (param.type == TINYEXR_ZFP_COMPRESSIONTYPE_PRECISION) {
-    zfp_stream_set_precision(zfp, param.precision);
-  } else if (param.type == TINYEXR_ZFP_COMPRESSIONTYPE_ACCURACY) {
-    zfp_stream_set_accuracy(zfp, param.tolerance);
-  } else {
-    return false;
-  }
+// A 3-byte block(B44A) has 0xfc(>= 13 << 2) in the third byte, which cannot
+// occur in the 14-byte encoding.
+static inline bool b44IsFlatBlock(const unsigned char *b) {
+  return b[2] >= (13 << 2);
+}
 
-  size_t buf_size = zfp_stream_maximum_size(zfp, field);
+#if TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+// Unpacks 8 blocks at once, one block per 16-bit lane. `bytes[k]` holds the
+// k-th byte of each block(a 3-byte block must be expanded to the equivalent
+// 14-byte block beforehand) and `mults[i]` holds 1 << shift of each block.
+// Row `r`(0 ~ 3) of the blocks is stored to `rows[r]`(8 x 4 values).
+// Same result as `b44Unpack14`.
+#if TINYEXR_SIMD_SSE2
+typedef __m128i B44Vec;
+#define TINYEXR_B44_LOAD(p) _mm_loadu_si128(reinterpret_cast<const __m128i *>(p))
+#define TINYEXR_B44_SET1(x) _mm_set1_epi16(static_cast<short>(x))
+#define TINYEXR_B44_ADD(a, b) _mm_add_epi16(a, b)
+#define TINYEXR_B44_SUB(a, b) _mm_sub_epi16(a, b)
+#define TINYEXR_B44_MUL(a, b) _mm_mullo_epi16(a, b)
+#define TINYEXR_B44_AND(a, b) _mm_and_si128(a, b)
+#define TINYEXR_B44_OR(a, b) _mm_or_si128(a, b)
+#define TINYEXR_B44_XOR(a, b) _mm_xor_si128(a, b)
+#define TINYEXR_B44_SHL(a, n) _mm_slli_epi16(a, n)
+#define TINYEXR_B44_SHR(a, n) _mm_srli_epi16(a, n)
+#define TINYEXR_B44_SAR(a, n) _mm_srai_epi16(a, n)
+#else
+typedef uint16x8_t B44Vec;
+#define TINYEXR_B44_LOAD(p) vld1q_u16(p)
+#define TINYEXR_B44_SET1(x) vdupq_n_u16(static_cast<uint16_t>(x))
+#define TINYEXR_B44_ADD(a, b) vaddq_u16(a, b)
+#define TINYEXR_B44_SUB(a, b) vsubq_u16(a, b)
+#define TINYEXR_B44_MUL(a, b) vmulq_u16(a, b)
+#define TINYEXR_B44_AND(a, b) vandq_u16(a, b)
+#define TINYEXR_B44_OR(a, b) vorrq_u16(a, b)
+#define TINYEXR_B44_XOR(a, b) veorq_u16(a, b)
+#define TINYEXR_B44_SHL(a, n) vshlq_n_u16(a, n)
+#define TINYEXR_B44_SHR(a, n) vshrq_n_u16(a, n)
+#define TINYEXR_B44_SAR(a, n) \
+  vreinterpretq_u16_s16(vshrq_n_s16(vreinterpretq_s16_u16(a), n))
+#endif
 
-  outBuf->resize(buf_size);
+// Stores row (v0[i], v1[i], v2[i], v3[i]) of block i(0 ~ 7) to dst[4 * i].
+static inline void b44StoreRow(unsigned short *dst, B44Vec v0, B44Vec v1,
+                               B44Vec v2, B44Vec v3) {
+#if TINYEXR_SIMD_SSE2
+  __m128i lo01 = _mm_unpacklo_epi16(v0, v1);
+  __m128i lo23 = _mm_unpacklo_epi16(v2, v3);
+  __m128i hi01 = _mm_unpackhi_epi16(v0, v1);
+  __m128i hi23 = _mm_unpackhi_epi16(v2, v3);
+  __m128i *p = reinterpret_cast<__m128i *>(dst);
+  _mm_storeu_si128(p + 0, _mm_unpacklo_epi32(lo01, lo23));
+  _mm_storeu_si128(p + 1, _mm_unpackhi_epi32(lo01, lo23));
+  _mm_storeu_si128(p + 2, _mm_unpacklo_epi32(hi01, hi23));
+  _mm_storeu_si128(p + 3, _mm_unpackhi_epi32(hi01, hi23));
+#else
+  uint16x8x4_t rows;
+  rows.val[0] = v0;
+  rows.val[1] = v1;
+  rows.val[2] = v2;
+  rows.val[3] = v3;
+  vst4q_u16(dst, rows);
+#endif
+}
 
-  bitstream *stream = stream_open(&outBuf->at(0), buf_size);
-  zfp_stream_set_bit_stream(zfp, stream);
-  zfp_field_free(field);
+static void b44Unpack14x8(const unsigned short bytes[14][8],
+                          const unsigned short mults[8],
+                          unsigned short *rows[4]) {
+  B44Vec b[14];
+  for (int k = 0; k < 14; k++) {
+    b[k] = TINYEXR_B44_LOAD(bytes[k]);
+  }
+  const B44Vec mask = TINYEXR_B44_SET1(0x3f);
+  const B44Vec mult = TINYEXR_B44_LOAD(mults);
+  const B44Vec bias = TINYEXR_B44_MUL(mult, TINYEXR_B44_SET1(0x20));
+
+#define TINYEXR_B44_FIELD(hi, lo, lshift, rshift)                    \
+  TINYEXR_B44_AND(TINYEXR_B44_OR(TINYEXR_B44_SHL(b[hi], lshift),    \
+                                 TINYEXR_B44_SHR(b[lo], rshift)),   \
+                  mask)
+#define TINYEXR_B44_DELTA(r) TINYEXR_B44_SUB(TINYEXR_B44_MUL(r, mult), bias)
+
+  B44Vec s[16];
+  s[0] = TINYEXR_B44_OR(TINYEXR_B44_SHL(b[0], 8), b[1]);
+  s[4] = TINYEXR_B44_ADD(s[0], TINYEXR_B44_DELTA(TINYEXR_B44_FIELD(2, 3, 4, 4)));
+  s[8] = TINYEXR_B44_ADD(s[4], TINYEXR_B44_DELTA(TINYEXR_B44_FIELD(3, 4, 2, 6)));
+  s[12] = TINYEXR_B44_ADD(
+      s[8], TINYEXR_B44_DELTA(TINYEXR_B44_AND(b[4], mask)));
+
+  // Rows. Field layout is the same for the columns 1, 2 and 3.
+  for (int c = 1; c < 4; c++) {
+    const int k = 5 + 3 * (c - 1);
+    s[c] = TINYEXR_B44_ADD(s[c - 1],
+                           TINYEXR_B44_DELTA(TINYEXR_B44_SHR(b[k], 2)));
+    s[4 + c] = TINYEXR_B44_ADD(
+        s[4 + c - 1], TINYEXR_B44_DELTA(TINYEXR_B44_FIELD(k, k + 1, 4, 4)));
+    s[8 + c] = TINYEXR_B44_ADD(
+        s[8 + c - 1],
+        TINYEXR_B44_DELTA(TINYEXR_B44_FIELD(k + 1, k + 2, 2, 6)));
+    s[12 + c] = TINYEXR_B44_ADD(
+        s[12 + c - 1], TINYEXR_B44_DELTA(TINYEXR_B44_AND(b[k + 2], mask)));
+  }
+#undef TINYEXR_B44_FIELD
+#undef TINYEXR_B44_DELTA
+
+  // b44ToHalf: t ^ 0x8000 if the top bit is set, ~t otherwise.
+  const B44Vec ones = TINYEXR_B44_SET1(0xffff);
+  const B44Vec top = TINYEXR_B44_SET1(0x8000);
+  for (int i = 0; i < 16; i++) {
+    B44Vec m = TINYEXR_B44_SAR(s[i], 15);
+    s[i] = TINYEXR_B44_XOR(s[i], TINYEXR_B44_OR(TINYEXR_B44_XOR(m, ones), top));
+  }
+
+  for (int r = 0; r < 4; r++) {
+    b44StoreRow(rows[r], s[4 * r + 0], s[4 * r + 1], s[4 * r + 2],
+                s[4 * r + 3]);
+  }
+}
 
-  size_t image_size = size_t(width) * size_t(num_lines);
+#undef TINYEXR_B44_LOAD
+#undef TINYEXR_B44_SET1
+#undef TINYEXR_B44_ADD
+#undef TINYEXR_B44_SUB
+#undef TINYEXR_B44_MUL
+#undef TINYEXR_B44_AND
+#undef TINYEXR_B44_OR
+#undef TINYEXR_B44_XOR
+#undef TINYEXR_B44_SHL
+#undef TINYEXR_B44_SHR
+#undef TINYEXR_B44_SAR
+#endif  // TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+
+static inline size_t B44PixelTypeSize(int pixel_type) {
+  return (pixel_type == TINYEXR_PIXELTYPE_HALF) ? 2 : 4;
+}
 
-  for (size_t c = 0; c < size_t(num_channels); c++) {
-    // compress 4x4 pixel block.
-    for (size_t y = 0; y < size_t(num_lines); y += 4) {
-      for (size_t x = 0; x < size_t(width); x += 4) {
-        float fblock[16];
-        for (size_t j = 0; j < 4; j++) {
-          for (size_t i = 0; i < 4; i++) {
-            fblock[j * 4 + i] =
-                inPtr[c * image_size + ((y + j) * size_t(width) + (x + i))];
-          }
-        }
-        zfp_encode_block_float_2(zfp, fblock);
-      }
+// Upper bound of the compressed size of a chunk.
+static size_t B44CompressBound(int width, int num_lines,
+                               const std::vector<ChannelInfo> &channels) {
+  size_t num_blocks = static_cast<size_t>((width + 3) / 4) *
+                      static_cast<size_t>((num_lines + 3) / 4);
+  size_t bound = 0;
+  for (size_t c = 0; c < channels.size(); c++) {
+    if (channels[c].requested_pixel_type == TINYEXR_PIXELTYPE_HALF) {
+      bound += num_blocks * 14;
+    } else {
+      bound += static_cast<size_t>(width) * static_cast<size_t>(num_lines) *
+               B44PixelTypeSize(channels[c].requested_pixel_type);
     }
   }
-
-  zfp_stream_flush(zfp);
-  (*outSize) = static_cast<unsigned int>(zfp_stream_compressed_size(zfp));
-
-  zfp_stream_close(zfp);
-
-  return true;
+  return bound;
 }
 
-#endif
-
-//
-// -----------------------------------------------------------------
-//
+// Compresses `src`(a chunk of `width` x `num_lines` pixels, in the layout of
+// the EXR file) into `dst`(at least `B44CompressBound` bytes).
+// `flat_fields` enables 3-byte blocks(B44A).
+// Returns the compressed size.
+static size_t CompressB44(unsigned char *dst, const unsigned char *src,
+                          int width, int num_lines,
+                          const std::vector<ChannelInfo> &channels,
+                          bool flat_fields) {
+  const size_t w = static_cast<size_t>(width);
+  const size_t h = static_cast<size_t>(num_lines);
+
+  size_t line_size = 0;
+  for (size_t c = 0; c < channels.size(); c++) {
+    line_size += w * B44PixelTypeSize(channels[c].requested_pixel_type);
+  }
 
-// heuristics
-#define TINYEXR_DIMENSION_THRESHOLD (1024 * 8192)
+  unsigned char *out = dst;
+  size_t channel_offset = 0;
+  for (size_t c = 0; c < channels.size(); c++) {
+    const size_t type_size =
+        B44PixelTypeSize(channels[c].requested_pixel_type);
 
-// TODO(syoyo): Refactor function arguments.
-static bool DecodePixelData(/* out */ unsigned char **out_images,
-                            const int *requested_pixel_types,
-                            const unsigned char *data_ptr, size_t data_len,
-                            int compression_type, int line_order, int width,
-                            int height, int x_stride, int y, int line_no,
-                            int num_lines, size_t pixel_data_size,
-                            size_t num_attributes,
-                            const EXRAttribute *attributes, size_t num_channels,
-                            const EXRChannelInfo *channels,
-                            const std::vector<size_t> &channel_offset_list) {
-  if (compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {  // PIZ
-#if TINYEXR_USE_PIZ
-    if ((width == 0) || (num_lines == 0) || (pixel_data_size == 0)) {
-      // Invalid input #90
-      return false;
+    if (channels[c].requested_pixel_type != TINYEXR_PIXELTYPE_HALF) {
+      for (size_t y = 0; y < h; y++) {
+        memcpy(out, src + y * line_size + channel_offset, w * type_size);
+        out += w * type_size;
+      }
+      channel_offset += w * type_size;
+      continue;
     }
 
-    // Allocate original data size.
-    std::vector<unsigned char> outBuf(static_cast<size_t>(
-        static_cast<size_t>(width * num_lines) * pixel_data_size));
-    size_t tmpBufLen = outBuf.size();
-
-    bool ret = tinyexr::DecompressPiz(
-        reinterpret_cast<unsigned char *>(&outBuf.at(0)), data_ptr, tmpBufLen,
-        data_len, static_cast<int>(num_channels), channels, width, num_lines);
+    const bool p_linear = channels[c].p_linear != 0;
+    const unsigned short *exp_table =
+        p_linear ? GetB44ExpLogTables().exp_table : NULL;
 
-    if (!ret) {
-      return false;
-    }
+    for (size_t y = 0; y < h; y += 4) {
+      // Rows past the bottom repeat the last row.
+      const unsigned char *rows[4];
+      for (size_t r = 0; r < 4; r++) {
+        size_t ry = (std::min)(y + r, h - 1);
+        rows[r] = src + ry * line_size + channel_offset;
+      }
 
-    // For PIZ_COMPRESSION:
-    //   pixel sample data for channel 0 for scanline 0
-    //   pixel sample data for channel 1 for scanline 0
-    //   pixel sample data for channel ... for scanline 0
-    //   pixel sample data for channel n for scanline 0
-    //   pixel sample data for channel 0 for scanline 1
-    //   pixel sample data for channel 1 for scanline 1
-    //   pixel sample data for channel ... for scanline 1
-    //   pixel sample data for channel n for scanline 1
-    //   ...
-    for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
-      if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
-        for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
-          const unsigned short *line_ptr = reinterpret_cast<unsigned short *>(
-              &outBuf.at(v * pixel_data_size * static_cast<size_t>(width) +
-                         channel_offset_list[c] * static_cast<size_t>(width)));
-          for (size_t u = 0; u < static_cast<size_t>(width); u++) {
-            FP16 hf;
-
-            // hf.u = line_ptr[u];
-            // use `cpy` to avoid unaligned memory access when compiler's
-            // optimization is on.
-            tinyexr::cpy2(&(hf.u), line_ptr + u);
-
-            tinyexr::swap2(reinterpret_cast<unsigned short *>(&hf.u));
-
-            if (requested_pixel_types[c] == TINYEXR_PIXELTYPE_HALF) {
-              unsigned short *image =
-                  reinterpret_cast<unsigned short **>(out_images)[c];
-              if (line_order == 0) {
-                image += (static_cast<size_t>(line_no) + v) *
-                             static_cast<size_t>(x_stride) +
-                         u;
-              } else {
-                image += static_cast<size_t>(
-                             (height - 1 - (line_no + static_cast<int>(v)))) *
-                             static_cast<size_t>(x_stride) +
-                         u;
-              }
-              *image = hf.u;
-            } else {  // HALF -> FLOAT
-              FP32 f32 = half_to_float(hf);
-              float *image = reinterpret_cast<float **>(out_images)[c];
-              size_t offset = 0;
-              if (line_order == 0) {
-                offset = (static_cast<size_t>(line_no) + v) *
-                             static_cast<size_t>(x_stride) +
-                         u;
-              } else {
-                offset = static_cast<size_t>(
-                             (height - 1 - (line_no + static_cast<int>(v)))) *
-                             static_cast<size_t>(x_stride) +
-                         u;
-              }
-              image += offset;
-              *image = f32.f;
-            }
-          }
-        }
-      } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_UINT) {
-        TINYEXR_CHECK_AND_RETURN_C(requested_pixel_types[c] == TINYEXR_PIXELTYPE_UINT, false);
-
-        for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
-          const unsigned int *line_ptr = reinterpret_cast<unsigned int *>(
-              &outBuf.at(v * pixel_data_size * static_cast<size_t>(width) +
-                         channel_offset_list[c] * static_cast<size_t>(width)));
-          for (size_t u = 0; u < static_cast<size_t>(width); u++) {
-            unsigned int val;
-            // val = line_ptr[u];
-            tinyexr::cpy4(&val, line_ptr + u);
-
-            tinyexr::swap4(&val);
-
-            unsigned int *image =
-                reinterpret_cast<unsigned int **>(out_images)[c];
-            if (line_order == 0) {
-              image += (static_cast<size_t>(line_no) + v) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            } else {
-              image += static_cast<size_t>(
-                           (height - 1 - (line_no + static_cast<int>(v)))) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            }
-            *image = val;
+      for (size_t x = 0; x < w; x += 4) {
+        unsigned short s[16];
+        for (size_t r = 0; r < 4; r++) {
+          for (size_t i = 0; i < 4; i++) {
+            // Columns past the right edge repeat the last column.
+            size_t rx = (std::min)(x + i, w - 1);
+            const unsigned char *p = rows[r] + 2 * rx;
+            s[4 * r + i] = static_cast<unsigned short>(p[0] | (p[1] << 8));
           }
         }
-      } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
-        TINYEXR_CHECK_AND_RETURN_C(requested_pixel_types[c] == TINYEXR_PIXELTYPE_FLOAT, false);
-        for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
-          const float *line_ptr = reinterpret_cast<float *>(&outBuf.at(
-              v * pixel_data_size * static_cast<size_t>(width) +
-              channel_offset_list[c] * static_cast<size_t>(width)));
-          for (size_t u = 0; u < static_cast<size_t>(width); u++) {
-            float val;
-            // val = line_ptr[u];
-            tinyexr::cpy4(&val, line_ptr + u);
-
-            tinyexr::swap4(reinterpret_cast<unsigned int *>(&val));
-
-            float *image = reinterpret_cast<float **>(out_images)[c];
-            if (line_order == 0) {
-              image += (static_cast<size_t>(line_no) + v) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            } else {
-              image += static_cast<size_t>(
-                           (height - 1 - (line_no + static_cast<int>(v)))) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            }
-            *image = val;
+
+        if (exp_table) {
+          for (int i = 0; i < 16; i++) {
+            s[i] = exp_table[s[i]];
           }
         }
-      } else {
-        return false;
+
+        out += b44Pack(s, out, flat_fields, !p_linear);
       }
     }
-#else
-    return false;
-#endif
 
-  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_ZIPS ||
-             compression_type == TINYEXR_COMPRESSIONTYPE_ZIP) {
-    // Allocate original data size.
-    std::vector<unsigned char> outBuf(static_cast<size_t>(width) *
-                                      static_cast<size_t>(num_lines) *
-                                      pixel_data_size);
+    channel_offset += w * type_size;
+  }
 
-    unsigned long dstLen = static_cast<unsigned long>(outBuf.size());
-    TINYEXR_CHECK_AND_RETURN_C(dstLen > 0, false);
-    if (!tinyexr::DecompressZip(
-            reinterpret_cast<unsigned char *>(&outBuf.at(0)), &dstLen, data_ptr,
-            static_cast<unsigned long>(data_len))) {
-      return false;
-    }
+  return static_cast<size_t>(out - dst);
+}
 
-    // For ZIP_COMPRESSION:
-    //   pixel sample data for channel 0 for scanline 0
-    //   pixel sample data for channel 1 for scanline 0
-    //   pixel sample data for channel ... for scanline 0
-    //   pixel sample data for channel n for scanline 0
-    //   pixel sample data for channel 0 for scanline 1
-    //   pixel sample data for channel 1 for scanline 1
-    //   pixel sample data for channel ... for scanline 1
-    //   pixel sample data for channel n for scanline 1
-    //   ...
-    for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
-      if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
-        for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
-          const unsigned short *line_ptr = reinterpret_cast<unsigned short *>(
-              &outBuf.at(v * static_cast<size_t>(pixel_data_size) *
-                             static_cast<size_t>(width) +
-                         channel_offset_list[c] * static_cast<size_t>(width)));
-          for (size_t u = 0; u < static_cast<size_t>(width); u++) {
-            tinyexr::FP16 hf;
-
-            // hf.u = line_ptr[u];
-            tinyexr::cpy2(&(hf.u), line_ptr + u);
-
-            tinyexr::swap2(reinterpret_cast<unsigned short *>(&hf.u));
-
-            if (requested_pixel_types[c] == TINYEXR_PIXELTYPE_HALF) {
-              unsigned short *image =
-                  reinterpret_cast<unsigned short **>(out_images)[c];
-              if (line_order == 0) {
-                image += (static_cast<size_t>(line_no) + v) *
-                             static_cast<size_t>(x_stride) +
-                         u;
-              } else {
-                image += (static_cast<size_t>(height) - 1U -
-                          (static_cast<size_t>(line_no) + v)) *
-                             static_cast<size_t>(x_stride) +
-                         u;
-              }
-              *image = hf.u;
-            } else {  // HALF -> FLOAT
-              tinyexr::FP32 f32 = half_to_float(hf);
-              float *image = reinterpret_cast<float **>(out_images)[c];
-              size_t offset = 0;
-              if (line_order == 0) {
-                offset = (static_cast<size_t>(line_no) + v) *
-                             static_cast<size_t>(x_stride) +
-                         u;
-              } else {
-                offset = (static_cast<size_t>(height) - 1U -
-                          (static_cast<size_t>(line_no) + v)) *
-                             static_cast<size_t>(x_stride) +
-                         u;
-              }
-              image += offset;
+// Decompresses B44/B44A data `src` into `dst`(a chunk of `width` x
+// `num_lines` pixels, in the layout of the EXR file).
+static bool DecompressB44(unsigned char *dst, size_t dst_size,
+                          const unsigned char *src, size_t src_size,
+                          int width, int num_lines, size_t num_channels,
+                          const EXRChannelInfo *channels) {
+  if ((width <= 0) || (num_lines <= 0)) {
+    return false;
+  }
+  const size_t w = static_cast<size_t>(width);
+  const size_t h = static_cast<size_t>(num_lines);
 
-              *image = f32.f;
-            }
-          }
-        }
-      } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_UINT) {
-        TINYEXR_CHECK_AND_RETURN_C(requested_pixel_types[c] == TINYEXR_PIXELTYPE_UINT, false);
-
-        for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
-          const unsigned int *line_ptr = reinterpret_cast<unsigned int *>(
-              &outBuf.at(v * pixel_data_size * static_cast<size_t>(width) +
-                         channel_offset_list[c] * static_cast<size_t>(width)));
-          for (size_t u = 0; u < static_cast<size_t>(width); u++) {
-            unsigned int val;
-            // val = line_ptr[u];
-            tinyexr::cpy4(&val, line_ptr + u);
-
-            tinyexr::swap4(&val);
-
-            unsigned int *image =
-                reinterpret_cast<unsigned int **>(out_images)[c];
-            if (line_order == 0) {
-              image += (static_cast<size_t>(line_no) + v) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            } else {
-              image += (static_cast<size_t>(height) - 1U -
-                        (static_cast<size_t>(line_no) + v)) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            }
-            *image = val;
-          }
-        }
-      } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
-        TINYEXR_CHECK_AND_RETURN_C(requested_pixel_types[c] == TINYEXR_PIXELTYPE_FLOAT, false);
-        for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
-          const float *line_ptr = reinterpret_cast<float *>(
-              &outBuf.at(v * pixel_data_size * static_cast<size_t>(width) +
-                         channel_offset_list[c] * static_cast<size_t>(width)));
-          for (size_t u = 0; u < static_cast<size_t>(width); u++) {
-            float val;
-            // val = line_ptr[u];
-            tinyexr::cpy4(&val, line_ptr + u);
-
-            tinyexr::swap4(reinterpret_cast<unsigned int *>(&val));
-
-            float *image = reinterpret_cast<float **>(out_images)[c];
-            if (line_order == 0) {
-              image += (static_cast<size_t>(line_no) + v) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            } else {
-              image += (static_cast<size_t>(height) - 1U -
-                        (static_cast<size_t>(line_no) + v)) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            }
-            *image = val;
-          }
-        }
-      } else {
+  size_t line_size = 0;
+  for (size_t c = 0; c < num_channels; c++) {
+    line_size += w * B44PixelTypeSize(channels[c].pixel_type);
+  }
+  if (line_size * h != dst_size) {
+    return false;
+  }
+
+  const unsigned char *in = src;
+  const unsigned char *in_end = src + src_size;
+  size_t channel_offset = 0;
+  for (size_t c = 0; c < num_channels; c++) {
+    const size_t type_size = B44PixelTypeSize(channels[c].pixel_type);
+
+    if (channels[c].pixel_type != TINYEXR_PIXELTYPE_HALF) {
+      if (static_cast<size_t>(in_end - in) < w * h * type_size) {
         return false;
       }
+      for (size_t y = 0; y < h; y++) {
+        memcpy(dst + y * line_size + channel_offset, in, w * type_size);
+        in += w * type_size;
+      }
+      channel_offset += w * type_size;
+      continue;
     }
-  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_RLE) {
-    // Allocate original data size.
-    std::vector<unsigned char> outBuf(static_cast<size_t>(width) *
-                                      static_cast<size_t>(num_lines) *
-                                      pixel_data_size);
 
-    unsigned long dstLen = static_cast<unsigned long>(outBuf.size());
-    if (dstLen == 0) {
-      return false;
-    }
+    const unsigned short *log_table =
+        channels[c].p_linear ? GetB44ExpLogTables().log_table : NULL;
 
-    if (!tinyexr::DecompressRle(
-            reinterpret_cast<unsigned char *>(&outBuf.at(0)), dstLen, data_ptr,
-            static_cast<unsigned long>(data_len))) {
-      return false;
-    }
+    for (size_t y = 0; y < h; y += 4) {
+      const size_t num_rows = (std::min)(h - y, size_t(4));
+      unsigned char *rows[4];
+      for (size_t r = 0; r < num_rows; r++) {
+        rows[r] = dst + (y + r) * line_size + channel_offset;
+      }
 
-    // For RLE_COMPRESSION:
-    //   pixel sample data for channel 0 for scanline 0
-    //   pixel sample data for channel 1 for scanline 0
-    //   pixel sample data for channel ... for scanline 0
-    //   pixel sample data for channel n for scanline 0
-    //   pixel sample data for channel 0 for scanline 1
-    //   pixel sample data for channel 1 for scanline 1
-    //   pixel sample data for channel ... for scanline 1
-    //   pixel sample data for channel n for scanline 1
-    //   ...
-    for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
-      if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
-        for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
-          const unsigned short *line_ptr = reinterpret_cast<unsigned short *>(
-              &outBuf.at(v * static_cast<size_t>(pixel_data_size) *
-                             static_cast<size_t>(width) +
-                         channel_offset_list[c] * static_cast<size_t>(width)));
-          for (size_t u = 0; u < static_cast<size_t>(width); u++) {
-            tinyexr::FP16 hf;
-
-            // hf.u = line_ptr[u];
-            tinyexr::cpy2(&(hf.u), line_ptr + u);
-
-            tinyexr::swap2(reinterpret_cast<unsigned short *>(&hf.u));
-
-            if (requested_pixel_types[c] == TINYEXR_PIXELTYPE_HALF) {
-              unsigned short *image =
-                  reinterpret_cast<unsigned short **>(out_images)[c];
-              if (line_order == 0) {
-                image += (static_cast<size_t>(line_no) + v) *
-                             static_cast<size_t>(x_stride) +
-                         u;
-              } else {
-                image += (static_cast<size_t>(height) - 1U -
-                          (static_cast<size_t>(line_no) + v)) *
-                             static_cast<size_t>(x_stride) +
-                         u;
+      size_t x = 0;
+#if TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+      // 8 blocks at once, while they are entirely inside the chunk.
+      if ((num_rows == 4) && !log_table) {
+        unsigned short bytes[14][8];
+        unsigned short mults[8];
+        for (; x + 32 <= w; x += 32) {
+          for (int i = 0; i < 8; i++) {
+            if (static_cast<size_t>(in_end - in) < 3) {
+              return false;
+            }
+            if (b44IsFlatBlock(in)) {
+              // Same as a 14-byte block with shift 0 and all differences 0.
+              static const unsigned char kFlat[12] = {2, 8, 32, 130, 8, 32,
+                                                      130, 8, 32, 130, 8, 32};
+              bytes[0][i] = in[0];
+              bytes[1][i] = in[1];
+              for (int k = 0; k < 12; k++) {
+                bytes[2 + k][i] = kFlat[k];
+              }
+              mults[i] = 1;
+              in += 3;
+            } else {
+              if (static_cast<size_t>(in_end - in) < 14) {
+                return false;
               }
-              *image = hf.u;
-            } else {  // HALF -> FLOAT
-              tinyexr::FP32 f32 = half_to_float(hf);
-              float *image = reinterpret_cast<float **>(out_images)[c];
-              if (line_order == 0) {
-                image += (static_cast<size_t>(line_no) + v) *
-                             static_cast<size_t>(x_stride) +
-                         u;
-              } else {
-                image += (static_cast<size_t>(height) - 1U -
-                          (static_cast<size_t>(line_no) + v)) *
-                             static_cast<size_t>(x_stride) +
-                         u;
+              for (int k = 0; k < 14; k++) {
+                bytes[k][i] = in[k];
               }
-              *image = f32.f;
+              mults[i] = static_cast<unsigned short>(1u << (in[2] >> 2));
+              in += 14;
             }
           }
-        }
-      } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_UINT) {
-        TINYEXR_CHECK_AND_RETURN_C(requested_pixel_types[c] == TINYEXR_PIXELTYPE_UINT, false);
-
-        for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
-          const unsigned int *line_ptr = reinterpret_cast<unsigned int *>(
-              &outBuf.at(v * pixel_data_size * static_cast<size_t>(width) +
-                         channel_offset_list[c] * static_cast<size_t>(width)));
-          for (size_t u = 0; u < static_cast<size_t>(width); u++) {
-            unsigned int val;
-            // val = line_ptr[u];
-            tinyexr::cpy4(&val, line_ptr + u);
-
-            tinyexr::swap4(&val);
-
-            unsigned int *image =
-                reinterpret_cast<unsigned int **>(out_images)[c];
-            if (line_order == 0) {
-              image += (static_cast<size_t>(line_no) + v) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            } else {
-              image += (static_cast<size_t>(height) - 1U -
-                        (static_cast<size_t>(line_no) + v)) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            }
-            *image = val;
+          unsigned short *out_rows[4];
+          for (int r = 0; r < 4; r++) {
+            out_rows[r] = reinterpret_cast<unsigned short *>(rows[r] + 2 * x);
           }
+          b44Unpack14x8(bytes, mults, out_rows);
         }
-      } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
-        TINYEXR_CHECK_AND_RETURN_C(requested_pixel_types[c] == TINYEXR_PIXELTYPE_FLOAT, false);
-        for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
-          const float *line_ptr = reinterpret_cast<float *>(
-              &outBuf.at(v * pixel_data_size * static_cast<size_t>(width) +
-                         channel_offset_list[c] * static_cast<size_t>(width)));
-          for (size_t u = 0; u < static_cast<size_t>(width); u++) {
-            float val;
-            // val = line_ptr[u];
-            tinyexr::cpy4(&val, line_ptr + u);
-
-            tinyexr::swap4(reinterpret_cast<unsigned int *>(&val));
-
-            float *image = reinterpret_cast<float **>(out_images)[c];
-            if (line_order == 0) {
-              image += (static_cast<size_t>(line_no) + v) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            } else {
-              image += (static_cast<size_t>(height) - 1U -
-                        (static_cast<size_t>(line_no) + v)) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            }
-            *image = val;
+      }
+#endif
+
+      for (; x < w; x += 4) {
+        unsigned short s[16];
+        if (static_cast<size_t>(in_end - in) < 3) {
+          return false;
+        }
+        if (b44IsFlatBlock(in)) {
+          b44Unpack3(in, s);
+          in += 3;
+        } else {
+          if (static_cast<size_t>(in_end - in) < 14) {
+            return false;
           }
+          b44Unpack14(in, s);
+          in += 14;
         }
-      } else {
-        return false;
-      }
-    }
-  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
-#if TINYEXR_USE_ZFP
-    tinyexr::ZFPCompressionParam zfp_compression_param;
-    std::string e;
-    if (!tinyexr::FindZFPCompressionParam(&zfp_compression_param, attributes,
-                                          int(num_attributes), &e)) {
-      // This code path should not be reachable.
-      return false;
-    }
 
-    // Allocate original data size.
-    std::vector<unsigned char> outBuf(static_cast<size_t>(width) *
-                                      static_cast<size_t>(num_lines) *
-                                      pixel_data_size);
+        if (log_table) {
+          for (int i = 0; i < 16; i++) {
+            s[i] = log_table[s[i]];
+          }
+        }
 
-    unsigned long dstLen = outBuf.size();
-    TINYEXR_CHECK_AND_RETURN_C(dstLen > 0, false);
-    tinyexr::DecompressZfp(reinterpret_cast<float *>(&outBuf.at(0)), width,
-                           num_lines, num_channels, data_ptr,
-                           static_cast<unsigned long>(data_len),
-                           zfp_compression_param);
-
-    // For ZFP_COMPRESSION:
-    //   pixel sample data for channel 0 for scanline 0
-    //   pixel sample data for channel 1 for scanline 0
-    //   pixel sample data for channel ... for scanline 0
-    //   pixel sample data for channel n for scanline 0
-    //   pixel sample data for channel 0 for scanline 1
-    //   pixel sample data for channel 1 for scanline 1
-    //   pixel sample data for channel ... for scanline 1
-    //   pixel sample data for channel n for scanline 1
-    //   ...
-    for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
-      TINYEXR_CHECK_AND_RETURN_C(channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT, false);
-      if (channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
-        TINYEXR_CHECK_AND_RETURN_C(requested_pixel_types[c] == TINYEXR_PIXELTYPE_FLOAT, false);
-        for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
-          const float *line_ptr = reinterpret_cast<float *>(
-              &outBuf.at(v * pixel_data_size * static_cast<size_t>(width) +
-                         channel_offset_list[c] * static_cast<size_t>(width)));
-          for (size_t u = 0; u < static_cast<size_t>(width); u++) {
-            float val;
-            tinyexr::cpy4(&val, line_ptr + u);
-
-            tinyexr::swap4(reinterpret_cast<unsigned int *>(&val));
-
-            float *image = reinterpret_cast<float **>(out_images)[c];
-            if (line_order == 0) {
-              image += (static_cast<size_t>(line_no) + v) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            } else {
-              image += (static_cast<size_t>(height) - 1U -
-                        (static_cast<size_t>(line_no) + v)) *
-                           static_cast<size_t>(x_stride) +
-                       u;
-            }
-            *image = val;
+        const size_t n = (std::min)(w - x, size_t(4));
+        for (size_t r = 0; r < num_rows; r++) {
+          unsigned char *p = rows[r] + 2 * x;
+          for (size_t i = 0; i < n; i++) {
+            p[2 * i + 0] = static_cast<unsigned char>(s[4 * r + i] & 0xff);
+            p[2 * i + 1] = static_cast<unsigned char>(s[4 * r + i] >> 8);
           }
         }
-      } else {
-        return false;
       }
     }
-#else
-    (void)attributes;
-    (void)num_attributes;
-    (void)num_channels;
-    return false;
-#endif
-  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_NONE) {
-    for (size_t c = 0; c < num_channels; c++) {
-      for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
-        if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
-          const unsigned short *line_ptr =
-              reinterpret_cast<const unsigned short *>(
-                  data_ptr + v * pixel_data_size * size_t(width) +
-                  channel_offset_list[c] * static_cast<size_t>(width));
-
-          if (requested_pixel_types[c] == TINYEXR_PIXELTYPE_HALF) {
-            unsigned short *outLine =
-                reinterpret_cast<unsigned short *>(out_images[c]);
-            if (line_order == 0) {
-              outLine += (size_t(y) + v) * size_t(x_stride);
-            } else {
-              outLine +=
-                  (size_t(height) - 1 - (size_t(y) + v)) * size_t(x_stride);
-            }
 
-            for (int u = 0; u < width; u++) {
-              tinyexr::FP16 hf;
-
-              // hf.u = line_ptr[u];
-              tinyexr::cpy2(&(hf.u), line_ptr + u);
+    channel_offset += w * type_size;
+  }
 
-              tinyexr::swap2(reinterpret_cast<unsigned short *>(&hf.u));
+  return true;
+}
 
-              outLine[u] = hf.u;
-            }
-          } else if (requested_pixel_types[c] == TINYEXR_PIXELTYPE_FLOAT) {
-            float *outLine = reinterpret_cast<float *>(out_images[c]);
-            if (line_order == 0) {
-              outLine += (size_t(y) + v) * size_t(x_stride);
-            } else {
-              outLine +=
-                  (size_t(height) - 1 - (size_t(y) + v)) * size_t(x_stride);
-            }
+// End of B44 code from OpenEXR -----------------------------------
+
+// DWA code from OpenEXR --------------------------------------
+
+// DWAA(32 scanlines per chunk) and DWAB(256 scanlines per chunk) compress
+// RGB and luminance channels with a lossy 8x8 DCT, alpha channels with RLE
+// and the other channels with zlib. Only decoding is supported.
+// Grabbed from OpenEXR's ImfDwaCompressor.cpp.
+
+// Counters at the beginning of a chunk(64bit each).
+enum {
+  DWA_VERSION = 0,
+  DWA_UNKNOWN_UNCOMPRESSED_SIZE,
+  DWA_UNKNOWN_COMPRESSED_SIZE,
+  DWA_AC_COMPRESSED_SIZE,
+  DWA_DC_COMPRESSED_SIZE,
+  DWA_RLE_COMPRESSED_SIZE,
+  DWA_RLE_UNCOMPRESSED_SIZE,
+  DWA_RLE_RAW_SIZE,
+  DWA_AC_UNCOMPRESSED_COUNT,
+  DWA_DC_UNCOMPRESSED_COUNT,
+  DWA_AC_COMPRESSION,
+  DWA_NUM_SIZES_SINGLE
+};
 
-            if (reinterpret_cast<const unsigned char *>(line_ptr + width) >
-                (data_ptr + data_len)) {
-              // Insufficient data size
-              return false;
-            }
+// Compression scheme of a channel.
+enum {
+  DWA_SCHEME_UNKNOWN = 0,
+  DWA_SCHEME_LOSSY_DCT,
+  DWA_SCHEME_RLE,
+  DWA_NUM_SCHEMES
+};
 
-            for (int u = 0; u < width; u++) {
-              tinyexr::FP16 hf;
+// Compression of the AC coefficients.
+enum { DWA_AC_STATIC_HUFFMAN = 0, DWA_AC_DEFLATE };
 
-              // address may not be aligned. use byte-wise copy for safety.#76
-              // hf.u = line_ptr[u];
-              tinyexr::cpy2(&(hf.u), line_ptr + u);
+// Selects the compression scheme of a channel by the suffix of its name(after
+// the last '.') and its pixel type.
+struct DwaClassifier {
+  std::string suffix;
+  int scheme;
+  int pixel_type;
+  int csc_idx;  // R, G or B(0 ~ 2) of a channel triple, or -1.
+  bool case_insensitive;
+};
 
-              tinyexr::swap2(reinterpret_cast<unsigned short *>(&hf.u));
+// R, G and B channels with the same prefix, decoded together.
+struct DwaCscSet {
+  const char *prefix;
+  size_t prefix_len;
+  int idx[3];
+};
 
-              tinyexr::FP32 f32 = half_to_float(hf);
+struct DwaScratch {
+  std::vector<DwaClassifier> rules;
+  std::vector<DwaCscSet> csc_sets;
+  std::vector<int> schemes;
+  std::vector<size_t> channel_offsets;
+  std::vector<unsigned char> decoded;
+  std::vector<unsigned char> unknown;     // UNKNOWN channels(planar)
+  std::vector<unsigned char> rle;         // RLE channels(run length encoded)
+  std::vector<unsigned char> rle_planar;  // RLE channels(planar bytes)
+  std::vector<unsigned char> dc_tmp;      // DC reorder buffer
+  std::vector<unsigned short> ac;
+  std::vector<unsigned short> dc;
+  std::vector<unsigned short> row_block;  // a row of 8x8 blocks
+  std::vector<unsigned short> line;
+  std::vector<float> line_float;
+#if TINYEXR_USE_PIZ
+  PizScratch huf;
+#endif
 
-              outLine[u] = f32.f;
-            }
-          } else {
-            return false;
-          }
-        } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
-          const float *line_ptr = reinterpret_cast<const float *>(
-              data_ptr + v * pixel_data_size * size_t(width) +
-              channel_offset_list[c] * static_cast<size_t>(width));
-
-          float *outLine = reinterpret_cast<float *>(out_images[c]);
-          if (line_order == 0) {
-            outLine += (size_t(y) + v) * size_t(x_stride);
-          } else {
-            outLine +=
-                (size_t(height) - 1 - (size_t(y) + v)) * size_t(x_stride);
-          }
-
-          if (reinterpret_cast<const unsigned char *>(line_ptr + width) >
-              (data_ptr + data_len)) {
-            // Insufficient data size
-            return false;
-          }
-
-          for (int u = 0; u < width; u++) {
-            float val;
-            tinyexr::cpy4(&val, line_ptr + u);
-
-            tinyexr::swap4(reinterpret_cast<unsigned int *>(&val));
-
-            outLine[u] = val;
-          }
-        } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_UINT) {
-          const unsigned int *line_ptr = reinterpret_cast<const unsigned int *>(
-              data_ptr + v * pixel_data_size * size_t(width) +
-              channel_offset_list[c] * static_cast<size_t>(width));
-
-          unsigned int *outLine =
-              reinterpret_cast<unsigned int *>(out_images[c]);
-          if (line_order == 0) {
-            outLine += (size_t(y) + v) * size_t(x_stride);
-          } else {
-            outLine +=
-                (size_t(height) - 1 - (size_t(y) + v)) * size_t(x_stride);
-          }
+  void Trim(size_t max_size) {
+    if (unknown.capacity() > max_size) {
+      std::vector<unsigned char>().swap(unknown);
+    }
+    if (rle.capacity() > max_size) {
+      std::vector<unsigned char>().swap(rle);
+    }
+    if (rle_planar.capacity() > max_size) {
+      std::vector<unsigned char>().swap(rle_planar);
+    }
+    if (ac.capacity() * sizeof(unsigned short) > max_size) {
+      std::vector<unsigned short>().swap(ac);
+    }
+  }
+};
 
-          if (reinterpret_cast<const unsigned char *>(line_ptr + width) >
-              (data_ptr + data_len)) {
-            // Corrupted data
-            return false;
-          }
+// Rules of the files written by OpenEXR 2.0.x and 2.1.x(version < 2), which
+// do not store the rules in chunks.
+static void DwaLegacyChannelRules(std::vector<DwaClassifier> *rules) {
+  static const struct {
+    const char *suffix;
+    int scheme;
+    int csc_idx;
+  } kRules[] = {{"r", DWA_SCHEME_LOSSY_DCT, 0},
+                {"red", DWA_SCHEME_LOSSY_DCT, 0},
+                {"g", DWA_SCHEME_LOSSY_DCT, 1},
+                {"grn", DWA_SCHEME_LOSSY_DCT, 1},
+                {"green", DWA_SCHEME_LOSSY_DCT, 1},
+                {"b", DWA_SCHEME_LOSSY_DCT, 2},
+                {"blu", DWA_SCHEME_LOSSY_DCT, 2},
+                {"blue", DWA_SCHEME_LOSSY_DCT, 2},
+                {"y", DWA_SCHEME_LOSSY_DCT, -1},
+                {"by", DWA_SCHEME_LOSSY_DCT, -1},
+                {"ry", DWA_SCHEME_LOSSY_DCT, -1},
+                {"a", DWA_SCHEME_RLE, -1}};
+
+  rules->clear();
+  for (size_t i = 0; i < sizeof(kRules) / sizeof(kRules[0]); i++) {
+    for (int t = TINYEXR_PIXELTYPE_UINT; t <= TINYEXR_PIXELTYPE_FLOAT; t++) {
+      if ((kRules[i].scheme == DWA_SCHEME_LOSSY_DCT) &&
+          (t == TINYEXR_PIXELTYPE_UINT)) {
+        continue;
+      }
+      DwaClassifier rule;
+      rule.suffix = kRules[i].suffix;
+      rule.scheme = kRules[i].scheme;
+      rule.pixel_type = t;
+      rule.csc_idx = kRules[i].csc_idx;
+      rule.case_insensitive = true;
+      rules->push_back(rule);
+    }
+  }
+}
 
-          for (int u = 0; u < width; u++) {
+// Reads the rules stored in a chunk(version 2). `size` includes the 16bit
+// size field at the beginning.
+static bool DwaReadChannelRules(const unsigned char *p, size_t size,
+                                std::vector<DwaClassifier> *rules) {
+  rules->clear();
+  size_t i = 2;
+  while (i < size) {
+    // Suffix(null terminated), flags and pixel type.
+    size_t len = 0;
+    while ((i + len < size) && (p[i + len] != 0)) {
+      len++;
+    }
+    if (i + len + 3 > size) {
+      return false;
+    }
 
-            unsigned int val;
-            tinyexr::cpy4(&val, line_ptr + u);
+    DwaClassifier rule;
+    rule.suffix.assign(reinterpret_cast<const char *>(p + i), len);
+    unsigned char flags = p[i + len + 1];
+    unsigned char pixel_type = p[i + len + 2];
+    rule.csc_idx = (flags >> 4) - 1;
+    rule.scheme = (flags >> 2) & 3;
+    rule.case_insensitive = (flags & 1) != 0;
+    rule.pixel_type = pixel_type;
+    if ((rule.csc_idx >= 3) || (rule.scheme >= DWA_NUM_SCHEMES) ||
+        (pixel_type > TINYEXR_PIXELTYPE_FLOAT)) {
+      return false;
+    }
+    rules->push_back(rule);
+    i += len + 3;
+  }
+  return true;
+}
 
-            tinyexr::swap4(reinterpret_cast<unsigned int *>(&val));
+static bool DwaMatch(const DwaClassifier &rule, const char *suffix,
+                     int pixel_type) {
+  if (rule.pixel_type != pixel_type) {
+    return false;
+  }
+  if (!rule.case_insensitive) {
+    return rule.suffix.compare(suffix) == 0;
+  }
+  if (rule.suffix.size() != strlen(suffix)) {
+    return false;
+  }
+  for (size_t i = 0; i < rule.suffix.size(); i++) {
+    char a = rule.suffix[i];
+    char b = suffix[i];
+    if ((a >= 'A') && (a <= 'Z')) a = static_cast<char>(a - 'A' + 'a');
+    if ((b >= 'A') && (b <= 'Z')) b = static_cast<char>(b - 'A' + 'a');
+    if (a != b) {
+      return false;
+    }
+  }
+  return true;
+}
 
-            outLine[u] = val;
-          }
-        }
+// Converts the nonlinear values of lossy DCT channels back to linear:
+// x^2.2 for |x| <= 1, and e^(2.2 * (|x| - 1)) otherwise. Inf and NaN are
+// mapped to 0. Same as `dwaCompressorToLinear` of OpenEXR's dwaLookups.h.
+struct DwaToLinearTable {
+  unsigned short table[65536];
+
+  DwaToLinearTable() {
+    const float log_base = static_cast<float>(std::pow(2.7182818, 2.2));
+    table[0] = 0;
+    for (unsigned int i = 1; i < 65536; i++) {
+      if ((i & 0x7c00) == 0x7c00) {
+        table[i] = 0;
+        continue;
+      }
+      FP16 h;
+      h.u = static_cast<unsigned short>(i);
+      float f = half_to_float(h).f;
+      float sign = (f < 0.0f) ? -1.0f : 1.0f;
+      float a = std::fabs(f);
+      if (a <= 1.0f) {
+        table[i] = FloatToHalfRne(sign * std::pow(a, 2.2f));
+      } else {
+        table[i] = FloatToHalfRne(sign * std::pow(log_base, a - 1.0f));
       }
     }
   }
+};
 
-  return true;
+static const DwaToLinearTable &GetDwaToLinearTable() {
+  // Intentionally leaked. Built on first use(128KB).
+  static const DwaToLinearTable *table = new DwaToLinearTable();
+  return *table;
 }
 
-static bool DecodeTiledPixelData(
-    unsigned char **out_images, int *width, int *height,
-    const int *requested_pixel_types, const unsigned char *data_ptr,
-    size_t data_len, int compression_type, int line_order, int data_width,
-    int data_height, int tile_offset_x, int tile_offset_y, int tile_size_x,
-    int tile_size_y, size_t pixel_data_size, size_t num_attributes,
-    const EXRAttribute *attributes, size_t num_channels,
-    const EXRChannelInfo *channels,
-    const std::vector<size_t> &channel_offset_list) {
-  // Here, data_width and data_height are the dimensions of the current (sub)level.
-  if (tile_size_x * tile_offset_x > data_width ||
-      tile_size_y * tile_offset_y > data_height) {
-    return false;
+// Coefficients of the inverse DCT. OpenEXR uses 3.14159f for pi.
+struct DwaDctConstants {
+  float a, b, c, d, e, f, g;
+
+  DwaDctConstants() {
+    a = .5f * std::cos(3.14159f / 4.0f);
+    b = .5f * std::cos(3.14159f / 16.0f);
+    c = .5f * std::cos(3.14159f / 8.0f);
+    d = .5f * std::cos(3.f * 3.14159f / 16.0f);
+    e = .5f * std::cos(5.f * 3.14159f / 16.0f);
+    f = .5f * std::cos(3.f * 3.14159f / 8.0f);
+    g = .5f * std::cos(7.f * 3.14159f / 16.0f);
   }
+};
 
-  // Compute actual image size in a tile.
-  if ((tile_offset_x + 1) * tile_size_x >= data_width) {
-    (*width) = data_width - (tile_offset_x * tile_size_x);
-  } else {
-    (*width) = tile_size_x;
+static const DwaDctConstants &GetDwaDctConstants() {
+  static const DwaDctConstants constants;
+  return constants;
+}
+
+// 8 point inverse DCT of x[0], x[stride], ..., x[7 * stride], in place.
+static inline void DwaInverseDct8(float *x, size_t stride,
+                                  const DwaDctConstants &k) {
+  const float x0 = x[0], x1 = x[stride], x2 = x[2 * stride],
+              x3 = x[3 * stride], x4 = x[4 * stride], x5 = x[5 * stride],
+              x6 = x[6 * stride], x7 = x[7 * stride];
+  float alpha[4], beta[4], theta[4], gamma[4];
+
+  alpha[0] = k.c * x2;
+  alpha[1] = k.f * x2;
+  alpha[2] = k.c * x6;
+  alpha[3] = k.f * x6;
+
+  beta[0] = k.b * x1 + k.d * x3 + k.e * x5 + k.g * x7;
+  beta[1] = k.d * x1 - k.g * x3 - k.b * x5 - k.e * x7;
+  beta[2] = k.e * x1 - k.b * x3 + k.g * x5 + k.d * x7;
+  beta[3] = k.g * x1 - k.e * x3 + k.d * x5 - k.b * x7;
+
+  theta[0] = k.a * (x0 + x4);
+  theta[3] = k.a * (x0 - x4);
+  theta[1] = alpha[0] + alpha[3];
+  theta[2] = alpha[1] - alpha[2];
+
+  gamma[0] = theta[0] + theta[1];
+  gamma[1] = theta[3] + theta[2];
+  gamma[2] = theta[3] - theta[2];
+  gamma[3] = theta[0] - theta[1];
+
+  x[0] = gamma[0] + beta[0];
+  x[stride] = gamma[1] + beta[1];
+  x[2 * stride] = gamma[2] + beta[2];
+  x[3 * stride] = gamma[3] + beta[3];
+  x[4 * stride] = gamma[3] - beta[3];
+  x[5 * stride] = gamma[2] - beta[2];
+  x[6 * stride] = gamma[1] - beta[1];
+  x[7 * stride] = gamma[0] - beta[0];
+}
+
+#if TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+#if TINYEXR_SIMD_SSE2
+typedef __m128 DwaVec;
+#define TINYEXR_DWA_LOAD(p) _mm_loadu_ps(p)
+#define TINYEXR_DWA_STORE(p, v) _mm_storeu_ps(p, v)
+#define TINYEXR_DWA_SET1(x) _mm_set1_ps(x)
+#define TINYEXR_DWA_ADD(a, b) _mm_add_ps(a, b)
+#define TINYEXR_DWA_SUB(a, b) _mm_sub_ps(a, b)
+#define TINYEXR_DWA_MUL(a, b) _mm_mul_ps(a, b)
+#else
+typedef float32x4_t DwaVec;
+#define TINYEXR_DWA_LOAD(p) vld1q_f32(p)
+#define TINYEXR_DWA_STORE(p, v) vst1q_f32(p, v)
+#define TINYEXR_DWA_SET1(x) vdupq_n_f32(x)
+#define TINYEXR_DWA_ADD(a, b) vaddq_f32(a, b)
+#define TINYEXR_DWA_SUB(a, b) vsubq_f32(a, b)
+#define TINYEXR_DWA_MUL(a, b) vmulq_f32(a, b)
+#endif
+
+static inline void DwaTranspose4(DwaVec *r0, DwaVec *r1, DwaVec *r2,
+                                 DwaVec *r3) {
+#if TINYEXR_SIMD_SSE2
+  _MM_TRANSPOSE4_PS(*r0, *r1, *r2, *r3);
+#else
+  float32x4x2_t t01 = vtrnq_f32(*r0, *r1);
+  float32x4x2_t t23 = vtrnq_f32(*r2, *r3);
+  *r0 = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+  *r1 = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+  *r2 = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+  *r3 = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+#endif
+}
+
+// `v[h][r]` holds columns 4h ~ 4h + 3 of row r.
+static inline void DwaTranspose8x8(DwaVec v[2][8]) {
+  DwaTranspose4(&v[0][0], &v[0][1], &v[0][2], &v[0][3]);
+  DwaTranspose4(&v[1][0], &v[1][1], &v[1][2], &v[1][3]);
+  DwaTranspose4(&v[0][4], &v[0][5], &v[0][6], &v[0][7]);
+  DwaTranspose4(&v[1][4], &v[1][5], &v[1][6], &v[1][7]);
+  for (int r = 0; r < 4; r++) {
+    DwaVec t = v[1][r];
+    v[1][r] = v[0][4 + r];
+    v[0][4 + r] = t;
   }
+}
 
-  if ((tile_offset_y + 1) * tile_size_y >= data_height) {
-    (*height) = data_height - (tile_offset_y * tile_size_y);
-  } else {
-    (*height) = tile_size_y;
+// Same as `DwaInverseDct8` for 4 columns.
+static inline void DwaInverseDct8x4(DwaVec x[8], const DwaVec k[7]) {
+  const DwaVec &a = k[0], &b = k[1], &c = k[2], &d = k[3], &e = k[4],
+               &f = k[5], &g = k[6];
+  DwaVec alpha[4], beta[4], theta[4], gamma[4];
+
+  alpha[0] = TINYEXR_DWA_MUL(c, x[2]);
+  alpha[1] = TINYEXR_DWA_MUL(f, x[2]);
+  alpha[2] = TINYEXR_DWA_MUL(c, x[6]);
+  alpha[3] = TINYEXR_DWA_MUL(f, x[6]);
+
+  beta[0] = TINYEXR_DWA_ADD(
+      TINYEXR_DWA_ADD(TINYEXR_DWA_ADD(TINYEXR_DWA_MUL(b, x[1]),
+                                      TINYEXR_DWA_MUL(d, x[3])),
+                      TINYEXR_DWA_MUL(e, x[5])),
+      TINYEXR_DWA_MUL(g, x[7]));
+  beta[1] = TINYEXR_DWA_SUB(
+      TINYEXR_DWA_SUB(TINYEXR_DWA_SUB(TINYEXR_DWA_MUL(d, x[1]),
+                                      TINYEXR_DWA_MUL(g, x[3])),
+                      TINYEXR_DWA_MUL(b, x[5])),
+      TINYEXR_DWA_MUL(e, x[7]));
+  beta[2] = TINYEXR_DWA_ADD(
+      TINYEXR_DWA_ADD(TINYEXR_DWA_SUB(TINYEXR_DWA_MUL(e, x[1]),
+                                      TINYEXR_DWA_MUL(b, x[3])),
+                      TINYEXR_DWA_MUL(g, x[5])),
+      TINYEXR_DWA_MUL(d, x[7]));
+  beta[3] = TINYEXR_DWA_SUB(
+      TINYEXR_DWA_ADD(TINYEXR_DWA_SUB(TINYEXR_DWA_MUL(g, x[1]),
+                                      TINYEXR_DWA_MUL(e, x[3])),
+                      TINYEXR_DWA_MUL(d, x[5])),
+      TINYEXR_DWA_MUL(b, x[7]));
+
+  theta[0] = TINYEXR_DWA_MUL(a, TINYEXR_DWA_ADD(x[0], x[4]));
+  theta[3] = TINYEXR_DWA_MUL(a, TINYEXR_DWA_SUB(x[0], x[4]));
+  theta[1] = TINYEXR_DWA_ADD(alpha[0], alpha[3]);
+  theta[2] = TINYEXR_DWA_SUB(alpha[1], alpha[2]);
+
+  gamma[0] = TINYEXR_DWA_ADD(theta[0], theta[1]);
+  gamma[1] = TINYEXR_DWA_ADD(theta[3], theta[2]);
+  gamma[2] = TINYEXR_DWA_SUB(theta[3], theta[2]);
+  gamma[3] = TINYEXR_DWA_SUB(theta[0], theta[1]);
+
+  x[0] = TINYEXR_DWA_ADD(gamma[0], beta[0]);
+  x[1] = TINYEXR_DWA_ADD(gamma[1], beta[1]);
+  x[2] = TINYEXR_DWA_ADD(gamma[2], beta[2]);
+  x[3] = TINYEXR_DWA_ADD(gamma[3], beta[3]);
+  x[4] = TINYEXR_DWA_SUB(gamma[3], beta[3]);
+  x[5] = TINYEXR_DWA_SUB(gamma[2], beta[2]);
+  x[6] = TINYEXR_DWA_SUB(gamma[1], beta[1]);
+  x[7] = TINYEXR_DWA_SUB(gamma[0], beta[0]);
+}
+
+// The row transform is the column transform of the transposed block.
+// Operations are done in the same order as `DwaInverseDct8`.
+static void DwaInverseDct8x8SIMD(float *data) {
+  const DwaDctConstants &kc = GetDwaDctConstants();
+  const DwaVec k[7] = {TINYEXR_DWA_SET1(kc.a), TINYEXR_DWA_SET1(kc.b),
+                       TINYEXR_DWA_SET1(kc.c), TINYEXR_DWA_SET1(kc.d),
+                       TINYEXR_DWA_SET1(kc.e), TINYEXR_DWA_SET1(kc.f),
+                       TINYEXR_DWA_SET1(kc.g)};
+  DwaVec v[2][8];
+  for (int r = 0; r < 8; r++) {
+    v[0][r] = TINYEXR_DWA_LOAD(data + 8 * r);
+    v[1][r] = TINYEXR_DWA_LOAD(data + 8 * r + 4);
+  }
+
+  DwaTranspose8x8(v);
+  DwaInverseDct8x4(v[0], k);
+  DwaInverseDct8x4(v[1], k);
+  DwaTranspose8x8(v);
+  DwaInverseDct8x4(v[0], k);
+  DwaInverseDct8x4(v[1], k);
+
+  for (int r = 0; r < 8; r++) {
+    TINYEXR_DWA_STORE(data + 8 * r, v[0][r]);
+    TINYEXR_DWA_STORE(data + 8 * r + 4, v[1][r]);
+  }
+}
+#else
+// Row transforms of the zero rows are skipped.
+static void DwaInverseDct8x8Scalar(float *data, int zeroed_rows) {
+  const DwaDctConstants &k = GetDwaDctConstants();
+  for (int row = 0; row < 8 - zeroed_rows; row++) {
+    DwaInverseDct8(data + 8 * row, 1, k);
+  }
+  for (int column = 0; column < 8; column++) {
+    DwaInverseDct8(data + column, 8, k);
   }
+}
+#endif  // TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+
+// 8x8 inverse DCT of `data`, in place. `zeroed_rows` bottom rows are known to
+// be zero.
+static void DwaInverseDct8x8(float *data, int zeroed_rows) {
+#if TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+  (void)zeroed_rows;
+  DwaInverseDct8x8SIMD(data);
+#else
+  DwaInverseDct8x8Scalar(data, zeroed_rows);
+#endif
+}
 
-  // Image size = tile size.
-  return DecodePixelData(out_images, requested_pixel_types, data_ptr, data_len,
-                         compression_type, line_order, (*width), tile_size_y,
-                         /* stride */ tile_size_x, /* y */ 0, /* line_no */ 0,
-                         (*height), pixel_data_size, num_attributes, attributes,
-                         num_channels, channels, channel_offset_list);
+// Converts Y'CbCr(Rec. 709) of `n` pixels to R'G'B', in place.
+static void DwaCsc709Inverse(float *comp0, float *comp1, float *comp2,
+                             size_t n) {
+  size_t i = 0;
+#if TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+  const DwaVec k0 = TINYEXR_DWA_SET1(1.5747f);
+  const DwaVec k1 = TINYEXR_DWA_SET1(0.1873f);
+  const DwaVec k2 = TINYEXR_DWA_SET1(0.4682f);
+  const DwaVec k3 = TINYEXR_DWA_SET1(1.8556f);
+  for (; i + 4 <= n; i += 4) {
+    DwaVec s0 = TINYEXR_DWA_LOAD(comp0 + i);
+    DwaVec s1 = TINYEXR_DWA_LOAD(comp1 + i);
+    DwaVec s2 = TINYEXR_DWA_LOAD(comp2 + i);
+    TINYEXR_DWA_STORE(comp0 + i,
+                      TINYEXR_DWA_ADD(s0, TINYEXR_DWA_MUL(k0, s2)));
+    TINYEXR_DWA_STORE(
+        comp1 + i,
+        TINYEXR_DWA_SUB(TINYEXR_DWA_SUB(s0, TINYEXR_DWA_MUL(k1, s1)),
+                        TINYEXR_DWA_MUL(k2, s2)));
+    TINYEXR_DWA_STORE(comp2 + i,
+                      TINYEXR_DWA_ADD(s0, TINYEXR_DWA_MUL(k3, s1)));
+  }
+#endif
+  for (; i < n; i++) {
+    float s0 = comp0[i];
+    float s1 = comp1[i];
+    float s2 = comp2[i];
+    comp0[i] = s0 + 1.5747f * s2;
+    comp1[i] = s0 - 0.1873f * s1 - 0.4682f * s2;
+    comp2[i] = s0 + 1.8556f * s1;
+  }
 }
 
-static bool ComputeChannelLayout(std::vector<size_t> *channel_offset_list,
-                                 int *pixel_data_size, size_t *channel_offset,
-                                 int num_channels,
-                                 const EXRChannelInfo *channels) {
-  channel_offset_list->resize(static_cast<size_t>(num_channels));
+#if TINYEXR_SIMD_SSE2
+// Same as `FloatToHalfRne` for 4 floats(in the lower 16 bits of each lane).
+static __m128i FloatToHalfRne4SSE2(__m128 f) {
+  __m128i bits = _mm_castps_si128(f);
+  __m128i sign =
+      _mm_and_si128(_mm_srli_epi32(bits, 16), _mm_set1_epi32(0x8000));
+  __m128i a = _mm_and_si128(bits, _mm_set1_epi32(0x7fffffff));
+
+  // Normalized half: rebias exponent and round to nearest even.
+  __m128i hn = _mm_srli_epi32(
+      _mm_add_epi32(
+          _mm_add_epi32(a, _mm_set1_epi32(0xfff - (112 << 23))),
+          _mm_and_si128(_mm_srli_epi32(a, 13), _mm_set1_epi32(1))),
+      13);
+  __m128i overflow = _mm_cmpgt_epi32(hn, _mm_set1_epi32(0x7c00));
+  hn = _mm_or_si128(_mm_andnot_si128(overflow, hn),
+                    _mm_and_si128(overflow, _mm_set1_epi32(0x7c00)));
+
+  // Denormalized half: adding 0.5 rounds |f| to a multiple of 2^-24.
+  __m128i hd = _mm_sub_epi32(
+      _mm_castps_si128(_mm_add_ps(_mm_castsi128_ps(a), _mm_set1_ps(0.5f))),
+      _mm_set1_epi32(0x3f000000));
+
+  __m128i normal = _mm_cmpgt_epi32(a, _mm_set1_epi32(0x387fffff));
+  __m128i h = _mm_or_si128(_mm_andnot_si128(normal, hd),
+                           _mm_and_si128(normal, hn));
+
+  // Inf/NaN(NaN -> qNaN)
+  __m128i infnan = _mm_cmpgt_epi32(a, _mm_set1_epi32(0x7f7fffff));
+  __m128i nan = _mm_cmpgt_epi32(a, _mm_set1_epi32(0x7f800000));
+  __m128i special = _mm_or_si128(_mm_set1_epi32(0x7c00),
+                                 _mm_and_si128(nan, _mm_set1_epi32(0x200)));
+  h = _mm_or_si128(_mm_andnot_si128(infnan, h),
+                   _mm_and_si128(infnan, special));
+
+  return _mm_or_si128(h, sign);
+}
+#elif TINYEXR_SIMD_NEON
+// Same as `FloatToHalfRne` for 4 floats.
+static uint16x4_t FloatToHalfRne4NEON(float32x4_t f) {
+  uint32x4_t bits = vreinterpretq_u32_f32(f);
+  uint32x4_t sign = vandq_u32(vshrq_n_u32(bits, 16), vdupq_n_u32(0x8000));
+  uint32x4_t a = vandq_u32(bits, vdupq_n_u32(0x7fffffff));
+
+  uint32x4_t hn = vshrq_n_u32(
+      vaddq_u32(vaddq_u32(a, vdupq_n_u32(0xfff - (112u << 23))),
+                vandq_u32(vshrq_n_u32(a, 13), vdupq_n_u32(1))),
+      13);
+  hn = vminq_u32(hn, vdupq_n_u32(0x7c00));
+
+  uint32x4_t hd = vsubq_u32(
+      vreinterpretq_u32_f32(
+          vaddq_f32(vreinterpretq_f32_u32(a), vdupq_n_f32(0.5f))),
+      vdupq_n_u32(0x3f000000));
+
+  uint32x4_t h = vbslq_u32(vcgtq_u32(a, vdupq_n_u32(0x387fffff)), hn, hd);
+
+  uint32x4_t special =
+      vorrq_u32(vdupq_n_u32(0x7c00),
+                vandq_u32(vcgtq_u32(a, vdupq_n_u32(0x7f800000)),
+                          vdupq_n_u32(0x200)));
+  h = vbslq_u32(vcgtq_u32(a, vdupq_n_u32(0x7f7fffff)), special, h);
+  return vmovn_u32(vorrq_u32(h, sign));
+}
+#endif
 
-  (*pixel_data_size) = 0;
-  (*channel_offset) = 0;
+// Converts 64 floats to halves with round-to-nearest-even.
+static void DwaFloatToHalf64(unsigned short *dst, const float *src) {
+#if TINYEXR_SIMD_SSE2
+  for (int i = 0; i < 64; i += 8) {
+    __m128i lo = FloatToHalfRne4SSE2(_mm_loadu_ps(src + i));
+    __m128i hi = FloatToHalfRne4SSE2(_mm_loadu_ps(src + i + 4));
+    // Sign extend 16bit values so that `packs` does not saturate.
+    lo = _mm_srai_epi32(_mm_slli_epi32(lo, 16), 16);
+    hi = _mm_srai_epi32(_mm_slli_epi32(hi, 16), 16);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+                     _mm_packs_epi32(lo, hi));
+  }
+#elif TINYEXR_SIMD_NEON
+  for (int i = 0; i < 64; i += 8) {
+    vst1q_u16(dst + i, vcombine_u16(FloatToHalfRne4NEON(vld1q_f32(src + i)),
+                                    FloatToHalfRne4NEON(vld1q_f32(src + i + 4))));
+  }
+#else
+  for (int i = 0; i < 64; i++) {
+    dst[i] = FloatToHalfRne(src[i]);
+  }
+#endif
+}
 
-  for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
-    (*channel_offset_list)[c] = (*channel_offset);
-    if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
-      (*pixel_data_size) += sizeof(unsigned short);
-      (*channel_offset) += sizeof(unsigned short);
-    } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
-      (*pixel_data_size) += sizeof(float);
-      (*channel_offset) += sizeof(float);
-    } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_UINT) {
-      (*pixel_data_size) += sizeof(unsigned int);
-      (*channel_offset) += sizeof(unsigned int);
-    } else {
-      // ???
+// Decodes the lossy DCT data of `num_comps` channels(an R, G and B triple if
+// 3) of `width` x `height` pixels. `out[i]` is the first row of channel i in
+// the output, whose rows are `line_size` bytes apart. `to_linear` is applied
+// to the decoded values if not NULL. `ac` and `dc` are advanced past the
+// consumed coefficients.
+static bool DwaDecodeLossyDct(int num_comps, unsigned char *const *out,
+                              const int *pixel_types, size_t line_size,
+                              int width, int height,
+                              const unsigned short *to_linear,
+                              const unsigned short **ac,
+                              const unsigned short *ac_end,
+                              const unsigned short **dc,
+                              const unsigned short *dc_end,
+                              DwaScratch *scratch) {
+  // Index in the zig-zag order of each coefficient.
+  static const unsigned char kZigZag[64] = {
+      0,  1,  5,  6,  14, 15, 27, 28, 2,  4,  7,  13, 16, 26, 29, 42,
+      3,  8,  12, 17, 25, 30, 41, 43, 9,  11, 18, 24, 31, 40, 44, 53,
+      10, 19, 23, 32, 39, 45, 52, 54, 20, 22, 33, 38, 46, 51, 55, 60,
+      21, 34, 37, 47, 50, 56, 59, 61, 35, 36, 48, 49, 57, 58, 62, 63};
+  // Index in the zig-zag order of the first coefficient of rows 1 ~ 7.
+  static const int kRowStart[7] = {2, 3, 9, 10, 20, 21, 35};
+
+  const size_t w = static_cast<size_t>(width);
+  const size_t num_blocks_x = (w + 7) / 8;
+  const size_t num_blocks_y = (static_cast<size_t>(height) + 7) / 8;
+  const size_t num_blocks = num_blocks_x * num_blocks_y;
+  const size_t nc = static_cast<size_t>(num_comps);
+
+  for (int comp = 0; comp < num_comps; comp++) {
+    if ((pixel_types[comp] != TINYEXR_PIXELTYPE_HALF) &&
+        (pixel_types[comp] != TINYEXR_PIXELTYPE_FLOAT)) {
       return false;
     }
   }
-  return true;
-}
+  // DC coefficients are stored per channel.
+  if (static_cast<size_t>(dc_end - (*dc)) < nc * num_blocks) {
+    return false;
+  }
 
-// TODO: Simply return nullptr when failed to allocate?
-static unsigned char **AllocateImage(int num_channels,
-                                     const EXRChannelInfo *channels,
-                                     const int *requested_pixel_types,
-                                     int data_width, int data_height, bool *success) {
-  unsigned char **images =
-      reinterpret_cast<unsigned char **>(static_cast<float **>(
-          malloc(sizeof(float *) * static_cast<size_t>(num_channels))));
+  std::vector<unsigned short> &row_block = scratch->row_block;
+  std::vector<unsigned short> &line = scratch->line;
+  std::vector<float> &line_float = scratch->line_float;
+  row_block.resize(nc * num_blocks_x * 64);
+  line.resize(w);
+  line_float.resize(w);
 
-  for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
-    images[c] = NULL;
-  }
+  const unsigned short *acp = *ac;
+  float dct[3][64];
 
-  bool valid = true;
+  for (size_t by = 0; by < num_blocks_y; by++) {
+    for (size_t bx = 0; bx < num_blocks_x; bx++) {
+      // Only DC coefficients in all channels.
+      bool constant = true;
 
-  for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
-    size_t data_len =
-        static_cast<size_t>(data_width) * static_cast<size_t>(data_height);
-    if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
-      // pixel_data_size += sizeof(unsigned short);
-      // channel_offset += sizeof(unsigned short);
-      // Alloc internal image for half type.
-      if (requested_pixel_types[c] == TINYEXR_PIXELTYPE_HALF) {
-        images[c] =
-            reinterpret_cast<unsigned char *>(static_cast<unsigned short *>(
-                malloc(sizeof(unsigned short) * data_len)));
-      } else if (requested_pixel_types[c] == TINYEXR_PIXELTYPE_FLOAT) {
-        images[c] = reinterpret_cast<unsigned char *>(
-            static_cast<float *>(malloc(sizeof(float) * data_len)));
-      } else {
-        images[c] = NULL; // just in case.
-        valid = false;
-        break;
+      for (size_t comp = 0; comp < nc; comp++) {
+        unsigned short zig[64];
+        memset(zig, 0, sizeof(zig));
+        zig[0] = (*dc)[comp * num_blocks + by * num_blocks_x + bx];
+
+        // AC coefficients are run length encoded: 0xff00 ends the block and
+        // 0xffXX skips XX zeros.
+        int last_non_zero = 0;
+        for (int i = 1; i < 64;) {
+          if (acp == ac_end) {
+            return false;
+          }
+          unsigned short v = *acp++;
+          if (v == 0xff00) {
+            break;
+          } else if ((v >> 8) == 0xff) {
+            i += v & 0xff;
+          } else {
+            last_non_zero = i;
+            zig[i++] = v;
+          }
+        }
+
+        if (last_non_zero == 0) {
+          FP16 h;
+          h.u = zig[0];
+          float val = half_to_float(h).f * 3.535536e-01f * 3.535536e-01f;
+          for (int i = 0; i < 64; i++) {
+            dct[comp][i] = val;
+          }
+        } else {
+          constant = false;
+
+          unsigned short coef[64];
+          for (int i = 0; i < 64; i++) {
+            coef[i] = zig[kZigZag[i]];
+            tinyexr::swap2(&coef[i]);
+          }
+          HalfToFloatLine(dct[comp], reinterpret_cast<unsigned char *>(coef),
+                          64);
+
+          int zeroed_rows = 0;
+          for (int r = 0; r < 7; r++) {
+            if (last_non_zero < kRowStart[r]) {
+              zeroed_rows = 7 - r;
+              break;
+            }
+          }
+          DwaInverseDct8x8(dct[comp], zeroed_rows);
+        }
       }
-    } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
-      // pixel_data_size += sizeof(float);
-      // channel_offset += sizeof(float);
-      images[c] = reinterpret_cast<unsigned char *>(
-          static_cast<float *>(malloc(sizeof(float) * data_len)));
-    } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_UINT) {
-      // pixel_data_size += sizeof(unsigned int);
-      // channel_offset += sizeof(unsigned int);
-      images[c] = reinterpret_cast<unsigned char *>(
-          static_cast<unsigned int *>(malloc(sizeof(unsigned int) * data_len)));
-    } else {
-      images[c] = NULL; // just in case.
-      valid = false;
-      break;
-    }
-  }
 
-  if (!valid) {
-    for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
-      if (images[c]) {
-        free(images[c]);
-        images[c] = NULL;
+      if (constant) {
+        if (nc == 3) {
+          DwaCsc709Inverse(dct[0], dct[1], dct[2], 1);
+        }
+        for (size_t comp = 0; comp < nc; comp++) {
+          unsigned short h = FloatToHalfRne(dct[comp][0]);
+          unsigned short *dst = &row_block[(comp * num_blocks_x + bx) * 64];
+          for (int i = 0; i < 64; i++) {
+            dst[i] = h;
+          }
+        }
+      } else {
+        if (nc == 3) {
+          DwaCsc709Inverse(dct[0], dct[1], dct[2], 64);
+        }
+        for (size_t comp = 0; comp < nc; comp++) {
+          DwaFloatToHalf64(&row_block[(comp * num_blocks_x + bx) * 64],
+                           dct[comp]);
+        }
       }
     }
 
-    if (success) {
-      (*success) = false;
-    }
-  } else {
-    if (success) {
-      (*success) = true;
+    // Unblock the row of blocks(clipped to the chunk).
+    const size_t num_rows =
+        (std::min)(static_cast<size_t>(height) - 8 * by, size_t(8));
+    for (size_t comp = 0; comp < nc; comp++) {
+      for (size_t r = 0; r < num_rows; r++) {
+        const unsigned short *blocks =
+            &row_block[comp * num_blocks_x * 64 + r * 8];
+        for (size_t x = 0; x < w; x++) {
+          unsigned short v = blocks[(x >> 3) * 64 + (x & 7)];
+          line[x] = to_linear ? to_linear[v] : v;
+          tinyexr::swap2(&line[x]);
+        }
+
+        unsigned char *dst = out[comp] + (8 * by + r) * line_size;
+        if (pixel_types[comp] == TINYEXR_PIXELTYPE_HALF) {
+          memcpy(dst, &line.at(0), w * sizeof(unsigned short));
+        } else {
+          HalfToFloatLine(&line_float.at(0),
+                          reinterpret_cast<unsigned char *>(&line.at(0)), w);
+          for (size_t x = 0; x < w; x++) {
+            tinyexr::swap4(&line_float[x]);
+          }
+          memcpy(dst, &line_float.at(0), w * sizeof(float));
+        }
+      }
     }
   }
 
-  return images;
-}
-
-#ifdef _WIN32
-static inline std::wstring UTF8ToWchar(const std::string &str) {
-  int wstr_size =
-      MultiByteToWideChar(CP_UTF8, 0, str.data(), (int)str.size(), NULL, 0);
-  std::wstring wstr(wstr_size, 0);
-  MultiByteToWideChar(CP_UTF8, 0, str.data(), (int)str.size(), &wstr[0],
-                      (int)wstr.size());
-  return wstr;
+  *ac = acp;
+  *dc += nc * num_blocks;
+  return true;
 }
-#endif
 
+// Decompresses a DWAA/DWAB chunk `src` of `width` x `num_lines` pixels into
+// `dst`(`dst_size` bytes, in the layout of the EXR file).
+static bool DecompressDwa(unsigned char *dst, size_t dst_size,
+                          const unsigned char *src, size_t src_size,
+                          int width, int num_lines, size_t num_channels,
+                          const EXRChannelInfo *channels,
+                          DwaScratch *scratch) {
+  if ((width <= 0) || (num_lines <= 0) || (num_channels == 0)) {
+    return false;
+  }
 
-static int ParseEXRHeader(HeaderInfo *info, bool *empty_header,
-                          const EXRVersion *version, std::string *err,
-                          const unsigned char *buf, size_t size) {
-  const char *marker = reinterpret_cast<const char *>(&buf[0]);
+  const size_t header_size = DWA_NUM_SIZES_SINGLE * sizeof(tinyexr_uint64);
+  if (src_size < header_size) {
+    return false;
+  }
+  tinyexr_uint64 counters[DWA_NUM_SIZES_SINGLE];
+  for (size_t i = 0; i < DWA_NUM_SIZES_SINGLE; i++) {
+    memcpy(&counters[i], src + 8 * i, sizeof(tinyexr_uint64));
+    tinyexr::swap8(&counters[i]);
+  }
 
-  if (empty_header) {
-    (*empty_header) = false;
+  // Version 1 adds the end of block symbol to AC coefficients and version 2
+  // stores the channel rules in chunks.
+  if (counters[DWA_VERSION] > 2) {
+    return false;
   }
 
-  if (version->multipart) {
-    if (size > 0 && marker[0] == '\0') {
-      // End of header list.
-      if (empty_header) {
-        (*empty_header) = true;
-      }
-      return TINYEXR_SUCCESS;
+  const unsigned char *p = src + header_size;
+  size_t avail = src_size - header_size;
+
+  std::vector<DwaClassifier> &rules = scratch->rules;
+  if (counters[DWA_VERSION] < 2) {
+    DwaLegacyChannelRules(&rules);
+  } else {
+    if (avail < 2) {
+      return false;
     }
+    size_t rule_size = static_cast<size_t>(p[0]) |
+                       (static_cast<size_t>(p[1]) << 8);
+    if ((rule_size < 2) || (rule_size > avail) ||
+        !DwaReadChannelRules(p, rule_size, &rules)) {
+      return false;
+    }
+    p += rule_size;
+    avail -= rule_size;
+  }
+
+  // UNKNOWN, AC, DC and RLE data follow.
+  const tinyexr_uint64 unknown_compressed_size =
+      counters[DWA_UNKNOWN_COMPRESSED_SIZE];
+  const tinyexr_uint64 ac_compressed_size = counters[DWA_AC_COMPRESSED_SIZE];
+  const tinyexr_uint64 dc_compressed_size = counters[DWA_DC_COMPRESSED_SIZE];
+  const tinyexr_uint64 rle_compressed_size = counters[DWA_RLE_COMPRESSED_SIZE];
+  if ((unknown_compressed_size > avail) ||
+      (ac_compressed_size > avail - unknown_compressed_size) ||
+      (dc_compressed_size >
+       avail - unknown_compressed_size - ac_compressed_size) ||
+      (rle_compressed_size > avail - unknown_compressed_size -
+                                 ac_compressed_size - dc_compressed_size)) {
+    return false;
+  }
+  const unsigned char *unknown_src = p;
+  const unsigned char *ac_src = unknown_src + unknown_compressed_size;
+  const unsigned char *dc_src = ac_src + ac_compressed_size;
+  const unsigned char *rle_src = dc_src + dc_compressed_size;
+
+  // Classify channels. The scheme of the last matching rule is used.
+  std::vector<int> &schemes = scratch->schemes;
+  std::vector<DwaCscSet> &csc_sets = scratch->csc_sets;
+  schemes.assign(num_channels, DWA_SCHEME_UNKNOWN);
+  csc_sets.clear();
+  for (size_t c = 0; c < num_channels; c++) {
+    const char *name = channels[c].name;
+    const char *dot = strrchr(name, '.');
+    const char *suffix = dot ? (dot + 1) : name;
+    const size_t prefix_len = static_cast<size_t>(suffix - name);
+
+    for (size_t r = 0; r < rules.size(); r++) {
+      if (!DwaMatch(rules[r], suffix, channels[c].pixel_type)) {
+        continue;
+      }
+      schemes[c] = rules[r].scheme;
+      if (rules[r].csc_idx < 0) {
+        continue;
+      }
+      size_t s = 0;
+      for (; s < csc_sets.size(); s++) {
+        if ((csc_sets[s].prefix_len == prefix_len) &&
+            (strncmp(csc_sets[s].prefix, name, prefix_len) == 0)) {
+          break;
+        }
+      }
+      if (s == csc_sets.size()) {
+        DwaCscSet set;
+        set.prefix = name;
+        set.prefix_len = prefix_len;
+        set.idx[0] = set.idx[1] = set.idx[2] = -1;
+        csc_sets.push_back(set);
+      }
+      csc_sets[s].idx[rules[r].csc_idx] = static_cast<int>(c);
+    }
+  }
+
+  // Sizes of the planar data of UNKNOWN and RLE channels.
+  const size_t w = static_cast<size_t>(width);
+  const size_t h = static_cast<size_t>(num_lines);
+  std::vector<size_t> &channel_offsets = scratch->channel_offsets;
+  channel_offsets.resize(num_channels);
+  size_t line_size = 0;
+  size_t unknown_size = 0;
+  size_t rle_size = 0;
+  size_t num_lossy = 0;
+  for (size_t c = 0; c < num_channels; c++) {
+    const size_t channel_size =
+        w * h * B44PixelTypeSize(channels[c].pixel_type);
+    channel_offsets[c] = line_size;
+    line_size += w * B44PixelTypeSize(channels[c].pixel_type);
+    if (schemes[c] == DWA_SCHEME_UNKNOWN) {
+      unknown_size += channel_size;
+    } else if (schemes[c] == DWA_SCHEME_RLE) {
+      rle_size += channel_size;
+    } else {
+      num_lossy++;
+    }
+  }
+  if ((dst_size != line_size * h) || (rle_size > 0x7fffffff)) {
+    return false;
   }
 
-  // According to the spec, the header of every OpenEXR file must contain at
-  // least the following attributes:
-  //
-  // channels chlist
-  // compression compression
-  // dataWindow box2i
-  // displayWindow box2i
-  // lineOrder lineOrder
-  // pixelAspectRatio float
-  // screenWindowCenter v2f
-  // screenWindowWidth float
-  bool has_channels = false;
-  bool has_compression = false;
-  bool has_data_window = false;
-  bool has_display_window = false;
-  bool has_line_order = false;
-  bool has_pixel_aspect_ratio = false;
-  bool has_screen_window_center = false;
-  bool has_screen_window_width = false;
-  bool has_name = false;
-  bool has_type = false;
-
-  info->name.clear();
-  info->type.clear();
-
-  info->data_window.min_x = 0;
-  info->data_window.min_y = 0;
-  info->data_window.max_x = 0;
-  info->data_window.max_y = 0;
-  info->line_order = 0;  // @fixme
-  info->display_window.min_x = 0;
-  info->display_window.min_y = 0;
-  info->display_window.max_x = 0;
-  info->display_window.max_y = 0;
-  info->screen_window_center[0] = 0.0f;
-  info->screen_window_center[1] = 0.0f;
-  info->screen_window_width = -1.0f;
-  info->pixel_aspect_ratio = -1.0f;
-
-  info->tiled = 0;
-  info->tile_size_x = -1;
-  info->tile_size_y = -1;
-  info->tile_level_mode = -1;
-  info->tile_rounding_mode = -1;
+  // UNKNOWN: zlib.
+  std::vector<unsigned char> &unknown = scratch->unknown;
+  if (unknown_size > 0) {
+    if ((counters[DWA_UNKNOWN_UNCOMPRESSED_SIZE] != unknown_size) ||
+        (unknown_compressed_size == 0)) {
+      return false;
+    }
+    unknown.resize(unknown_size);
+    unsigned long len = static_cast<unsigned long>(unknown_size);
+    if (!InflateZlib(&unknown.at(0), &len, unknown_src,
+                     static_cast<unsigned long>(unknown_compressed_size)) ||
+        (len != unknown_size)) {
+      return false;
+    }
+  }
 
-  info->attributes.clear();
+  const size_t num_blocks = ((w + 7) / 8) * ((h + 7) / 8);
 
-  // Read attributes
-  size_t orig_size = size;
-  for (size_t nattr = 0; nattr < TINYEXR_MAX_HEADER_ATTRIBUTES; nattr++) {
-    if (0 == size) {
-      if (err) {
-        (*err) += "Insufficient data size for attributes.\n";
+  // AC: run length encoded, then Huffman or zlib.
+  std::vector<unsigned short> &ac = scratch->ac;
+  ac.clear();
+  if (ac_compressed_size > 0) {
+    const tinyexr_uint64 count = counters[DWA_AC_UNCOMPRESSED_COUNT];
+    if ((count == 0) || (count > num_lossy * num_blocks * 63)) {
+      return false;
+    }
+    ac.resize(static_cast<size_t>(count));
+    if (counters[DWA_AC_COMPRESSION] == DWA_AC_STATIC_HUFFMAN) {
+#if TINYEXR_USE_PIZ
+      if ((ac_compressed_size > 0x7fffffff) ||
+          !hufUncompress(reinterpret_cast<const char *>(ac_src),
+                         static_cast<int>(ac_compressed_size), &ac,
+                         &scratch->huf)) {
+        return false;
       }
-      return TINYEXR_ERROR_INVALID_DATA;
-    } else if (marker[0] == '\0') {
-      size--;
-      break;
+#else
+      // Huffman decoder is a part of the PIZ code.
+      return false;
+#endif
+    } else if (counters[DWA_AC_COMPRESSION] == DWA_AC_DEFLATE) {
+      unsigned long len =
+          static_cast<unsigned long>(ac.size() * sizeof(unsigned short));
+      if (!InflateZlib(reinterpret_cast<unsigned char *>(&ac.at(0)), &len,
+                       ac_src, static_cast<unsigned long>(ac_compressed_size)) ||
+          (len != ac.size() * sizeof(unsigned short))) {
+        return false;
+      }
+      for (size_t i = 0; i < ac.size(); i++) {
+        tinyexr::swap2(&ac[i]);
+      }
+    } else {
+      return false;
     }
+  }
 
-    std::string attr_name;
-    std::string attr_type;
-    std::vector<unsigned char> data;
-    size_t marker_size;
-    if (!tinyexr::ReadAttribute(&attr_name, &attr_type, &data, &marker_size,
-                                marker, size)) {
-      if (err) {
-        (*err) += "Failed to read attribute.\n";
-      }
-      return TINYEXR_ERROR_INVALID_DATA;
+  // DC: ZIP(zlib with the predictor and the byte reordering).
+  std::vector<unsigned short> &dc = scratch->dc;
+  dc.clear();
+  if (dc_compressed_size > 0) {
+    const tinyexr_uint64 count = counters[DWA_DC_UNCOMPRESSED_COUNT];
+    if ((count == 0) || (count > num_lossy * num_blocks)) {
+      return false;
     }
-    marker += marker_size;
-    size -= marker_size;
+    dc.resize(static_cast<size_t>(count));
+    std::vector<unsigned char> &tmp = scratch->dc_tmp;
+    tmp.resize(dc.size() * sizeof(unsigned short));
+    unsigned long len = static_cast<unsigned long>(tmp.size());
+    if (!InflateZlib(&tmp.at(0), &len, dc_src,
+                     static_cast<unsigned long>(dc_compressed_size)) ||
+        (len != tmp.size())) {
+      return false;
+    }
+    DecodeDeltaPredictor(&tmp.at(0), tmp.size());
+    InterleaveBytes(reinterpret_cast<unsigned char *>(&dc.at(0)), &tmp.at(0),
+                    tmp.size());
+    for (size_t i = 0; i < dc.size(); i++) {
+      tinyexr::swap2(&dc[i]);
+    }
+  }
 
-    // For a multipart file, the version field 9th bit is 0.
-    if ((version->tiled || version->multipart || version->non_image) && attr_name.compare("tiles") == 0) {
-      unsigned int x_size, y_size;
-      unsigned char tile_mode;
-      if (data.size() != 9) {
-        if (err) {
-          (*err) += "(ParseEXRHeader) Invalid attribute data size. Attribute data size must be 9.\n";
-        }
-        return TINYEXR_ERROR_INVALID_DATA;
-      }
+  // RLE: each byte of the values is stored in a separate plane, run length
+  // encoded, then zlib.
+  std::vector<unsigned char> &rle_planar = scratch->rle_planar;
+  if (rle_size > 0) {
+    const tinyexr_uint64 rle_uncompressed_size =
+        counters[DWA_RLE_UNCOMPRESSED_SIZE];
+    if ((counters[DWA_RLE_RAW_SIZE] != rle_size) ||
+        (rle_uncompressed_size == 0) ||
+        (rle_uncompressed_size > 2 * rle_size) || (rle_compressed_size == 0)) {
+      return false;
+    }
+    std::vector<unsigned char> &rle = scratch->rle;
+    rle.resize(static_cast<size_t>(rle_uncompressed_size));
+    unsigned long len = static_cast<unsigned long>(rle.size());
+    if (!InflateZlib(&rle.at(0), &len, rle_src,
+                     static_cast<unsigned long>(rle_compressed_size)) ||
+        (len != rle.size())) {
+      return false;
+    }
+    rle_planar.resize(rle_size);
+    if (rleUncompress(static_cast<int>(rle.size()), static_cast<int>(rle_size),
+                      reinterpret_cast<const signed char *>(&rle.at(0)),
+                      reinterpret_cast<char *>(&rle_planar.at(0))) !=
+        static_cast<int>(rle_size)) {
+      return false;
+    }
+  }
 
-      memcpy(&x_size, &data.at(0), sizeof(int));
-      memcpy(&y_size, &data.at(4), sizeof(int));
-      tile_mode = data[8];
-      tinyexr::swap4(&x_size);
-      tinyexr::swap4(&y_size);
+  const unsigned short *to_linear =
+      (num_lossy > 0) ? GetDwaToLinearTable().table : NULL;
+  const unsigned short *ac_ptr = ac.empty() ? NULL : &ac.at(0);
+  const unsigned short *ac_end = ac_ptr + ac.size();
+  const unsigned short *dc_ptr = dc.empty() ? NULL : &dc.at(0);
+  const unsigned short *dc_end = dc_ptr + dc.size();
 
-      if (x_size > static_cast<unsigned int>(std::numeric_limits<int>::max()) ||
-          y_size > static_cast<unsigned int>(std::numeric_limits<int>::max())) {
-        if (err) {
-          (*err) = "Tile sizes were invalid.";
-        }
-        return TINYEXR_ERROR_UNSUPPORTED_FORMAT;
+  std::vector<unsigned char> &decoded = scratch->decoded;
+  decoded.assign(num_channels, 0);
+
+  // Lossy DCT: RGB triples first, in Y'CbCr.
+  for (size_t s = 0; s < csc_sets.size(); s++) {
+    const int *idx = csc_sets[s].idx;
+    if ((idx[0] < 0) || (idx[1] < 0) || (idx[2] < 0)) {
+      continue;
+    }
+    unsigned char *out[3];
+    int pixel_types[3];
+    for (int i = 0; i < 3; i++) {
+      const size_t c = static_cast<size_t>(idx[i]);
+      if (schemes[c] != DWA_SCHEME_LOSSY_DCT) {
+        return false;
       }
+      out[i] = dst + channel_offsets[c];
+      pixel_types[i] = channels[c].pixel_type;
+      decoded[c] = 1;
+    }
+    if (!DwaDecodeLossyDct(3, out, pixel_types, line_size, width, num_lines,
+                           to_linear, &ac_ptr, ac_end, &dc_ptr, dc_end,
+                           scratch)) {
+      return false;
+    }
+  }
 
-      info->tile_size_x = static_cast<int>(x_size);
-      info->tile_size_y = static_cast<int>(y_size);
+  // Other channels, in channel order.
+  size_t unknown_offset = 0;
+  size_t rle_offset = 0;
+  for (size_t c = 0; c < num_channels; c++) {
+    if (decoded[c]) {
+      continue;
+    }
+    const size_t type_size = B44PixelTypeSize(channels[c].pixel_type);
+    unsigned char *out = dst + channel_offsets[c];
 
-      // mode = levelMode + roundingMode * 16
-      info->tile_level_mode = tile_mode & 0x3;
-      info->tile_rounding_mode = (tile_mode >> 4) & 0x1;
-      info->tiled = 1;
-    } else if (attr_name.compare("compression") == 0) {
-      bool ok = false;
-      if (data[0] < TINYEXR_COMPRESSIONTYPE_PIZ) {
-        ok = true;
+    if (schemes[c] == DWA_SCHEME_LOSSY_DCT) {
+      // Perceptually linear channels are not converted.
+      if (!DwaDecodeLossyDct(1, &out, &channels[c].pixel_type, line_size,
+                             width, num_lines,
+                             channels[c].p_linear ? NULL : to_linear, &ac_ptr,
+                             ac_end, &dc_ptr, dc_end, scratch)) {
+        return false;
       }
-
-      if (data[0] == TINYEXR_COMPRESSIONTYPE_PIZ) {
-#if TINYEXR_USE_PIZ
-        ok = true;
-#else
-        if (err) {
-          (*err) = "PIZ compression is not supported.";
+    } else if (schemes[c] == DWA_SCHEME_RLE) {
+      const unsigned char *planes = &rle_planar.at(rle_offset);
+      for (size_t y = 0; y < h; y++) {
+        unsigned char *o = out + y * line_size;
+        for (size_t x = 0; x < w; x++) {
+          for (size_t b = 0; b < type_size; b++) {
+            o[x * type_size + b] = planes[b * w * h + y * w + x];
+          }
         }
-        return TINYEXR_ERROR_UNSUPPORTED_FORMAT;
-#endif
       }
+      rle_offset += w * h * type_size;
+    } else {
+      for (size_t y = 0; y < h; y++) {
+        memcpy(out + y * line_size, &unknown.at(unknown_offset),
+               w * type_size);
+        unknown_offset += w * type_size;
+      }
+    }
+  }
 
-      if (data[0] == TINYEXR_COMPRESSIONTYPE_ZFP) {
-#if TINYEXR_USE_ZFP
-        ok = true;
-#else
-        if (err) {
-          (*err) = "ZFP compression is not supported.";
-        }
-        return TINYEXR_ERROR_UNSUPPORTED_FORMAT;
+  return true;
+}
+
+#if TINYEXR_SIMD_SSE2 || TINYEXR_SIMD_NEON
+#undef TINYEXR_DWA_LOAD
+#undef TINYEXR_DWA_STORE
+#undef TINYEXR_DWA_SET1
+#undef TINYEXR_DWA_ADD
+#undef TINYEXR_DWA_SUB
+#undef TINYEXR_DWA_MUL
 #endif
-      }
 
-      if (!ok) {
-        if (err) {
-          (*err) = "Unknown compression type.";
-        }
-        return TINYEXR_ERROR_UNSUPPORTED_FORMAT;
-      }
+// End of DWA code from OpenEXR -----------------------------------
+
+// PXR24 code from OpenEXR --------------------------------------
+
+// PXR24 rounds FLOAT values to 24 bits. Each scanline of each channel is
+// stored as the byte planes(most significant byte first) of the differences
+// between adjacent values, and the whole chunk is compressed with zlib.
+// HALF and UINT values are lossless.
+
+// Rounds `f` to 24 bits(sign, 8-bit exponent and 15-bit mantissa).
+// Same as `floatToFloat24` of OpenEXR's ImfPxr24Compressor.cpp.
+static unsigned int FloatToFloat24(float f) {
+  FP32 u;
+  u.f = f;
+  const unsigned int s = u.u & 0x80000000;
+  const unsigned int e = u.u & 0x7f800000;
+  unsigned int m = u.u & 0x007fffff;
+  unsigned int i;
+
+  if (e == 0x7f800000) {
+    if (m) {
+      // NaN: keep the sign and the 15 leftmost mantissa bits, and make sure
+      // the result is still a NaN.
+      m >>= 8;
+      i = (e >> 8) | m | (m == 0);
+    } else {
+      // Infinity.
+      i = e >> 8;
+    }
+  } else {
+    // Round to nearest(ties away from zero). Truncate values which would
+    // overflow to infinity.
+    i = ((e | m) + (m & 0x00000080)) >> 8;
+    if (i >= 0x7f8000) {
+      i = (e | m) >> 8;
+    }
+  }
 
-      info->compression_type = static_cast<int>(data[0]);
-      has_compression = true;
+  return (s >> 8) | i;
+}
 
-    } else if (attr_name.compare("channels") == 0) {
-      // name: zero-terminated string, from 1 to 255 bytes long
-      // pixel type: int, possible values are: UINT = 0 HALF = 1 FLOAT = 2
-      // pLinear: unsigned char, possible values are 0 and 1
-      // reserved: three chars, should be zero
-      // xSampling: int
-      // ySampling: int
+// Bytes per value in the byte planes.
+static size_t Pxr24PixelTypeSize(int pixel_type) {
+  if (pixel_type == TINYEXR_PIXELTYPE_HALF) {
+    return 2;
+  } else if (pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
+    return 3;
+  }
+  return 4;
+}
 
-      if (!ReadChannelInfo(info->channels, data)) {
-        if (err) {
-          (*err) += "Failed to parse channel info.\n";
+// Compresses `src`(a chunk of `width` x `num_lines` pixels, in the layout of
+// the EXR file) into `dst`(`*compressed_size` bytes, at least
+// `ZipCompressBound(src_size)`). `*compressed_size` is the compressed size on
+// output. `level` is TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT or 1 ~ 9.
+// `tmp_buf` is a work buffer(resized as needed).
+static bool CompressPxr24(unsigned char *dst,
+                          tinyexr::tinyexr_uint64 *compressed_size,
+                          const unsigned char *src, int width, int num_lines,
+                          const std::vector<ChannelInfo> &channels,
+                          std::vector<unsigned char> *tmp_buf, int level) {
+  const size_t w = static_cast<size_t>(width);
+  const size_t h = static_cast<size_t>(num_lines);
+
+  size_t planes_size = 0;
+  for (size_t c = 0; c < channels.size(); c++) {
+    planes_size += w * h * Pxr24PixelTypeSize(channels[c].requested_pixel_type);
+  }
+  if (planes_size == 0) {
+    return false;
+  }
+
+  std::vector<unsigned char> &tmp = *tmp_buf;
+  tmp.resize(planes_size);
+  unsigned char *out = &tmp.at(0);
+  const unsigned char *in = src;
+
+  for (size_t y = 0; y < h; y++) {
+    for (size_t c = 0; c < channels.size(); c++) {
+      const int pixel_type = channels[c].requested_pixel_type;
+      unsigned int previous = 0;
+
+      if (pixel_type == TINYEXR_PIXELTYPE_HALF) {
+        unsigned char *p0 = out;
+        unsigned char *p1 = p0 + w;
+        for (size_t x = 0; x < w; x++) {
+          const unsigned int pixel = static_cast<unsigned int>(in[0]) |
+                                     (static_cast<unsigned int>(in[1]) << 8);
+          const unsigned int diff = pixel - previous;
+          previous = pixel;
+          p0[x] = static_cast<unsigned char>(diff >> 8);
+          p1[x] = static_cast<unsigned char>(diff);
+          in += 2;
         }
-        return TINYEXR_ERROR_INVALID_DATA;
+        out += 2 * w;
+      } else if (pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
+        unsigned char *p0 = out;
+        unsigned char *p1 = p0 + w;
+        unsigned char *p2 = p1 + w;
+        for (size_t x = 0; x < w; x++) {
+          float f;
+          memcpy(&f, in, sizeof(float));
+          tinyexr::swap4(&f);
+          const unsigned int pixel = FloatToFloat24(f);
+          const unsigned int diff = pixel - previous;
+          previous = pixel;
+          p0[x] = static_cast<unsigned char>(diff >> 16);
+          p1[x] = static_cast<unsigned char>(diff >> 8);
+          p2[x] = static_cast<unsigned char>(diff);
+          in += 4;
+        }
+        out += 3 * w;
+      } else {
+        unsigned char *p0 = out;
+        unsigned char *p1 = p0 + w;
+        unsigned char *p2 = p1 + w;
+        unsigned char *p3 = p2 + w;
+        for (size_t x = 0; x < w; x++) {
+          unsigned int pixel;
+          memcpy(&pixel, in, sizeof(unsigned int));
+          tinyexr::swap4(&pixel);
+          const unsigned int diff = pixel - previous;
+          previous = pixel;
+          p0[x] = static_cast<unsigned char>(diff >> 24);
+          p1[x] = static_cast<unsigned char>(diff >> 16);
+          p2[x] = static_cast<unsigned char>(diff >> 8);
+          p3[x] = static_cast<unsigned char>(diff);
+          in += 4;
+        }
+        out += 4 * w;
       }
+    }
+  }
 
-      if (info->channels.size() < 1) {
-        if (err) {
-          (*err) += "# of channels is zero.\n";
+  if (level != TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT) {
+    level = (std::min)((std::max)(level, 1), 9);
+  }
+  return DeflateZlib(dst, compressed_size, &tmp.at(0),
+                     static_cast<unsigned long>(planes_size), level);
+}
+
+// Decompresses a PXR24 chunk `src` of `width` x `num_lines` pixels into
+// `dst`(`dst_size` bytes, in the layout of the EXR file). `tmp_buf` is a work
+// buffer(resized as needed).
+static bool DecompressPxr24(unsigned char *dst, size_t dst_size,
+                            const unsigned char *src, size_t src_size,
+                            int width, int num_lines, size_t num_channels,
+                            const EXRChannelInfo *channels,
+                            std::vector<unsigned char> *tmp_buf) {
+  if ((width <= 0) || (num_lines <= 0)) {
+    return false;
+  }
+  const size_t w = static_cast<size_t>(width);
+  const size_t h = static_cast<size_t>(num_lines);
+
+  size_t line_size = 0;
+  size_t planes_size = 0;
+  for (size_t c = 0; c < num_channels; c++) {
+    line_size += w * ((channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) ? 2
+                                                                          : 4);
+    planes_size += w * h * Pxr24PixelTypeSize(channels[c].pixel_type);
+  }
+  if ((line_size * h != dst_size) || (planes_size == 0)) {
+    return false;
+  }
+
+  std::vector<unsigned char> &tmp = *tmp_buf;
+  tmp.resize(planes_size);
+  unsigned long len = static_cast<unsigned long>(planes_size);
+  if (!InflateZlib(&tmp.at(0), &len, src,
+                   static_cast<unsigned long>(src_size)) ||
+      (len != planes_size)) {
+    return false;
+  }
+
+  const unsigned char *in = &tmp.at(0);
+  unsigned char *out = dst;
+
+  for (size_t y = 0; y < h; y++) {
+    for (size_t c = 0; c < num_channels; c++) {
+      const int pixel_type = channels[c].pixel_type;
+      unsigned int pixel = 0;
+
+      if (pixel_type == TINYEXR_PIXELTYPE_HALF) {
+        const unsigned char *p0 = in;
+        const unsigned char *p1 = p0 + w;
+        for (size_t x = 0; x < w; x++) {
+          pixel += (static_cast<unsigned int>(p0[x]) << 8) | p1[x];
+          out[0] = static_cast<unsigned char>(pixel);
+          out[1] = static_cast<unsigned char>(pixel >> 8);
+          out += 2;
         }
-        return TINYEXR_ERROR_INVALID_DATA;
+        in += 2 * w;
+      } else if (pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
+        const unsigned char *p0 = in;
+        const unsigned char *p1 = p0 + w;
+        const unsigned char *p2 = p1 + w;
+        for (size_t x = 0; x < w; x++) {
+          pixel += (static_cast<unsigned int>(p0[x]) << 24) |
+                   (static_cast<unsigned int>(p1[x]) << 16) |
+                   (static_cast<unsigned int>(p2[x]) << 8);
+          out[0] = static_cast<unsigned char>(pixel);
+          out[1] = static_cast<unsigned char>(pixel >> 8);
+          out[2] = static_cast<unsigned char>(pixel >> 16);
+          out[3] = static_cast<unsigned char>(pixel >> 24);
+          out += 4;
+        }
+        in += 3 * w;
+      } else {
+        const unsigned char *p0 = in;
+        const unsigned char *p1 = p0 + w;
+        const unsigned char *p2 = p1 + w;
+        const unsigned char *p3 = p2 + w;
+        for (size_t x = 0; x < w; x++) {
+          pixel += (static_cast<unsigned int>(p0[x]) << 24) |
+                   (static_cast<unsigned int>(p1[x]) << 16) |
+                   (static_cast<unsigned int>(p2[x]) << 8) | p3[x];
+          out[0] = static_cast<unsigned char>(pixel);
+          out[1] = static_cast<unsigned char>(pixel >> 8);
+          out[2] = static_cast<unsigned char>(pixel >> 16);
+          out[3] = static_cast<unsigned char>(pixel >> 24);
+          out += 4;
+        }
+        in += 4 * w;
       }
+    }
+  }
 
-      has_channels = true;
+  return true;
+}
 
-    } else if (attr_name.compare("dataWindow") == 0) {
-      if (data.size() >= 16) {
-        memcpy(&info->data_window.min_x, &data.at(0), sizeof(int));
-        memcpy(&info->data_window.min_y, &data.at(4), sizeof(int));
-        memcpy(&info->data_window.max_x, &data.at(8), sizeof(int));
-        memcpy(&info->data_window.max_y, &data.at(12), sizeof(int));
-        tinyexr::swap4(&info->data_window.min_x);
-        tinyexr::swap4(&info->data_window.min_y);
-        tinyexr::swap4(&info->data_window.max_x);
-        tinyexr::swap4(&info->data_window.max_y);
-        has_data_window = true;
-      }
-    } else if (attr_name.compare("displayWindow") == 0) {
-      if (data.size() >= 16) {
-        memcpy(&info->display_window.min_x, &data.at(0), sizeof(int));
-        memcpy(&info->display_window.min_y, &data.at(4), sizeof(int));
-        memcpy(&info->display_window.max_x, &data.at(8), sizeof(int));
-        memcpy(&info->display_window.max_y, &data.at(12), sizeof(int));
-        tinyexr::swap4(&info->display_window.min_x);
-        tinyexr::swap4(&info->display_window.min_y);
-        tinyexr::swap4(&info->display_window.max_x);
-        tinyexr::swap4(&info->display_window.max_y);
+// End of PXR24 code from OpenEXR -----------------------------------
 
-        has_display_window = true;
-      }
-    } else if (attr_name.compare("lineOrder") == 0) {
-      if (data.size() >= 1) {
-        info->line_order = static_cast<int>(data[0]);
-        has_line_order = true;
-      }
-    } else if (attr_name.compare("pixelAspectRatio") == 0) {
-      if (data.size() >= sizeof(float)) {
-        memcpy(&info->pixel_aspect_ratio, &data.at(0), sizeof(float));
-        tinyexr::swap4(&info->pixel_aspect_ratio);
-        has_pixel_aspect_ratio = true;
-      }
-    } else if (attr_name.compare("screenWindowCenter") == 0) {
-      if (data.size() >= 8) {
-        memcpy(&info->screen_window_center[0], &data.at(0), sizeof(float));
-        memcpy(&info->screen_window_center[1], &data.at(4), sizeof(float));
-        tinyexr::swap4(&info->screen_window_center[0]);
-        tinyexr::swap4(&info->screen_window_center[1]);
-        has_screen_window_center = true;
-      }
-    } else if (attr_name.compare("screenWindowWidth") == 0) {
-      if (data.size() >= sizeof(float)) {
-        memcpy(&info->screen_window_width, &data.at(0), sizeof(float));
-        tinyexr::swap4(&info->screen_window_width);
+#if TINYEXR_USE_ZFP
 
-        has_screen_window_width = true;
-      }
-    } else if (attr_name.compare("chunkCount") == 0) {
-      if (data.size() >= sizeof(int)) {
-        memcpy(&info->chunk_count, &data.at(0), sizeof(int));
-        tinyexr::swap4(&info->chunk_count);
-      }
-    } else if (attr_name.compare("name") == 0) {
-      if (!data.empty() && data[0]) {
-        data.push_back(0);
-        size_t len = strlen(reinterpret_cast<const char*>(&data[0]));
-        info->name.resize(len);
-        info->name.assign(reinterpret_cast<const char*>(&data[0]), len);
-        has_name = true;
-      }
-    } else if (attr_name.compare("type") == 0) {
-      if (!data.empty() && data[0]) {
-        data.push_back(0);
-        size_t len = strlen(reinterpret_cast<const char*>(&data[0]));
-        info->type.resize(len);
-        info->type.assign(reinterpret_cast<const char*>(&data[0]), len);
-        has_type = true;
-      }
-    } else {
-      // Custom attribute(up to TINYEXR_MAX_CUSTOM_ATTRIBUTES)
-      if (info->attributes.size() < TINYEXR_MAX_CUSTOM_ATTRIBUTES) {
-        EXRAttribute attrib;
-#ifdef _MSC_VER
-        strncpy_s(attrib.name, attr_name.c_str(), 255);
-        strncpy_s(attrib.type, attr_type.c_str(), 255);
-#else
-        strncpy(attrib.name, attr_name.c_str(), 255);
-        strncpy(attrib.type, attr_type.c_str(), 255);
-#endif
-        attrib.name[255] = '\0';
-        attrib.type[255] = '\0';
-        //std::cout << "i = " << info->attributes.size() << ", dsize = " << data.size() << "\n";
-        attrib.size = static_cast<int>(data.size());
-        attrib.value = static_cast<unsigned char *>(malloc(data.size()));
-        memcpy(reinterpret_cast<char *>(attrib.value), &data.at(0),
-               data.size());
-        info->attributes.push_back(attrib);
-      }
-    }
+struct ZFPCompressionParam {
+  double rate;
+  unsigned int precision;
+  unsigned int __pad0;
+  double tolerance;
+  int type;  // TINYEXR_ZFP_COMPRESSIONTYPE_*
+  unsigned int __pad1;
+
+  ZFPCompressionParam() {
+    type = TINYEXR_ZFP_COMPRESSIONTYPE_RATE;
+    rate = 2.0;
+    precision = 0;
+    tolerance = 0.0;
   }
+};
 
-  // Check if required attributes exist
-  {
-    std::stringstream ss_err;
+static bool FindZFPCompressionParam(ZFPCompressionParam *param,
+                                    const EXRAttribute *attributes,
+                                    int num_attributes, std::string *err) {
+  bool foundType = false;
 
-    if (!has_compression) {
-      ss_err << "\"compression\" attribute not found in the header."
-             << std::endl;
+  for (int i = 0; i < num_attributes; i++) {
+    if ((strcmp(attributes[i].name, "zfpCompressionType") == 0)) {
+      if (attributes[i].size == 1) {
+        param->type = static_cast<int>(attributes[i].value[0]);
+        foundType = true;
+        break;
+      } else {
+        if (err) {
+          (*err) +=
+              "zfpCompressionType attribute must be uchar(1 byte) type.\n";
+        }
+        return false;
+      }
     }
+  }
 
-    if (!has_channels) {
-      ss_err << "\"channels\" attribute not found in the header." << std::endl;
+  if (!foundType) {
+    if (err) {
+      (*err) += "`zfpCompressionType` attribute not found.\n";
     }
+    return false;
+  }
 
-    if (!has_line_order) {
-      ss_err << "\"lineOrder\" attribute not found in the header." << std::endl;
+  if (param->type == TINYEXR_ZFP_COMPRESSIONTYPE_RATE) {
+    for (int i = 0; i < num_attributes; i++) {
+      if ((strcmp(attributes[i].name, "zfpCompressionRate") == 0) &&
+          (attributes[i].size == 8)) {
+        param->rate = *(reinterpret_cast<double *>(attributes[i].value));
+        return true;
+      }
     }
 
-    if (!has_display_window) {
-      ss_err << "\"displayWindow\" attribute not found in the header."
-             << std::endl;
+    if (err) {
+      (*err) += "`zfpCompressionRate` attribute not found.\n";
     }
 
-    if (!has_data_window) {
-      ss_err << "\"dataWindow\" attribute not found in the header or invalid."
-             << std::endl;
+  } else if (param->type == TINYEXR_ZFP_COMPRESSIONTYPE_PRECISION) {
+    for (int i = 0; i < num_attributes; i++) {
+      if ((strcmp(attributes[i].name, "zfpCompressionPrecision") == 0) &&
+          (attributes[i].size == 4)) {
+        param->rate = *(reinterpret_cast<int *>(attributes[i].value));
+        return true;
+      }
     }
 
-    if (!has_pixel_aspect_ratio) {
-      ss_err << "\"pixelAspectRatio\" attribute not found in the header."
-             << std::endl;
+    if (err) {
+      (*err) += "`zfpCompressionPrecision` attribute not found.\n";
     }
 
-    if (!has_screen_window_width) {
-      ss_err << "\"screenWindowWidth\" attribute not found in the header."
-             << std::endl;
+  } else if (param->type == TINYEXR_ZFP_COMPRESSIONTYPE_ACCURACY) {
+    for (int i = 0; i < num_attributes; i++) {
+      if ((strcmp(attributes[i].name, "zfpCompressionTolerance") == 0) &&
+          (attributes[i].size == 8)) {
+        param->tolerance = *(reinterpret_cast<double *>(attributes[i].value));
+        return true;
+      }
     }
 
-    if (!has_screen_window_center) {
-      ss_err << "\"screenWindowCenter\" attribute not found in the header."
-             << std::endl;
+    if (err) {
+      (*err) += "`zfpCompressionTolerance` attribute not found.\n";
     }
-
-    if (version->multipart || version->non_image) {
-      if (!has_name) {
-        ss_err << "\"name\" attribute not found in the header."
-          << std::endl;
-      }
-      if (!has_type) {
-        ss_err << "\"type\" attribute not found in the header."
-          << std::endl;
-      }
+  } else {
+    if (err) {
+      (*err) += "Unknown value specified for `zfpCompressionType`.\n";
     }
+  }
 
-    if (!(ss_err.str().empty())) {
-      if (err) {
-        (*err) += ss_err.str();
-      }
+  return false;
+}
 
-      return TINYEXR_ERROR_INVALID_HEADER;
-    }
+// Assume pixel format is FLOAT for all channels.
+static bool DecompressZfp(float *dst, int dst_width, int dst_num_lines,
+                          size_t num_channels, const unsigned char *src,
+                          unsigned long src_size,
+                          const ZFPCompressionParam &param) {
+  size_t uncompressed_size =
+      size_t(dst_width) * size_t(dst_num_lines) * num_channels;
+
+  if (uncompressed_size == src_size) {
+    // Data is not compressed(Issue 40).
+    memcpy(dst, src, src_size);
   }
 
-  info->header_len = static_cast<unsigned int>(orig_size - size);
+  zfp_stream *zfp = NULL;
+  zfp_field *field = NULL;
 
-  return TINYEXR_SUCCESS;
-}
+  TINYEXR_CHECK_AND_RETURN_C((dst_width % 4) == 0, false);
+  TINYEXR_CHECK_AND_RETURN_C((dst_num_lines % 4) == 0, false);
 
-// C++ HeaderInfo to C EXRHeader conversion.
-static bool ConvertHeader(EXRHeader *exr_header, const HeaderInfo &info, std::string *warn, std::string *err) {
-  exr_header->pixel_aspect_ratio = info.pixel_aspect_ratio;
-  exr_header->screen_window_center[0] = info.screen_window_center[0];
-  exr_header->screen_window_center[1] = info.screen_window_center[1];
-  exr_header->screen_window_width = info.screen_window_width;
-  exr_header->chunk_count = info.chunk_count;
-  exr_header->display_window.min_x = info.display_window.min_x;
-  exr_header->display_window.min_y = info.display_window.min_y;
-  exr_header->display_window.max_x = info.display_window.max_x;
-  exr_header->display_window.max_y = info.display_window.max_y;
-  exr_header->data_window.min_x = info.data_window.min_x;
-  exr_header->data_window.min_y = info.data_window.min_y;
-  exr_header->data_window.max_x = info.data_window.max_x;
-  exr_header->data_window.max_y = info.data_window.max_y;
-  exr_header->line_order = info.line_order;
-  exr_header->compression_type = info.compression_type;
-  exr_header->tiled = info.tiled;
-  exr_header->tile_size_x = info.tile_size_x;
-  exr_header->tile_size_y = info.tile_size_y;
-  exr_header->tile_level_mode = info.tile_level_mode;
-  exr_header->tile_rounding_mode = info.tile_rounding_mode;
+  if ((size_t(dst_width) & 3U) || (size_t(dst_num_lines) & 3U)) {
+    return false;
+  }
 
-  EXRSetNameAttr(exr_header, info.name.c_str());
+  field =
+      zfp_field_2d(reinterpret_cast<void *>(const_cast<unsigned char *>(src)),
+                   zfp_type_float, static_cast<unsigned int>(dst_width),
+                   static_cast<unsigned int>(dst_num_lines) *
+                       static_cast<unsigned int>(num_channels));
+  zfp = zfp_stream_open(NULL);
 
+  if (param.type == TINYEXR_ZFP_COMPRESSIONTYPE_RATE) {
+    zfp_stream_set_rate(zfp, param.rate, zfp_type_float, /* dimension */ 2,
+                        /* write random access */ 0);
+  } else if (param.type == TINYEXR_ZFP_COMPRESSIONTYPE_PRECISION) {
+    zfp_stream_set_precision(zfp, param.precision);
+  } else if (param.type == TINYEXR_ZFP_COMPRESSIONTYPE_ACCURACY) {
+    zfp_stream_set_accuracy(zfp, param.tolerance);
+  } else {
+    return false;
+  }
 
-  if (!info.type.empty()) {
-    bool valid = true;
-    if (info.type == "scanlineimage") {
-      if (exr_header->tiled) {
-        if (err) {
-          (*err) += "(ConvertHeader) tiled bit must be off for `scanlineimage` type.\n";
-        }
-        valid = false;
-      }
-    } else if (info.type == "tiledimage") {
-      if (!exr_header->tiled) {
-        if (err) {
-          (*err) += "(ConvertHeader) tiled bit must be on for `tiledimage` type.\n";
-        }
-        valid = false;
-      }
-    } else if (info.type == "deeptile") {
-      exr_header->non_image = 1;
-      if (!exr_header->tiled) {
-        if (err) {
-          (*err) += "(ConvertHeader) tiled bit must be on for `deeptile` type.\n";
-        }
-        valid = false;
-      }
-    } else if (info.type == "deepscanline") {
-      exr_header->non_image = 1;
-      if (exr_header->tiled) {
-        if (err) {
-          (*err) += "(ConvertHeader) tiled bit must be off for `deepscanline` type.\n";
+  size_t buf_size = zfp_stream_maximum_size(zfp, field);
+  std::vector<unsigned char> buf(buf_size);
+  memcpy(&buf.at(0), src, src_size);
+
+  bitstream *stream = stream_open(&buf.at(0), buf_size);
+  zfp_stream_set_bit_stream(zfp, stream);
+  zfp_stream_rewind(zfp);
+
+  size_t image_size = size_t(dst_width) * size_t(dst_num_lines);
+
+  for (size_t c = 0; c < size_t(num_channels); c++) {
+    // decompress 4x4 pixel block.
+    for (size_t y = 0; y < size_t(dst_num_lines); y += 4) {
+      for (size_t x = 0; x < size_t(dst_width); x += 4) {
+        float fblock[16];
+        zfp_decode_block_float_2(zfp, fblock);
+        for (size_t j = 0; j < 4; j++) {
+          for (size_t i = 0; i < 4; i++) {
+            dst[c * image_size + ((y + j) * size_t(dst_width) + (x + i))] =
+                fblock[j * 4 + i];
+          }
         }
-        //valid = false;
       }
-    } else {
-      if (warn) {
-        std::stringstream ss;
-        ss << "(ConvertHeader) Unsupported or unknown info.type: " << info.type << "\n";
-        (*warn) += ss.str();
-      }
-    }
-
-    if (!valid) {
-      return false;
     }
   }
 
-  exr_header->num_channels = static_cast<int>(info.channels.size());
+  zfp_field_free(field);
+  zfp_stream_close(zfp);
+  stream_close(stream);
 
-  exr_header->channels = static_cast<EXRChannelInfo *>(malloc(
-      sizeof(EXRChannelInfo) * static_cast<size_t>(exr_header->num_channels)));
-  for (size_t c = 0; c < static_cast<size_t>(exr_header->num_channels); c++) {
-#ifdef _MSC_VER
-    strncpy_s(exr_header->channels[c].name, info.channels[c].name.c_str(), 255);
-#else
-    strncpy(exr_header->channels[c].name, info.channels[c].name.c_str(), 255);
-#endif
-    // manually add '\0' for safety.
-    exr_header->channels[c].name[255] = '\0';
+  return true;
+}
 
-    exr_header->channels[c].pixel_type = info.channels[c].pixel_type;
-    exr_header->channels[c].p_linear = info.channels[c].p_linear;
-    exr_header->channels[c].x_sampling = info.channels[c].x_sampling;
-    exr_header->channels[c].y_sampling = info.channels[c].y_sampling;
-  }
+// Assume pixel format is FLOAT for all channels.
+static bool CompressZfp(std::vector<unsigned char> *outBuf,
+                        unsigned int *outSize, const float *inPtr, int width,
+                        int num_lines, int num_channels,
+                        const ZFPCompressionParam &param) {
+  zfp_stream *zfp = NULL;
+  zfp_field *field = NULL;
 
-  exr_header->pixel_types = static_cast<int *>(
-      malloc(sizeof(int) * static_cast<size_t>(exr_header->num_channels)));
-  for (size_t c = 0; c < static_cast<size_t>(exr_header->num_channels); c++) {
-    exr_header->pixel_types[c] = info.channels[c].pixel_type;
+  TINYEXR_CHECK_AND_RETURN_C((width % 4) == 0, false);
+  TINYEXR_CHECK_AND_RETURN_C((num_lines % 4) == 0, false);
+
+  if ((size_t(width) & 3U) || (size_t(num_lines) & 3U)) {
+    return false;
   }
 
-  // Initially fill with values of `pixel_types`
-  exr_header->requested_pixel_types = static_cast<int *>(
-      malloc(sizeof(int) * static_cast<size_t>(exr_header->num_channels)));
-  for (size_t c = 0; c < static_cast<size_t>(exr_header->num_channels); c++) {
-    exr_header->requested_pixel_types[c] = info.channels[c].pixel_type;
+  // create input array.
+  field = zfp_field_2d(reinterpret_cast<void *>(const_cast<float *>(inPtr)),
+                       zfp_type_float, static_cast<unsigned int>(width),
+                       static_cast<unsigned int>(num_lines * num_channels));
+
+  zfp = zfp_stream_open(NULL);
+
+  if (param.type == TINYEXR_ZFP_COMPRESSIONTYPE_RATE) {
+    zfp_stream_set_rate(zfp, param.rate, zfp_type_float, 2, 0);
+  } else if (param.type == TINYEXR_ZFP_COMPRESSIONTYPE_PRECISION) {
+    zfp_stream_set_precision(zfp, param.precision);
+  } else if (param.type == TINYEXR_ZFP_COMPRESSIONTYPE_ACCURACY) {
+    zfp_stream_set_accuracy(zfp, param.tolerance);
+  } else {
+    return false;
   }
 
-  exr_header->num_custom_attributes = static_cast<int>(info.attributes.size());
+  size_t buf_size = zfp_stream_maximum_size(zfp, field);
 
-  if (exr_header->num_custom_attributes > 0) {
-    // TODO(syoyo): Report warning when # of attributes exceeds
-    // `TINYEXR_MAX_CUSTOM_ATTRIBUTES`
-    if (exr_header->num_custom_attributes > TINYEXR_MAX_CUSTOM_ATTRIBUTES) {
-      exr_header->num_custom_attributes = TINYEXR_MAX_CUSTOM_ATTRIBUTES;
-    }
+  outBuf->resize(buf_size);
 
-    exr_header->custom_attributes = static_cast<EXRAttribute *>(malloc(
-        sizeof(EXRAttribute) * size_t(exr_header->num_custom_attributes)));
+  bitstream *stream = stream_open(&outBuf->at(0), buf_size);
+  zfp_stream_set_bit_stream(zfp, stream);
+  zfp_field_free(field);
 
-    for (size_t i = 0; i < size_t(exr_header->num_custom_attributes); i++) {
-      memcpy(exr_header->custom_attributes[i].name, info.attributes[i].name,
-             256);
-      memcpy(exr_header->custom_attributes[i].type, info.attributes[i].type,
-             256);
-      exr_header->custom_attributes[i].size = info.attributes[i].size;
-      // Just copy pointer
-      exr_header->custom_attributes[i].value = info.attributes[i].value;
-    }
+  size_t image_size = size_t(width) * size_t(num_lines);
 
-  } else {
-    exr_header->custom_attributes = NULL;
+  for (size_t c = 0; c < size_t(num_channels); c++) {
+    // compress 4x4 pixel block.
+    for (size_t y = 0; y < size_t(num_lines); y += 4) {
+      for (size_t x = 0; x < size_t(width); x += 4) {
+        float fblock[16];
+        for (size_t j = 0; j < 4; j++) {
+          for (size_t i = 0; i < 4; i++) {
+            fblock[j * 4 + i] =
+                inPtr[c * image_size + ((y + j) * size_t(width) + (x + i))];
+          }
+        }
+        zfp_encode_block_float_2(zfp, fblock);
+      }
+    }
   }
 
-  exr_header->header_len = info.header_len;
+  zfp_stream_flush(zfp);
+  (*outSize) = static_cast<unsigned int>(zfp_stream_compressed_size(zfp));
+
+  zfp_stream_close(zfp);
 
   return true;
 }
 
-struct OffsetData {
-  OffsetData() : num_x_levels(0), num_y_levels(0) {}
-  std::vector<std::vector<std::vector <tinyexr::tinyexr_uint64> > > offsets;
-  int num_x_levels;
-  int num_y_levels;
-};
-
-// -1 = error
-static int LevelIndex(int lx, int ly, int tile_level_mode, int num_x_levels) {
-  switch (tile_level_mode) {
-  case TINYEXR_TILE_ONE_LEVEL:
-    return 0;
+#endif
 
-  case TINYEXR_TILE_MIPMAP_LEVELS:
-    return lx;
+//
+// -----------------------------------------------------------------
+//
 
-  case TINYEXR_TILE_RIPMAP_LEVELS:
-    return lx + ly * num_x_levels;
+// heuristics
+#define TINYEXR_DIMENSION_THRESHOLD (1024 * 8192)
 
-  default:
-    return -1;
+// Converts float to unsigned int. NaN and negative values are clamped to 0.
+static unsigned int FloatToUInt(float f) {
+  if (!(f > 0.0f)) {
+    return 0;
   }
-  return 0;
+  if (f >= 4294967296.0f) {
+    return 0xffffffffu;
+  }
+  return static_cast<unsigned int>(f);
 }
 
-static int LevelSize(int toplevel_size, int level, int tile_rounding_mode) {
-  if (level < 0) {
-    return -1;
+// Converts `n` pixels of `src_type` at `src`(uncompressed pixel data; little
+// endian, no alignment requirement) to `dst_type` and stores them to `dst`
+// with the stride of `x_stride` bytes(no alignment requirement).
+static bool ConvertPixelLine(unsigned char *dst, size_t x_stride, int dst_type,
+                             const unsigned char *src, int src_type,
+                             size_t n) {
+  if ((dst_type != TINYEXR_PIXELTYPE_UINT) &&
+      (dst_type != TINYEXR_PIXELTYPE_HALF) &&
+      (dst_type != TINYEXR_PIXELTYPE_FLOAT)) {
+    return false;
   }
 
-  int b = static_cast<int>(1u << static_cast<unsigned int>(level));
-  int level_size = toplevel_size / b;
+  if (src_type == TINYEXR_PIXELTYPE_HALF) {
+    if (dst_type == TINYEXR_PIXELTYPE_HALF) {
+#if TINYEXR_LITTLE_ENDIAN
+      if (x_stride == sizeof(unsigned short)) {
+        memcpy(dst, src, n * sizeof(unsigned short));
+        return true;
+      }
+#endif
+      for (size_t u = 0; u < n; u++) {
+        unsigned short hf;
+        memcpy(&hf, src + u * sizeof(unsigned short), sizeof(unsigned short));
+        tinyexr::swap2(&hf);
+        memcpy(dst + u * x_stride, &hf, sizeof(unsigned short));
+      }
+    } else {
+      // Convert in small batches so that the vectorized conversion is also
+      // used for interleaved or unaligned destination.
+      float buf[256];
+      const size_t kBatch = sizeof(buf) / sizeof(buf[0]);
+      for (size_t i = 0; i < n; i += kBatch) {
+        size_t m = (std::min)(kBatch, n - i);
+        tinyexr::HalfToFloatLine(buf, src + i * sizeof(unsigned short), m);
+        unsigned char *d = dst + i * x_stride;
+        if (dst_type == TINYEXR_PIXELTYPE_FLOAT) {
+          if (x_stride == sizeof(float)) {
+            memcpy(d, buf, m * sizeof(float));
+          } else {
+            for (size_t j = 0; j < m; j++) {
+              memcpy(d + j * x_stride, &buf[j], sizeof(float));
+            }
+          }
+        } else {
+          for (size_t j = 0; j < m; j++) {
+            unsigned int val = FloatToUInt(buf[j]);
+            memcpy(d + j * x_stride, &val, sizeof(unsigned int));
+          }
+        }
+      }
+    }
+  } else if ((src_type == TINYEXR_PIXELTYPE_FLOAT) ||
+             (src_type == TINYEXR_PIXELTYPE_UINT)) {
+#if TINYEXR_LITTLE_ENDIAN
+    if ((dst_type == src_type) && (x_stride == sizeof(unsigned int))) {
+      memcpy(dst, src, n * sizeof(unsigned int));
+      return true;
+    }
+#endif
+    for (size_t u = 0; u < n; u++) {
+      unsigned int val;
+      memcpy(&val, src + u * sizeof(unsigned int), sizeof(unsigned int));
+      tinyexr::swap4(&val);
+
+      unsigned char *d = dst + u * x_stride;
+      if (dst_type == src_type) {
+        memcpy(d, &val, sizeof(unsigned int));
+        continue;
+      }
 
-  if (tile_rounding_mode == TINYEXR_TILE_ROUND_UP && level_size * b < toplevel_size)
-    level_size += 1;
+      tinyexr::FP32 f32;
+      if (src_type == TINYEXR_PIXELTYPE_FLOAT) {
+        f32.u = val;
+      } else {
+        f32.f = static_cast<float>(val);
+      }
 
-  return std::max(level_size, 1);
-}
+      if (dst_type == TINYEXR_PIXELTYPE_HALF) {
+        tinyexr::FP16 f16 = tinyexr::float_to_half_full(f32);
+        memcpy(d, &f16.u, sizeof(unsigned short));
+      } else if (dst_type == TINYEXR_PIXELTYPE_FLOAT) {
+        memcpy(d, &f32.f, sizeof(float));
+      } else {
+        unsigned int uval = FloatToUInt(f32.f);
+        memcpy(d, &uval, sizeof(unsigned int));
+      }
+    }
+  } else {
+    return false;
+  }
 
-static int DecodeTiledLevel(EXRImage* exr_image, const EXRHeader* exr_header,
-  const OffsetData& offset_data,
-  const std::vector<size_t>& channel_offset_list,
-  int pixel_data_size,
-  const unsigned char* head, const size_t size,
-  std::string* err) {
-  int num_channels = exr_header->num_channels;
+  return true;
+}
 
-  int level_index = LevelIndex(exr_image->level_x, exr_image->level_y, exr_header->tile_level_mode, offset_data.num_x_levels);
-  int num_y_tiles = int(offset_data.offsets[size_t(level_index)].size());
-  if (num_y_tiles < 1) {
-    return TINYEXR_ERROR_INVALID_DATA;
+// TODO(syoyo): Refactor function arguments.
+// Converts uncompressed pixel data of a scanline block(or a tile) into
+// the frame buffer `slices`.
+//
+// `src` has the uncompressed layout of OpenEXR:
+//   pixel sample data for channel 0 for scanline 0
+//   pixel sample data for channel 1 for scanline 0
+//   pixel sample data for channel ... for scanline 0
+//   pixel sample data for channel n for scanline 0
+//   pixel sample data for channel 0 for scanline 1
+//   ...
+// and each scanline has `width` pixels.
+//
+// Columns [x_offset, x_offset + out_width) of scanline `v` are stored to
+// the row `line_no + v`(or `height - 1 - (line_no + v)` when `line_order` is
+// not 0) of `slices`. Scanlines whose row is outside of [0, height) and
+// channels whose slice has NULL `base` are skipped.
+static bool UnpackPixelData(const EXRFrameBufferSlice *slices,
+                            const unsigned char *src, size_t src_len,
+                            int line_order, int width, int height,
+                            int line_no, int num_lines, int x_offset,
+                            int out_width, size_t pixel_data_size,
+                            size_t num_channels,
+                            const EXRChannelInfo *channels,
+                            const std::vector<size_t> &channel_offset_list) {
+  if ((x_offset < 0) || (out_width < 0) || (x_offset + out_width > width)) {
+    return false;
   }
-  int num_x_tiles = int(offset_data.offsets[size_t(level_index)][0].size());
-  if (num_x_tiles < 1) {
-    return TINYEXR_ERROR_INVALID_DATA;
+
+  if (src_len < static_cast<size_t>(width) * static_cast<size_t>(num_lines) *
+                    pixel_data_size) {
+    // Insufficient data size
+    return false;
   }
-  int num_tiles = num_x_tiles * num_y_tiles;
 
-  int err_code = TINYEXR_SUCCESS;
+  for (size_t c = 0; c < num_channels; c++) {
+    if (slices[c].base == NULL) {
+      continue;
+    }
 
-  enum {
-    EF_SUCCESS = 0,
-    EF_INVALID_DATA = 1,
-    EF_INSUFFICIENT_DATA = 2,
-    EF_FAILED_TO_DECODE = 4
-  };
-#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
-  std::atomic<unsigned> error_flag(EF_SUCCESS);
-#else
-  unsigned error_flag(EF_SUCCESS);
-#endif
+    size_t type_size = (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF)
+                           ? sizeof(unsigned short)
+                           : sizeof(float);
 
-  // Although the spec says : "...the data window is subdivided into an array of smaller rectangles...",
-  // the IlmImf library allows the dimensions of the tile to be larger (or equal) than the dimensions of the data window.
-#if 0
-  if ((exr_header->tile_size_x > exr_image->width || exr_header->tile_size_y > exr_image->height) &&
-    exr_image->level_x == 0 && exr_image->level_y == 0) {
-    if (err) {
-      (*err) += "Failed to decode tile data.\n";
-    }
-    err_code = TINYEXR_ERROR_INVALID_DATA;
-  }
-#endif
-  exr_image->tiles = static_cast<EXRTile*>(
-    calloc(sizeof(EXRTile), static_cast<size_t>(num_tiles)));
+    for (int v = 0; v < num_lines; v++) {
+      int row = (line_order == 0) ? (line_no + v) : (height - 1 - (line_no + v));
+      if ((row < 0) || (row >= height)) {
+        continue;
+      }
 
-#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
-  std::vector<std::thread> workers;
-  std::atomic<int> tile_count(0);
+      const unsigned char *line_ptr =
+          src + static_cast<size_t>(v) * pixel_data_size * size_t(width) +
+          channel_offset_list[c] * static_cast<size_t>(width) +
+          static_cast<size_t>(x_offset) * type_size;
+      unsigned char *out_ptr =
+          slices[c].base + static_cast<size_t>(row) * slices[c].y_stride;
 
-  int num_threads = std::max(1, int(std::thread::hardware_concurrency()));
-  if (num_threads > int(num_tiles)) {
-    num_threads = int(num_tiles);
+      if (!ConvertPixelLine(out_ptr, slices[c].x_stride, slices[c].pixel_type,
+                            line_ptr, channels[c].pixel_type,
+                            static_cast<size_t>(out_width))) {
+        return false;
+      }
+    }
   }
 
-  for (int t = 0; t < num_threads; t++) {
-    workers.emplace_back(std::thread([&]()
-      {
-        int tile_idx = 0;
-        while ((tile_idx = tile_count++) < num_tiles) {
+  return true;
+}
 
-#else
-#if TINYEXR_USE_OPENMP
-#pragma omp parallel for
-#endif
-  for (int tile_idx = 0; tile_idx < num_tiles; tile_idx++) {
-#endif
-    // Allocate memory for each tile.
-    bool alloc_success = false;
-    exr_image->tiles[tile_idx].images = tinyexr::AllocateImage(
-      num_channels, exr_header->channels,
-      exr_header->requested_pixel_types, exr_header->tile_size_x,
-      exr_header->tile_size_y, &alloc_success);
-
-    if (!alloc_success) {
-      error_flag |= EF_INVALID_DATA;
-      continue;
-    }
-
-    int x_tile = tile_idx % num_x_tiles;
-    int y_tile = tile_idx / num_x_tiles;
-    // 16 byte: tile coordinates
-    // 4 byte : data size
-    // ~      : data(uncompressed or compressed)
-    tinyexr::tinyexr_uint64 offset = offset_data.offsets[size_t(level_index)][size_t(y_tile)][size_t(x_tile)];
-    if (offset + sizeof(int) * 5 > size) {
-      // Insufficient data size.
-      error_flag |= EF_INSUFFICIENT_DATA;
+// Sets up frame buffer slices for planar `images`(row stride = `x_stride`
+// pixels) with the pixel type of `requested_pixel_types`.
+// Only HALF channel can be requested as a different pixel type(FLOAT).
+// Channels whose `images[c]` is NULL are not decoded.
+static bool SetupPlanarSlices(std::vector<EXRFrameBufferSlice> *slices,
+                              unsigned char **images,
+                              const int *requested_pixel_types,
+                              size_t num_channels,
+                              const EXRChannelInfo *channels, int x_stride) {
+  slices->resize(num_channels);
+  for (size_t c = 0; c < num_channels; c++) {
+    if (images[c] == NULL) {
+      memset(&(*slices)[c], 0, sizeof(EXRFrameBufferSlice));
       continue;
     }
 
-    size_t data_size =
-      size_t(size - (offset + sizeof(int) * 5));
-    const unsigned char* data_ptr =
-      reinterpret_cast<const unsigned char*>(head + offset);
-
-    int tile_coordinates[4];
-    memcpy(tile_coordinates, data_ptr, sizeof(int) * 4);
-    tinyexr::swap4(&tile_coordinates[0]);
-    tinyexr::swap4(&tile_coordinates[1]);
-    tinyexr::swap4(&tile_coordinates[2]);
-    tinyexr::swap4(&tile_coordinates[3]);
-
-    if (tile_coordinates[2] != exr_image->level_x) {
-      // Invalid data.
-      error_flag |= EF_INVALID_DATA;
-      continue;
-    }
-    if (tile_coordinates[3] != exr_image->level_y) {
-      // Invalid data.
-      error_flag |= EF_INVALID_DATA;
-      continue;
+    if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
+      if ((requested_pixel_types[c] != TINYEXR_PIXELTYPE_HALF) &&
+          (requested_pixel_types[c] != TINYEXR_PIXELTYPE_FLOAT)) {
+        return false;
+      }
+    } else if ((channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT) ||
+               (channels[c].pixel_type == TINYEXR_PIXELTYPE_UINT)) {
+      if (requested_pixel_types[c] != channels[c].pixel_type) {
+        return false;
+      }
+    } else {
+      return false;
     }
 
-    int data_len;
-    memcpy(&data_len, data_ptr + 16,
-      sizeof(int));  // 16 = sizeof(tile_coordinates)
-    tinyexr::swap4(&data_len);
+    size_t type_size = (requested_pixel_types[c] == TINYEXR_PIXELTYPE_HALF)
+                           ? sizeof(unsigned short)
+                           : sizeof(float);
+    EXRFrameBufferSlice &slice = (*slices)[c];
+    slice.base = images[c];
+    slice.x_stride = type_size;
+    slice.y_stride = type_size * static_cast<size_t>(x_stride);
+    slice.pixel_type = requested_pixel_types[c];
+    slice.pad0 = 0;
+  }
 
-    if (data_len < 2 || size_t(data_len) > data_size) {
-      // Insufficient data size.
-      error_flag |= EF_INSUFFICIENT_DATA;
-      continue;
-    }
+  return true;
+}
 
-    // Move to data addr: 20 = 16 + 4;
-    data_ptr += 20;
-    bool ret = tinyexr::DecodeTiledPixelData(
-      exr_image->tiles[tile_idx].images,
-      &(exr_image->tiles[tile_idx].width),
-      &(exr_image->tiles[tile_idx].height),
-      exr_header->requested_pixel_types, data_ptr,
-      static_cast<size_t>(data_len), exr_header->compression_type,
-      exr_header->line_order,
-      exr_image->width, exr_image->height,
-      tile_coordinates[0], tile_coordinates[1], exr_header->tile_size_x,
-      exr_header->tile_size_y, static_cast<size_t>(pixel_data_size),
-      static_cast<size_t>(exr_header->num_custom_attributes),
-      exr_header->custom_attributes,
-      static_cast<size_t>(exr_header->num_channels),
-      exr_header->channels, channel_offset_list);
+// Codecs registered by `EXRRegisterCodec`, indexed by compression type.
+// `lines_per_block` is 0 for unregistered ids.
+static EXRCodec g_codecs[256];
 
-    if (!ret) {
-      // Failed to decode tile data.
-      error_flag |= EF_FAILED_TO_DECODE;
-    }
+// Returns the registered codec for `compression_type`, or NULL.
+static const EXRCodec *FindCodec(int compression_type) {
+  if ((compression_type < 0) || (compression_type > 255)) {
+    return NULL;
+  }
+  const EXRCodec *codec = &g_codecs[compression_type];
+  return (codec->lines_per_block > 0) ? codec : NULL;
+}
 
-    exr_image->tiles[tile_idx].offset_x = tile_coordinates[0];
-    exr_image->tiles[tile_idx].offset_y = tile_coordinates[1];
-    exr_image->tiles[tile_idx].level_x = tile_coordinates[2];
-    exr_image->tiles[tile_idx].level_y = tile_coordinates[3];
+// Returns the number of scanlines in a scanline block(chunk).
+static int NumScanlines(int compression_type) {
+  const EXRCodec *codec = FindCodec(compression_type);
+  if (codec) {
+    return codec->lines_per_block;
+  }
 
-#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
+  int num_scanlines = 1;
+  if (compression_type == TINYEXR_COMPRESSIONTYPE_ZIP) {
+    num_scanlines = 16;
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
+    num_scanlines = 32;
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_PXR24) {
+    num_scanlines = 16;
+  } else if ((compression_type == TINYEXR_COMPRESSIONTYPE_B44) ||
+             (compression_type == TINYEXR_COMPRESSIONTYPE_B44A)) {
+    num_scanlines = 32;
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_DWAA) {
+    num_scanlines = 32;
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_DWAB) {
+    num_scanlines = 256;
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
+    num_scanlines = 16;
   }
-        }));
-    }  // num_thread loop
+  return num_scanlines;
+}
 
-    for (auto& t : workers) {
-      t.join();
+// Work buffers for encoding/decoding a chunk(scanline block or tile).
+// Buffers are grown on demand and reused, so encoding/decoding chunks(and
+// images) on the same thread does not allocate memory after the first chunk.
+struct CodecScratch {
+  std::vector<unsigned char> block;       // uncompressed chunk
+  std::vector<unsigned char> compressed;  // compressed chunk(encoding, or
+                                          // read by the stream reader)
+  std::vector<unsigned char> tmp;         // ZIP/RLE reorder buffer
+#if TINYEXR_USE_PIZ
+  PizScratch piz;
+#endif
+  DwaScratch dwa;
+
+  // Releases buffers grown too large by an unusually large chunk, so that
+  // an idle thread does not keep holding them.
+  void Trim() {
+    const size_t kMaxRetainedSize = 64 * 1024 * 1024;
+    if (block.capacity() > kMaxRetainedSize) {
+      std::vector<unsigned char>().swap(block);
+    }
+    if (compressed.capacity() > kMaxRetainedSize) {
+      std::vector<unsigned char>().swap(compressed);
     }
+    if (tmp.capacity() > kMaxRetainedSize) {
+      std::vector<unsigned char>().swap(tmp);
+    }
+#if TINYEXR_USE_PIZ
+    if (piz.tmp_buffer.capacity() * sizeof(unsigned short) > kMaxRetainedSize) {
+      std::vector<unsigned short>().swap(piz.tmp_buffer);
+    }
+#endif
+    dwa.Trim(kMaxRetainedSize);
+  }
+};
 
+// Declares `name` as the work buffers of the calling thread.
+// Without C++11(thread_local), a new instance is used for each chunk.
+#if TINYEXR_HAS_CXX11
+#define TINYEXR_CODEC_SCRATCH(name) \
+  static thread_local tinyexr::CodecScratch name
 #else
-  } // parallel for
+#define TINYEXR_CODEC_SCRATCH(name) tinyexr::CodecScratch name
 #endif
 
-  // Even in the event of an error, the reserved memory may be freed.
-  exr_image->num_channels = num_channels;
-  exr_image->num_tiles = static_cast<int>(num_tiles);
+// Decodes(decompresses and unpacks) pixel data of a scanline block(or a tile).
+// See `UnpackPixelData` for the meaning of the arguments.
+static bool DecodePixelData(/* out */ const EXRFrameBufferSlice *slices,
+                            const unsigned char *data_ptr, size_t data_len,
+                            int compression_type, int line_order, int width,
+                            int height, int line_no,
+                            int num_lines, int x_offset, int out_width,
+                            size_t pixel_data_size,
+                            size_t num_attributes,
+                            const EXRAttribute *attributes, size_t num_channels,
+                            const EXRChannelInfo *channels,
+                            const std::vector<size_t> &channel_offset_list) {
+  TINYEXR_CODEC_SCRATCH(scratch);
+
+  // Uncompressed pixel data.
+  const unsigned char *src = NULL;
+  size_t src_len = 0;
+  std::vector<unsigned char> &outBuf = scratch.block;
+  const EXRCodec *codec = FindCodec(compression_type);
+
+  if (codec) {
+    size_t raw_len = static_cast<size_t>(width) *
+                     static_cast<size_t>(num_lines) * pixel_data_size;
+    if (data_len == raw_len) {
+      // Stored uncompressed.
+      src = data_ptr;
+      src_len = data_len;
+    } else {
+      if (!codec->decompress_func || (raw_len == 0)) {
+        return false;
+      }
+      outBuf.resize(raw_len);
 
-  if (error_flag)  err_code = TINYEXR_ERROR_INVALID_DATA;
-  if (err) {
-    if (error_flag & EF_INSUFFICIENT_DATA) {
-      (*err) += "Insufficient data length.\n";
+      EXRCodecChunk chunk;
+      chunk.width = width;
+      chunk.num_lines = num_lines;
+      chunk.num_channels = static_cast<int>(num_channels);
+      chunk.channels = channels;
+      if (codec->decompress_func(&outBuf.at(0), raw_len, data_ptr, data_len,
+                            &chunk, codec->userdata) != 0) {
+        return false;
+      }
     }
-    if (error_flag & EF_FAILED_TO_DECODE) {
-      (*err) += "Failed to decode tile data.\n";
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {  // PIZ
+#if TINYEXR_USE_PIZ
+    if ((width == 0) || (num_lines == 0) || (pixel_data_size == 0)) {
+      // Invalid input #90
+      return false;
     }
-  }
-  return err_code;
-}
 
-static int DecodeChunk(EXRImage *exr_image, const EXRHeader *exr_header,
-                       const OffsetData& offset_data,
-                       const unsigned char *head, const size_t size,
-                       std::string *err) {
-  int num_channels = exr_header->num_channels;
+    // Allocate original data size.
+    outBuf.resize(static_cast<size_t>(
+        static_cast<size_t>(width * num_lines) * pixel_data_size));
+    size_t tmpBufLen = outBuf.size();
 
-  int num_scanline_blocks = 1;
-  if (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_ZIP) {
-    num_scanline_blocks = 16;
-  } else if (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
-    num_scanline_blocks = 32;
-  } else if (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
-    num_scanline_blocks = 16;
+    bool ret = tinyexr::DecompressPiz(
+        reinterpret_cast<unsigned char *>(&outBuf.at(0)), data_ptr, tmpBufLen,
+        data_len, static_cast<int>(num_channels), channels, width, num_lines,
+        &scratch.piz);
 
-#if TINYEXR_USE_ZFP
-    tinyexr::ZFPCompressionParam zfp_compression_param;
-    if (!FindZFPCompressionParam(&zfp_compression_param,
-                                 exr_header->custom_attributes,
-                                 int(exr_header->num_custom_attributes), err)) {
-      return TINYEXR_ERROR_INVALID_HEADER;
+    if (!ret) {
+      return false;
     }
+#else
+    return false;
 #endif
-  }
-
-  if (exr_header->data_window.max_x < exr_header->data_window.min_x ||
-      exr_header->data_window.max_y < exr_header->data_window.min_y) {
-    if (err) {
-      (*err) += "Invalid data window.\n";
-    }
-    return TINYEXR_ERROR_INVALID_DATA;
-  }
 
-  tinyexr_int64 data_width =
-      static_cast<tinyexr_int64>(exr_header->data_window.max_x) - static_cast<tinyexr_int64>(exr_header->data_window.min_x) + static_cast<tinyexr_int64>(1);
-  tinyexr_int64 data_height =
-      static_cast<tinyexr_int64>(exr_header->data_window.max_y) - static_cast<tinyexr_int64>(exr_header->data_window.min_y) + static_cast<tinyexr_int64>(1);
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_ZIPS ||
+             compression_type == TINYEXR_COMPRESSIONTYPE_ZIP) {
+    // Allocate original data size.
+    outBuf.resize(static_cast<size_t>(width) *
+                  static_cast<size_t>(num_lines) * pixel_data_size);
 
-  if (data_width <= 0) {
-    if (err) {
-      (*err) += "Invalid data window width.\n";
+    unsigned long dstLen = static_cast<unsigned long>(outBuf.size());
+    TINYEXR_CHECK_AND_RETURN_C(dstLen > 0, false);
+    if (!tinyexr::DecompressZip(
+            reinterpret_cast<unsigned char *>(&outBuf.at(0)), &dstLen, data_ptr,
+            static_cast<unsigned long>(data_len), &scratch.tmp)) {
+      return false;
     }
-    return TINYEXR_ERROR_INVALID_DATA;
-  }
-
-  if (data_height <= 0) {
-    if (err) {
-      (*err) += "Invalid data window height.\n";
+    TINYEXR_CHECK_AND_RETURN_C(dstLen == outBuf.size(), false);
+  } else if ((compression_type == TINYEXR_COMPRESSIONTYPE_B44) ||
+             (compression_type == TINYEXR_COMPRESSIONTYPE_B44A)) {
+    size_t raw_len = static_cast<size_t>(width) *
+                     static_cast<size_t>(num_lines) * pixel_data_size;
+    if (data_len == raw_len) {
+      // Stored uncompressed.
+      src = data_ptr;
+      src_len = data_len;
+    } else {
+      outBuf.resize(raw_len);
+      if (raw_len == 0 ||
+          !tinyexr::DecompressB44(&outBuf.at(0), raw_len, data_ptr, data_len,
+                                  width, num_lines, num_channels, channels)) {
+        return false;
+      }
     }
-    return TINYEXR_ERROR_INVALID_DATA;
-  }
-
-  // Do not allow too large data_width and data_height. header invalid?
-  {
-    if ((data_width > TINYEXR_DIMENSION_THRESHOLD) || (data_height > TINYEXR_DIMENSION_THRESHOLD)) {
-      if (err) {
-        std::stringstream ss;
-        ss << "data_with or data_height too large. data_width: " << data_width
-           << ", "
-           << "data_height = " << data_height << std::endl;
-        (*err) += ss.str();
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_PXR24) {
+    size_t raw_len = static_cast<size_t>(width) *
+                     static_cast<size_t>(num_lines) * pixel_data_size;
+    if (data_len == raw_len) {
+      // Stored uncompressed.
+      src = data_ptr;
+      src_len = data_len;
+    } else {
+      outBuf.resize(raw_len);
+      if (raw_len == 0 ||
+          !tinyexr::DecompressPxr24(&outBuf.at(0), raw_len, data_ptr,
+                                    data_len, width, num_lines, num_channels,
+                                    channels, &scratch.tmp)) {
+        return false;
       }
-      return TINYEXR_ERROR_INVALID_DATA;
     }
-    if (exr_header->tiled) {
-      if ((exr_header->tile_size_x > TINYEXR_DIMENSION_THRESHOLD) || (exr_header->tile_size_y > TINYEXR_DIMENSION_THRESHOLD)) {
-        if (err) {
-          std::stringstream ss;
-          ss << "tile with or tile height too large. tile width: " << exr_header->tile_size_x
-            << ", "
-            << "tile height = " << exr_header->tile_size_y << std::endl;
-          (*err) += ss.str();
-        }
-        return TINYEXR_ERROR_INVALID_DATA;
+  } else if ((compression_type == TINYEXR_COMPRESSIONTYPE_DWAA) ||
+             (compression_type == TINYEXR_COMPRESSIONTYPE_DWAB)) {
+    size_t raw_len = static_cast<size_t>(width) *
+                     static_cast<size_t>(num_lines) * pixel_data_size;
+    if (data_len == raw_len) {
+      // Stored uncompressed.
+      src = data_ptr;
+      src_len = data_len;
+    } else {
+      outBuf.resize(raw_len);
+      if (raw_len == 0 ||
+          !tinyexr::DecompressDwa(&outBuf.at(0), raw_len, data_ptr, data_len,
+                                  width, num_lines, num_channels, channels,
+                                  &scratch.dwa)) {
+        return false;
       }
     }
-  }
-
-  const std::vector<tinyexr::tinyexr_uint64>& offsets = offset_data.offsets[0][0];
-  size_t num_blocks = offsets.size();
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_RLE) {
+    // Allocate original data size.
+    outBuf.resize(static_cast<size_t>(width) *
+                  static_cast<size_t>(num_lines) * pixel_data_size);
 
-  std::vector<size_t> channel_offset_list;
-  int pixel_data_size = 0;
-  size_t channel_offset = 0;
-  if (!tinyexr::ComputeChannelLayout(&channel_offset_list, &pixel_data_size,
-                                     &channel_offset, num_channels,
-                                     exr_header->channels)) {
-    if (err) {
-      (*err) += "Failed to compute channel layout.\n";
+    unsigned long dstLen = static_cast<unsigned long>(outBuf.size());
+    if (dstLen == 0) {
+      return false;
     }
-    return TINYEXR_ERROR_INVALID_DATA;
-  }
-
-#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
-  std::atomic<bool> invalid_data(false);
-#else
-  bool invalid_data(false);
-#endif
 
-  if (exr_header->tiled) {
-    // value check
-    if (exr_header->tile_size_x < 0) {
-      if (err) {
-        std::stringstream ss;
-        ss << "Invalid tile size x : " << exr_header->tile_size_x << "\n";
-        (*err) += ss.str();
-      }
-      return TINYEXR_ERROR_INVALID_HEADER;
+    if (!tinyexr::DecompressRle(
+            reinterpret_cast<unsigned char *>(&outBuf.at(0)), dstLen, data_ptr,
+            static_cast<unsigned long>(data_len), &scratch.tmp)) {
+      return false;
+    }
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
+#if TINYEXR_USE_ZFP
+    tinyexr::ZFPCompressionParam zfp_compression_param;
+    std::string e;
+    if (!tinyexr::FindZFPCompressionParam(&zfp_compression_param, attributes,
+                                          int(num_attributes), &e)) {
+      // This code path should not be reachable.
+      return false;
     }
 
-    if (exr_header->tile_size_y < 0) {
-      if (err) {
-        std::stringstream ss;
-        ss << "Invalid tile size y : " << exr_header->tile_size_y << "\n";
-        (*err) += ss.str();
-      }
-      return TINYEXR_ERROR_INVALID_HEADER;
+    for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
+      TINYEXR_CHECK_AND_RETURN_C(channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT, false);
     }
-    if (exr_header->tile_level_mode != TINYEXR_TILE_RIPMAP_LEVELS) {
-      EXRImage* level_image = NULL;
-      for (int level = 0; level < offset_data.num_x_levels; ++level) {
-        if (!level_image) {
-          level_image = exr_image;
-        } else {
-          level_image->next_level = new EXRImage;
-          InitEXRImage(level_image->next_level);
-          level_image = level_image->next_level;
-        }
-        level_image->width =
-          LevelSize(exr_header->data_window.max_x - exr_header->data_window.min_x + 1, level, exr_header->tile_rounding_mode);
-        if (level_image->width < 1) {
-          return TINYEXR_ERROR_INVALID_DATA;
-        }
 
-        level_image->height =
-          LevelSize(exr_header->data_window.max_y - exr_header->data_window.min_y + 1, level, exr_header->tile_rounding_mode);
+    // Allocate original data size.
+    outBuf.resize(static_cast<size_t>(width) *
+                  static_cast<size_t>(num_lines) * pixel_data_size);
 
-        if (level_image->height < 1) {
-          return TINYEXR_ERROR_INVALID_DATA;
-        }
+    unsigned long dstLen = outBuf.size();
+    TINYEXR_CHECK_AND_RETURN_C(dstLen > 0, false);
+    if (!tinyexr::DecompressZfp(reinterpret_cast<float *>(&outBuf.at(0)),
+                                width, num_lines, num_channels, data_ptr,
+                                static_cast<unsigned long>(data_len),
+                                zfp_compression_param)) {
+      return false;
+    }
+#else
+    (void)attributes;
+    (void)num_attributes;
+    return false;
+#endif
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_NONE) {
+    src = data_ptr;
+    src_len = data_len;
+  } else {
+    return false;
+  }
 
-        level_image->level_x = level;
-        level_image->level_y = level;
+  if (src == NULL) {
+    src = outBuf.data();
+    src_len = outBuf.size();
+  }
 
-        int ret = DecodeTiledLevel(level_image, exr_header,
-          offset_data,
-          channel_offset_list,
-          pixel_data_size,
-          head, size,
-          err);
-        if (ret != TINYEXR_SUCCESS) return ret;
-      }
-    } else {
-      EXRImage* level_image = NULL;
-      for (int level_y = 0; level_y < offset_data.num_y_levels; ++level_y)
-        for (int level_x = 0; level_x < offset_data.num_x_levels; ++level_x) {
-          if (!level_image) {
-            level_image = exr_image;
-          } else {
-            level_image->next_level = new EXRImage;
-            InitEXRImage(level_image->next_level);
-            level_image = level_image->next_level;
-          }
-
-          level_image->width =
-            LevelSize(exr_header->data_window.max_x - exr_header->data_window.min_x + 1, level_x, exr_header->tile_rounding_mode);
-          if (level_image->width < 1) {
-            return TINYEXR_ERROR_INVALID_DATA;
-          }
+  bool ret = UnpackPixelData(slices, src, src_len, line_order, width, height,
+                             line_no, num_lines, x_offset, out_width,
+                             pixel_data_size, num_channels, channels,
+                             channel_offset_list);
+  scratch.Trim();
+  return ret;
+}
 
-          level_image->height =
-            LevelSize(exr_header->data_window.max_y - exr_header->data_window.min_y + 1, level_y, exr_header->tile_rounding_mode);
-          if (level_image->height < 1) {
-            return TINYEXR_ERROR_INVALID_DATA;
-          }
+// Decodes a tile(`tile_offset_x`, `tile_offset_y`) into `slices`, whose base
+// points to the top-left pixel of the tile.
+static bool DecodeTiledPixelData(
+    const EXRFrameBufferSlice *slices, int *width, int *height,
+    const unsigned char *data_ptr,
+    size_t data_len, int compression_type, int line_order, int data_width,
+    int data_height, int tile_offset_x, int tile_offset_y, int tile_size_x,
+    int tile_size_y, size_t pixel_data_size, size_t num_attributes,
+    const EXRAttribute *attributes, size_t num_channels,
+    const EXRChannelInfo *channels,
+    const std::vector<size_t> &channel_offset_list) {
+  // Here, data_width and data_height are the dimensions of the current (sub)level.
+  if (tile_size_x * tile_offset_x > data_width ||
+      tile_size_y * tile_offset_y > data_height) {
+    return false;
+  }
 
-          level_image->level_x = level_x;
-          level_image->level_y = level_y;
+  // Compute actual image size in a tile.
+  if ((tile_offset_x + 1) * tile_size_x >= data_width) {
+    (*width) = data_width - (tile_offset_x * tile_size_x);
+  } else {
+    (*width) = tile_size_x;
+  }
 
-          int ret = DecodeTiledLevel(level_image, exr_header,
-            offset_data,
-            channel_offset_list,
-            pixel_data_size,
-            head, size,
-            err);
-          if (ret != TINYEXR_SUCCESS) return ret;
-        }
-    }
-  } else {  // scanline format
-    // Don't allow too large image(256GB * pixel_data_size or more). Workaround
-    // for #104.
-    size_t total_data_len =
-        size_t(data_width) * size_t(data_height) * size_t(num_channels);
-    const bool total_data_len_overflown =
-        sizeof(void *) == 8 ? (total_data_len >= 0x4000000000) : false;
-    if ((total_data_len == 0) || total_data_len_overflown) {
-      if (err) {
-        std::stringstream ss;
-        ss << "Image data size is zero or too large: width = " << data_width
-           << ", height = " << data_height << ", channels = " << num_channels
-           << std::endl;
-        (*err) += ss.str();
-      }
-      return TINYEXR_ERROR_INVALID_DATA;
-    }
+  if ((tile_offset_y + 1) * tile_size_y >= data_height) {
+    (*height) = data_height - (tile_offset_y * tile_size_y);
+  } else {
+    (*height) = tile_size_y;
+  }
 
-    bool alloc_success = false;
-    exr_image->images = tinyexr::AllocateImage(
-        num_channels, exr_header->channels, exr_header->requested_pixel_types,
-        int(data_width), int(data_height), &alloc_success);
+  // Image size = tile size.
+  return DecodePixelData(slices, data_ptr, data_len,
+                         compression_type, line_order, (*width), tile_size_y,
+                         /* line_no */ 0,
+                         (*height), /* x_offset */ 0, (*width),
+                         pixel_data_size, num_attributes, attributes,
+                         num_channels, channels, channel_offset_list);
+}
 
-    if (!alloc_success) {
-      if (err) {
-        std::stringstream ss;
-        ss << "Failed to allocate memory for Images. Maybe EXR header is corrupted or Image data size is too large: width = " << data_width
-           << ", height = " << data_height << ", channels = " << num_channels
-           << std::endl;
-        (*err) += ss.str();
-      }
-      return TINYEXR_ERROR_INVALID_DATA;
-    }
+static bool ComputeChannelLayout(std::vector<size_t> *channel_offset_list,
+                                 int *pixel_data_size, size_t *channel_offset,
+                                 int num_channels,
+                                 const EXRChannelInfo *channels) {
+  channel_offset_list->resize(static_cast<size_t>(num_channels));
 
-#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
-    std::vector<std::thread> workers;
-    std::atomic<int> y_count(0);
+  (*pixel_data_size) = 0;
+  (*channel_offset) = 0;
 
-    int num_threads = std::max(1, int(std::thread::hardware_concurrency()));
-    if (num_threads > int(num_blocks)) {
-      num_threads = int(num_blocks);
+  for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
+    (*channel_offset_list)[c] = (*channel_offset);
+    if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
+      (*pixel_data_size) += sizeof(unsigned short);
+      (*channel_offset) += sizeof(unsigned short);
+    } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
+      (*pixel_data_size) += sizeof(float);
+      (*channel_offset) += sizeof(float);
+    } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_UINT) {
+      (*pixel_data_size) += sizeof(unsigned int);
+      (*channel_offset) += sizeof(unsigned int);
+    } else {
+      // ???
+      return false;
     }
+  }
+  return true;
+}
 
-    for (int t = 0; t < num_threads; t++) {
-      workers.emplace_back(std::thread([&]() {
-        int y = 0;
-        while ((y = y_count++) < int(num_blocks)) {
-
-#else
-
-#if TINYEXR_USE_OPENMP
-#pragma omp parallel for
-#endif
-    for (int y = 0; y < static_cast<int>(num_blocks); y++) {
+// TODO: Simply return nullptr when failed to allocate?
+// Channels with a zero `channel_mask` entry(if not NULL) are left NULL.
+static unsigned char **AllocateImage(int num_channels,
+                                     const EXRChannelInfo *channels,
+                                     const int *requested_pixel_types,
+                                     const unsigned char *channel_mask,
+                                     int data_width, int data_height, bool *success) {
+  unsigned char **images =
+      reinterpret_cast<unsigned char **>(static_cast<float **>(
+          malloc(sizeof(float *) * static_cast<size_t>(num_channels))));
 
-#endif
-          size_t y_idx = static_cast<size_t>(y);
+  for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
+    images[c] = NULL;
+  }
 
-          if (offsets[y_idx] + sizeof(int) * 2 > size) {
-            invalid_data = true;
-          } else {
-            // 4 byte: scan line
-            // 4 byte: data size
-            // ~     : pixel data(uncompressed or compressed)
-            size_t data_size =
-                size_t(size - (offsets[y_idx] + sizeof(int) * 2));
-            const unsigned char *data_ptr =
-                reinterpret_cast<const unsigned char *>(head + offsets[y_idx]);
-
-            int line_no;
-            memcpy(&line_no, data_ptr, sizeof(int));
-            int data_len;
-            memcpy(&data_len, data_ptr + 4, sizeof(int));
-            tinyexr::swap4(&line_no);
-            tinyexr::swap4(&data_len);
-
-            if (size_t(data_len) > data_size) {
-              invalid_data = true;
-
-            } else if ((line_no > (2 << 20)) || (line_no < -(2 << 20))) {
-              // Too large value. Assume this is invalid
-              // 2**20 = 1048576 = heuristic value.
-              invalid_data = true;
-            } else if (data_len == 0) {
-              // TODO(syoyo): May be ok to raise the threshold for example
-              // `data_len < 4`
-              invalid_data = true;
-            } else {
-              // line_no may be negative.
-              int end_line_no = (std::min)(line_no + num_scanline_blocks,
-                                           (exr_header->data_window.max_y + 1));
-
-              int num_lines = end_line_no - line_no;
-
-              if (num_lines <= 0) {
-                invalid_data = true;
-              } else {
-                // Move to data addr: 8 = 4 + 4;
-                data_ptr += 8;
-
-                // Adjust line_no with data_window.bmin.y
-
-                // overflow check
-                tinyexr_int64 lno =
-                    static_cast<tinyexr_int64>(line_no) -
-                    static_cast<tinyexr_int64>(exr_header->data_window.min_y);
-                if (lno > std::numeric_limits<int>::max()) {
-                  line_no = -1;  // invalid
-                } else if (lno < -std::numeric_limits<int>::max()) {
-                  line_no = -1;  // invalid
-                } else {
-                  line_no -= exr_header->data_window.min_y;
-                }
-
-                if (line_no < 0) {
-                  invalid_data = true;
-                } else {
-                  if (!tinyexr::DecodePixelData(
-                          exr_image->images, exr_header->requested_pixel_types,
-                          data_ptr, static_cast<size_t>(data_len),
-                          exr_header->compression_type, exr_header->line_order,
-                          int(data_width), int(data_height), int(data_width), y, line_no,
-                          num_lines, static_cast<size_t>(pixel_data_size),
-                          static_cast<size_t>(
-                              exr_header->num_custom_attributes),
-                          exr_header->custom_attributes,
-                          static_cast<size_t>(exr_header->num_channels),
-                          exr_header->channels, channel_offset_list)) {
-                    invalid_data = true;
-                  }
-                }
-              }
-            }
-          }
+  bool valid = true;
 
-#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
-        }
-      }));
+  for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
+    if (channel_mask && !channel_mask[c]) {
+      continue;
     }
 
-    for (auto &t : workers) {
-      t.join();
+    size_t data_len =
+        static_cast<size_t>(data_width) * static_cast<size_t>(data_height);
+    if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
+      // pixel_data_size += sizeof(unsigned short);
+      // channel_offset += sizeof(unsigned short);
+      // Alloc internal image for half type.
+      if (requested_pixel_types[c] == TINYEXR_PIXELTYPE_HALF) {
+        images[c] =
+            reinterpret_cast<unsigned char *>(static_cast<unsigned short *>(
+                malloc(sizeof(unsigned short) * data_len)));
+      } else if (requested_pixel_types[c] == TINYEXR_PIXELTYPE_FLOAT) {
+        images[c] = reinterpret_cast<unsigned char *>(
+            static_cast<float *>(malloc(sizeof(float) * data_len)));
+      } else {
+        images[c] = NULL; // just in case.
+        valid = false;
+        break;
+      }
+    } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
+      // pixel_data_size += sizeof(float);
+      // channel_offset += sizeof(float);
+      images[c] = reinterpret_cast<unsigned char *>(
+          static_cast<float *>(malloc(sizeof(float) * data_len)));
+    } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_UINT) {
+      // pixel_data_size += sizeof(unsigned int);
+      // channel_offset += sizeof(unsigned int);
+      images[c] = reinterpret_cast<unsigned char *>(
+          static_cast<unsigned int *>(malloc(sizeof(unsigned int) * data_len)));
+    } else {
+      images[c] = NULL; // just in case.
+      valid = false;
+      break;
     }
-#else
-    }  // omp parallel
-#endif
   }
 
-  if (invalid_data) {
-    if (err) {
-      (*err) += "Invalid/Corrupted data found when decoding pixels.\n";
-    }
-
-    // free alloced image.
+  if (!valid) {
     for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
-      if (exr_image->images[c]) {
-        free(exr_image->images[c]);
-        exr_image->images[c] = NULL;
+      if (images[c]) {
+        free(images[c]);
+        images[c] = NULL;
       }
     }
-    return TINYEXR_ERROR_INVALID_DATA;
-  }
 
-  // Overwrite `pixel_type` with `requested_pixel_type`.
-  {
-    for (int c = 0; c < exr_header->num_channels; c++) {
-      exr_header->pixel_types[c] = exr_header->requested_pixel_types[c];
+    if (success) {
+      (*success) = false;
+    }
+  } else {
+    if (success) {
+      (*success) = true;
     }
   }
 
-  {
-    exr_image->num_channels = num_channels;
-
-    exr_image->width = int(data_width);
-    exr_image->height = int(data_height);
-  }
-
-  return TINYEXR_SUCCESS;
+  return images;
 }
 
-static bool ReconstructLineOffsets(
-    std::vector<tinyexr::tinyexr_uint64> *offsets, size_t n,
-    const unsigned char *head, const unsigned char *marker, const size_t size) {
-  if (head >= marker) {
-    return false;
-  }
-  if (offsets->size() != n) {
-    return false;
-  }
+#ifdef _WIN32
+static inline std::wstring UTF8ToWchar(const std::string &str) {
+  int wstr_size =
+      MultiByteToWideChar(CP_UTF8, 0, str.data(), (int)str.size(), NULL, 0);
+  std::wstring wstr(wstr_size, 0);
+  MultiByteToWideChar(CP_UTF8, 0, str.data(), (int)str.size(), &wstr[0],
+                      (int)wstr.size());
+  return wstr;
+}
+#endif
 
-  for (size_t i = 0; i < n; i++) {
-    size_t offset = static_cast<size_t>(marker - head);
-    // Offset should not exceed whole EXR file/data size.
-    if ((offset + sizeof(tinyexr::tinyexr_uint64)) >= size) {
-      return false;
-    }
 
-    int y;
-    unsigned int data_len;
+static int ParseEXRHeader(HeaderInfo *info, bool *empty_header,
+                          const EXRVersion *version, std::string *err,
+                          const unsigned char *buf, size_t size) {
+  const char *marker = reinterpret_cast<const char *>(&buf[0]);
 
-    memcpy(&y, marker, sizeof(int));
-    memcpy(&data_len, marker + 4, sizeof(unsigned int));
+  if (empty_header) {
+    (*empty_header) = false;
+  }
 
-    if (data_len >= size) {
-      return false;
+  if (version->multipart) {
+    if (size > 0 && marker[0] == '\0') {
+      // End of header list.
+      if (empty_header) {
+        (*empty_header) = true;
+      }
+      return TINYEXR_SUCCESS;
     }
-
-    tinyexr::swap4(&y);
-    tinyexr::swap4(&data_len);
-
-    (*offsets)[i] = offset;
-
-    marker += data_len + 8;  // 8 = 4 bytes(y) + 4 bytes(data_len)
   }
 
-  return true;
-}
+  // According to the spec, the header of every OpenEXR file must contain at
+  // least the following attributes:
+  //
+  // channels chlist
+  // compression compression
+  // dataWindow box2i
+  // displayWindow box2i
+  // lineOrder lineOrder
+  // pixelAspectRatio float
+  // screenWindowCenter v2f
+  // screenWindowWidth float
+  bool has_channels = false;
+  bool has_compression = false;
+  bool has_data_window = false;
+  bool has_display_window = false;
+  bool has_line_order = false;
+  bool has_pixel_aspect_ratio = false;
+  bool has_screen_window_center = false;
+  bool has_screen_window_width = false;
+  bool has_name = false;
+  bool has_type = false;
 
+  info->name.clear();
+  info->type.clear();
 
-static int FloorLog2(unsigned x) {
-  //
-  // For x > 0, floorLog2(y) returns floor(log(x)/log(2)).
+  info->data_window.min_x = 0;
+  info->data_window.min_y = 0;
+  info->data_window.max_x = 0;
+  info->data_window.max_y = 0;
+  info->line_order = 0;  // @fixme
+  info->display_window.min_x = 0;
+  info->display_window.min_y = 0;
+  info->display_window.max_x = 0;
+  info->display_window.max_y = 0;
+  info->screen_window_center[0] = 0.0f;
+  info->screen_window_center[1] = 0.0f;
+  info->screen_window_width = -1.0f;
+  info->pixel_aspect_ratio = -1.0f;
+
+  info->tiled = 0;
+  info->tile_size_x = -1;
+  info->tile_size_y = -1;
+  info->tile_level_mode = -1;
+  info->tile_rounding_mode = -1;
+
+  info->attributes.clear();
+
+  // Read attributes
+  size_t orig_size = size;
+  for (size_t nattr = 0; nattr < TINYEXR_MAX_HEADER_ATTRIBUTES; nattr++) {
+    if (0 == size) {
+      if (err) {
+        (*err) += "Insufficient data size for attributes.\n";
+      }
+      return TINYEXR_ERROR_INVALID_DATA;
+    } else if (marker[0] == '\0') {
+      size--;
+      break;
+    }
+
+    std::string attr_name;
+    std::string attr_type;
+    std::vector<unsigned char> data;
+    size_t marker_size;
+    if (!tinyexr::ReadAttribute(&attr_name, &attr_type, &data, &marker_size,
+                                marker, size)) {
+      if (err) {
+        (*err) += "Failed to read attribute.\n";
+      }
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+    marker += marker_size;
+    size -= marker_size;
+
+    // For a multipart file, the version field 9th bit is 0.
+    if ((version->tiled || version->multipart || version->non_image) && attr_name.compare("tiles") == 0) {
+      unsigned int x_size, y_size;
+      unsigned char tile_mode;
+      if (data.size() != 9) {
+        if (err) {
+          (*err) += "(ParseEXRHeader) Invalid attribute data size. Attribute data size must be 9.\n";
+        }
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
+
+      memcpy(&x_size, &data.at(0), sizeof(int));
+      memcpy(&y_size, &data.at(4), sizeof(int));
+      tile_mode = data[8];
+      tinyexr::swap4(&x_size);
+      tinyexr::swap4(&y_size);
+
+      if (x_size > static_cast<unsigned int>(std::numeric_limits<int>::max()) ||
+          y_size > static_cast<unsigned int>(std::numeric_limits<int>::max())) {
+        if (err) {
+          (*err) = "Tile sizes were invalid.";
+        }
+        return TINYEXR_ERROR_UNSUPPORTED_FORMAT;
+      }
+
+      info->tile_size_x = static_cast<int>(x_size);
+      info->tile_size_y = static_cast<int>(y_size);
+
+      // mode = levelMode + roundingMode * 16
+      info->tile_level_mode = tile_mode & 0x3;
+      info->tile_rounding_mode = (tile_mode >> 4) & 0x1;
+      info->tiled = 1;
+    } else if (attr_name.compare("compression") == 0) {
+      bool ok = false;
+      if ((data[0] < TINYEXR_COMPRESSIONTYPE_PIZ) ||
+          (data[0] == TINYEXR_COMPRESSIONTYPE_PXR24) ||
+          (data[0] == TINYEXR_COMPRESSIONTYPE_B44) ||
+          (data[0] == TINYEXR_COMPRESSIONTYPE_B44A) ||
+          (data[0] == TINYEXR_COMPRESSIONTYPE_DWAA) ||
+          (data[0] == TINYEXR_COMPRESSIONTYPE_DWAB) || FindCodec(data[0])) {
+        ok = true;
+      }
+
+      if (!ok && (data[0] == TINYEXR_COMPRESSIONTYPE_PIZ)) {
+#if TINYEXR_USE_PIZ
+        ok = true;
+#else
+        if (err) {
+          (*err) = "PIZ compression is not supported.";
+        }
+        return TINYEXR_ERROR_UNSUPPORTED_FORMAT;
+#endif
+      }
+
+      if (!ok && (data[0] == TINYEXR_COMPRESSIONTYPE_ZFP)) {
+#if TINYEXR_USE_ZFP
+        ok = true;
+#else
+        if (err) {
+          (*err) = "ZFP compression is not supported.";
+        }
+        return TINYEXR_ERROR_UNSUPPORTED_FORMAT;
+#endif
+      }
+
+      if (!ok) {
+        if (err) {
+          (*err) = "Unknown compression type.";
+        }
+        return TINYEXR_ERROR_UNSUPPORTED_FORMAT;
+      }
+
+      info->compression_type = static_cast<int>(data[0]);
+      has_compression = true;
+
+    } else if (attr_name.compare("channels") == 0) {
+      // name: zero-terminated string, from 1 to 255 bytes long
+      // pixel type: int, possible values are: UINT = 0 HALF = 1 FLOAT = 2
+      // pLinear: unsigned char, possible values are 0 and 1
+      // reserved: three chars, should be zero
+      // xSampling: int
+      // ySampling: int
+
+      if (!ReadChannelInfo(info->channels, data)) {
+        if (err) {
+          (*err) += "Failed to parse channel info.\n";
+        }
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
+
+      if (info->channels.size() < 1) {
+        if (err) {
+          (*err) += "# of channels is zero.\n";
+        }
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
+
+      has_channels = true;
+
+    } else if (attr_name.compare("dataWindow") == 0) {
+      if (data.size() >= 16) {
+        memcpy(&info->data_window.min_x, &data.at(0), sizeof(int));
+        memcpy(&info->data_window.min_y, &data.at(4), sizeof(int));
+        memcpy(&info->data_window.max_x, &data.at(8), sizeof(int));
+        memcpy(&info->data_window.max_y, &data.at(12), sizeof(int));
+        tinyexr::swap4(&info->data_window.min_x);
+        tinyexr::swap4(&info->data_window.min_y);
+        tinyexr::swap4(&info->data_window.max_x);
+        tinyexr::swap4(&info->data_window.max_y);
+        has_data_window = true;
+      }
+    } else if (attr_name.compare("displayWindow") == 0) {
+      if (data.size() >= 16) {
+        memcpy(&info->display_window.min_x, &data.at(0), sizeof(int));
+        memcpy(&info->display_window.min_y, &data.at(4), sizeof(int));
+        memcpy(&info->display_window.max_x, &data.at(8), sizeof(int));
+        memcpy(&info->display_window.max_y, &data.at(12), sizeof(int));
+        tinyexr::swap4(&info->display_window.min_x);
+        tinyexr::swap4(&info->display_window.min_y);
+        tinyexr::swap4(&info->display_window.max_x);
+        tinyexr::swap4(&info->display_window.max_y);
+
+        has_display_window = true;
+      }
+    } else if (attr_name.compare("lineOrder") == 0) {
+      if (data.size() >= 1) {
+        info->line_order = static_cast<int>(data[0]);
+        has_line_order = true;
+      }
+    } else if (attr_name.compare("pixelAspectRatio") == 0) {
+      if (data.size() >= sizeof(float)) {
+        memcpy(&info->pixel_aspect_ratio, &data.at(0), sizeof(float));
+        tinyexr::swap4(&info->pixel_aspect_ratio);
+        has_pixel_aspect_ratio = true;
+      }
+    } else if (attr_name.compare("screenWindowCenter") == 0) {
+      if (data.size() >= 8) {
+        memcpy(&info->screen_window_center[0], &data.at(0), sizeof(float));
+        memcpy(&info->screen_window_center[1], &data.at(4), sizeof(float));
+        tinyexr::swap4(&info->screen_window_center[0]);
+        tinyexr::swap4(&info->screen_window_center[1]);
+        has_screen_window_center = true;
+      }
+    } else if (attr_name.compare("screenWindowWidth") == 0) {
+      if (data.size() >= sizeof(float)) {
+        memcpy(&info->screen_window_width, &data.at(0), sizeof(float));
+        tinyexr::swap4(&info->screen_window_width);
+
+        has_screen_window_width = true;
+      }
+    } else if (attr_name.compare("chunkCount") == 0) {
+      if (data.size() >= sizeof(int)) {
+        memcpy(&info->chunk_count, &data.at(0), sizeof(int));
+        tinyexr::swap4(&info->chunk_count);
+      }
+    } else if (attr_name.compare("name") == 0) {
+      if (!data.empty() && data[0]) {
+        data.push_back(0);
+        size_t len = strlen(reinterpret_cast<const char*>(&data[0]));
+        info->name.resize(len);
+        info->name.assign(reinterpret_cast<const char*>(&data[0]), len);
+        has_name = true;
+      }
+    } else if (attr_name.compare("type") == 0) {
+      if (!data.empty() && data[0]) {
+        data.push_back(0);
+        size_t len = strlen(reinterpret_cast<const char*>(&data[0]));
+        info->type.resize(len);
+        info->type.assign(reinterpret_cast<const char*>(&data[0]), len);
+        has_type = true;
+      }
+    } else {
+      // Custom attribute(up to TINYEXR_MAX_CUSTOM_ATTRIBUTES)
+      if (info->attributes.size() < TINYEXR_MAX_CUSTOM_ATTRIBUTES) {
+        EXRAttribute attrib;
+#ifdef _MSC_VER
+        strncpy_s(attrib.name, attr_name.c_str(), 255);
+        strncpy_s(attrib.type, attr_type.c_str(), 255);
+#else
+        strncpy(attrib.name, attr_name.c_str(), 255);
+        strncpy(attrib.type, attr_type.c_str(), 255);
+#endif
+        attrib.name[255] = '\0';
+        attrib.type[255] = '\0';
+        //std::cout << "i = " << info->attributes.size() << ", dsize = " << data.size() << "\n";
+        attrib.size = static_cast<int>(data.size());
+        attrib.value = static_cast<unsigned char *>(malloc(data.size()));
+        memcpy(reinterpret_cast<char *>(attrib.value), &data.at(0),
+               data.size());
+        info->attributes.push_back(attrib);
+      }
+    }
+  }
+
+  // Check if required attributes exist
+  {
+    std::stringstream ss_err;
+
+    if (!has_compression) {
+      ss_err << "\"compression\" attribute not found in the header."
+             << std::endl;
+    }
+
+    if (!has_channels) {
+      ss_err << "\"channels\" attribute not found in the header." << std::endl;
+    }
+
+    if (!has_line_order) {
+      ss_err << "\"lineOrder\" attribute not found in the header." << std::endl;
+    }
+
+    if (!has_display_window) {
+      ss_err << "\"displayWindow\" attribute not found in the header."
+             << std::endl;
+    }
+
+    if (!has_data_window) {
+      ss_err << "\"dataWindow\" attribute not found in the header or invalid."
+             << std::endl;
+    }
+
+    if (!has_pixel_aspect_ratio) {
+      ss_err << "\"pixelAspectRatio\" attribute not found in the header."
+             << std::endl;
+    }
+
+    if (!has_screen_window_width) {
+      ss_err << "\"screenWindowWidth\" attribute not found in the header."
+             << std::endl;
+    }
+
+    if (!has_screen_window_center) {
+      ss_err << "\"screenWindowCenter\" attribute not found in the header."
+             << std::endl;
+    }
+
+    if (version->multipart || version->non_image) {
+      if (!has_name) {
+        ss_err << "\"name\" attribute not found in the header."
+          << std::endl;
+      }
+      if (!has_type) {
+        ss_err << "\"type\" attribute not found in the header."
+          << std::endl;
+      }
+    }
+
+    if (!(ss_err.str().empty())) {
+      if (err) {
+        (*err) += ss_err.str();
+      }
+
+      return TINYEXR_ERROR_INVALID_HEADER;
+    }
+  }
+
+  info->header_len = static_cast<unsigned int>(orig_size - size);
+
+  return TINYEXR_SUCCESS;
+}
+
+// C++ HeaderInfo to C EXRHeader conversion.
+static bool ConvertHeader(EXRHeader *exr_header, const HeaderInfo &info, std::string *warn, std::string *err) {
+  exr_header->pixel_aspect_ratio = info.pixel_aspect_ratio;
+  exr_header->screen_window_center[0] = info.screen_window_center[0];
+  exr_header->screen_window_center[1] = info.screen_window_center[1];
+  exr_header->screen_window_width = info.screen_window_width;
+  exr_header->chunk_count = info.chunk_count;
+  exr_header->display_window.min_x = info.display_window.min_x;
+  exr_header->display_window.min_y = info.display_window.min_y;
+  exr_header->display_window.max_x = info.display_window.max_x;
+  exr_header->display_window.max_y = info.display_window.max_y;
+  exr_header->data_window.min_x = info.data_window.min_x;
+  exr_header->data_window.min_y = info.data_window.min_y;
+  exr_header->data_window.max_x = info.data_window.max_x;
+  exr_header->data_window.max_y = info.data_window.max_y;
+  exr_header->line_order = info.line_order;
+  exr_header->compression_type = info.compression_type;
+  exr_header->tiled = info.tiled;
+  exr_header->tile_size_x = info.tile_size_x;
+  exr_header->tile_size_y = info.tile_size_y;
+  exr_header->tile_level_mode = info.tile_level_mode;
+  exr_header->tile_rounding_mode = info.tile_rounding_mode;
+
+  EXRSetNameAttr(exr_header, info.name.c_str());
+
+
+  if (!info.type.empty()) {
+    bool valid = true;
+    if (info.type == "scanlineimage") {
+      if (exr_header->tiled) {
+        if (err) {
+          (*err) += "(ConvertHeader) tiled bit must be off for `scanlineimage` type.\n";
+        }
+        valid = false;
+      }
+    } else if (info.type == "tiledimage") {
+      if (!exr_header->tiled) {
+        if (err) {
+          (*err) += "(ConvertHeader) tiled bit must be on for `tiledimage` type.\n";
+        }
+        valid = false;
+      }
+    } else if (info.type == "deeptile") {
+      exr_header->non_image = 1;
+      if (!exr_header->tiled) {
+        if (err) {
+          (*err) += "(ConvertHeader) tiled bit must be on for `deeptile` type.\n";
+        }
+        valid = false;
+      }
+    } else if (info.type == "deepscanline") {
+      exr_header->non_image = 1;
+      if (exr_header->tiled) {
+        if (err) {
+          (*err) += "(ConvertHeader) tiled bit must be off for `deepscanline` type.\n";
+        }
+        //valid = false;
+      }
+    } else {
+      if (warn) {
+        std::stringstream ss;
+        ss << "(ConvertHeader) Unsupported or unknown info.type: " << info.type << "\n";
+        (*warn) += ss.str();
+      }
+    }
+
+    if (!valid) {
+      return false;
+    }
+  }
+
+  exr_header->num_channels = static_cast<int>(info.channels.size());
+
+  exr_header->channels = static_cast<EXRChannelInfo *>(malloc(
+      sizeof(EXRChannelInfo) * static_cast<size_t>(exr_header->num_channels)));
+  for (size_t c = 0; c < static_cast<size_t>(exr_header->num_channels); c++) {
+#ifdef _MSC_VER
+    strncpy_s(exr_header->channels[c].name, info.channels[c].name.c_str(), 255);
+#else
+    strncpy(exr_header->channels[c].name, info.channels[c].name.c_str(), 255);
+#endif
+    // manually add '\0' for safety.
+    exr_header->channels[c].name[255] = '\0';
+
+    exr_header->channels[c].pixel_type = info.channels[c].pixel_type;
+    exr_header->channels[c].p_linear = info.channels[c].p_linear;
+    exr_header->channels[c].x_sampling = info.channels[c].x_sampling;
+    exr_header->channels[c].y_sampling = info.channels[c].y_sampling;
+  }
+
+  exr_header->pixel_types = static_cast<int *>(
+      malloc(sizeof(int) * static_cast<size_t>(exr_header->num_channels)));
+  for (size_t c = 0; c < static_cast<size_t>(exr_header->num_channels); c++) {
+    exr_header->pixel_types[c] = info.channels[c].pixel_type;
+  }
+
+  // Initially fill with values of `pixel_types`
+  exr_header->requested_pixel_types = static_cast<int *>(
+      malloc(sizeof(int) * static_cast<size_t>(exr_header->num_channels)));
+  for (size_t c = 0; c < static_cast<size_t>(exr_header->num_channels); c++) {
+    exr_header->requested_pixel_types[c] = info.channels[c].pixel_type;
+  }
+
+  exr_header->num_custom_attributes = static_cast<int>(info.attributes.size());
+
+  if (exr_header->num_custom_attributes > 0) {
+    // TODO(syoyo): Report warning when # of attributes exceeds
+    // `TINYEXR_MAX_CUSTOM_ATTRIBUTES`
+    if (exr_header->num_custom_attributes > TINYEXR_MAX_CUSTOM_ATTRIBUTES) {
+      exr_header->num_custom_attributes = TINYEXR_MAX_CUSTOM_ATTRIBUTES;
+    }
+
+    exr_header->custom_attributes = static_cast<EXRAttribute *>(malloc(
+        sizeof(EXRAttribute) * size_t(exr_header->num_custom_attributes)));
+
+    for (size_t i = 0; i < size_t(exr_header->num_custom_attributes); i++) {
+      memcpy(exr_header->custom_attributes[i].name, info.attributes[i].name,
+             256);
+      memcpy(exr_header->custom_attributes[i].type, info.attributes[i].type,
+             256);
+      exr_header->custom_attributes[i].size = info.attributes[i].size;
+      // Just copy pointer
+      exr_header->custom_attributes[i].value = info.attributes[i].value;
+    }
+
+  } else {
+    exr_header->custom_attributes = NULL;
+  }
+
+  exr_header->header_len = info.header_len;
+
+  return true;
+}
+
+struct OffsetData {
+  OffsetData() : num_x_levels(0), num_y_levels(0) {}
+  std::vector<std::vector<std::vector <tinyexr::tinyexr_uint64> > > offsets;
+  int num_x_levels;
+  int num_y_levels;
+};
+
+// -1 = error
+static int LevelIndex(int lx, int ly, int tile_level_mode, int num_x_levels) {
+  switch (tile_level_mode) {
+  case TINYEXR_TILE_ONE_LEVEL:
+    return 0;
+
+  case TINYEXR_TILE_MIPMAP_LEVELS:
+    return lx;
+
+  case TINYEXR_TILE_RIPMAP_LEVELS:
+    return lx + ly * num_x_levels;
+
+  default:
+    return -1;
+  }
+  return 0;
+}
+
+static int LevelSize(int toplevel_size, int level, int tile_rounding_mode) {
+  if (level < 0) {
+    return -1;
+  }
+
+  int b = static_cast<int>(1u << static_cast<unsigned int>(level));
+  int level_size = toplevel_size / b;
+
+  if (tile_rounding_mode == TINYEXR_TILE_ROUND_UP && level_size * b < toplevel_size)
+    level_size += 1;
+
+  return std::max(level_size, 1);
+}
+
+// Error flags of tile decoding.
+enum {
+  EF_SUCCESS = 0,
+  EF_INVALID_DATA = 1,
+  EF_INSUFFICIENT_DATA = 2,
+  EF_FAILED_TO_DECODE = 4
+};
+
+// Decodes a tile chunk at `offset` into `slices`, whose base points to the
+// top-left pixel of the tile.
+// The tile must belong to level (`level_x`, `level_y`), whose size is
+// `level_width` x `level_height`.
+// Tile coordinates stored in the chunk are returned to `tile_coordinates`
+// (tile x, tile y, level x, level y).
+// Returns EF_SUCCESS or combination of EF_* flags.
+static unsigned DecodeTile(const EXRFrameBufferSlice *slices, int *tile_width,
+                           int *tile_height, int tile_coordinates[4],
+                           const EXRHeader *exr_header,
+                           tinyexr::tinyexr_uint64 offset, int level_x,
+                           int level_y, int level_width, int level_height,
+                           const std::vector<size_t> &channel_offset_list,
+                           int pixel_data_size, const unsigned char *head,
+                           const size_t size) {
+  // 16 byte: tile coordinates
+  // 4 byte : data size
+  // ~      : data(uncompressed or compressed)
+  if (offset + sizeof(int) * 5 > size) {
+    // Insufficient data size.
+    return EF_INSUFFICIENT_DATA;
+  }
+
+  size_t data_size = size_t(size - (offset + sizeof(int) * 5));
+  const unsigned char *data_ptr =
+      reinterpret_cast<const unsigned char *>(head + offset);
+
+  memcpy(tile_coordinates, data_ptr, sizeof(int) * 4);
+  tinyexr::swap4(&tile_coordinates[0]);
+  tinyexr::swap4(&tile_coordinates[1]);
+  tinyexr::swap4(&tile_coordinates[2]);
+  tinyexr::swap4(&tile_coordinates[3]);
+
+  if (tile_coordinates[2] != level_x) {
+    // Invalid data.
+    return EF_INVALID_DATA;
+  }
+  if (tile_coordinates[3] != level_y) {
+    // Invalid data.
+    return EF_INVALID_DATA;
+  }
+
+  int data_len;
+  memcpy(&data_len, data_ptr + 16,
+         sizeof(int));  // 16 = sizeof(tile_coordinates)
+  tinyexr::swap4(&data_len);
+
+  if (data_len < 2 || size_t(data_len) > data_size) {
+    // Insufficient data size.
+    return EF_INSUFFICIENT_DATA;
+  }
+
+  // Move to data addr: 20 = 16 + 4;
+  data_ptr += 20;
+  bool ret = tinyexr::DecodeTiledPixelData(
+      slices, tile_width, tile_height, data_ptr, static_cast<size_t>(data_len), exr_header->compression_type,
+      exr_header->line_order, level_width, level_height, tile_coordinates[0],
+      tile_coordinates[1], exr_header->tile_size_x, exr_header->tile_size_y,
+      static_cast<size_t>(pixel_data_size),
+      static_cast<size_t>(exr_header->num_custom_attributes),
+      exr_header->custom_attributes,
+      static_cast<size_t>(exr_header->num_channels), exr_header->channels,
+      channel_offset_list);
+
+  if (!ret) {
+    // Failed to decode tile data.
+    return EF_FAILED_TO_DECODE;
+  }
+
+  return EF_SUCCESS;
+}
+
+// Decodes the first level of tiled image directly into `frame_buffer`.
+static int DecodeTiledLevelToFrameBuffer(
+    const EXRHeader *exr_header, const OffsetData &offset_data,
+    const std::vector<size_t> &channel_offset_list, int pixel_data_size,
+    const unsigned char *head, const size_t size,
+    const EXRParallelOptions *parallel_options,
+    const EXRFrameBufferSlice *frame_buffer, std::string *err) {
+  size_t num_channels = size_t(exr_header->num_channels);
+
+  int level_width = LevelSize(
+      exr_header->data_window.max_x - exr_header->data_window.min_x + 1, 0,
+      exr_header->tile_rounding_mode);
+  int level_height = LevelSize(
+      exr_header->data_window.max_y - exr_header->data_window.min_y + 1, 0,
+      exr_header->tile_rounding_mode);
+  if ((level_width < 1) || (level_height < 1) ||
+      (exr_header->tile_size_x < 1) || (exr_header->tile_size_y < 1)) {
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  int num_y_tiles = int(offset_data.offsets[0].size());
+  if (num_y_tiles < 1) {
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+  int num_x_tiles = int(offset_data.offsets[0][0].size());
+  if (num_x_tiles < 1) {
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+  int num_tiles = num_x_tiles * num_y_tiles;
+
+  // Rows of a partial tile must not be flipped into the outside of the tile,
+  // so decode tiles in top-to-bottom order(line order only specifies the
+  // order of tiles in a file). Unlike the tiles of `EXRImage`, rows of a
+  // DECREASING_Y image are not flipped within each tile.
+  EXRHeader header = *exr_header;
+  header.line_order = 0;
+
+#if TINYEXR_HAS_CXX11
+  std::atomic<unsigned> error_flag(EF_SUCCESS);
+#else
+  unsigned error_flag(EF_SUCCESS);
+#endif
+
+  ParallelFor(num_tiles, parallel_options, [&](int tile_idx) {
+    int x_tile = tile_idx % num_x_tiles;
+    int y_tile = tile_idx / num_x_tiles;
+    tinyexr::tinyexr_uint64 offset =
+        offset_data.offsets[0][size_t(y_tile)][size_t(x_tile)];
+
+    // Tile coordinates in the file must be validated before writing into the
+    // frame buffer, so read them first.
+    if (offset + sizeof(int) * 2 > size) {
+      error_flag |= EF_INSUFFICIENT_DATA;
+      return;
+    }
+    int tile_x, tile_y;
+    memcpy(&tile_x, head + offset, sizeof(int));
+    memcpy(&tile_y, head + offset + 4, sizeof(int));
+    tinyexr::swap4(&tile_x);
+    tinyexr::swap4(&tile_y);
+    if ((tile_x != x_tile) || (tile_y != y_tile)) {
+      error_flag |= EF_INVALID_DATA;
+      return;
+    }
+
+    std::vector<EXRFrameBufferSlice> slices(frame_buffer,
+                                            frame_buffer + num_channels);
+    for (size_t c = 0; c < num_channels; c++) {
+      if (slices[c].base) {
+        slices[c].base +=
+            size_t(x_tile) * size_t(exr_header->tile_size_x) *
+                slices[c].x_stride +
+            size_t(y_tile) * size_t(exr_header->tile_size_y) *
+                slices[c].y_stride;
+      }
+    }
+
+    int tile_coordinates[4] = {0, 0, 0, 0};
+    int tile_width = 0, tile_height = 0;
+    error_flag |= DecodeTile(slices.data(), &tile_width, &tile_height,
+                             tile_coordinates, &header, offset, 0, 0,
+                             level_width, level_height, channel_offset_list,
+                             pixel_data_size, head, size);
+  });
+
+  if (error_flag) {
+    if (err) {
+      if (error_flag & EF_INSUFFICIENT_DATA) {
+        (*err) += "Insufficient data length.\n";
+      }
+      if (error_flag & EF_FAILED_TO_DECODE) {
+        (*err) += "Failed to decode tile data.\n";
+      }
+      if (error_flag & EF_INVALID_DATA) {
+        (*err) += "Invalid tile data.\n";
+      }
+    }
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  return TINYEXR_SUCCESS;
+}
+
+// State for decoding the blocks(scanline blocks, or tiles of all levels) of
+// a part, set up by `BeginDecodeChunk`. Blocks are decoded independently by
+// `DecodeChunkBlock`, so the blocks of several parts can be decoded in a
+// single parallel loop(see `LoadEXRMultipartImageFromMemory`).
+struct ChunkDecoder {
+  ChunkDecoder()
+      : exr_image(NULL), exr_header(NULL), offset_data(NULL), head(NULL),
+        size(0), to_frame_buffer(false), pixel_data_size(0),
+        num_scanline_blocks(0), data_width(0), roi_min_x(0), roi_width(0),
+        roi_height(0), first_line(0), first_block(0), num_blocks(0),
+        invalid_data(false), error_flag(EF_SUCCESS) {}
+
+  EXRImage *exr_image;
+  const EXRHeader *exr_header;
+  const OffsetData *offset_data;
+  const unsigned char *head;
+  size_t size;
+  bool to_frame_buffer;
+
+  std::vector<size_t> channel_offset_list;
+  int pixel_data_size;
+
+  // Scanline image.
+  int num_scanline_blocks;
+  int data_width;
+  int roi_min_x;
+  int roi_width;
+  int roi_height;
+  int first_line;
+  size_t first_block;
+  std::vector<EXRFrameBufferSlice> slices;
+
+  // Tiled image: image, offset table index and number of tiles in x of each
+  // level. Tiles of level `l` are blocks [level_first_tile[l],
+  // level_first_tile[l + 1]).
+  std::vector<EXRImage *> levels;
+  std::vector<int> level_index;
+  std::vector<int> level_num_x_tiles;
+  std::vector<size_t> level_first_tile;
+
+  size_t num_blocks;  // Number of blocks to decode.
+
+#if TINYEXR_HAS_CXX11
+  std::atomic<bool> invalid_data;
+  std::atomic<unsigned> error_flag;
+#else
+  bool invalid_data;
+  unsigned error_flag;
+#endif
+};
+
+// Validates the header and allocates the images of `exr_image`(tiles of all
+// levels for tiled image). Blocks are then decoded by `DecodeChunkBlock` and
+// the result is checked by `EndDecodeChunk`.
+// The first level of tiled image is decoded into `frame_buffer` here.
+static int BeginDecodeChunk(ChunkDecoder *decoder, EXRImage *exr_image,
+                            const EXRHeader *exr_header,
+                            const OffsetData &offset_data,
+                            const unsigned char *head, const size_t size,
+                            const EXRParallelOptions *parallel_options,
+                            const EXRBox2i *roi,
+                            const EXRFrameBufferSlice *frame_buffer,
+                            std::string *err) {
+  decoder->exr_image = exr_image;
+  decoder->exr_header = exr_header;
+  decoder->offset_data = &offset_data;
+  decoder->head = head;
+  decoder->size = size;
+  decoder->to_frame_buffer = (frame_buffer != NULL);
+
+  int num_channels = exr_header->num_channels;
+
+  int num_scanline_blocks = NumScanlines(exr_header->compression_type);
+  if ((exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) &&
+      !FindCodec(exr_header->compression_type)) {
+#if TINYEXR_USE_ZFP
+    tinyexr::ZFPCompressionParam zfp_compression_param;
+    if (!FindZFPCompressionParam(&zfp_compression_param,
+                                 exr_header->custom_attributes,
+                                 int(exr_header->num_custom_attributes), err)) {
+      return TINYEXR_ERROR_INVALID_HEADER;
+    }
+#endif
+  }
+
+  if (exr_header->data_window.max_x < exr_header->data_window.min_x ||
+      exr_header->data_window.max_y < exr_header->data_window.min_y) {
+    if (err) {
+      (*err) += "Invalid data window.\n";
+    }
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  tinyexr_int64 data_width =
+      static_cast<tinyexr_int64>(exr_header->data_window.max_x) - static_cast<tinyexr_int64>(exr_header->data_window.min_x) + static_cast<tinyexr_int64>(1);
+  tinyexr_int64 data_height =
+      static_cast<tinyexr_int64>(exr_header->data_window.max_y) - static_cast<tinyexr_int64>(exr_header->data_window.min_y) + static_cast<tinyexr_int64>(1);
+
+  if (data_width <= 0) {
+    if (err) {
+      (*err) += "Invalid data window width.\n";
+    }
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  if (data_height <= 0) {
+    if (err) {
+      (*err) += "Invalid data window height.\n";
+    }
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  // Do not allow too large data_width and data_height. header invalid?
+  {
+    if ((data_width > TINYEXR_DIMENSION_THRESHOLD) || (data_height > TINYEXR_DIMENSION_THRESHOLD)) {
+      if (err) {
+        std::stringstream ss;
+        ss << "data_with or data_height too large. data_width: " << data_width
+           << ", "
+           << "data_height = " << data_height << std::endl;
+        (*err) += ss.str();
+      }
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+    if (exr_header->tiled) {
+      if ((exr_header->tile_size_x > TINYEXR_DIMENSION_THRESHOLD) || (exr_header->tile_size_y > TINYEXR_DIMENSION_THRESHOLD)) {
+        if (err) {
+          std::stringstream ss;
+          ss << "tile with or tile height too large. tile width: " << exr_header->tile_size_x
+            << ", "
+            << "tile height = " << exr_header->tile_size_y << std::endl;
+          (*err) += ss.str();
+        }
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
+    }
+  }
+
+  // Region to decode, relative to the data window. Whole image by default.
+  int roi_min_x = 0;
+  int roi_min_y = 0;
+  int roi_max_x = int(data_width) - 1;
+  int roi_max_y = int(data_height) - 1;
+  if (roi) {
+    if (exr_header->tiled) {
+      if (err) {
+        (*err) += "Region decoding is not supported for tiled image.\n";
+      }
+      return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
+    }
+
+    // Clip the region with the data window.
+    roi_min_x = (std::max)(roi->min_x, exr_header->data_window.min_x) -
+                exr_header->data_window.min_x;
+    roi_min_y = (std::max)(roi->min_y, exr_header->data_window.min_y) -
+                exr_header->data_window.min_y;
+    roi_max_x = (std::min)(roi->max_x, exr_header->data_window.max_x) -
+                exr_header->data_window.min_x;
+    roi_max_y = (std::min)(roi->max_y, exr_header->data_window.max_y) -
+                exr_header->data_window.min_y;
+
+    if ((roi_max_x < roi_min_x) || (roi_max_y < roi_min_y)) {
+      if (err) {
+        (*err) += "Region does not intersect with the data window.\n";
+      }
+      return TINYEXR_ERROR_INVALID_ARGUMENT;
+    }
+  }
+
+  int roi_width = roi_max_x - roi_min_x + 1;
+  int roi_height = roi_max_y - roi_min_y + 1;
+
+  decoder->num_scanline_blocks = num_scanline_blocks;
+  decoder->data_width = int(data_width);
+  decoder->roi_min_x = roi_min_x;
+  decoder->roi_width = roi_width;
+  decoder->roi_height = roi_height;
+
+  size_t channel_offset = 0;
+  if (!tinyexr::ComputeChannelLayout(&decoder->channel_offset_list,
+                                     &decoder->pixel_data_size,
+                                     &channel_offset, num_channels,
+                                     exr_header->channels)) {
+    if (err) {
+      (*err) += "Failed to compute channel layout.\n";
+    }
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  if (exr_header->tiled) {
+    // value check
+    if (exr_header->tile_size_x < 0) {
+      if (err) {
+        std::stringstream ss;
+        ss << "Invalid tile size x : " << exr_header->tile_size_x << "\n";
+        (*err) += ss.str();
+      }
+      return TINYEXR_ERROR_INVALID_HEADER;
+    }
+
+    if (exr_header->tile_size_y < 0) {
+      if (err) {
+        std::stringstream ss;
+        ss << "Invalid tile size y : " << exr_header->tile_size_y << "\n";
+        (*err) += ss.str();
+      }
+      return TINYEXR_ERROR_INVALID_HEADER;
+    }
+    if (frame_buffer) {
+      return DecodeTiledLevelToFrameBuffer(
+          exr_header, offset_data, decoder->channel_offset_list,
+          decoder->pixel_data_size, head, size, parallel_options,
+          frame_buffer, err);
+    }
+
+    // Set up the image of each level(all levels for mipmap/ripmap).
+    int num_x_levels = offset_data.num_x_levels;
+    int num_y_levels = 1;
+    if (exr_header->tile_level_mode == TINYEXR_TILE_RIPMAP_LEVELS) {
+      num_y_levels = offset_data.num_y_levels;
+    }
+
+    EXRImage* level_image = NULL;
+    decoder->level_first_tile.push_back(0);
+    for (int level_y = 0; level_y < num_y_levels; ++level_y) {
+      for (int level_x = 0; level_x < num_x_levels; ++level_x) {
+        if (!level_image) {
+          level_image = exr_image;
+        } else {
+          level_image->next_level = new EXRImage;
+          InitEXRImage(level_image->next_level);
+          level_image = level_image->next_level;
+        }
+
+        // Same level in x and y for mipmap.
+        int level_y_ = (exr_header->tile_level_mode ==
+                        TINYEXR_TILE_RIPMAP_LEVELS)
+                           ? level_y
+                           : level_x;
+
+        level_image->width =
+          LevelSize(exr_header->data_window.max_x - exr_header->data_window.min_x + 1, level_x, exr_header->tile_rounding_mode);
+        if (level_image->width < 1) {
+          return TINYEXR_ERROR_INVALID_DATA;
+        }
+
+        level_image->height =
+          LevelSize(exr_header->data_window.max_y - exr_header->data_window.min_y + 1, level_y_, exr_header->tile_rounding_mode);
+        if (level_image->height < 1) {
+          return TINYEXR_ERROR_INVALID_DATA;
+        }
+
+        level_image->level_x = level_x;
+        level_image->level_y = level_y_;
+
+        int level_index = LevelIndex(level_x, level_y_,
+                                     exr_header->tile_level_mode,
+                                     offset_data.num_x_levels);
+        int num_y_tiles = int(offset_data.offsets[size_t(level_index)].size());
+        if (num_y_tiles < 1) {
+          return TINYEXR_ERROR_INVALID_DATA;
+        }
+        int num_x_tiles =
+            int(offset_data.offsets[size_t(level_index)][0].size());
+        if (num_x_tiles < 1) {
+          return TINYEXR_ERROR_INVALID_DATA;
+        }
+        int num_tiles = num_x_tiles * num_y_tiles;
+
+        level_image->tiles = static_cast<EXRTile*>(
+          calloc(sizeof(EXRTile), static_cast<size_t>(num_tiles)));
+        // Even in the event of an error, the reserved memory may be freed.
+        level_image->num_channels = num_channels;
+        level_image->num_tiles = num_tiles;
+
+        decoder->levels.push_back(level_image);
+        decoder->level_index.push_back(level_index);
+        decoder->level_num_x_tiles.push_back(num_x_tiles);
+        decoder->level_first_tile.push_back(decoder->level_first_tile.back() +
+                                            size_t(num_tiles));
+      }
+    }
+
+    decoder->num_blocks = decoder->level_first_tile.back();
+  } else {  // scanline format
+    // Don't allow too large image(256GB * pixel_data_size or more). Workaround
+    // for #104.
+    size_t total_data_len =
+        size_t(roi_width) * size_t(roi_height) * size_t(num_channels);
+    const bool total_data_len_overflown =
+        sizeof(void *) == 8 ? (total_data_len >= 0x4000000000) : false;
+    if ((total_data_len == 0) || total_data_len_overflown) {
+      if (err) {
+        std::stringstream ss;
+        ss << "Image data size is zero or too large: width = " << roi_width
+           << ", height = " << roi_height << ", channels = " << num_channels
+           << std::endl;
+        (*err) += ss.str();
+      }
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+
+    if (frame_buffer) {
+      decoder->slices.assign(frame_buffer, frame_buffer + num_channels);
+    } else {
+      bool alloc_success = false;
+      exr_image->images = tinyexr::AllocateImage(
+          num_channels, exr_header->channels,
+          exr_header->requested_pixel_types, exr_header->channel_mask,
+          roi_width, roi_height,
+          &alloc_success);
+
+      if (!alloc_success) {
+        if (err) {
+          std::stringstream ss;
+          ss << "Failed to allocate memory for Images. Maybe EXR header is corrupted or Image data size is too large: width = " << roi_width
+             << ", height = " << roi_height << ", channels = " << num_channels
+             << std::endl;
+          (*err) += ss.str();
+        }
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
+
+      if (!tinyexr::SetupPlanarSlices(
+              &decoder->slices, exr_image->images,
+              exr_header->requested_pixel_types, size_t(num_channels),
+              exr_header->channels, roi_width)) {
+        decoder->invalid_data = true;
+      }
+    }
+
+    // Range of scanlines(relative to the data window, in file order) and
+    // blocks which cover the region.
+    int first_line = roi_min_y;
+    int last_line = roi_max_y;
+    if (exr_header->line_order != 0) {
+      first_line = int(data_height) - 1 - roi_max_y;
+      last_line = int(data_height) - 1 - roi_min_y;
+    }
+
+    size_t num_blocks = offset_data.offsets[0][0].size();
+    size_t first_block = 0;
+    size_t last_block = num_blocks;
+    if (roi) {
+      first_block = (std::min)(
+          static_cast<size_t>(first_line / num_scanline_blocks), num_blocks);
+      last_block = (std::min)(
+          static_cast<size_t>(last_line / num_scanline_blocks) + 1, num_blocks);
+    }
+
+    if (decoder->invalid_data) {
+      // Invalid requested pixel type.
+      last_block = first_block;
+    }
+
+    decoder->first_line = first_line;
+    decoder->first_block = first_block;
+    decoder->num_blocks = last_block - first_block;
+  }
+
+  return TINYEXR_SUCCESS;
+}
+
+// Decodes the `i`th block set up by `BeginDecodeChunk`. Errors are recorded in
+// `decoder`. Can be called from multiple threads at the same time.
+static void DecodeChunkBlock(ChunkDecoder *decoder, size_t i) {
+  const EXRHeader *exr_header = decoder->exr_header;
+  const unsigned char *head = decoder->head;
+  const size_t size = decoder->size;
+
+  if (exr_header->tiled) {
+    size_t l = size_t(std::upper_bound(decoder->level_first_tile.begin(),
+                                       decoder->level_first_tile.end(), i) -
+                      decoder->level_first_tile.begin()) - 1;
+    EXRImage *level_image = decoder->levels[l];
+    int tile_idx = int(i - decoder->level_first_tile[l]);
+    int num_x_tiles = decoder->level_num_x_tiles[l];
+    int num_channels = exr_header->num_channels;
+
+    // Allocate memory for each tile.
+    bool alloc_success = false;
+    level_image->tiles[tile_idx].images = tinyexr::AllocateImage(
+      num_channels, exr_header->channels,
+      exr_header->requested_pixel_types, exr_header->channel_mask,
+      exr_header->tile_size_x,
+      exr_header->tile_size_y, &alloc_success);
+
+    if (!alloc_success) {
+      decoder->error_flag |= EF_INVALID_DATA;
+      return;
+    }
+
+    std::vector<EXRFrameBufferSlice> slices;
+    if (!SetupPlanarSlices(&slices, level_image->tiles[tile_idx].images,
+                           exr_header->requested_pixel_types,
+                           size_t(num_channels), exr_header->channels,
+                           exr_header->tile_size_x)) {
+      decoder->error_flag |= EF_FAILED_TO_DECODE;
+      return;
+    }
+
+    int x_tile = tile_idx % num_x_tiles;
+    int y_tile = tile_idx / num_x_tiles;
+    tinyexr::tinyexr_uint64 offset =
+        decoder->offset_data->offsets[size_t(decoder->level_index[l])]
+                                     [size_t(y_tile)][size_t(x_tile)];
+
+    int tile_coordinates[4] = {0, 0, 0, 0};
+    decoder->error_flag |= DecodeTile(
+      slices.data(),
+      &(level_image->tiles[tile_idx].width),
+      &(level_image->tiles[tile_idx].height), tile_coordinates, exr_header,
+      offset, level_image->level_x, level_image->level_y, level_image->width,
+      level_image->height, decoder->channel_offset_list,
+      decoder->pixel_data_size, head, size);
+
+    level_image->tiles[tile_idx].offset_x = tile_coordinates[0];
+    level_image->tiles[tile_idx].offset_y = tile_coordinates[1];
+    level_image->tiles[tile_idx].level_x = tile_coordinates[2];
+    level_image->tiles[tile_idx].level_y = tile_coordinates[3];
+    return;
+  }
+
+  const std::vector<tinyexr::tinyexr_uint64>& offsets =
+      decoder->offset_data->offsets[0][0];
+  size_t y_idx = decoder->first_block + i;
+  int num_scanline_blocks = decoder->num_scanline_blocks;
+
+  if (offsets[y_idx] + sizeof(int) * 2 > size) {
+    decoder->invalid_data = true;
+  } else {
+    // 4 byte: scan line
+    // 4 byte: data size
+    // ~     : pixel data(uncompressed or compressed)
+    size_t data_size =
+        size_t(size - (offsets[y_idx] + sizeof(int) * 2));
+    const unsigned char *data_ptr =
+        reinterpret_cast<const unsigned char *>(head + offsets[y_idx]);
+
+    int line_no;
+    memcpy(&line_no, data_ptr, sizeof(int));
+    int data_len;
+    memcpy(&data_len, data_ptr + 4, sizeof(int));
+    tinyexr::swap4(&line_no);
+    tinyexr::swap4(&data_len);
+
+    if (size_t(data_len) > data_size) {
+      decoder->invalid_data = true;
+
+    } else if ((line_no > (2 << 20)) || (line_no < -(2 << 20))) {
+      // Too large value. Assume this is invalid
+      // 2**20 = 1048576 = heuristic value.
+      decoder->invalid_data = true;
+    } else if (data_len == 0) {
+      // TODO(syoyo): May be ok to raise the threshold for example
+      // `data_len < 4`
+      decoder->invalid_data = true;
+    } else {
+      // line_no may be negative.
+      int end_line_no = (std::min)(line_no + num_scanline_blocks,
+                                   (exr_header->data_window.max_y + 1));
+
+      int num_lines = end_line_no - line_no;
+
+      if (num_lines <= 0) {
+        decoder->invalid_data = true;
+      } else {
+        // Move to data addr: 8 = 4 + 4;
+        data_ptr += 8;
+
+        // Adjust line_no with data_window.bmin.y
+
+        // overflow check
+        tinyexr_int64 lno =
+            static_cast<tinyexr_int64>(line_no) -
+            static_cast<tinyexr_int64>(exr_header->data_window.min_y);
+        if (lno > std::numeric_limits<int>::max()) {
+          line_no = -1;  // invalid
+        } else if (lno < -std::numeric_limits<int>::max()) {
+          line_no = -1;  // invalid
+        } else {
+          line_no -= exr_header->data_window.min_y;
+        }
+
+        if (line_no < 0) {
+          decoder->invalid_data = true;
+        } else {
+          if (!tinyexr::DecodePixelData(
+                  decoder->slices.data(), data_ptr,
+                  static_cast<size_t>(data_len),
+                  exr_header->compression_type, exr_header->line_order,
+                  decoder->data_width, decoder->roi_height,
+                  line_no - decoder->first_line, num_lines,
+                  decoder->roi_min_x, decoder->roi_width,
+                  static_cast<size_t>(decoder->pixel_data_size),
+                  static_cast<size_t>(
+                      exr_header->num_custom_attributes),
+                  exr_header->custom_attributes,
+                  static_cast<size_t>(exr_header->num_channels),
+                  exr_header->channels, decoder->channel_offset_list)) {
+            decoder->invalid_data = true;
+          }
+        }
+      }
+    }
+  }
+}
+
+// Checks the errors of the decoded blocks and finishes `exr_image`.
+static int EndDecodeChunk(ChunkDecoder *decoder, std::string *err) {
+  EXRImage *exr_image = decoder->exr_image;
+  const EXRHeader *exr_header = decoder->exr_header;
+  int num_channels = exr_header->num_channels;
+
+  if (decoder->error_flag) {
+    if (err) {
+      if (decoder->error_flag & EF_INSUFFICIENT_DATA) {
+        (*err) += "Insufficient data length.\n";
+      }
+      if (decoder->error_flag & EF_FAILED_TO_DECODE) {
+        (*err) += "Failed to decode tile data.\n";
+      }
+    }
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  if (decoder->invalid_data) {
+    if (err) {
+      (*err) += "Invalid/Corrupted data found when decoding pixels.\n";
+    }
+
+    // free alloced image.
+    if (exr_image->images) {
+      for (size_t c = 0; c < static_cast<size_t>(num_channels); c++) {
+        if (exr_image->images[c]) {
+          free(exr_image->images[c]);
+          exr_image->images[c] = NULL;
+        }
+      }
+    }
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  if (decoder->to_frame_buffer) {
+    // Pixels are stored only in the frame buffer.
+    return TINYEXR_SUCCESS;
+  }
+
+  // Overwrite `pixel_type` with `requested_pixel_type`.
+  {
+    for (int c = 0; c < exr_header->num_channels; c++) {
+      exr_header->pixel_types[c] = exr_header->requested_pixel_types[c];
+    }
+  }
+
+  {
+    exr_image->num_channels = num_channels;
+
+    exr_image->width = decoder->roi_width;
+    exr_image->height = decoder->roi_height;
+  }
+
+  return TINYEXR_SUCCESS;
+}
+
+// Byte range [first, second) of chunk data in the file.
+typedef std::pair<tinyexr_uint64, tinyexr_uint64> ChunkRange;
+
+// Appends the byte ranges of the blocks [first_block, first_block +
+// num_blocks) of `offset_data`(all levels in table order) to `ranges`.
+// A chunk ends where the next chunk in the table begins. The end of the last
+// chunk is read from its `data_len` field.
+static void AppendChunkRanges(const OffsetData &offset_data, bool tiled,
+                              size_t first_block, size_t num_blocks,
+                              const unsigned char *head, const size_t size,
+                              std::vector<ChunkRange> *ranges) {
+  std::vector<tinyexr_uint64> offsets;
+  for (size_t l = 0; l < offset_data.offsets.size(); l++) {
+    for (size_t y = 0; y < offset_data.offsets[l].size(); y++) {
+      offsets.insert(offsets.end(), offset_data.offsets[l][y].begin(),
+                     offset_data.offsets[l][y].end());
+    }
+  }
+  if (first_block + num_blocks > offsets.size()) {
+    return;
+  }
+
+  std::vector<tinyexr_uint64> sorted_offsets(offsets);
+  std::sort(sorted_offsets.begin(), sorted_offsets.end());
+
+  // 4 bytes(y) + 4 bytes(data_len), or 16 bytes(tile coordinates) + 4 bytes.
+  const tinyexr_uint64 header_len = tiled ? 20 : 8;
+  for (size_t i = first_block; i < first_block + num_blocks; i++) {
+    const tinyexr_uint64 begin = offsets[i];
+    if (begin >= size) {
+      continue;
+    }
+    tinyexr_uint64 end = size;
+    std::vector<tinyexr_uint64>::const_iterator next = std::upper_bound(
+        sorted_offsets.begin(), sorted_offsets.end(), begin);
+    if (next != sorted_offsets.end()) {
+      end = *next;
+    } else if (begin + header_len <= size) {
+      unsigned int data_len;
+      memcpy(&data_len, head + begin + header_len - 4, sizeof(unsigned int));
+      tinyexr::swap4(&data_len);
+      end = std::min(tinyexr_uint64(size), begin + header_len + data_len);
+    }
+    ranges->push_back(ChunkRange(begin, end));
+  }
+}
+
+// Applies `advice`(TINYEXR_MMAP_ADVICE_*, OR'ed) to the chunks of the memory
+// mapped file `head` while they are decoded. `Begin` hints the chunks before
+// decoding. `End`(also called by the destructor, e.g. on errors) resets
+// MADV_SEQUENTIAL to MADV_NORMAL, so that a later load through the same
+// mapping(e.g. `EXRFile`) gets the default readahead, and releases the pages
+// for TINYEXR_MMAP_ADVICE_DONTNEED.
+// No-op when memory mapping by POSIX mmap() is not available.
+class ChunkAdvice {
+ public:
+  ChunkAdvice(const unsigned char *head, const size_t size, int advice)
+      : head_(head), size_(size), advice_(advice) {}
+  ~ChunkAdvice() { End(); }
+
+  // `ranges` is sorted and merged into page-aligned ranges.
+  void Begin(std::vector<ChunkRange> *ranges) {
+#if defined(TINYEXR_USE_POSIX_MMAP) && defined(MADV_WILLNEED)
+    if ((advice_ == 0) || ranges->empty()) {
+      return;
+    }
+
+    const long page_size = sysconf(_SC_PAGESIZE);
+    if ((page_size <= 0) ||
+        (reinterpret_cast<size_t>(head_) % size_t(page_size)) != 0) {
+      // Not the start of a mapping.
+      return;
+    }
+    const tinyexr_uint64 page = tinyexr_uint64(page_size);
+
+    std::sort(ranges->begin(), ranges->end());
+    for (size_t i = 0; i < ranges->size(); i++) {
+      tinyexr_uint64 begin = (*ranges)[i].first / page * page;
+      tinyexr_uint64 end = std::min(tinyexr_uint64(size_), (*ranges)[i].second);
+      if (begin >= end) {
+        continue;
+      }
+      if (!ranges_.empty() && (begin <= ranges_.back().second)) {
+        ranges_.back().second = std::max(ranges_.back().second, end);
+      } else {
+        ranges_.push_back(ChunkRange(begin, end));
+      }
+    }
+
+    // Hints only: errors are ignored.
+    if (advice_ & TINYEXR_MMAP_ADVICE_SEQUENTIAL) {
+      Advise(MADV_SEQUENTIAL);
+    }
+    if (advice_ & TINYEXR_MMAP_ADVICE_WILLNEED) {
+      Advise(MADV_WILLNEED);
+    }
+#else
+    (void)ranges;
+#endif
+  }
+
+  void End() {
+#if defined(TINYEXR_USE_POSIX_MMAP) && defined(MADV_WILLNEED)
+    if (advice_ & TINYEXR_MMAP_ADVICE_SEQUENTIAL) {
+      Advise(MADV_NORMAL);
+    }
+    if (advice_ & TINYEXR_MMAP_ADVICE_DONTNEED) {
+      Advise(MADV_DONTNEED);
+    }
+#endif
+    ranges_.clear();
+  }
+
+ private:
+  ChunkAdvice(const ChunkAdvice &);
+  ChunkAdvice &operator=(const ChunkAdvice &);
+
+#if defined(TINYEXR_USE_POSIX_MMAP) && defined(MADV_WILLNEED)
+  void Advise(int advice) {
+    for (size_t i = 0; i < ranges_.size(); i++) {
+      madvise(const_cast<unsigned char *>(head_ + ranges_[i].first),
+              size_t(ranges_[i].second - ranges_[i].first), advice);
+    }
+  }
+#endif
+
+  const unsigned char *head_;
+  size_t size_;
+  int advice_;
+  std::vector<ChunkRange> ranges_;  // page-aligned, merged
+};
+
+static int MmapAdvice(const EXRParallelOptions *parallel_options) {
+  return parallel_options ? parallel_options->mmap_advice : 0;
+}
+
+// Returns `parallel_options` without `mmap_advice`(stored in `storage`), for
+// memory which is not mapped by tinyexr. madvise(MADV_DONTNEED) discards the
+// contents of anonymous memory.
+static const EXRParallelOptions *WithoutMmapAdvice(
+    const EXRParallelOptions *parallel_options, EXRParallelOptions *storage) {
+  if (MmapAdvice(parallel_options) == 0) {
+    return parallel_options;
+  }
+  *storage = *parallel_options;
+  storage->mmap_advice = 0;
+  return storage;
+}
+
+static int DecodeChunk(EXRImage *exr_image, const EXRHeader *exr_header,
+                       const OffsetData& offset_data,
+                       const unsigned char *head, const size_t size,
+                       const EXRParallelOptions *parallel_options,
+                       const EXRBox2i *roi,
+                       const EXRFrameBufferSlice *frame_buffer,
+                       std::string *err) {
+  ChunkDecoder decoder;
+  int ret = BeginDecodeChunk(&decoder, exr_image, exr_header, offset_data,
+                             head, size, parallel_options, roi, frame_buffer,
+                             err);
+  if (ret != TINYEXR_SUCCESS) {
+    return ret;
+  }
+
+  // Only the blocks in `roi` are touched for scanline image.
+  // Tiles decoded into `frame_buffer` are decoded in `BeginDecodeChunk`
+  // (`num_blocks` is 0) and are not hinted. `LoadEXRImageToFrameBuffer*` do
+  // not take `mmap_advice`.
+  const int advice = MmapAdvice(parallel_options);
+  ChunkAdvice chunk_advice(head, size, advice);
+  if ((advice != 0) && (decoder.num_blocks > 0)) {
+    std::vector<ChunkRange> ranges;
+    AppendChunkRanges(offset_data, exr_header->tiled != 0,
+                      exr_header->tiled ? 0 : decoder.first_block,
+                      decoder.num_blocks, head, size, &ranges);
+    chunk_advice.Begin(&ranges);
+  }
+
+  ParallelFor(int(decoder.num_blocks), parallel_options, [&](int i) {
+    DecodeChunkBlock(&decoder, size_t(i));
+  });
+
+  chunk_advice.End();
+
+  return EndDecodeChunk(&decoder, err);
+}
+
+static bool ReconstructLineOffsets(
+    std::vector<tinyexr::tinyexr_uint64> *offsets, size_t n,
+    const unsigned char *head, const unsigned char *marker, const size_t size) {
+  if (head >= marker) {
+    return false;
+  }
+  if (offsets->size() != n) {
+    return false;
+  }
+
+  for (size_t i = 0; i < n; i++) {
+    size_t offset = static_cast<size_t>(marker - head);
+    // Offset should not exceed whole EXR file/data size.
+    if ((offset + sizeof(tinyexr::tinyexr_uint64)) >= size) {
+      return false;
+    }
+
+    int y;
+    unsigned int data_len;
+
+    memcpy(&y, marker, sizeof(int));
+    memcpy(&data_len, marker + 4, sizeof(unsigned int));
+
+    if (data_len >= size) {
+      return false;
+    }
+
+    tinyexr::swap4(&y);
+    tinyexr::swap4(&data_len);
+
+    (*offsets)[i] = offset;
+
+    marker += data_len + 8;  // 8 = 4 bytes(y) + 4 bytes(data_len)
+  }
+
+  return true;
+}
+
+
+static int FloorLog2(unsigned x) {
+  //
+  // For x > 0, floorLog2(y) returns floor(log(x)/log(2)).
+  //
+  int y = 0;
+  while (x > 1) {
+    y += 1;
+    x >>= 1u;
+  }
+  return y;
+}
+
+
+static int CeilLog2(unsigned x) {
+  //
+  // For x > 0, ceilLog2(y) returns ceil(log(x)/log(2)).
   //
   int y = 0;
+  int r = 0;
   while (x > 1) {
+    if (x & 1)
+      r = 1;
+
     y += 1;
     x >>= 1u;
   }
-  return y;
-}
-
+  return y + r;
+}
+
+static int RoundLog2(int x, int tile_rounding_mode) {
+  return (tile_rounding_mode == TINYEXR_TILE_ROUND_DOWN) ? FloorLog2(static_cast<unsigned>(x)) : CeilLog2(static_cast<unsigned>(x));
+}
+
+static int CalculateNumXLevels(const EXRHeader* exr_header) {
+  int min_x = exr_header->data_window.min_x;
+  int max_x = exr_header->data_window.max_x;
+  int min_y = exr_header->data_window.min_y;
+  int max_y = exr_header->data_window.max_y;
+
+  int num = 0;
+  switch (exr_header->tile_level_mode) {
+  case TINYEXR_TILE_ONE_LEVEL:
+
+    num = 1;
+    break;
+
+  case TINYEXR_TILE_MIPMAP_LEVELS:
+
+  {
+    int w = max_x - min_x + 1;
+    int h = max_y - min_y + 1;
+    num = RoundLog2(std::max(w, h), exr_header->tile_rounding_mode) + 1;
+  }
+  break;
+
+  case TINYEXR_TILE_RIPMAP_LEVELS:
+
+  {
+    int w = max_x - min_x + 1;
+    num = RoundLog2(w, exr_header->tile_rounding_mode) + 1;
+  }
+  break;
+
+  default:
+
+    return -1;
+  }
+
+  return num;
+}
+
+static int CalculateNumYLevels(const EXRHeader* exr_header) {
+  int min_x = exr_header->data_window.min_x;
+  int max_x = exr_header->data_window.max_x;
+  int min_y = exr_header->data_window.min_y;
+  int max_y = exr_header->data_window.max_y;
+  int num = 0;
+
+  switch (exr_header->tile_level_mode) {
+  case TINYEXR_TILE_ONE_LEVEL:
+
+    num = 1;
+    break;
+
+  case TINYEXR_TILE_MIPMAP_LEVELS:
+
+  {
+    int w = max_x - min_x + 1;
+    int h = max_y - min_y + 1;
+    num = RoundLog2(std::max(w, h), exr_header->tile_rounding_mode) + 1;
+  }
+  break;
+
+  case TINYEXR_TILE_RIPMAP_LEVELS:
+
+  {
+    int h = max_y - min_y + 1;
+    num = RoundLog2(h, exr_header->tile_rounding_mode) + 1;
+  }
+  break;
+
+  default:
+
+    return -1;
+  }
+
+  return num;
+}
+
+static bool CalculateNumTiles(std::vector<int>& numTiles,
+  int toplevel_size,
+  int size,
+  int tile_rounding_mode) {
+  for (unsigned i = 0; i < numTiles.size(); i++) {
+    int l = LevelSize(toplevel_size, int(i), tile_rounding_mode);
+    if (l < 0) {
+      return false;
+    }
+    TINYEXR_CHECK_AND_RETURN_C(l <= std::numeric_limits<int>::max() - size + 1, false);
+
+    numTiles[i] = (l + size - 1) / size;
+  }
+  return true;
+}
+
+static bool PrecalculateTileInfo(std::vector<int>& num_x_tiles,
+  std::vector<int>& num_y_tiles,
+  const EXRHeader* exr_header) {
+  int min_x = exr_header->data_window.min_x;
+  int max_x = exr_header->data_window.max_x;
+  int min_y = exr_header->data_window.min_y;
+  int max_y = exr_header->data_window.max_y;
+
+  int num_x_levels = CalculateNumXLevels(exr_header);
+
+  if (num_x_levels < 0) {
+    return false;
+  }
+
+  int num_y_levels = CalculateNumYLevels(exr_header);
+
+  if (num_y_levels < 0) {
+    return false;
+  }
+
+  num_x_tiles.resize(size_t(num_x_levels));
+  num_y_tiles.resize(size_t(num_y_levels));
+
+  if (!CalculateNumTiles(num_x_tiles,
+    max_x - min_x + 1,
+    exr_header->tile_size_x,
+    exr_header->tile_rounding_mode)) {
+    return false;
+  }
+
+  if (!CalculateNumTiles(num_y_tiles,
+    max_y - min_y + 1,
+    exr_header->tile_size_y,
+    exr_header->tile_rounding_mode)) {
+    return false;
+  }
+
+  return true;
+}
+
+static void InitSingleResolutionOffsets(OffsetData& offset_data, size_t num_blocks) {
+  offset_data.offsets.resize(1);
+  offset_data.offsets[0].resize(1);
+  offset_data.offsets[0][0].resize(num_blocks);
+  offset_data.num_x_levels = 1;
+  offset_data.num_y_levels = 1;
+}
+
+// Return sum of tile blocks.
+// 0 = error
+static int InitTileOffsets(OffsetData& offset_data,
+  const EXRHeader* exr_header,
+  const std::vector<int>& num_x_tiles,
+  const std::vector<int>& num_y_tiles) {
+  int num_tile_blocks = 0;
+  offset_data.num_x_levels = static_cast<int>(num_x_tiles.size());
+  offset_data.num_y_levels = static_cast<int>(num_y_tiles.size());
+  switch (exr_header->tile_level_mode) {
+  case TINYEXR_TILE_ONE_LEVEL:
+  case TINYEXR_TILE_MIPMAP_LEVELS:
+    TINYEXR_CHECK_AND_RETURN_C(offset_data.num_x_levels == offset_data.num_y_levels, 0);
+    offset_data.offsets.resize(size_t(offset_data.num_x_levels));
+
+    for (unsigned int l = 0; l < offset_data.offsets.size(); ++l) {
+      offset_data.offsets[l].resize(size_t(num_y_tiles[l]));
+
+      for (unsigned int dy = 0; dy < offset_data.offsets[l].size(); ++dy) {
+        offset_data.offsets[l][dy].resize(size_t(num_x_tiles[l]));
+        num_tile_blocks += num_x_tiles[l];
+      }
+    }
+    break;
+
+  case TINYEXR_TILE_RIPMAP_LEVELS:
+
+    offset_data.offsets.resize(static_cast<size_t>(offset_data.num_x_levels) * static_cast<size_t>(offset_data.num_y_levels));
+
+    for (int ly = 0; ly < offset_data.num_y_levels; ++ly) {
+      for (int lx = 0; lx < offset_data.num_x_levels; ++lx) {
+        int l = ly * offset_data.num_x_levels + lx;
+        offset_data.offsets[size_t(l)].resize(size_t(num_y_tiles[size_t(ly)]));
+
+        for (size_t dy = 0; dy < offset_data.offsets[size_t(l)].size(); ++dy) {
+          offset_data.offsets[size_t(l)][dy].resize(size_t(num_x_tiles[size_t(lx)]));
+          num_tile_blocks += num_x_tiles[size_t(lx)];
+        }
+      }
+    }
+    break;
+
+  default:
+    return 0;
+  }
+  return num_tile_blocks;
+}
+
+static bool IsAnyOffsetsAreInvalid(const OffsetData& offset_data) {
+  for (unsigned int l = 0; l < offset_data.offsets.size(); ++l)
+    for (unsigned int dy = 0; dy < offset_data.offsets[l].size(); ++dy)
+      for (unsigned int dx = 0; dx < offset_data.offsets[l][dy].size(); ++dx)
+        if (reinterpret_cast<const tinyexr::tinyexr_int64&>(offset_data.offsets[l][dy][dx]) <= 0)
+          return true;
+
+  return false;
+}
+
+static bool isValidTile(const EXRHeader* exr_header,
+                        const OffsetData& offset_data,
+                        int dx, int dy, int lx, int ly) {
+  if (lx < 0 || ly < 0 || dx < 0 || dy < 0) return false;
+  int num_x_levels = offset_data.num_x_levels;
+  int num_y_levels = offset_data.num_y_levels;
+  switch (exr_header->tile_level_mode) {
+  case TINYEXR_TILE_ONE_LEVEL:
+
+    if (lx == 0 &&
+        ly == 0 &&
+        offset_data.offsets.size() > 0 &&
+        offset_data.offsets[0].size() > static_cast<size_t>(dy) &&
+        offset_data.offsets[0][size_t(dy)].size() > static_cast<size_t>(dx)) {
+      return true;
+    }
+
+    break;
+
+  case TINYEXR_TILE_MIPMAP_LEVELS:
+
+    if (lx < num_x_levels &&
+        ly < num_y_levels &&
+        offset_data.offsets.size() > static_cast<size_t>(lx) &&
+        offset_data.offsets[size_t(lx)].size() > static_cast<size_t>(dy) &&
+        offset_data.offsets[size_t(lx)][size_t(dy)].size() > static_cast<size_t>(dx)) {
+      return true;
+    }
+
+    break;
+
+  case TINYEXR_TILE_RIPMAP_LEVELS:
+  {
+    size_t idx = static_cast<size_t>(lx) + static_cast<size_t>(ly)* static_cast<size_t>(num_x_levels);
+    if (lx < num_x_levels &&
+       ly < num_y_levels &&
+       (offset_data.offsets.size() > idx) &&
+       offset_data.offsets[idx].size() > static_cast<size_t>(dy) &&
+       offset_data.offsets[idx][size_t(dy)].size() > static_cast<size_t>(dx)) {
+      return true;
+    }
+  }
+
+    break;
+
+  default:
+
+    return false;
+  }
+
+  return false;
+}
+
+static bool ReconstructTileOffsets(OffsetData& offset_data,
+                                   const EXRHeader* exr_header,
+                                   const unsigned char* head, const unsigned char* marker, const size_t size,
+                                   bool isMultiPartFile,
+                                   bool isDeep) {
+  int numXLevels = offset_data.num_x_levels;
+  for (unsigned int l = 0; l < offset_data.offsets.size(); ++l) {
+    for (unsigned int dy = 0; dy < offset_data.offsets[l].size(); ++dy) {
+      for (unsigned int dx = 0; dx < offset_data.offsets[l][dy].size(); ++dx) {
+        tinyexr::tinyexr_uint64 tileOffset = tinyexr::tinyexr_uint64(marker - head);
+
+
+        if (isMultiPartFile) {
+          if ((marker + sizeof(int)) >= (head + size)) {
+            return false;
+          }
+
+          //int partNumber;
+          marker += sizeof(int);
+        }
+
+        if ((marker + 4 * sizeof(int)) >= (head + size)) {
+          return false;
+        }
+
+        int tileX;
+        memcpy(&tileX, marker, sizeof(int));
+        tinyexr::swap4(&tileX);
+        marker += sizeof(int);
+
+        int tileY;
+        memcpy(&tileY, marker, sizeof(int));
+        tinyexr::swap4(&tileY);
+        marker += sizeof(int);
+
+        int levelX;
+        memcpy(&levelX, marker, sizeof(int));
+        tinyexr::swap4(&levelX);
+        marker += sizeof(int);
+
+        int levelY;
+        memcpy(&levelY, marker, sizeof(int));
+        tinyexr::swap4(&levelY);
+        marker += sizeof(int);
+
+        if (isDeep) {
+          if ((marker + 2 * sizeof(tinyexr::tinyexr_int64)) >= (head + size)) {
+            return false;
+          }
+          tinyexr::tinyexr_int64 packed_offset_table_size;
+          memcpy(&packed_offset_table_size, marker, sizeof(tinyexr::tinyexr_int64));
+          tinyexr::swap8(reinterpret_cast<tinyexr::tinyexr_uint64*>(&packed_offset_table_size));
+          marker += sizeof(tinyexr::tinyexr_int64);
+
+          tinyexr::tinyexr_int64 packed_sample_size;
+          memcpy(&packed_sample_size, marker, sizeof(tinyexr::tinyexr_int64));
+          tinyexr::swap8(reinterpret_cast<tinyexr::tinyexr_uint64*>(&packed_sample_size));
+          marker += sizeof(tinyexr::tinyexr_int64);
+
+          // next Int64 is unpacked sample size - skip that too
+          marker += packed_offset_table_size + packed_sample_size + 8;
+
+          if (marker >= (head + size)) {
+            return false;
+          }
+
+        } else {
+
+          if ((marker + sizeof(uint32_t)) >= (head + size)) {
+            return false;
+          }
+
+          uint32_t dataSize;
+          memcpy(&dataSize, marker, sizeof(uint32_t));
+          tinyexr::swap4(&dataSize);
+          marker += sizeof(uint32_t);
+
+          marker += dataSize;
+
+          if (marker >= (head + size)) {
+            return false;
+          }
+        }
+
+        if (!isValidTile(exr_header, offset_data,
+          tileX, tileY, levelX, levelY)) {
+          return false;
+        }
+
+        int level_idx = LevelIndex(levelX, levelY, exr_header->tile_level_mode, numXLevels);
+        if (level_idx < 0) {
+          return false;
+        }
+
+        if (size_t(level_idx) >= offset_data.offsets.size()) {
+          return false;
+        }
+
+        if (size_t(tileY) >= offset_data.offsets[size_t(level_idx)].size()) {
+          return false;
+        }
+
+        if (size_t(tileX) >= offset_data.offsets[size_t(level_idx)][size_t(tileY)].size()) {
+          return false;
+        }
+        
+        offset_data.offsets[size_t(level_idx)][size_t(tileY)][size_t(tileX)] = tileOffset;
+      }
+    }
+  }
+  return true;
+}
+
+// marker output is also
+static int ReadOffsets(OffsetData& offset_data,
+                       const unsigned char* head,
+                       const unsigned char*& marker,
+                       const size_t size,
+                       const char** err) {
+  for (unsigned int l = 0; l < offset_data.offsets.size(); ++l) {
+    for (unsigned int dy = 0; dy < offset_data.offsets[l].size(); ++dy) {
+      for (unsigned int dx = 0; dx < offset_data.offsets[l][dy].size(); ++dx) {
+        tinyexr::tinyexr_uint64 offset;
+        if ((marker + sizeof(tinyexr_uint64)) >= (head + size)) {
+          tinyexr::SetErrorMessage("Insufficient data size in offset table.", err);
+          return TINYEXR_ERROR_INVALID_DATA;
+        }
+
+        memcpy(&offset, marker, sizeof(tinyexr::tinyexr_uint64));
+        tinyexr::swap8(&offset);
+        if (offset >= size) {
+          tinyexr::SetErrorMessage("Invalid offset value in DecodeEXRImage.", err);
+          return TINYEXR_ERROR_INVALID_DATA;
+        }
+        marker += sizeof(tinyexr::tinyexr_uint64);  // = 8
+        offset_data.offsets[l][dy][dx] = offset;
+      }
+    }
+  }
+  return TINYEXR_SUCCESS;
+}
+
+// Reads(and reconstructs if required) the offset table of a tiled image.
+static int ReadTiledOffsets(OffsetData &offset_data,
+                            const EXRHeader *exr_header,
+                            const unsigned char *head,
+                            const unsigned char *marker, const size_t size,
+                            const char **err) {
+  {
+    std::vector<int> num_x_tiles, num_y_tiles;
+    if (!PrecalculateTileInfo(num_x_tiles, num_y_tiles, exr_header)) {
+      tinyexr::SetErrorMessage("Failed to precalculate tile info.", err);
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+    int num_blocks = InitTileOffsets(offset_data, exr_header, num_x_tiles, num_y_tiles);
+    if (exr_header->chunk_count > 0) {
+      if (exr_header->chunk_count != num_blocks) {
+        tinyexr::SetErrorMessage("Invalid offset table size.", err);
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
+    }
+  }
+
+  int ret = ReadOffsets(offset_data, head, marker, size, err);
+  if (ret != TINYEXR_SUCCESS) return ret;
+  if (IsAnyOffsetsAreInvalid(offset_data)) {
+    if (!ReconstructTileOffsets(offset_data, exr_header,
+      head, marker, size,
+      exr_header->multipart, exr_header->non_image)) {
+
+        tinyexr::SetErrorMessage("Invalid Tile Offsets data.", err);
+        return TINYEXR_ERROR_INVALID_DATA;
+    }
+  }
+
+  return TINYEXR_SUCCESS;
+}
+
+static int DecodeEXRImage(EXRImage *exr_image, const EXRHeader *exr_header,
+                          const unsigned char *head,
+                          const unsigned char *marker, const size_t size,
+                          const EXRParallelOptions *parallel_options,
+                          const EXRBox2i *roi,
+                          const EXRFrameBufferSlice *frame_buffer,
+                          const char **err) {
+  if (exr_image == NULL || exr_header == NULL || head == NULL ||
+      marker == NULL || (size <= tinyexr::kEXRVersionSize)) {
+    tinyexr::SetErrorMessage("Invalid argument for DecodeEXRImage().", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  int num_scanline_blocks =
+      tinyexr::NumScanlines(exr_header->compression_type);
+
+  if (exr_header->data_window.max_x < exr_header->data_window.min_x ||
+      exr_header->data_window.max_x - exr_header->data_window.min_x ==
+          std::numeric_limits<int>::max()) {
+    // Issue 63
+    tinyexr::SetErrorMessage("Invalid data width value", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+  tinyexr_int64 data_width =
+      static_cast<tinyexr_int64>(exr_header->data_window.max_x) - static_cast<tinyexr_int64>(exr_header->data_window.min_x) + static_cast<tinyexr_int64>(1);
+  if (data_width <= 0) {
+    tinyexr::SetErrorMessage("Invalid data window width value", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  if (exr_header->data_window.max_y < exr_header->data_window.min_y ||
+      exr_header->data_window.max_y - exr_header->data_window.min_y ==
+          std::numeric_limits<int>::max()) {
+    tinyexr::SetErrorMessage("Invalid data height value", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+  tinyexr_int64 data_height =
+      static_cast<tinyexr_int64>(exr_header->data_window.max_y) - static_cast<tinyexr_int64>(exr_header->data_window.min_y) + static_cast<tinyexr_int64>(1);
+
+  if (data_height <= 0) {
+    tinyexr::SetErrorMessage("Invalid data window height value", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  // Do not allow too large data_width and data_height. header invalid?
+  {
+    if (data_width > TINYEXR_DIMENSION_THRESHOLD) {
+      tinyexr::SetErrorMessage("data width too large.", err);
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+    if (data_height > TINYEXR_DIMENSION_THRESHOLD) {
+      tinyexr::SetErrorMessage("data height too large.", err);
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+  }
+
+  if (exr_header->tiled) {
+    if (exr_header->tile_size_x > TINYEXR_DIMENSION_THRESHOLD) {
+      tinyexr::SetErrorMessage("tile width too large.", err);
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+    if (exr_header->tile_size_y > TINYEXR_DIMENSION_THRESHOLD) {
+      tinyexr::SetErrorMessage("tile height too large.", err);
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+  }
+
+  // Read offset tables.
+  OffsetData offset_data;
+  size_t num_blocks = 0;
+  // For a multi-resolution image, the size of the offset table will be calculated from the other attributes of the header.
+  // If chunk_count > 0 then chunk_count must be equal to the calculated tile count.
+  if (exr_header->tiled) {
+    int ret = ReadTiledOffsets(offset_data, exr_header, head, marker, size, err);
+    if (ret != TINYEXR_SUCCESS) return ret;
+  } else if (exr_header->chunk_count > 0) {
+    // Use `chunkCount` attribute.
+    num_blocks = static_cast<size_t>(exr_header->chunk_count);
+    InitSingleResolutionOffsets(offset_data, num_blocks);
+  } else {
+    num_blocks = static_cast<size_t>(data_height) /
+      static_cast<size_t>(num_scanline_blocks);
+    if (num_blocks * static_cast<size_t>(num_scanline_blocks) <
+      static_cast<size_t>(data_height)) {
+      num_blocks++;
+    }
+
+    InitSingleResolutionOffsets(offset_data, num_blocks);
+  }
+
+  if (!exr_header->tiled) {
+    std::vector<tinyexr::tinyexr_uint64>& offsets = offset_data.offsets[0][0];
+    for (size_t y = 0; y < num_blocks; y++) {
+      tinyexr::tinyexr_uint64 offset;
+      // Issue #81
+      if ((marker + sizeof(tinyexr_uint64)) >= (head + size)) {
+        tinyexr::SetErrorMessage("Insufficient data size in offset table.", err);
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
+
+      memcpy(&offset, marker, sizeof(tinyexr::tinyexr_uint64));
+      tinyexr::swap8(&offset);
+      if (offset >= size) {
+        tinyexr::SetErrorMessage("Invalid offset value in DecodeEXRImage.", err);
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
+      marker += sizeof(tinyexr::tinyexr_uint64);  // = 8
+      offsets[y] = offset;
+    }
+
+    // If line offsets are invalid, we try to reconstruct it.
+    // See OpenEXR/IlmImf/ImfScanLineInputFile.cpp::readLineOffsets() for details.
+    for (size_t y = 0; y < num_blocks; y++) {
+      if (offsets[y] <= 0) {
+        // TODO(syoyo) Report as warning?
+        // if (err) {
+        //  stringstream ss;
+        //  ss << "Incomplete lineOffsets." << std::endl;
+        //  (*err) += ss.str();
+        //}
+        bool ret =
+          ReconstructLineOffsets(&offsets, num_blocks, head, marker, size);
+        if (ret) {
+          // OK
+          break;
+        } else {
+          tinyexr::SetErrorMessage(
+            "Cannot reconstruct lineOffset table in DecodeEXRImage.", err);
+          return TINYEXR_ERROR_INVALID_DATA;
+        }
+      }
+    }
+  }
+
+  {
+    std::string e;
+    int ret = DecodeChunk(exr_image, exr_header, offset_data, head, size,
+                          parallel_options, roi, frame_buffer, &e);
+
+    if (ret != TINYEXR_SUCCESS) {
+      if (!e.empty()) {
+        tinyexr::SetErrorMessage(e, err);
+      }
+
+#if 1
+      FreeEXRImage(exr_image);
+#else
+      // release memory(if exists)
+      if ((exr_header->num_channels > 0) && exr_image && exr_image->images) {
+        for (size_t c = 0; c < size_t(exr_header->num_channels); c++) {
+          if (exr_image->images[c]) {
+            free(exr_image->images[c]);
+            exr_image->images[c] = NULL;
+          }
+        }
+        free(exr_image->images);
+        exr_image->images = NULL;
+      }
+#endif
+    }
+
+    return ret;
+  }
+}
+
+static void GetLayers(const EXRHeader &exr_header,
+                      std::vector<std::string> &layer_names) {
+  // Naive implementation
+  // Group channels by layers
+  // go over all channel names, split by periods
+  // collect unique names
+  layer_names.clear();
+  for (int c = 0; c < exr_header.num_channels; c++) {
+    std::string full_name(exr_header.channels[c].name);
+    const size_t pos = full_name.find_last_of('.');
+    if (pos != std::string::npos && pos != 0 && pos + 1 < full_name.size()) {
+      full_name.erase(pos);
+      if (std::find(layer_names.begin(), layer_names.end(), full_name) ==
+          layer_names.end())
+        layer_names.push_back(full_name);
+    }
+  }
+}
+
+struct LayerChannel {
+  explicit LayerChannel(size_t i, std::string n) : index(i), name(n) {}
+  size_t index;
+  std::string name;
+};
+
+static void ChannelsInLayer(const EXRHeader &exr_header,
+                            const std::string &layer_name,
+                            std::vector<LayerChannel> &channels) {
+  channels.clear();
+  //std::cout << "layer_name = " << layer_name << "\n";
+  for (int c = 0; c < exr_header.num_channels; c++) {
+    //std::cout << "chan[" << c << "] = " << exr_header.channels[c].name << "\n";
+    std::string ch_name(exr_header.channels[c].name);
+    if (layer_name.empty()) {
+      const size_t pos = ch_name.find_last_of('.');
+      if (pos != std::string::npos && pos < ch_name.size()) {
+        if (pos != 0) continue;
+        ch_name = ch_name.substr(pos + 1);
+      }
+    } else {
+      const size_t pos = ch_name.find(layer_name + '.');
+      if (pos == std::string::npos) continue;
+      if (pos == 0) {
+        ch_name = ch_name.substr(layer_name.size() + 1);
+      }
+    }
+    LayerChannel ch(size_t(c), ch_name);
+    channels.push_back(ch);
+  }
+}
+
+}  // namespace tinyexr
+
+int EXRLayers(const char *filename, const char **layer_names[], int *num_layers,
+              const char **err) {
+  EXRFile *exr_file = NULL;
+  EXRHeader exr_header;
+  InitEXRHeader(&exr_header);
+
+  {
+    int ret = OpenEXRFile(&exr_file, filename, NULL);
+    if (ret != TINYEXR_SUCCESS) {
+      tinyexr::SetErrorMessage("Invalid EXR header.", err);
+      return ret;
+    }
+
+    const EXRVersion *exr_version = EXRFileVersion(exr_file);
+    if (exr_version->multipart || exr_version->non_image) {
+      CloseEXRFile(exr_file);
+      tinyexr::SetErrorMessage(
+          "Loading multipart or DeepImage is not supported  in LoadEXR() API",
+          err);
+      return TINYEXR_ERROR_INVALID_DATA;  // @fixme.
+    }
+  }
+
+  int ret = EXRFileParseHeader(exr_file, &exr_header, err);
+  CloseEXRFile(exr_file);
+  if (ret != TINYEXR_SUCCESS) {
+    FreeEXRHeader(&exr_header);
+    return ret;
+  }
+
+  std::vector<std::string> layer_vec;
+  tinyexr::GetLayers(exr_header, layer_vec);
+
+  (*num_layers) = int(layer_vec.size());
+  (*layer_names) = static_cast<const char **>(
+      malloc(sizeof(const char *) * static_cast<size_t>(layer_vec.size())));
+  for (size_t c = 0; c < static_cast<size_t>(layer_vec.size()); c++) {
+#ifdef _MSC_VER
+    (*layer_names)[c] = _strdup(layer_vec[c].c_str());
+#else
+    (*layer_names)[c] = strdup(layer_vec[c].c_str());
+#endif
+  }
+
+  FreeEXRHeader(&exr_header);
+  return TINYEXR_SUCCESS;
+}
+
+int LoadEXR(float **out_rgba, int *width, int *height, const char *filename,
+            const char **err) {
+  return LoadEXRWithLayer(out_rgba, width, height, filename,
+                          /* layername */ NULL, err);
+}
+
+int LoadEXRWithLayer(float **out_rgba, int *width, int *height,
+                     const char *filename, const char *layername,
+                     const char **err) {
+  if (out_rgba == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for LoadEXR()", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  EXRFile *exr_file = NULL;
+  EXRImage exr_image;
+  EXRHeader exr_header;
+  InitEXRHeader(&exr_header);
+  InitEXRImage(&exr_image);
+
+  // Open the file once for the version, the header and the image.
+  {
+    int ret = OpenEXRFile(&exr_file, filename, NULL);
+    if (ret != TINYEXR_SUCCESS) {
+      std::stringstream ss;
+      ss << "Failed to open EXR file or read version info from EXR file. code("
+         << ret << ")";
+      tinyexr::SetErrorMessage(ss.str(), err);
+      return ret;
+    }
+
+    const EXRVersion *exr_version = EXRFileVersion(exr_file);
+    if (exr_version->multipart || exr_version->non_image) {
+      CloseEXRFile(exr_file);
+      tinyexr::SetErrorMessage(
+          "Loading multipart or DeepImage is not supported  in LoadEXR() API",
+          err);
+      return TINYEXR_ERROR_INVALID_DATA;  // @fixme.
+    }
+  }
+
+  {
+    int ret = EXRFileParseHeader(exr_file, &exr_header, err);
+    if (ret != TINYEXR_SUCCESS) {
+      CloseEXRFile(exr_file);
+      FreeEXRHeader(&exr_header);
+      return ret;
+    }
+  }
+
+  // Read HALF channel as FLOAT.
+  for (int i = 0; i < exr_header.num_channels; i++) {
+    if (exr_header.pixel_types[i] == TINYEXR_PIXELTYPE_HALF) {
+      exr_header.requested_pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT;
+    }
+  }
+
+  // RGBA
+  int idxR = -1;
+  int idxG = -1;
+  int idxB = -1;
+  int idxA = -1;
+
+  std::vector<std::string> layer_names;
+  tinyexr::GetLayers(exr_header, layer_names);
+
+  std::vector<tinyexr::LayerChannel> channels;
+  tinyexr::ChannelsInLayer(
+      exr_header, layername == NULL ? "" : std::string(layername), channels);
+
+
+  if (channels.size() < 1) {
+    if (layername == NULL) {
+      tinyexr::SetErrorMessage("Layer Not Found. Seems EXR contains channels with layer(e.g. `diffuse.R`). if you are using LoadEXR(), please try LoadEXRWithLayer(). LoadEXR() cannot load EXR having channels with layer.", err);
+
+    } else {
+      tinyexr::SetErrorMessage("Layer Not Found", err);
+    }
+    CloseEXRFile(exr_file);
+    FreeEXRHeader(&exr_header);
+    return TINYEXR_ERROR_LAYER_NOT_FOUND;
+  }
+
+  size_t ch_count = channels.size() < 4 ? channels.size() : 4;
+
+  // Only decode the channels of the selected layer.
+  std::vector<unsigned char> channel_mask(
+      static_cast<size_t>(exr_header.num_channels), 0);
+  for (size_t c = 0; c < ch_count; c++) {
+    channel_mask[channels[c].index] = 1;
+  }
+  exr_header.channel_mask = channel_mask.data();
+
+  {
+    int ret = EXRFileLoadImage(exr_file, &exr_image, &exr_header, NULL, err);
+    CloseEXRFile(exr_file);
+    if (ret != TINYEXR_SUCCESS) {
+      FreeEXRHeader(&exr_header);
+      return ret;
+    }
+  }
+
+  for (size_t c = 0; c < ch_count; c++) {
+    const tinyexr::LayerChannel &ch = channels[c];
+
+    if (ch.name == "R") {
+      idxR = int(ch.index);
+    } else if (ch.name == "G") {
+      idxG = int(ch.index);
+    } else if (ch.name == "B") {
+      idxB = int(ch.index);
+    } else if (ch.name == "A") {
+      idxA = int(ch.index);
+    }
+  }
+
+  if (channels.size() == 1) {
+    int chIdx = int(channels.front().index);
+    // Grayscale channel only.
+
+    (*out_rgba) = reinterpret_cast<float *>(
+        malloc(4 * sizeof(float) * static_cast<size_t>(exr_image.width) *
+               static_cast<size_t>(exr_image.height)));
+
+    if (exr_header.tiled) {
+      const size_t tile_size_x = static_cast<size_t>(exr_header.tile_size_x);
+      const size_t tile_size_y = static_cast<size_t>(exr_header.tile_size_y);
+      for (int it = 0; it < exr_image.num_tiles; it++) {
+        for (size_t j = 0; j < tile_size_y; j++) {
+          for (size_t i = 0; i < tile_size_x; i++) {
+            const size_t ii =
+              static_cast<size_t>(exr_image.tiles[it].offset_x) * tile_size_x +
+              i;
+            const size_t jj =
+              static_cast<size_t>(exr_image.tiles[it].offset_y) * tile_size_y +
+              j;
+            const size_t idx = ii + jj * static_cast<size_t>(exr_image.width);
+
+            // out of region check.
+            if (ii >= static_cast<size_t>(exr_image.width)) {
+              continue;
+            }
+            if (jj >= static_cast<size_t>(exr_image.height)) {
+              continue;
+            }
+            const size_t srcIdx = i + j * tile_size_x;
+            unsigned char **src = exr_image.tiles[it].images;
+            (*out_rgba)[4 * idx + 0] =
+                reinterpret_cast<float **>(src)[chIdx][srcIdx];
+            (*out_rgba)[4 * idx + 1] =
+                reinterpret_cast<float **>(src)[chIdx][srcIdx];
+            (*out_rgba)[4 * idx + 2] =
+                reinterpret_cast<float **>(src)[chIdx][srcIdx];
+            (*out_rgba)[4 * idx + 3] =
+                reinterpret_cast<float **>(src)[chIdx][srcIdx];
+          }
+        }
+      }
+    } else {
+      const size_t pixel_size = static_cast<size_t>(exr_image.width) *
+        static_cast<size_t>(exr_image.height);
+      for (size_t i = 0; i < pixel_size; i++) {
+        const float val =
+            reinterpret_cast<float **>(exr_image.images)[chIdx][i];
+        (*out_rgba)[4 * i + 0] = val;
+        (*out_rgba)[4 * i + 1] = val;
+        (*out_rgba)[4 * i + 2] = val;
+        (*out_rgba)[4 * i + 3] = val;
+      }
+    }
+  } else {
+    // Assume RGB(A)
+
+    if (idxR == -1) {
+      tinyexr::SetErrorMessage("R channel not found", err);
+
+      FreeEXRHeader(&exr_header);
+      FreeEXRImage(&exr_image);
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+
+    if (idxG == -1) {
+      tinyexr::SetErrorMessage("G channel not found", err);
+      FreeEXRHeader(&exr_header);
+      FreeEXRImage(&exr_image);
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+
+    if (idxB == -1) {
+      tinyexr::SetErrorMessage("B channel not found", err);
+      FreeEXRHeader(&exr_header);
+      FreeEXRImage(&exr_image);
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+
+    (*out_rgba) = reinterpret_cast<float *>(
+        malloc(4 * sizeof(float) * static_cast<size_t>(exr_image.width) *
+               static_cast<size_t>(exr_image.height)));
+    if (exr_header.tiled) {
+      const size_t tile_size_x = static_cast<size_t>(exr_header.tile_size_x);
+      const size_t tile_size_y = static_cast<size_t>(exr_header.tile_size_y);
+      for (int it = 0; it < exr_image.num_tiles; it++) {
+        for (size_t j = 0; j < tile_size_y; j++) {
+          for (size_t i = 0; i < tile_size_x; i++) {
+            const size_t ii =
+                static_cast<size_t>(exr_image.tiles[it].offset_x) *
+                    tile_size_x +
+                i;
+            const size_t jj =
+                static_cast<size_t>(exr_image.tiles[it].offset_y) *
+                    tile_size_y +
+                j;
+            const size_t idx = ii + jj * static_cast<size_t>(exr_image.width);
+
+            // out of region check.
+            if (ii >= static_cast<size_t>(exr_image.width)) {
+              continue;
+            }
+            if (jj >= static_cast<size_t>(exr_image.height)) {
+              continue;
+            }
+            const size_t srcIdx = i + j * tile_size_x;
+            unsigned char **src = exr_image.tiles[it].images;
+            (*out_rgba)[4 * idx + 0] =
+                reinterpret_cast<float **>(src)[idxR][srcIdx];
+            (*out_rgba)[4 * idx + 1] =
+                reinterpret_cast<float **>(src)[idxG][srcIdx];
+            (*out_rgba)[4 * idx + 2] =
+                reinterpret_cast<float **>(src)[idxB][srcIdx];
+            if (idxA != -1) {
+              (*out_rgba)[4 * idx + 3] =
+                  reinterpret_cast<float **>(src)[idxA][srcIdx];
+            } else {
+              (*out_rgba)[4 * idx + 3] = 1.0;
+            }
+          }
+        }
+      }
+    } else {
+      const size_t pixel_size = static_cast<size_t>(exr_image.width) *
+        static_cast<size_t>(exr_image.height);
+      for (size_t i = 0; i < pixel_size; i++) {
+        (*out_rgba)[4 * i + 0] =
+            reinterpret_cast<float **>(exr_image.images)[idxR][i];
+        (*out_rgba)[4 * i + 1] =
+            reinterpret_cast<float **>(exr_image.images)[idxG][i];
+        (*out_rgba)[4 * i + 2] =
+            reinterpret_cast<float **>(exr_image.images)[idxB][i];
+        if (idxA != -1) {
+          (*out_rgba)[4 * i + 3] =
+              reinterpret_cast<float **>(exr_image.images)[idxA][i];
+        } else {
+          (*out_rgba)[4 * i + 3] = 1.0;
+        }
+      }
+    }
+  }
 
-static int CeilLog2(unsigned x) {
-  //
-  // For x > 0, ceilLog2(y) returns ceil(log(x)/log(2)).
-  //
-  int y = 0;
-  int r = 0;
-  while (x > 1) {
-    if (x & 1)
-      r = 1;
+  (*width) = exr_image.width;
+  (*height) = exr_image.height;
 
-    y += 1;
-    x >>= 1u;
-  }
-  return y + r;
-}
+  FreeEXRHeader(&exr_header);
+  FreeEXRImage(&exr_image);
 
-static int RoundLog2(int x, int tile_rounding_mode) {
-  return (tile_rounding_mode == TINYEXR_TILE_ROUND_DOWN) ? FloorLog2(static_cast<unsigned>(x)) : CeilLog2(static_cast<unsigned>(x));
+  return TINYEXR_SUCCESS;
 }
 
-static int CalculateNumXLevels(const EXRHeader* exr_header) {
-  int min_x = exr_header->data_window.min_x;
-  int max_x = exr_header->data_window.max_x;
-  int min_y = exr_header->data_window.min_y;
-  int max_y = exr_header->data_window.max_y;
-
-  int num = 0;
-  switch (exr_header->tile_level_mode) {
-  case TINYEXR_TILE_ONE_LEVEL:
-
-    num = 1;
-    break;
-
-  case TINYEXR_TILE_MIPMAP_LEVELS:
+int IsEXR(const char *filename) {
+  EXRVersion exr_version;
 
-  {
-    int w = max_x - min_x + 1;
-    int h = max_y - min_y + 1;
-    num = RoundLog2(std::max(w, h), exr_header->tile_rounding_mode) + 1;
+  int ret = ParseEXRVersionFromFile(&exr_version, filename);
+  if (ret != TINYEXR_SUCCESS) {
+    return ret;
   }
-  break;
-
-  case TINYEXR_TILE_RIPMAP_LEVELS:
 
-  {
-    int w = max_x - min_x + 1;
-    num = RoundLog2(w, exr_header->tile_rounding_mode) + 1;
-  }
-  break;
+  return TINYEXR_SUCCESS;
+}
 
-  default:
+int IsEXRFromMemory(const unsigned char *memory, size_t size) {
+  EXRVersion exr_version;
 
-    return -1;
+  int ret = ParseEXRVersionFromMemory(&exr_version, memory, size);
+  if (ret != TINYEXR_SUCCESS) {
+    return ret;
   }
 
-  return num;
+  return TINYEXR_SUCCESS;
 }
 
-static int CalculateNumYLevels(const EXRHeader* exr_header) {
-  int min_x = exr_header->data_window.min_x;
-  int max_x = exr_header->data_window.max_x;
-  int min_y = exr_header->data_window.min_y;
-  int max_y = exr_header->data_window.max_y;
-  int num = 0;
-
-  switch (exr_header->tile_level_mode) {
-  case TINYEXR_TILE_ONE_LEVEL:
-
-    num = 1;
-    break;
+int ParseEXRHeaderFromMemory(EXRHeader *exr_header, const EXRVersion *version,
+                             const unsigned char *memory, size_t size,
+                             const char **err) {
+  if (memory == NULL || exr_header == NULL) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument. `memory` or `exr_header` argument is null in "
+        "ParseEXRHeaderFromMemory()",
+        err);
 
-  case TINYEXR_TILE_MIPMAP_LEVELS:
+    // Invalid argument
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
-  {
-    int w = max_x - min_x + 1;
-    int h = max_y - min_y + 1;
-    num = RoundLog2(std::max(w, h), exr_header->tile_rounding_mode) + 1;
+  if (size < tinyexr::kEXRVersionSize) {
+    tinyexr::SetErrorMessage("Insufficient header/data size.\n", err);
+    return TINYEXR_ERROR_INVALID_DATA;
   }
-  break;
 
-  case TINYEXR_TILE_RIPMAP_LEVELS:
+  const unsigned char *marker = memory + tinyexr::kEXRVersionSize;
+  size_t marker_size = size - tinyexr::kEXRVersionSize;
 
-  {
-    int h = max_y - min_y + 1;
-    num = RoundLog2(h, exr_header->tile_rounding_mode) + 1;
-  }
-  break;
+  tinyexr::HeaderInfo info;
+  info.clear();
 
-  default:
+  int ret;
+  {
+    std::string err_str;
+    ret = ParseEXRHeader(&info, NULL, version, &err_str, marker, marker_size);
 
-    return -1;
+    if (ret != TINYEXR_SUCCESS) {
+      if (err && !err_str.empty()) {
+        tinyexr::SetErrorMessage(err_str, err);
+      }
+    }
   }
 
-  return num;
-}
+  {
+    std::string warn;
+    std::string err_str;
 
-static bool CalculateNumTiles(std::vector<int>& numTiles,
-  int toplevel_size,
-  int size,
-  int tile_rounding_mode) {
-  for (unsigned i = 0; i < numTiles.size(); i++) {
-    int l = LevelSize(toplevel_size, int(i), tile_rounding_mode);
-    if (l < 0) {
-      return false;
+    if (!ConvertHeader(exr_header, info, &warn, &err_str)) {
+      // release mem
+      for (size_t i = 0; i < info.attributes.size(); i++) {
+        if (info.attributes[i].value) {
+          free(info.attributes[i].value);
+        }
+      }
+      if (err && !err_str.empty()) {
+        tinyexr::SetErrorMessage(err_str, err);
+      }
+      ret = TINYEXR_ERROR_INVALID_HEADER;
     }
-    TINYEXR_CHECK_AND_RETURN_C(l <= std::numeric_limits<int>::max() - size + 1, false);
-
-    numTiles[i] = (l + size - 1) / size;
   }
-  return true;
-}
 
-static bool PrecalculateTileInfo(std::vector<int>& num_x_tiles,
-  std::vector<int>& num_y_tiles,
-  const EXRHeader* exr_header) {
-  int min_x = exr_header->data_window.min_x;
-  int max_x = exr_header->data_window.max_x;
-  int min_y = exr_header->data_window.min_y;
-  int max_y = exr_header->data_window.max_y;
+  exr_header->multipart = version->multipart ? 1 : 0;
+  exr_header->non_image = version->non_image ? 1 : 0;
 
-  int num_x_levels = CalculateNumXLevels(exr_header);
+  return ret;
+}
 
-  if (num_x_levels < 0) {
-    return false;
+int LoadEXRFromMemory(float **out_rgba, int *width, int *height,
+                      const unsigned char *memory, size_t size,
+                      const char **err) {
+  if (out_rgba == NULL || memory == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for LoadEXRFromMemory", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  int num_y_levels = CalculateNumYLevels(exr_header);
-
-  if (num_y_levels < 0) {
-    return false;
-  }
+  EXRVersion exr_version;
+  EXRHeader exr_header;
 
-  num_x_tiles.resize(size_t(num_x_levels));
-  num_y_tiles.resize(size_t(num_y_levels));
+  InitEXRHeader(&exr_header);
 
-  if (!CalculateNumTiles(num_x_tiles,
-    max_x - min_x + 1,
-    exr_header->tile_size_x,
-    exr_header->tile_rounding_mode)) {
-    return false;
+  int ret = ParseEXRVersionFromMemory(&exr_version, memory, size);
+  if (ret != TINYEXR_SUCCESS) {
+    std::stringstream ss;
+    ss << "Failed to parse EXR version. code(" << ret << ")";
+    tinyexr::SetErrorMessage(ss.str(), err);
+    return ret;
   }
 
-  if (!CalculateNumTiles(num_y_tiles,
-    max_y - min_y + 1,
-    exr_header->tile_size_y,
-    exr_header->tile_rounding_mode)) {
-    return false;
+  ret = ParseEXRHeaderFromMemory(&exr_header, &exr_version, memory, size, err);
+  if (ret != TINYEXR_SUCCESS) {
+    return ret;
   }
 
-  return true;
-}
-
-static void InitSingleResolutionOffsets(OffsetData& offset_data, size_t num_blocks) {
-  offset_data.offsets.resize(1);
-  offset_data.offsets[0].resize(1);
-  offset_data.offsets[0][0].resize(num_blocks);
-  offset_data.num_x_levels = 1;
-  offset_data.num_y_levels = 1;
-}
-
-// Return sum of tile blocks.
-// 0 = error
-static int InitTileOffsets(OffsetData& offset_data,
-  const EXRHeader* exr_header,
-  const std::vector<int>& num_x_tiles,
-  const std::vector<int>& num_y_tiles) {
-  int num_tile_blocks = 0;
-  offset_data.num_x_levels = static_cast<int>(num_x_tiles.size());
-  offset_data.num_y_levels = static_cast<int>(num_y_tiles.size());
-  switch (exr_header->tile_level_mode) {
-  case TINYEXR_TILE_ONE_LEVEL:
-  case TINYEXR_TILE_MIPMAP_LEVELS:
-    TINYEXR_CHECK_AND_RETURN_C(offset_data.num_x_levels == offset_data.num_y_levels, 0);
-    offset_data.offsets.resize(size_t(offset_data.num_x_levels));
+  // RGBA
+  int idxR = -1;
+  int idxG = -1;
+  int idxB = -1;
+  int idxA = -1;
+  for (int c = 0; c < exr_header.num_channels; c++) {
+    if (strcmp(exr_header.channels[c].name, "R") == 0) {
+      idxR = c;
+    } else if (strcmp(exr_header.channels[c].name, "G") == 0) {
+      idxG = c;
+    } else if (strcmp(exr_header.channels[c].name, "B") == 0) {
+      idxB = c;
+    } else if (strcmp(exr_header.channels[c].name, "A") == 0) {
+      idxA = c;
+    }
+  }
 
-    for (unsigned int l = 0; l < offset_data.offsets.size(); ++l) {
-      offset_data.offsets[l].resize(size_t(num_y_tiles[l]));
+  if (exr_header.num_channels != 1) {
+    // TODO(syoyo): Support non RGBA image.
+    const char *missing = NULL;
+    if (idxR == -1) {
+      missing = "R channel not found";
+    } else if (idxG == -1) {
+      missing = "G channel not found";
+    } else if (idxB == -1) {
+      missing = "B channel not found";
+    }
 
-      for (unsigned int dy = 0; dy < offset_data.offsets[l].size(); ++dy) {
-        offset_data.offsets[l][dy].resize(size_t(num_x_tiles[l]));
-        num_tile_blocks += num_x_tiles[l];
-      }
+    if (missing) {
+      tinyexr::SetErrorMessage(missing, err);
+      FreeEXRHeader(&exr_header);
+      return TINYEXR_ERROR_INVALID_DATA;
     }
-    break;
+  }
 
-  case TINYEXR_TILE_RIPMAP_LEVELS:
+  const tinyexr::tinyexr_int64 data_width =
+      static_cast<tinyexr::tinyexr_int64>(exr_header.data_window.max_x) -
+      static_cast<tinyexr::tinyexr_int64>(exr_header.data_window.min_x) + 1;
+  const tinyexr::tinyexr_int64 data_height =
+      static_cast<tinyexr::tinyexr_int64>(exr_header.data_window.max_y) -
+      static_cast<tinyexr::tinyexr_int64>(exr_header.data_window.min_y) + 1;
+  if ((data_width <= 0) || (data_height <= 0) ||
+      (data_width > TINYEXR_DIMENSION_THRESHOLD) ||
+      (data_height > TINYEXR_DIMENSION_THRESHOLD)) {
+    tinyexr::SetErrorMessage("Invalid data window", err);
+    FreeEXRHeader(&exr_header);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
 
-    offset_data.offsets.resize(static_cast<size_t>(offset_data.num_x_levels) * static_cast<size_t>(offset_data.num_y_levels));
+  const size_t pixel_size =
+      static_cast<size_t>(data_width) * static_cast<size_t>(data_height);
+  float *rgba =
+      reinterpret_cast<float *>(malloc(4 * sizeof(float) * pixel_size));
+  if (rgba == NULL) {
+    tinyexr::SetErrorMessage("Failed to allocate memory for RGBA image", err);
+    FreeEXRHeader(&exr_header);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
 
-    for (int ly = 0; ly < offset_data.num_y_levels; ++ly) {
-      for (int lx = 0; lx < offset_data.num_x_levels; ++lx) {
-        int l = ly * offset_data.num_x_levels + lx;
-        offset_data.offsets[size_t(l)].resize(size_t(num_y_tiles[size_t(ly)]));
+  // Decode channels directly into the interleaved RGBA buffer.
+  std::vector<EXRFrameBufferSlice> slices(
+      static_cast<size_t>(exr_header.num_channels));
+  for (size_t c = 0; c < slices.size(); c++) {
+    slices[c].base = NULL;
+    slices[c].x_stride = 4 * sizeof(float);
+    slices[c].y_stride = 4 * sizeof(float) * static_cast<size_t>(data_width);
+    slices[c].pixel_type = TINYEXR_PIXELTYPE_FLOAT;
+    slices[c].pad0 = 0;
+  }
 
-        for (size_t dy = 0; dy < offset_data.offsets[size_t(l)].size(); ++dy) {
-          offset_data.offsets[size_t(l)][dy].resize(size_t(num_x_tiles[size_t(lx)]));
-          num_tile_blocks += num_x_tiles[size_t(lx)];
-        }
+  if (exr_header.num_channels == 1) {
+    // Grayscale channel only.
+    slices[0].base = reinterpret_cast<unsigned char *>(rgba);
+  } else {
+    slices[size_t(idxR)].base = reinterpret_cast<unsigned char *>(rgba + 0);
+    slices[size_t(idxG)].base = reinterpret_cast<unsigned char *>(rgba + 1);
+    slices[size_t(idxB)].base = reinterpret_cast<unsigned char *>(rgba + 2);
+    if (idxA != -1) {
+      slices[size_t(idxA)].base = reinterpret_cast<unsigned char *>(rgba + 3);
+    } else {
+      for (size_t i = 0; i < pixel_size; i++) {
+        rgba[4 * i + 3] = 1.0f;
       }
     }
-    break;
+  }
 
-  default:
-    return 0;
+  ret = LoadEXRImageToFrameBufferFromMemory(&exr_header, memory, size,
+                                            slices.data(), err);
+  if (ret != TINYEXR_SUCCESS) {
+    free(rgba);
+    FreeEXRHeader(&exr_header);
+    return ret;
   }
-  return num_tile_blocks;
-}
 
-static bool IsAnyOffsetsAreInvalid(const OffsetData& offset_data) {
-  for (unsigned int l = 0; l < offset_data.offsets.size(); ++l)
-    for (unsigned int dy = 0; dy < offset_data.offsets[l].size(); ++dy)
-      for (unsigned int dx = 0; dx < offset_data.offsets[l][dy].size(); ++dx)
-        if (reinterpret_cast<const tinyexr::tinyexr_int64&>(offset_data.offsets[l][dy][dx]) <= 0)
-          return true;
+  if (exr_header.num_channels == 1) {
+    for (size_t i = 0; i < pixel_size; i++) {
+      const float val = rgba[4 * i + 0];
+      rgba[4 * i + 1] = val;
+      rgba[4 * i + 2] = val;
+      rgba[4 * i + 3] = val;
+    }
+  }
 
-  return false;
+  (*out_rgba) = rgba;
+  (*width) = static_cast<int>(data_width);
+  (*height) = static_cast<int>(data_height);
+
+  FreeEXRHeader(&exr_header);
+
+  return TINYEXR_SUCCESS;
 }
 
-static bool isValidTile(const EXRHeader* exr_header,
-                        const OffsetData& offset_data,
-                        int dx, int dy, int lx, int ly) {
-  if (lx < 0 || ly < 0 || dx < 0 || dy < 0) return false;
-  int num_x_levels = offset_data.num_x_levels;
-  int num_y_levels = offset_data.num_y_levels;
-  switch (exr_header->tile_level_mode) {
-  case TINYEXR_TILE_ONE_LEVEL:
+// Represents a read-only file mapped to an address space in memory.
+// If no memory-mapping API is available, falls back to allocating a buffer
+// with a copy of the file's data.
+struct MemoryMappedFile {
+  unsigned char *data;  // To the start of the file's data.
+  size_t size;          // The size of the file in bytes.
+#ifdef TINYEXR_USE_WIN32_MMAP
+  HANDLE windows_file;
+  HANDLE windows_file_mapping;
+#elif defined(TINYEXR_USE_POSIX_MMAP)
+  int posix_descriptor;
+#endif
 
-    if (lx == 0 &&
-        ly == 0 &&
-        offset_data.offsets.size() > 0 &&
-        offset_data.offsets[0].size() > static_cast<size_t>(dy) &&
-        offset_data.offsets[0][size_t(dy)].size() > static_cast<size_t>(dx)) {
-      return true;
+  // MemoryMappedFile's constructor tries to map memory to a file.
+  // If this succeeds, valid() will return true and all fields
+  // are usable; otherwise, valid() will return false.
+  MemoryMappedFile(const char *filename) {
+    data = NULL;
+    size = 0;
+#ifdef TINYEXR_USE_WIN32_MMAP
+    windows_file_mapping = NULL;
+    windows_file =
+        CreateFileW(tinyexr::UTF8ToWchar(filename).c_str(),  // lpFileName
+                    GENERIC_READ,                            // dwDesiredAccess
+                    FILE_SHARE_READ,                         // dwShareMode
+                    NULL,                     // lpSecurityAttributes
+                    OPEN_EXISTING,            // dwCreationDisposition
+                    FILE_ATTRIBUTE_READONLY,  // dwFlagsAndAttributes
+                    NULL);                    // hTemplateFile
+    if (windows_file == INVALID_HANDLE_VALUE) {
+      return;
     }
 
-    break;
-
-  case TINYEXR_TILE_MIPMAP_LEVELS:
+    windows_file_mapping = CreateFileMapping(windows_file,  // hFile
+                                             NULL,  // lpFileMappingAttributes
+                                             PAGE_READONLY,  // flProtect
+                                             0,      // dwMaximumSizeHigh
+                                             0,      // dwMaximumSizeLow
+                                             NULL);  // lpName
+    if (windows_file_mapping == NULL) {
+      return;
+    }
 
-    if (lx < num_x_levels &&
-        ly < num_y_levels &&
-        offset_data.offsets.size() > static_cast<size_t>(lx) &&
-        offset_data.offsets[size_t(lx)].size() > static_cast<size_t>(dy) &&
-        offset_data.offsets[size_t(lx)][size_t(dy)].size() > static_cast<size_t>(dx)) {
-      return true;
+    data = reinterpret_cast<unsigned char *>(
+        MapViewOfFile(windows_file_mapping,  // hFileMappingObject
+                      FILE_MAP_READ,         // dwDesiredAccess
+                      0,                     // dwFileOffsetHigh
+                      0,                     // dwFileOffsetLow
+                      0));                   // dwNumberOfBytesToMap
+    if (!data) {
+      return;
     }
 
-    break;
+    LARGE_INTEGER windows_file_size = {};
+    if (!GetFileSizeEx(windows_file, &windows_file_size) ||
+        static_cast<ULONGLONG>(windows_file_size.QuadPart) >
+            std::numeric_limits<size_t>::max()) {
+      UnmapViewOfFile(data);
+      data = NULL;
+      return;
+    }
+    size = static_cast<size_t>(windows_file_size.QuadPart);
+#elif defined(TINYEXR_USE_POSIX_MMAP)
+    posix_descriptor = open(filename, O_RDONLY);
+    if (posix_descriptor == -1) {
+      return;
+    }
 
-  case TINYEXR_TILE_RIPMAP_LEVELS:
-  {
-    size_t idx = static_cast<size_t>(lx) + static_cast<size_t>(ly)* static_cast<size_t>(num_x_levels);
-    if (lx < num_x_levels &&
-       ly < num_y_levels &&
-       (offset_data.offsets.size() > idx) &&
-       offset_data.offsets[idx].size() > static_cast<size_t>(dy) &&
-       offset_data.offsets[idx][size_t(dy)].size() > static_cast<size_t>(dx)) {
-      return true;
+    struct stat info;
+    if (fstat(posix_descriptor, &info) < 0) {
+      return;
     }
-  }
+    // Make sure st_size is in the valid range for a size_t. The second case
+    // can only fail if a POSIX implementation defines off_t to be a larger
+    // type than size_t - for instance, compiling with _FILE_OFFSET_BITS=64
+    // on a 32-bit system. On current 64-bit systems, this check can never
+    // fail, so we turn off clang's Wtautological-type-limit-compare warning
+    // around this code.
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wtautological-type-limit-compare"
+#endif
+    if (info.st_size < 0 ||
+        info.st_size > std::numeric_limits<ssize_t>::max()) {
+      return;
+    }
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+    size = static_cast<size_t>(info.st_size);
 
-    break;
+    data = reinterpret_cast<unsigned char *>(
+        mmap(0, size, PROT_READ, MAP_SHARED, posix_descriptor, 0));
+    if (data == MAP_FAILED) {
+      data = nullptr;
+      return;
+    }
+#else
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+      return;
+    }
 
-  default:
+    // Calling fseek(fp, 0, SEEK_END) isn't strictly-conforming C code, but
+    // since neither the WIN32 nor POSIX APIs are available in this branch, this
+    // is a reasonable fallback option.
+    if (fseek(fp, 0, SEEK_END) != 0) {
+      fclose(fp);
+      return;
+    }
+    const long ftell_result = ftell(fp);
+    if (ftell_result < 0) {
+      // Error from ftell
+      fclose(fp);
+      return;
+    }
+    size = static_cast<size_t>(ftell_result);
+    if (fseek(fp, 0, SEEK_SET) != 0) {
+      fclose(fp);
+      size = 0;
+      return;
+    }
 
-    return false;
+    data = reinterpret_cast<unsigned char *>(malloc(size));
+    if (!data) {
+      size = 0;
+      fclose(fp);
+      return;
+    }
+    size_t read_bytes = fread(data, 1, size, fp);
+    if (read_bytes != size) {
+      // TODO: Try to read data until reading `size` bytes.
+      fclose(fp);
+      size = 0; 
+      data = nullptr;
+      return;
+    }
+    fclose(fp);
+#endif
   }
 
-  return false;
-}
-
-static bool ReconstructTileOffsets(OffsetData& offset_data,
-                                   const EXRHeader* exr_header,
-                                   const unsigned char* head, const unsigned char* marker, const size_t size,
-                                   bool isMultiPartFile,
-                                   bool isDeep) {
-  int numXLevels = offset_data.num_x_levels;
-  for (unsigned int l = 0; l < offset_data.offsets.size(); ++l) {
-    for (unsigned int dy = 0; dy < offset_data.offsets[l].size(); ++dy) {
-      for (unsigned int dx = 0; dx < offset_data.offsets[l][dy].size(); ++dx) {
-        tinyexr::tinyexr_uint64 tileOffset = tinyexr::tinyexr_uint64(marker - head);
-
-
-        if (isMultiPartFile) {
-          if ((marker + sizeof(int)) >= (head + size)) {
-            return false;
-          }
-
-          //int partNumber;
-          marker += sizeof(int);
-        }
+  // MemoryMappedFile's destructor closes all its handles.
+  ~MemoryMappedFile() {
+#ifdef TINYEXR_USE_WIN32_MMAP
+    if (data) {
+      (void)UnmapViewOfFile(data);
+      data = NULL;
+    }
 
-        if ((marker + 4 * sizeof(int)) >= (head + size)) {
-          return false;
-        }
+    if (windows_file_mapping != NULL) {
+      (void)CloseHandle(windows_file_mapping);
+    }
 
-        int tileX;
-        memcpy(&tileX, marker, sizeof(int));
-        tinyexr::swap4(&tileX);
-        marker += sizeof(int);
+    if (windows_file != INVALID_HANDLE_VALUE) {
+      (void)CloseHandle(windows_file);
+    }
+#elif defined(TINYEXR_USE_POSIX_MMAP)
+    if (data) {
+      (void)munmap(data, size);
+      data = NULL;
+    }
 
-        int tileY;
-        memcpy(&tileY, marker, sizeof(int));
-        tinyexr::swap4(&tileY);
-        marker += sizeof(int);
+    if (posix_descriptor != -1) {
+      (void)close(posix_descriptor);
+    }
+#else
+    if (data) {
+      (void)free(data);
+    }
+    data = NULL;
+#endif
+  }
 
-        int levelX;
-        memcpy(&levelX, marker, sizeof(int));
-        tinyexr::swap4(&levelX);
-        marker += sizeof(int);
+  // A MemoryMappedFile cannot be copied or moved.
+  // Only check for this when compiling with C++11 or higher, since deleted
+  // function definitions were added then.
+#if TINYEXR_HAS_CXX11
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wc++98-compat"
+#endif
+  MemoryMappedFile(const MemoryMappedFile &) = delete;
+  MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
+  MemoryMappedFile(MemoryMappedFile &&other) noexcept = delete;
+  MemoryMappedFile &operator=(MemoryMappedFile &&other) noexcept = delete;
+#ifdef __clang__
+#pragma clang diagnostic pop
+#endif
+#endif
 
-        int levelY;
-        memcpy(&levelY, marker, sizeof(int));
-        tinyexr::swap4(&levelY);
-        marker += sizeof(int);
+  // Returns whether this was successfully opened.
+  bool valid() const { return data; }
+};
 
-        if (isDeep) {
-          if ((marker + 2 * sizeof(tinyexr::tinyexr_int64)) >= (head + size)) {
-            return false;
-          }
-          tinyexr::tinyexr_int64 packed_offset_table_size;
-          memcpy(&packed_offset_table_size, marker, sizeof(tinyexr::tinyexr_int64));
-          tinyexr::swap8(reinterpret_cast<tinyexr::tinyexr_uint64*>(&packed_offset_table_size));
-          marker += sizeof(tinyexr::tinyexr_int64);
+namespace tinyexr {
 
-          tinyexr::tinyexr_int64 packed_sample_size;
-          memcpy(&packed_sample_size, marker, sizeof(tinyexr::tinyexr_int64));
-          tinyexr::swap8(reinterpret_cast<tinyexr::tinyexr_uint64*>(&packed_sample_size));
-          marker += sizeof(tinyexr::tinyexr_int64);
+// `LoadEXRImageFromMemoryWithOptions` for `memory` mapped by tinyexr:
+// `options->mmap_advice` is applied.
+static int LoadMappedEXRImage(EXRImage *exr_image, const EXRHeader *exr_header,
+                              const unsigned char *memory, const size_t size,
+                              const EXRParallelOptions *options,
+                              const char **err) {
+  if (exr_image == NULL || memory == NULL ||
+      (size < tinyexr::kEXRVersionSize)) {
+    tinyexr::SetErrorMessage("Invalid argument for LoadEXRImageFromMemory",
+                             err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
-          // next Int64 is unpacked sample size - skip that too
-          marker += packed_offset_table_size + packed_sample_size + 8;
+  if (exr_header->header_len == 0) {
+    tinyexr::SetErrorMessage("EXRHeader variable is not initialized.", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
-          if (marker >= (head + size)) {
-            return false;
-          }
+  const unsigned char *head = memory;
+  const unsigned char *marker = reinterpret_cast<const unsigned char *>(
+      memory + exr_header->header_len +
+      8);  // +8 for magic number + version header.
+  return DecodeEXRImage(exr_image, exr_header, head, marker, size, options,
+                        /* roi */ NULL, /* frame_buffer */ NULL, err);
+}
 
-        } else {
+}  // namespace tinyexr
 
-          if ((marker + sizeof(uint32_t)) >= (head + size)) {
-            return false;
-          }
+int LoadEXRImageFromFile(EXRImage *exr_image, const EXRHeader *exr_header,
+                         const char *filename, const char **err) {
+  return LoadEXRImageFromFileWithOptions(exr_image, exr_header, filename, NULL,
+                                         err);
+}
 
-          uint32_t dataSize;
-          memcpy(&dataSize, marker, sizeof(uint32_t));
-          tinyexr::swap4(&dataSize);
-          marker += sizeof(uint32_t);
+int LoadEXRImageFromFileWithOptions(EXRImage *exr_image,
+                                    const EXRHeader *exr_header,
+                                    const char *filename,
+                                    const EXRParallelOptions *options,
+                                    const char **err) {
+  if (exr_image == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for LoadEXRImageFromFile", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
-          marker += dataSize;
+  MemoryMappedFile file(filename);
+  if (!file.valid()) {
+    tinyexr::SetErrorMessage("Cannot read file " + std::string(filename), err);
+    return TINYEXR_ERROR_CANT_OPEN_FILE;
+  }
 
-          if (marker >= (head + size)) {
-            return false;
-          }
-        }
+  if (file.size < 16) {
+    tinyexr::SetErrorMessage("File size too short : " + std::string(filename),
+                             err);
+    return TINYEXR_ERROR_INVALID_FILE;
+  }
 
-        if (!isValidTile(exr_header, offset_data,
-          tileX, tileY, levelX, levelY)) {
-          return false;
-        }
+  return tinyexr::LoadMappedEXRImage(exr_image, exr_header, file.data,
+                                     file.size, options, err);
+}
 
-        int level_idx = LevelIndex(levelX, levelY, exr_header->tile_level_mode, numXLevels);
-        if (level_idx < 0) {
-          return false;
-        }
+int LoadEXRImageFromMemory(EXRImage *exr_image, const EXRHeader *exr_header,
+                           const unsigned char *memory, const size_t size,
+                           const char **err) {
+  return LoadEXRImageFromMemoryWithOptions(exr_image, exr_header, memory, size,
+                                           NULL, err);
+}
 
-        if (size_t(level_idx) >= offset_data.offsets.size()) {
-          return false;
-        }
+int LoadEXRImageFromMemoryWithOptions(EXRImage *exr_image,
+                                      const EXRHeader *exr_header,
+                                      const unsigned char *memory,
+                                      const size_t size,
+                                      const EXRParallelOptions *options,
+                                      const char **err) {
+  EXRParallelOptions memory_options;
+  return tinyexr::LoadMappedEXRImage(
+      exr_image, exr_header, memory, size,
+      tinyexr::WithoutMmapAdvice(options, &memory_options), err);
+}
 
-        if (size_t(tileY) >= offset_data.offsets[size_t(level_idx)].size()) {
-          return false;
-        }
 
-        if (size_t(tileX) >= offset_data.offsets[size_t(level_idx)][size_t(tileY)].size()) {
-          return false;
-        }
-        
-        offset_data.offsets[size_t(level_idx)][size_t(tileY)][size_t(tileX)] = tileOffset;
-      }
-    }
+int LoadEXRImageRegionFromFile(EXRImage *exr_image, const EXRHeader *exr_header,
+                               const char *filename, const EXRBox2i *roi,
+                               const char **err) {
+  if (exr_image == NULL || roi == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for LoadEXRImageRegionFromFile",
+                             err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
-  return true;
-}
 
-// marker output is also
-static int ReadOffsets(OffsetData& offset_data,
-                       const unsigned char* head,
-                       const unsigned char*& marker,
-                       const size_t size,
-                       const char** err) {
-  for (unsigned int l = 0; l < offset_data.offsets.size(); ++l) {
-    for (unsigned int dy = 0; dy < offset_data.offsets[l].size(); ++dy) {
-      for (unsigned int dx = 0; dx < offset_data.offsets[l][dy].size(); ++dx) {
-        tinyexr::tinyexr_uint64 offset;
-        if ((marker + sizeof(tinyexr_uint64)) >= (head + size)) {
-          tinyexr::SetErrorMessage("Insufficient data size in offset table.", err);
-          return TINYEXR_ERROR_INVALID_DATA;
-        }
+  MemoryMappedFile file(filename);
+  if (!file.valid()) {
+    tinyexr::SetErrorMessage("Cannot read file " + std::string(filename), err);
+    return TINYEXR_ERROR_CANT_OPEN_FILE;
+  }
 
-        memcpy(&offset, marker, sizeof(tinyexr::tinyexr_uint64));
-        tinyexr::swap8(&offset);
-        if (offset >= size) {
-          tinyexr::SetErrorMessage("Invalid offset value in DecodeEXRImage.", err);
-          return TINYEXR_ERROR_INVALID_DATA;
-        }
-        marker += sizeof(tinyexr::tinyexr_uint64);  // = 8
-        offset_data.offsets[l][dy][dx] = offset;
-      }
-    }
+  if (file.size < 16) {
+    tinyexr::SetErrorMessage("File size too short : " + std::string(filename),
+                             err);
+    return TINYEXR_ERROR_INVALID_FILE;
   }
-  return TINYEXR_SUCCESS;
+
+  return LoadEXRImageRegionFromMemory(exr_image, exr_header, file.data,
+                                      file.size, roi, err);
 }
 
-static int DecodeEXRImage(EXRImage *exr_image, const EXRHeader *exr_header,
-                          const unsigned char *head,
-                          const unsigned char *marker, const size_t size,
-                          const char **err) {
-  if (exr_image == NULL || exr_header == NULL || head == NULL ||
-      marker == NULL || (size <= tinyexr::kEXRVersionSize)) {
-    tinyexr::SetErrorMessage("Invalid argument for DecodeEXRImage().", err);
+int LoadEXRImageRegionFromMemory(EXRImage *exr_image,
+                                 const EXRHeader *exr_header,
+                                 const unsigned char *memory,
+                                 const size_t size, const EXRBox2i *roi,
+                                 const char **err) {
+  if (exr_image == NULL || exr_header == NULL || memory == NULL ||
+      roi == NULL || (size < tinyexr::kEXRVersionSize)) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for LoadEXRImageRegionFromMemory", err);
     return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  int num_scanline_blocks = 1;
-  if (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_ZIP) {
-    num_scanline_blocks = 16;
-  } else if (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
-    num_scanline_blocks = 32;
-  } else if (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
-    num_scanline_blocks = 16;
+  if (exr_header->header_len == 0) {
+    tinyexr::SetErrorMessage("EXRHeader variable is not initialized.", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  if (exr_header->data_window.max_x < exr_header->data_window.min_x ||
-      exr_header->data_window.max_x - exr_header->data_window.min_x ==
-          std::numeric_limits<int>::max()) {
-    // Issue 63
-    tinyexr::SetErrorMessage("Invalid data width value", err);
-    return TINYEXR_ERROR_INVALID_DATA;
-  }
-  tinyexr_int64 data_width =
-      static_cast<tinyexr_int64>(exr_header->data_window.max_x) - static_cast<tinyexr_int64>(exr_header->data_window.min_x) + static_cast<tinyexr_int64>(1);
-  if (data_width <= 0) {
-    tinyexr::SetErrorMessage("Invalid data window width value", err);
-    return TINYEXR_ERROR_INVALID_DATA;
+  const unsigned char *head = memory;
+  const unsigned char *marker = reinterpret_cast<const unsigned char *>(
+      memory + exr_header->header_len +
+      8);  // +8 for magic number + version header.
+  return tinyexr::DecodeEXRImage(exr_image, exr_header, head, marker, size,
+                                 NULL, roi, /* frame_buffer */ NULL, err);
+}
+
+int LoadEXRImageToFrameBufferFromFile(const EXRHeader *exr_header,
+                                      const char *filename,
+                                      const EXRFrameBufferSlice *slices,
+                                      const char **err) {
+  if (exr_header == NULL || slices == NULL) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for LoadEXRImageToFrameBufferFromFile", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  if (exr_header->data_window.max_y < exr_header->data_window.min_y ||
-      exr_header->data_window.max_y - exr_header->data_window.min_y ==
-          std::numeric_limits<int>::max()) {
-    tinyexr::SetErrorMessage("Invalid data height value", err);
-    return TINYEXR_ERROR_INVALID_DATA;
+  MemoryMappedFile file(filename);
+  if (!file.valid()) {
+    tinyexr::SetErrorMessage("Cannot read file " + std::string(filename), err);
+    return TINYEXR_ERROR_CANT_OPEN_FILE;
   }
-  tinyexr_int64 data_height =
-      static_cast<tinyexr_int64>(exr_header->data_window.max_y) - static_cast<tinyexr_int64>(exr_header->data_window.min_y) + static_cast<tinyexr_int64>(1);
 
-  if (data_height <= 0) {
-    tinyexr::SetErrorMessage("Invalid data window height value", err);
-    return TINYEXR_ERROR_INVALID_DATA;
+  if (file.size < 16) {
+    tinyexr::SetErrorMessage("File size too short : " + std::string(filename),
+                             err);
+    return TINYEXR_ERROR_INVALID_FILE;
   }
 
-  // Do not allow too large data_width and data_height. header invalid?
-  {
-    if (data_width > TINYEXR_DIMENSION_THRESHOLD) {
-      tinyexr::SetErrorMessage("data width too large.", err);
-      return TINYEXR_ERROR_INVALID_DATA;
-    }
-    if (data_height > TINYEXR_DIMENSION_THRESHOLD) {
-      tinyexr::SetErrorMessage("data height too large.", err);
-      return TINYEXR_ERROR_INVALID_DATA;
-    }
+  return LoadEXRImageToFrameBufferFromMemory(exr_header, file.data, file.size,
+                                             slices, err);
+}
+
+int LoadEXRImageToFrameBufferFromMemory(const EXRHeader *exr_header,
+                                        const unsigned char *memory,
+                                        const size_t size,
+                                        const EXRFrameBufferSlice *slices,
+                                        const char **err) {
+  if (exr_header == NULL || memory == NULL || slices == NULL ||
+      (size < tinyexr::kEXRVersionSize)) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for LoadEXRImageToFrameBufferFromMemory", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  if (exr_header->tiled) {
-    if (exr_header->tile_size_x > TINYEXR_DIMENSION_THRESHOLD) {
-      tinyexr::SetErrorMessage("tile width too large.", err);
-      return TINYEXR_ERROR_INVALID_DATA;
-    }
-    if (exr_header->tile_size_y > TINYEXR_DIMENSION_THRESHOLD) {
-      tinyexr::SetErrorMessage("tile height too large.", err);
-      return TINYEXR_ERROR_INVALID_DATA;
-    }
+  if (exr_header->header_len == 0) {
+    tinyexr::SetErrorMessage("EXRHeader variable is not initialized.", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  // Read offset tables.
-  OffsetData offset_data;
-  size_t num_blocks = 0;
-  // For a multi-resolution image, the size of the offset table will be calculated from the other attributes of the header.
-  // If chunk_count > 0 then chunk_count must be equal to the calculated tile count.
-  if (exr_header->tiled) {
-    {
-      std::vector<int> num_x_tiles, num_y_tiles;
-      if (!PrecalculateTileInfo(num_x_tiles, num_y_tiles, exr_header)) {
-        tinyexr::SetErrorMessage("Failed to precalculate tile info.", err);
-        return TINYEXR_ERROR_INVALID_DATA;
-      }
-      num_blocks = size_t(InitTileOffsets(offset_data, exr_header, num_x_tiles, num_y_tiles));
-      if (exr_header->chunk_count > 0) {
-        if (exr_header->chunk_count != static_cast<int>(num_blocks)) {
-          tinyexr::SetErrorMessage("Invalid offset table size.", err);
-          return TINYEXR_ERROR_INVALID_DATA;
-        }
-      }
+  for (int c = 0; c < exr_header->num_channels; c++) {
+    if (slices[c].base &&
+        (slices[c].pixel_type != TINYEXR_PIXELTYPE_UINT) &&
+        (slices[c].pixel_type != TINYEXR_PIXELTYPE_HALF) &&
+        (slices[c].pixel_type != TINYEXR_PIXELTYPE_FLOAT)) {
+      tinyexr::SetErrorMessage(
+          "Invalid pixel type in LoadEXRImageToFrameBufferFromMemory", err);
+      return TINYEXR_ERROR_INVALID_ARGUMENT;
     }
+  }
 
-    int ret = ReadOffsets(offset_data, head, marker, size, err);
-    if (ret != TINYEXR_SUCCESS) return ret;
-    if (IsAnyOffsetsAreInvalid(offset_data)) {
-      if (!ReconstructTileOffsets(offset_data, exr_header,
-        head, marker, size,
-        exr_header->multipart, exr_header->non_image)) {
+  const unsigned char *head = memory;
+  const unsigned char *marker = reinterpret_cast<const unsigned char *>(
+      memory + exr_header->header_len +
+      8);  // +8 for magic number + version header.
 
-          tinyexr::SetErrorMessage("Invalid Tile Offsets data.", err);
-          return TINYEXR_ERROR_INVALID_DATA;
-      }
-    }
-  } else if (exr_header->chunk_count > 0) {
-    // Use `chunkCount` attribute.
-    num_blocks = static_cast<size_t>(exr_header->chunk_count);
-    InitSingleResolutionOffsets(offset_data, num_blocks);
-  } else {
-    num_blocks = static_cast<size_t>(data_height) /
-      static_cast<size_t>(num_scanline_blocks);
-    if (num_blocks * static_cast<size_t>(num_scanline_blocks) <
-      static_cast<size_t>(data_height)) {
-      num_blocks++;
-    }
+  // Pixels are only written to `slices`, so `image` keeps no data.
+  EXRImage image;
+  InitEXRImage(&image);
+  return tinyexr::DecodeEXRImage(&image, exr_header, head, marker, size, NULL,
+                                 /* roi */ NULL, slices, err);
+}
 
-    InitSingleResolutionOffsets(offset_data, num_blocks);
+struct TEXRFile {
+  explicit TEXRFile(const char *filename) : file(filename) {}
+
+  MemoryMappedFile file;
+  EXRVersion version;
+};
+
+int OpenEXRFile(EXRFile **file, const char *filename, const char **err) {
+  if (file == NULL || filename == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for OpenEXRFile", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  if (!exr_header->tiled) {
-    std::vector<tinyexr::tinyexr_uint64>& offsets = offset_data.offsets[0][0];
-    for (size_t y = 0; y < num_blocks; y++) {
-      tinyexr::tinyexr_uint64 offset;
-      // Issue #81
-      if ((marker + sizeof(tinyexr_uint64)) >= (head + size)) {
-        tinyexr::SetErrorMessage("Insufficient data size in offset table.", err);
-        return TINYEXR_ERROR_INVALID_DATA;
-      }
+  EXRFile *f = new EXRFile(filename);
+  if (!f->file.valid()) {
+    delete f;
+    tinyexr::SetErrorMessage("Cannot read file " + std::string(filename), err);
+    return TINYEXR_ERROR_CANT_OPEN_FILE;
+  }
 
-      memcpy(&offset, marker, sizeof(tinyexr::tinyexr_uint64));
-      tinyexr::swap8(&offset);
-      if (offset >= size) {
-        tinyexr::SetErrorMessage("Invalid offset value in DecodeEXRImage.", err);
-        return TINYEXR_ERROR_INVALID_DATA;
-      }
-      marker += sizeof(tinyexr::tinyexr_uint64);  // = 8
-      offsets[y] = offset;
-    }
+  if (f->file.size < tinyexr::kEXRVersionSize) {
+    delete f;
+    tinyexr::SetErrorMessage("File size too short : " + std::string(filename),
+                             err);
+    return TINYEXR_ERROR_INVALID_FILE;
+  }
 
-    // If line offsets are invalid, we try to reconstruct it.
-    // See OpenEXR/IlmImf/ImfScanLineInputFile.cpp::readLineOffsets() for details.
-    for (size_t y = 0; y < num_blocks; y++) {
-      if (offsets[y] <= 0) {
-        // TODO(syoyo) Report as warning?
-        // if (err) {
-        //  stringstream ss;
-        //  ss << "Incomplete lineOffsets." << std::endl;
-        //  (*err) += ss.str();
-        //}
-        bool ret =
-          ReconstructLineOffsets(&offsets, num_blocks, head, marker, size);
-        if (ret) {
-          // OK
-          break;
-        } else {
-          tinyexr::SetErrorMessage(
-            "Cannot reconstruct lineOffset table in DecodeEXRImage.", err);
-          return TINYEXR_ERROR_INVALID_DATA;
-        }
-      }
-    }
+  int ret = ParseEXRVersionFromMemory(&f->version, f->file.data, f->file.size);
+  if (ret != TINYEXR_SUCCESS) {
+    delete f;
+    tinyexr::SetErrorMessage("Invalid EXR version : " + std::string(filename),
+                             err);
+    return ret;
   }
 
-  {
-    std::string e;
-    int ret = DecodeChunk(exr_image, exr_header, offset_data, head, size, &e);
+  (*file) = f;
+  return TINYEXR_SUCCESS;
+}
 
-    if (ret != TINYEXR_SUCCESS) {
-      if (!e.empty()) {
-        tinyexr::SetErrorMessage(e, err);
-      }
+void CloseEXRFile(EXRFile *file) { delete file; }
 
-#if 1
-      FreeEXRImage(exr_image);
-#else
-      // release memory(if exists)
-      if ((exr_header->num_channels > 0) && exr_image && exr_image->images) {
-        for (size_t c = 0; c < size_t(exr_header->num_channels); c++) {
-          if (exr_image->images[c]) {
-            free(exr_image->images[c]);
-            exr_image->images[c] = NULL;
-          }
-        }
-        free(exr_image->images);
-        exr_image->images = NULL;
-      }
-#endif
-    }
+const EXRVersion *EXRFileVersion(const EXRFile *file) {
+  if (file == NULL) {
+    return NULL;
+  }
+  return &file->version;
+}
 
-    return ret;
+const unsigned char *EXRFileData(const EXRFile *file, size_t *size) {
+  if (file == NULL) {
+    return NULL;
   }
+  if (size) {
+    (*size) = file->file.size;
+  }
+  return file->file.data;
 }
 
-static void GetLayers(const EXRHeader &exr_header,
-                      std::vector<std::string> &layer_names) {
-  // Naive implementation
-  // Group channels by layers
-  // go over all channel names, split by periods
-  // collect unique names
-  layer_names.clear();
-  for (int c = 0; c < exr_header.num_channels; c++) {
-    std::string full_name(exr_header.channels[c].name);
-    const size_t pos = full_name.find_last_of('.');
-    if (pos != std::string::npos && pos != 0 && pos + 1 < full_name.size()) {
-      full_name.erase(pos);
-      if (std::find(layer_names.begin(), layer_names.end(), full_name) ==
-          layer_names.end())
-        layer_names.push_back(full_name);
-    }
+int EXRFileParseHeader(const EXRFile *file, EXRHeader *exr_header,
+                       const char **err) {
+  if (file == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for EXRFileParseHeader", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
+
+  return ParseEXRHeaderFromMemory(exr_header, &file->version, file->file.data,
+                                  file->file.size, err);
 }
 
-struct LayerChannel {
-  explicit LayerChannel(size_t i, std::string n) : index(i), name(n) {}
-  size_t index;
-  std::string name;
-};
+int EXRFileParseMultipartHeader(const EXRFile *file, EXRHeader ***exr_headers,
+                                int *num_headers, const char **err) {
+  if (file == NULL) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for EXRFileParseMultipartHeader", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
-static void ChannelsInLayer(const EXRHeader &exr_header,
-                            const std::string &layer_name,
-                            std::vector<LayerChannel> &channels) {
-  channels.clear();
-  //std::cout << "layer_name = " << layer_name << "\n";
-  for (int c = 0; c < exr_header.num_channels; c++) {
-    //std::cout << "chan[" << c << "] = " << exr_header.channels[c].name << "\n";
-    std::string ch_name(exr_header.channels[c].name);
-    if (layer_name.empty()) {
-      const size_t pos = ch_name.find_last_of('.');
-      if (pos != std::string::npos && pos < ch_name.size()) {
-        if (pos != 0) continue;
-        ch_name = ch_name.substr(pos + 1);
-      }
-    } else {
-      const size_t pos = ch_name.find(layer_name + '.');
-      if (pos == std::string::npos) continue;
-      if (pos == 0) {
-        ch_name = ch_name.substr(layer_name.size() + 1);
-      }
-    }
-    LayerChannel ch(size_t(c), ch_name);
-    channels.push_back(ch);
+  return ParseEXRMultipartHeaderFromMemory(exr_headers, num_headers,
+                                           &file->version, file->file.data,
+                                           file->file.size, err);
+}
+
+int EXRFileLoadImage(const EXRFile *file, EXRImage *exr_image,
+                     const EXRHeader *exr_header,
+                     const EXRParallelOptions *options, const char **err) {
+  if (file == NULL || exr_header == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for EXRFileLoadImage", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
+
+  return tinyexr::LoadMappedEXRImage(exr_image, exr_header, file->file.data,
+                                     file->file.size, options, err);
 }
 
-}  // namespace tinyexr
+struct TEXRTiledReader {
+  TEXRTiledReader() : header(NULL), file(NULL), head(NULL), size(0),
+                      pixel_data_size(0) {}
+  ~TEXRTiledReader() { delete file; }
 
-int EXRLayers(const char *filename, const char **layer_names[], int *num_layers,
-              const char **err) {
-  EXRVersion exr_version;
-  EXRHeader exr_header;
-  InitEXRHeader(&exr_header);
+  const EXRHeader *header;
+  MemoryMappedFile *file;  // NULL when reading from memory.
+  const unsigned char *head;
+  size_t size;
+  tinyexr::OffsetData offset_data;
+  std::vector<size_t> channel_offset_list;
+  int pixel_data_size;
+};
 
-  {
-    int ret = ParseEXRVersionFromFile(&exr_version, filename);
-    if (ret != TINYEXR_SUCCESS) {
-      tinyexr::SetErrorMessage("Invalid EXR header.", err);
-      return ret;
-    }
+int CreateEXRTiledReaderFromFile(EXRTiledReader **reader,
+                                 const EXRHeader *exr_header,
+                                 const char *filename, const char **err) {
+  if (reader == NULL || exr_header == NULL || filename == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for CreateEXRTiledReaderFromFile",
+                             err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
-    if (exr_version.multipart || exr_version.non_image) {
-      tinyexr::SetErrorMessage(
-          "Loading multipart or DeepImage is not supported  in LoadEXR() API",
-          err);
-      return TINYEXR_ERROR_INVALID_DATA;  // @fixme.
-    }
+  MemoryMappedFile *file = new MemoryMappedFile(filename);
+  if (!file->valid()) {
+    delete file;
+    tinyexr::SetErrorMessage("Cannot read file " + std::string(filename), err);
+    return TINYEXR_ERROR_CANT_OPEN_FILE;
+  }
+
+  if (file->size < 16) {
+    delete file;
+    tinyexr::SetErrorMessage("File size too short : " + std::string(filename),
+                             err);
+    return TINYEXR_ERROR_INVALID_FILE;
   }
 
-  int ret = ParseEXRHeaderFromFile(&exr_header, &exr_version, filename, err);
+  int ret = CreateEXRTiledReaderFromMemory(reader, exr_header, file->data,
+                                           file->size, err);
   if (ret != TINYEXR_SUCCESS) {
-    FreeEXRHeader(&exr_header);
+    delete file;
     return ret;
   }
 
-  std::vector<std::string> layer_vec;
-  tinyexr::GetLayers(exr_header, layer_vec);
+  (*reader)->file = file;
+  return TINYEXR_SUCCESS;
+}
 
-  (*num_layers) = int(layer_vec.size());
-  (*layer_names) = static_cast<const char **>(
-      malloc(sizeof(const char *) * static_cast<size_t>(layer_vec.size())));
-  for (size_t c = 0; c < static_cast<size_t>(layer_vec.size()); c++) {
-#ifdef _MSC_VER
-    (*layer_names)[c] = _strdup(layer_vec[c].c_str());
-#else
-    (*layer_names)[c] = strdup(layer_vec[c].c_str());
-#endif
+int CreateEXRTiledReaderFromMemory(EXRTiledReader **reader,
+                                   const EXRHeader *exr_header,
+                                   const unsigned char *memory,
+                                   const size_t size, const char **err) {
+  if (reader == NULL || exr_header == NULL || memory == NULL ||
+      (size < tinyexr::kEXRVersionSize)) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for CreateEXRTiledReaderFromMemory", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (exr_header->header_len == 0) {
+    tinyexr::SetErrorMessage("EXRHeader variable is not initialized.", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  if (!exr_header->tiled || exr_header->multipart) {
+    tinyexr::SetErrorMessage("Not a single-part tiled EXR image.", err);
+    return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
+  }
+
+  if (exr_header->data_window.max_x < exr_header->data_window.min_x ||
+      exr_header->data_window.max_y < exr_header->data_window.min_y) {
+    tinyexr::SetErrorMessage("Invalid data window.", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  if ((exr_header->tile_size_x < 1) || (exr_header->tile_size_y < 1) ||
+      (exr_header->tile_size_x > TINYEXR_DIMENSION_THRESHOLD) ||
+      (exr_header->tile_size_y > TINYEXR_DIMENSION_THRESHOLD)) {
+    tinyexr::SetErrorMessage("Invalid tile size.", err);
+    return TINYEXR_ERROR_INVALID_HEADER;
+  }
+
+  EXRTiledReader *r = new EXRTiledReader();
+  r->header = exr_header;
+  r->head = memory;
+  r->size = size;
+
+  size_t channel_offset = 0;
+  if (!tinyexr::ComputeChannelLayout(&r->channel_offset_list,
+                                     &r->pixel_data_size, &channel_offset,
+                                     exr_header->num_channels,
+                                     exr_header->channels)) {
+    delete r;
+    tinyexr::SetErrorMessage("Failed to compute channel layout.", err);
+    return TINYEXR_ERROR_INVALID_DATA;
   }
 
-  FreeEXRHeader(&exr_header);
+  const unsigned char *marker = reinterpret_cast<const unsigned char *>(
+      memory + exr_header->header_len +
+      8);  // +8 for magic number + version header.
+  int ret = tinyexr::ReadTiledOffsets(r->offset_data, exr_header, memory,
+                                      marker, size, err);
+  if (ret != TINYEXR_SUCCESS) {
+    delete r;
+    return ret;
+  }
+
+  (*reader) = r;
   return TINYEXR_SUCCESS;
 }
 
-int LoadEXR(float **out_rgba, int *width, int *height, const char *filename,
-            const char **err) {
-  return LoadEXRWithLayer(out_rgba, width, height, filename,
-                          /* layername */ NULL, err);
+void FreeEXRTiledReader(EXRTiledReader *reader) { delete reader; }
+
+void EXRTiledReaderNumLevels(const EXRTiledReader *reader, int *num_x_levels,
+                             int *num_y_levels) {
+  if (reader == NULL) {
+    return;
+  }
+
+  if (num_x_levels) {
+    (*num_x_levels) = reader->offset_data.num_x_levels;
+  }
+  if (num_y_levels) {
+    (*num_y_levels) = reader->offset_data.num_y_levels;
+  }
 }
 
-int LoadEXRWithLayer(float **out_rgba, int *width, int *height,
-                     const char *filename, const char *layername,
-                     const char **err) {
-  if (out_rgba == NULL) {
-    tinyexr::SetErrorMessage("Invalid argument for LoadEXR()", err);
+int EXRTiledReaderLevelInfo(const EXRTiledReader *reader, int level_x,
+                            int level_y, int *width, int *height,
+                            int *num_x_tiles, int *num_y_tiles) {
+  if (reader == NULL) {
     return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  EXRVersion exr_version;
-  EXRImage exr_image;
-  EXRHeader exr_header;
-  InitEXRHeader(&exr_header);
-  InitEXRImage(&exr_image);
+  const EXRHeader *exr_header = reader->header;
+  const tinyexr::OffsetData &offset_data = reader->offset_data;
 
-  {
-    int ret = ParseEXRVersionFromFile(&exr_version, filename);
-    if (ret != TINYEXR_SUCCESS) {
-      std::stringstream ss;
-      ss << "Failed to open EXR file or read version info from EXR file. code("
-         << ret << ")";
-      tinyexr::SetErrorMessage(ss.str(), err);
-      return ret;
-    }
+  if ((level_x < 0) || (level_y < 0) ||
+      (level_x >= offset_data.num_x_levels) ||
+      (level_y >= offset_data.num_y_levels)) {
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
-    if (exr_version.multipart || exr_version.non_image) {
-      tinyexr::SetErrorMessage(
-          "Loading multipart or DeepImage is not supported  in LoadEXR() API",
-          err);
-      return TINYEXR_ERROR_INVALID_DATA;  // @fixme.
-    }
+  if ((exr_header->tile_level_mode != TINYEXR_TILE_RIPMAP_LEVELS) &&
+      (level_x != level_y)) {
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  {
-    int ret = ParseEXRHeaderFromFile(&exr_header, &exr_version, filename, err);
-    if (ret != TINYEXR_SUCCESS) {
-      FreeEXRHeader(&exr_header);
-      return ret;
-    }
+  int level_index = tinyexr::LevelIndex(level_x, level_y,
+                                        exr_header->tile_level_mode,
+                                        offset_data.num_x_levels);
+  if ((level_index < 0) ||
+      (size_t(level_index) >= offset_data.offsets.size()) ||
+      offset_data.offsets[size_t(level_index)].empty()) {
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  // Read HALF channel as FLOAT.
-  for (int i = 0; i < exr_header.num_channels; i++) {
-    if (exr_header.pixel_types[i] == TINYEXR_PIXELTYPE_HALF) {
-      exr_header.requested_pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT;
-    }
+  if (width) {
+    (*width) = tinyexr::LevelSize(
+        exr_header->data_window.max_x - exr_header->data_window.min_x + 1,
+        level_x, exr_header->tile_rounding_mode);
+  }
+  if (height) {
+    (*height) = tinyexr::LevelSize(
+        exr_header->data_window.max_y - exr_header->data_window.min_y + 1,
+        level_y, exr_header->tile_rounding_mode);
+  }
+  if (num_x_tiles) {
+    (*num_x_tiles) =
+        int(offset_data.offsets[size_t(level_index)][0].size());
+  }
+  if (num_y_tiles) {
+    (*num_y_tiles) = int(offset_data.offsets[size_t(level_index)].size());
   }
 
-  // TODO: Probably limit loading to layers (channels) selected by layer index
-  {
-    int ret = LoadEXRImageFromFile(&exr_image, &exr_header, filename, err);
-    if (ret != TINYEXR_SUCCESS) {
-      FreeEXRHeader(&exr_header);
-      return ret;
-    }
+  return TINYEXR_SUCCESS;
+}
+
+int EXRTiledReaderReadTile(const EXRTiledReader *reader, int level_x,
+                           int level_y, int tile_x, int tile_y,
+                           unsigned char **images, int *width, int *height,
+                           const char **err) {
+  if (reader == NULL || images == NULL || width == NULL || height == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for EXRTiledReaderReadTile",
+                             err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  // RGBA
-  int idxR = -1;
-  int idxG = -1;
-  int idxB = -1;
-  int idxA = -1;
+  int level_width = 0, level_height = 0, num_x_tiles = 0, num_y_tiles = 0;
+  if (EXRTiledReaderLevelInfo(reader, level_x, level_y, &level_width,
+                              &level_height, &num_x_tiles,
+                              &num_y_tiles) != TINYEXR_SUCCESS) {
+    tinyexr::SetErrorMessage("Invalid level for EXRTiledReaderReadTile", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
-  std::vector<std::string> layer_names;
-  tinyexr::GetLayers(exr_header, layer_names);
+  if ((tile_x < 0) || (tile_y < 0) || (tile_x >= num_x_tiles) ||
+      (tile_y >= num_y_tiles)) {
+    tinyexr::SetErrorMessage("Invalid tile for EXRTiledReaderReadTile", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
-  std::vector<tinyexr::LayerChannel> channels;
-  tinyexr::ChannelsInLayer(
-      exr_header, layername == NULL ? "" : std::string(layername), channels);
+  const EXRHeader *exr_header = reader->header;
+  int level_index = tinyexr::LevelIndex(level_x, level_y,
+                                        exr_header->tile_level_mode,
+                                        reader->offset_data.num_x_levels);
+  tinyexr::tinyexr_uint64 offset =
+      reader->offset_data
+          .offsets[size_t(level_index)][size_t(tile_y)][size_t(tile_x)];
+
+  std::vector<EXRFrameBufferSlice> slices;
+  if (!tinyexr::SetupPlanarSlices(&slices, images,
+                                  exr_header->requested_pixel_types,
+                                  size_t(exr_header->num_channels),
+                                  exr_header->channels,
+                                  exr_header->tile_size_x)) {
+    tinyexr::SetErrorMessage("Invalid requested pixel type.", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
+  int tile_coordinates[4];
+  unsigned error_flag = tinyexr::DecodeTile(
+      slices.data(), width, height, tile_coordinates, exr_header, offset, level_x,
+      level_y, level_width, level_height, reader->channel_offset_list,
+      reader->pixel_data_size, reader->head, reader->size);
 
-  if (channels.size() < 1) {
-    if (layername == NULL) {
-      tinyexr::SetErrorMessage("Layer Not Found. Seems EXR contains channels with layer(e.g. `diffuse.R`). if you are using LoadEXR(), please try LoadEXRWithLayer(). LoadEXR() cannot load EXR having channels with layer.", err);
+  if ((error_flag == tinyexr::EF_SUCCESS) &&
+      ((tile_coordinates[0] != tile_x) || (tile_coordinates[1] != tile_y))) {
+    error_flag = tinyexr::EF_INVALID_DATA;
+  }
 
+  if (error_flag != tinyexr::EF_SUCCESS) {
+    if (error_flag & tinyexr::EF_INSUFFICIENT_DATA) {
+      tinyexr::SetErrorMessage("Insufficient data length.", err);
+    } else if (error_flag & tinyexr::EF_FAILED_TO_DECODE) {
+      tinyexr::SetErrorMessage("Failed to decode tile data.", err);
     } else {
-      tinyexr::SetErrorMessage("Layer Not Found", err);
+      tinyexr::SetErrorMessage("Invalid tile data.", err);
     }
-    FreeEXRHeader(&exr_header);
-    FreeEXRImage(&exr_image);
-    return TINYEXR_ERROR_LAYER_NOT_FOUND;
+    return TINYEXR_ERROR_INVALID_DATA;
   }
 
-  size_t ch_count = channels.size() < 4 ? channels.size() : 4;
-  for (size_t c = 0; c < ch_count; c++) {
-    const tinyexr::LayerChannel &ch = channels[c];
+  return TINYEXR_SUCCESS;
+}
 
-    if (ch.name == "R") {
-      idxR = int(ch.index);
-    } else if (ch.name == "G") {
-      idxG = int(ch.index);
-    } else if (ch.name == "B") {
-      idxB = int(ch.index);
-    } else if (ch.name == "A") {
-      idxA = int(ch.index);
-    }
+// File of `CreateEXRStreamReaderFromFile`. Read with pread() when
+// `TINYEXR_USE_PREAD`, so chunks can be read concurrently, otherwise with
+// fread().
+struct StreamReaderFile {
+  StreamReaderFile() : size(0) {
+#if TINYEXR_USE_PREAD
+    posix_descriptor = -1;
+#else
+    fp = NULL;
+#endif
   }
 
-  if (channels.size() == 1) {
-    int chIdx = int(channels.front().index);
-    // Grayscale channel only.
-
-    (*out_rgba) = reinterpret_cast<float *>(
-        malloc(4 * sizeof(float) * static_cast<size_t>(exr_image.width) *
-               static_cast<size_t>(exr_image.height)));
-
-    if (exr_header.tiled) {
-      const size_t tile_size_x = static_cast<size_t>(exr_header.tile_size_x);
-      const size_t tile_size_y = static_cast<size_t>(exr_header.tile_size_y);
-      for (int it = 0; it < exr_image.num_tiles; it++) {
-        for (size_t j = 0; j < tile_size_y; j++) {
-          for (size_t i = 0; i < tile_size_x; i++) {
-            const size_t ii =
-              static_cast<size_t>(exr_image.tiles[it].offset_x) * tile_size_x +
-              i;
-            const size_t jj =
-              static_cast<size_t>(exr_image.tiles[it].offset_y) * tile_size_y +
-              j;
-            const size_t idx = ii + jj * static_cast<size_t>(exr_image.width);
-
-            // out of region check.
-            if (ii >= static_cast<size_t>(exr_image.width)) {
-              continue;
-            }
-            if (jj >= static_cast<size_t>(exr_image.height)) {
-              continue;
-            }
-            const size_t srcIdx = i + j * tile_size_x;
-            unsigned char **src = exr_image.tiles[it].images;
-            (*out_rgba)[4 * idx + 0] =
-                reinterpret_cast<float **>(src)[chIdx][srcIdx];
-            (*out_rgba)[4 * idx + 1] =
-                reinterpret_cast<float **>(src)[chIdx][srcIdx];
-            (*out_rgba)[4 * idx + 2] =
-                reinterpret_cast<float **>(src)[chIdx][srcIdx];
-            (*out_rgba)[4 * idx + 3] =
-                reinterpret_cast<float **>(src)[chIdx][srcIdx];
-          }
-        }
-      }
-    } else {
-      const size_t pixel_size = static_cast<size_t>(exr_image.width) *
-        static_cast<size_t>(exr_image.height);
-      for (size_t i = 0; i < pixel_size; i++) {
-        const float val =
-            reinterpret_cast<float **>(exr_image.images)[chIdx][i];
-        (*out_rgba)[4 * i + 0] = val;
-        (*out_rgba)[4 * i + 1] = val;
-        (*out_rgba)[4 * i + 2] = val;
-        (*out_rgba)[4 * i + 3] = val;
-      }
+  ~StreamReaderFile() {
+#if TINYEXR_USE_PREAD
+    if (posix_descriptor != -1) {
+      (void)close(posix_descriptor);
     }
-  } else {
-    // Assume RGB(A)
-
-    if (idxR == -1) {
-      tinyexr::SetErrorMessage("R channel not found", err);
-
-      FreeEXRHeader(&exr_header);
-      FreeEXRImage(&exr_image);
-      return TINYEXR_ERROR_INVALID_DATA;
+#else
+    if (fp) {
+      fclose(fp);
     }
+#endif
+  }
 
-    if (idxG == -1) {
-      tinyexr::SetErrorMessage("G channel not found", err);
-      FreeEXRHeader(&exr_header);
-      FreeEXRImage(&exr_image);
-      return TINYEXR_ERROR_INVALID_DATA;
+  bool Open(const char *filename) {
+#if TINYEXR_USE_PREAD
+    posix_descriptor = open(filename, O_RDONLY);
+    if (posix_descriptor == -1) {
+      return false;
     }
-
-    if (idxB == -1) {
-      tinyexr::SetErrorMessage("B channel not found", err);
-      FreeEXRHeader(&exr_header);
-      FreeEXRImage(&exr_image);
-      return TINYEXR_ERROR_INVALID_DATA;
+    struct stat info;
+    if ((fstat(posix_descriptor, &info) < 0) || (info.st_size < 0)) {
+      return false;
     }
-
-    (*out_rgba) = reinterpret_cast<float *>(
-        malloc(4 * sizeof(float) * static_cast<size_t>(exr_image.width) *
-               static_cast<size_t>(exr_image.height)));
-    if (exr_header.tiled) {
-      const size_t tile_size_x = static_cast<size_t>(exr_header.tile_size_x);
-      const size_t tile_size_y = static_cast<size_t>(exr_header.tile_size_y);
-      for (int it = 0; it < exr_image.num_tiles; it++) {
-        for (size_t j = 0; j < tile_size_y; j++) {
-          for (size_t i = 0; i < tile_size_x; i++) {
-            const size_t ii =
-                static_cast<size_t>(exr_image.tiles[it].offset_x) *
-                    tile_size_x +
-                i;
-            const size_t jj =
-                static_cast<size_t>(exr_image.tiles[it].offset_y) *
-                    tile_size_y +
-                j;
-            const size_t idx = ii + jj * static_cast<size_t>(exr_image.width);
-
-            // out of region check.
-            if (ii >= static_cast<size_t>(exr_image.width)) {
-              continue;
-            }
-            if (jj >= static_cast<size_t>(exr_image.height)) {
-              continue;
-            }
-            const size_t srcIdx = i + j * tile_size_x;
-            unsigned char **src = exr_image.tiles[it].images;
-            (*out_rgba)[4 * idx + 0] =
-                reinterpret_cast<float **>(src)[idxR][srcIdx];
-            (*out_rgba)[4 * idx + 1] =
-                reinterpret_cast<float **>(src)[idxG][srcIdx];
-            (*out_rgba)[4 * idx + 2] =
-                reinterpret_cast<float **>(src)[idxB][srcIdx];
-            if (idxA != -1) {
-              (*out_rgba)[4 * idx + 3] =
-                  reinterpret_cast<float **>(src)[idxA][srcIdx];
-            } else {
-              (*out_rgba)[4 * idx + 3] = 1.0;
-            }
-          }
-        }
-      }
-    } else {
-      const size_t pixel_size = static_cast<size_t>(exr_image.width) *
-        static_cast<size_t>(exr_image.height);
-      for (size_t i = 0; i < pixel_size; i++) {
-        (*out_rgba)[4 * i + 0] =
-            reinterpret_cast<float **>(exr_image.images)[idxR][i];
-        (*out_rgba)[4 * i + 1] =
-            reinterpret_cast<float **>(exr_image.images)[idxG][i];
-        (*out_rgba)[4 * i + 2] =
-            reinterpret_cast<float **>(exr_image.images)[idxB][i];
-        if (idxA != -1) {
-          (*out_rgba)[4 * i + 3] =
-              reinterpret_cast<float **>(exr_image.images)[idxA][i];
-        } else {
-          (*out_rgba)[4 * i + 3] = 1.0;
-        }
+    size = static_cast<tinyexr::tinyexr_uint64>(info.st_size);
+#else
+#ifdef _WIN32
+#if defined(_MSC_VER) || (defined(MINGW_HAS_SECURE_API) && MINGW_HAS_SECURE_API) // MSVC, MinGW GCC, or Clang
+    if (_wfopen_s(&fp, tinyexr::UTF8ToWchar(filename).c_str(), L"rb") != 0) {
+      fp = NULL;
+    }
+#else
+    // Unknown compiler or MinGW without MINGW_HAS_SECURE_API.
+    fp = fopen(filename, "rb");
+#endif
+#else
+    fp = fopen(filename, "rb");
+#endif
+    if (!fp || !Seek(0, SEEK_END)) {
+      return false;
+    }
+#ifdef _WIN32
+    const long long pos = _ftelli64(fp);
+#else
+    const long pos = ftell(fp);
+#endif
+    if (pos < 0) {
+      return false;
+    }
+    size = static_cast<tinyexr::tinyexr_uint64>(pos);
+#endif
+    return true;
+  }
+
+#if !TINYEXR_USE_PREAD
+  bool Seek(tinyexr::tinyexr_uint64 offset, int origin) {
+#ifdef _WIN32
+    return _fseeki64(fp, static_cast<long long>(offset), origin) == 0;
+#else
+    if (offset > static_cast<tinyexr::tinyexr_uint64>(
+                     std::numeric_limits<long>::max())) {
+      return false;
+    }
+    return fseek(fp, static_cast<long>(offset), origin) == 0;
+#endif
+  }
+#endif
+
+  // `EXRReadFunc`.
+  static size_t Read(void *userdata, unsigned long long offset,
+                     unsigned char *dst, size_t len) {
+    StreamReaderFile *file = static_cast<StreamReaderFile *>(userdata);
+#if TINYEXR_USE_PREAD
+    size_t n = 0;
+    while (n < len) {
+      ssize_t ret = pread(file->posix_descriptor, dst + n, len - n,
+                          static_cast<off_t>(offset + n));
+      if (ret <= 0) {
+        break;
       }
+      n += static_cast<size_t>(ret);
+    }
+    return n;
+#else
+    if (!file->Seek(offset, SEEK_SET)) {
+      return 0;
     }
+    return fread(dst, 1, len, file->fp);
+#endif
   }
 
-  (*width) = exr_image.width;
-  (*height) = exr_image.height;
+  // Whether `Read` may be called concurrently.
+  static bool ConcurrentRead() {
+#if TINYEXR_USE_PREAD
+    return true;
+#else
+    return false;
+#endif
+  }
 
-  FreeEXRHeader(&exr_header);
-  FreeEXRImage(&exr_image);
+  // Starts reading [offset, offset + len) in the background(hint only).
+  void Prefetch(tinyexr::tinyexr_uint64 offset,
+                tinyexr::tinyexr_uint64 len) const {
+#if TINYEXR_USE_PREAD && defined(POSIX_FADV_WILLNEED)
+    (void)posix_fadvise(posix_descriptor, static_cast<off_t>(offset),
+                        static_cast<off_t>(len), POSIX_FADV_WILLNEED);
+#else
+    (void)offset;
+    (void)len;
+#endif
+  }
 
-  return TINYEXR_SUCCESS;
-}
+#if TINYEXR_USE_PREAD
+  int posix_descriptor;
+#else
+  FILE *fp;
+#endif
+  tinyexr::tinyexr_uint64 size;
+};
 
-int IsEXR(const char *filename) {
-  EXRVersion exr_version;
+struct TEXRStreamReader {
+  TEXRStreamReader()
+      : header(NULL), read(NULL), userdata(NULL), file(NULL), width(0),
+        height(0), num_scanlines(1), pixel_data_size(0), options(NULL) {}
+  ~TEXRStreamReader() { delete file; }
+
+  // Reads `size` bytes at `offset` into `dst`. Returns false on short read.
+  bool ReadAt(tinyexr::tinyexr_uint64 offset, unsigned char *dst,
+              size_t size) const {
+    return read(userdata, offset, dst, size) == size;
+  }
+
+  // Whether chunks are read concurrently(outside of `read_mutex`).
+  bool ConcurrentRead() const {
+    return file && StreamReaderFile::ConcurrentRead();
+  }
+
+  // Starts reading chunk `block` in the background.
+  void Prefetch(size_t block) const {
+    if (file && (block < chunk_ends.size()) &&
+        (chunk_ends[block] > offsets[block])) {
+      file->Prefetch(offsets[block], chunk_ends[block] - offsets[block]);
+    }
+  }
+
+  // Reads chunk `block` into `data`. Its pixel data(`*data_len` bytes) starts
+  // at `data[8]`. Returns an error message, or NULL on success.
+  const char *ReadChunk(size_t block, size_t max_data_len,
+                        std::vector<unsigned char> *data, int *line_no,
+                        int *data_len) const {
+    const size_t header_len = 2 * sizeof(int);  // y, data_len
+    size_t n = header_len;
+    if (block < chunk_ends.size()) {
+      // The extent of the chunk is known: read it with a single call.
+      tinyexr::tinyexr_uint64 len =
+          (chunk_ends[block] > offsets[block])
+              ? (chunk_ends[block] - offsets[block])
+              : 0;
+      len = (std::min)(len, static_cast<tinyexr::tinyexr_uint64>(
+                                header_len + max_data_len));
+      data->resize((std::max)(static_cast<size_t>(len), header_len));
+      n = read(userdata, offsets[block], &data->at(0),
+               static_cast<size_t>(len));
+      if (n < header_len) {
+        return "Failed to read chunk.";
+      }
+    } else {
+      data->resize(header_len);
+      if (!ReadAt(offsets[block], &data->at(0), header_len)) {
+        return "Failed to read chunk.";
+      }
+    }
 
-  int ret = ParseEXRVersionFromFile(&exr_version, filename);
-  if (ret != TINYEXR_SUCCESS) {
-    return ret;
+    memcpy(line_no, &data->at(0), sizeof(int));
+    memcpy(data_len, &data->at(4), sizeof(int));
+    tinyexr::swap4(line_no);
+    tinyexr::swap4(data_len);
+
+    if ((*data_len <= 0) || (static_cast<size_t>(*data_len) > max_data_len)) {
+      return "Invalid chunk data size.";
+    }
+
+    if (block < chunk_ends.size()) {
+      if (header_len + static_cast<size_t>(*data_len) > n) {
+        return "Failed to read chunk.";
+      }
+    } else {
+      data->resize(header_len + static_cast<size_t>(*data_len));
+      if (!ReadAt(offsets[block] + header_len, &data->at(header_len),
+                  static_cast<size_t>(*data_len))) {
+        return "Failed to read chunk.";
+      }
+    }
+    return NULL;
   }
 
-  return TINYEXR_SUCCESS;
-}
+  const EXRHeader *header;
+  EXRReadFunc read;
+  void *userdata;
+  StreamReaderFile *file;  // `CreateEXRStreamReaderFromFile` only.
+  int width;
+  int height;
+  int num_scanlines;  // scanlines per chunk
+  size_t pixel_data_size;
+  std::vector<size_t> channel_offset_list;
+  std::vector<tinyexr::tinyexr_uint64> offsets;
+  // End of each chunk(the next chunk in the file or the end of the file).
+  // Empty when the data size is not known.
+  std::vector<tinyexr::tinyexr_uint64> chunk_ends;
+#if TINYEXR_HAS_CXX11
+  std::mutex read_mutex;  // serializes calls of `read`
+#endif
 
-int IsEXRFromMemory(const unsigned char *memory, size_t size) {
-  EXRVersion exr_version;
+  EXRParallelOptions parallel_options;
+  const EXRParallelOptions *options;  // NULL or &parallel_options
+};
 
-  int ret = ParseEXRVersionFromMemory(&exr_version, memory, size);
-  if (ret != TINYEXR_SUCCESS) {
-    return ret;
+int CreateEXRStreamReader(EXRStreamReader **reader, EXRHeader *exr_header,
+                          EXRReadFunc read, void *userdata,
+                          const EXRParallelOptions *options,
+                          const char **err) {
+  if (reader == NULL || exr_header == NULL || read == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for CreateEXRStreamReader",
+                             err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  return TINYEXR_SUCCESS;
-}
+  unsigned char version_buf[tinyexr::kEXRVersionSize];
+  EXRVersion version;
+  if ((read(userdata, 0, version_buf, tinyexr::kEXRVersionSize) !=
+       tinyexr::kEXRVersionSize) ||
+      (ParseEXRVersionFromMemory(&version, version_buf,
+                                 tinyexr::kEXRVersionSize) !=
+       TINYEXR_SUCCESS)) {
+    tinyexr::SetErrorMessage("Invalid EXR version header", err);
+    return TINYEXR_ERROR_INVALID_EXR_VERSION;
+  }
 
-int ParseEXRHeaderFromMemory(EXRHeader *exr_header, const EXRVersion *version,
-                             const unsigned char *memory, size_t size,
-                             const char **err) {
-  if (memory == NULL || exr_header == NULL) {
+  if (version.multipart || version.non_image || version.tiled) {
     tinyexr::SetErrorMessage(
-        "Invalid argument. `memory` or `exr_header` argument is null in "
-        "ParseEXRHeaderFromMemory()",
+        "Only single-part scanline image is supported by the stream reader",
         err);
+    return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
+  }
 
-    // Invalid argument
-    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  // The size of the header is not known in advance. Read a prefix of the
+  // data and retry with a larger prefix while the header is incomplete.
+  // Bytes already read are kept, so each byte is read only once.
+  {
+    const size_t kMaxHeaderSize = 64 * 1024 * 1024;
+    std::vector<unsigned char> buf;
+    size_t buf_size = 64 * 1024;
+    size_t n = 0;  // number of bytes read so far
+    for (;;) {
+      buf.resize(buf_size);
+      size_t m = read(userdata, n, &buf.at(n), buf_size - n);
+      n += (std::min)(m, buf_size - n);
+      bool eof = n < buf_size;
+
+      const char *e = NULL;
+      int ret = ParseEXRHeaderFromMemory(exr_header, &version, &buf.at(0), n,
+                                         &e);
+      if (ret == TINYEXR_SUCCESS) {
+        break;
+      }
+
+      FreeEXRHeader(exr_header);
+      InitEXRHeader(exr_header);
+      if (eof || (buf_size >= kMaxHeaderSize)) {
+        if (e) {
+          if (err) {
+            (*err) = e;
+          } else {
+            FreeEXRErrorMessage(e);
+          }
+        }
+        return ret;
+      }
+      FreeEXRErrorMessage(e);
+      buf_size *= 2;
+    }
   }
 
-  if (size < tinyexr::kEXRVersionSize) {
-    tinyexr::SetErrorMessage("Insufficient header/data size.\n", err);
+  if (exr_header->data_window.max_x < exr_header->data_window.min_x ||
+      exr_header->data_window.max_y < exr_header->data_window.min_y) {
+    tinyexr::SetErrorMessage("Invalid data window", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+  tinyexr::tinyexr_int64 data_width =
+      static_cast<tinyexr::tinyexr_int64>(exr_header->data_window.max_x) -
+      static_cast<tinyexr::tinyexr_int64>(exr_header->data_window.min_x) + 1;
+  tinyexr::tinyexr_int64 data_height =
+      static_cast<tinyexr::tinyexr_int64>(exr_header->data_window.max_y) -
+      static_cast<tinyexr::tinyexr_int64>(exr_header->data_window.min_y) + 1;
+  if ((data_width > TINYEXR_DIMENSION_THRESHOLD) ||
+      (data_height > TINYEXR_DIMENSION_THRESHOLD)) {
+    tinyexr::SetErrorMessage("data width or data height too large.", err);
     return TINYEXR_ERROR_INVALID_DATA;
   }
 
-  const unsigned char *marker = memory + tinyexr::kEXRVersionSize;
-  size_t marker_size = size - tinyexr::kEXRVersionSize;
-
-  tinyexr::HeaderInfo info;
-  info.clear();
-
-  int ret;
-  {
-    std::string err_str;
-    ret = ParseEXRHeader(&info, NULL, version, &err_str, marker, marker_size);
+  TEXRStreamReader *r = new TEXRStreamReader();
+  r->header = exr_header;
+  r->read = read;
+  r->userdata = userdata;
+  r->width = static_cast<int>(data_width);
+  r->height = static_cast<int>(data_height);
+  r->num_scanlines = tinyexr::NumScanlines(exr_header->compression_type);
 
-    if (ret != TINYEXR_SUCCESS) {
-      if (err && !err_str.empty()) {
-        tinyexr::SetErrorMessage(err_str, err);
-      }
+  r->channel_offset_list.resize(static_cast<size_t>(exr_header->num_channels));
+  for (size_t c = 0; c < static_cast<size_t>(exr_header->num_channels); c++) {
+    r->channel_offset_list[c] = r->pixel_data_size;
+    int pixel_type = exr_header->channels[c].pixel_type;
+    if (pixel_type == TINYEXR_PIXELTYPE_HALF) {
+      r->pixel_data_size += sizeof(unsigned short);
+    } else if ((pixel_type == TINYEXR_PIXELTYPE_FLOAT) ||
+               (pixel_type == TINYEXR_PIXELTYPE_UINT)) {
+      r->pixel_data_size += sizeof(float);
+    } else {
+      tinyexr::SetErrorMessage("Invalid pixel type in the header", err);
+      delete r;
+      return TINYEXR_ERROR_INVALID_DATA;
     }
   }
 
-  {
-    std::string warn;
-    std::string err_str;
+  // Read the offset table.
+  size_t num_blocks = 0;
+  if (exr_header->chunk_count > 0) {
+    // Use `chunkCount` attribute.
+    num_blocks = static_cast<size_t>(exr_header->chunk_count);
+  } else {
+    num_blocks = static_cast<size_t>(
+        (data_height + r->num_scanlines - 1) / r->num_scanlines);
+  }
+  if (num_blocks > static_cast<size_t>(data_height)) {
+    tinyexr::SetErrorMessage("Invalid chunk count.", err);
+    delete r;
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
 
-    if (!ConvertHeader(exr_header, info, &warn, &err_str)) {
-      // release mem
-      for (size_t i = 0; i < info.attributes.size(); i++) {
-        if (info.attributes[i].value) {
-          free(info.attributes[i].value);
-        }
-      }
-      if (err && !err_str.empty()) {
-        tinyexr::SetErrorMessage(err_str, err);
-      }
-      ret = TINYEXR_ERROR_INVALID_HEADER;
+  tinyexr::tinyexr_uint64 table_pos =
+      tinyexr::kEXRVersionSize + exr_header->header_len;
+  tinyexr::tinyexr_uint64 data_pos =
+      table_pos + num_blocks * sizeof(tinyexr::tinyexr_uint64);
+  r->offsets.resize(num_blocks);
+  if (!r->ReadAt(table_pos, reinterpret_cast<unsigned char *>(&r->offsets.at(0)),
+                 num_blocks * sizeof(tinyexr::tinyexr_uint64))) {
+    tinyexr::SetErrorMessage("Insufficient data size in offset table.", err);
+    delete r;
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+  for (size_t i = 0; i < num_blocks; i++) {
+    tinyexr::swap8(&r->offsets[i]);
+    // The offset table can not be reconstructed without reading the whole
+    // data, so an incomplete table is an error.
+    if (r->offsets[i] < data_pos) {
+      tinyexr::SetErrorMessage("Invalid offset value in the offset table.",
+                               err);
+      delete r;
+      return TINYEXR_ERROR_INVALID_DATA;
     }
   }
 
-  exr_header->multipart = version->multipart ? 1 : 0;
-  exr_header->non_image = version->non_image ? 1 : 0;
+  if (options) {
+    r->parallel_options = *options;
+    r->options = &r->parallel_options;
+  }
 
-  return ret;
+  (*reader) = r;
+  return TINYEXR_SUCCESS;
 }
 
-int LoadEXRFromMemory(float **out_rgba, int *width, int *height,
-                      const unsigned char *memory, size_t size,
-                      const char **err) {
-  if (out_rgba == NULL || memory == NULL) {
-    tinyexr::SetErrorMessage("Invalid argument for LoadEXRFromMemory", err);
+int CreateEXRStreamReaderFromFile(EXRStreamReader **reader,
+                                  EXRHeader *exr_header, const char *filename,
+                                  const EXRParallelOptions *options,
+                                  const char **err) {
+  if (reader == NULL || exr_header == NULL || filename == NULL) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for CreateEXRStreamReaderFromFile", err);
     return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  EXRVersion exr_version;
-  EXRImage exr_image;
-  EXRHeader exr_header;
-
-  InitEXRHeader(&exr_header);
-
-  int ret = ParseEXRVersionFromMemory(&exr_version, memory, size);
-  if (ret != TINYEXR_SUCCESS) {
-    std::stringstream ss;
-    ss << "Failed to parse EXR version. code(" << ret << ")";
-    tinyexr::SetErrorMessage(ss.str(), err);
-    return ret;
+  StreamReaderFile *file = new StreamReaderFile();
+  if (!file->Open(filename)) {
+    delete file;
+    tinyexr::SetErrorMessage("Cannot read file " + std::string(filename), err);
+    return TINYEXR_ERROR_CANT_OPEN_FILE;
   }
 
-  ret = ParseEXRHeaderFromMemory(&exr_header, &exr_version, memory, size, err);
+  int ret = CreateEXRStreamReader(reader, exr_header, StreamReaderFile::Read,
+                                  file, options, err);
   if (ret != TINYEXR_SUCCESS) {
+    delete file;
     return ret;
   }
+  TEXRStreamReader *r = *reader;
+  r->file = file;
 
-  // Read HALF channel as FLOAT.
-  for (int i = 0; i < exr_header.num_channels; i++) {
-    if (exr_header.pixel_types[i] == TINYEXR_PIXELTYPE_HALF) {
-      exr_header.requested_pixel_types[i] = TINYEXR_PIXELTYPE_FLOAT;
-    }
+  // A chunk ends where the next chunk in the file begins, so it is read with
+  // a single call and can be prefetched.
+  std::vector<tinyexr::tinyexr_uint64> sorted_offsets(r->offsets);
+  std::sort(sorted_offsets.begin(), sorted_offsets.end());
+  r->chunk_ends.resize(r->offsets.size());
+  for (size_t i = 0; i < r->offsets.size(); i++) {
+    std::vector<tinyexr::tinyexr_uint64>::const_iterator next =
+        std::upper_bound(sorted_offsets.begin(), sorted_offsets.end(),
+                         r->offsets[i]);
+    r->chunk_ends[i] = (next != sorted_offsets.end()) ? *next : file->size;
   }
 
-  InitEXRImage(&exr_image);
-  ret = LoadEXRImageFromMemory(&exr_image, &exr_header, memory, size, err);
-  if (ret != TINYEXR_SUCCESS) {
-    return ret;
+  return TINYEXR_SUCCESS;
+}
+
+int EXRStreamReaderReadScanlines(EXRStreamReader *reader, int y,
+                                 int num_lines,
+                                 const EXRFrameBufferSlice *slices,
+                                 const char **err) {
+  if (reader == NULL || slices == NULL || y < 0 || num_lines <= 0 ||
+      num_lines > reader->height - y) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for EXRStreamReaderReadScanlines", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  // RGBA
-  int idxR = -1;
-  int idxG = -1;
-  int idxB = -1;
-  int idxA = -1;
-  for (int c = 0; c < exr_header.num_channels; c++) {
-    if (strcmp(exr_header.channels[c].name, "R") == 0) {
-      idxR = c;
-    } else if (strcmp(exr_header.channels[c].name, "G") == 0) {
-      idxG = c;
-    } else if (strcmp(exr_header.channels[c].name, "B") == 0) {
-      idxB = c;
-    } else if (strcmp(exr_header.channels[c].name, "A") == 0) {
-      idxA = c;
+  const EXRHeader *exr_header = reader->header;
+  for (int c = 0; c < exr_header->num_channels; c++) {
+    if ((slices[c].base != NULL) &&
+        (slices[c].pixel_type != TINYEXR_PIXELTYPE_UINT) &&
+        (slices[c].pixel_type != TINYEXR_PIXELTYPE_HALF) &&
+        (slices[c].pixel_type != TINYEXR_PIXELTYPE_FLOAT)) {
+      tinyexr::SetErrorMessage("Invalid pixel type in slices", err);
+      return TINYEXR_ERROR_INVALID_ARGUMENT;
     }
   }
 
-  // TODO(syoyo): Refactor removing same code as used in LoadEXR().
-  if (exr_header.num_channels == 1) {
-    // Grayscale channel only.
+  const int num_scanlines = reader->num_scanlines;
+  const size_t num_blocks = reader->offsets.size();
 
-    (*out_rgba) = reinterpret_cast<float *>(
-        malloc(4 * sizeof(float) * static_cast<size_t>(exr_image.width) *
-               static_cast<size_t>(exr_image.height)));
+  // Range of scanlines(in file order) and blocks to read. Same as
+  // `DecodeChunk` with region of interest.
+  int first_line = y;
+  int last_line = y + num_lines - 1;
+  if (exr_header->line_order != 0) {
+    first_line = reader->height - 1 - last_line;
+    last_line = reader->height - 1 - y;
+  }
+  size_t first_block =
+      (std::min)(static_cast<size_t>(first_line / num_scanlines), num_blocks);
+  size_t last_block = (std::min)(
+      static_cast<size_t>(last_line / num_scanlines) + 1, num_blocks);
 
-    if (exr_header.tiled) {
-      const size_t tile_size_x = static_cast<size_t>(exr_header.tile_size_x);
-      const size_t tile_size_y = static_cast<size_t>(exr_header.tile_size_y);
-      for (int it = 0; it < exr_image.num_tiles; it++) {
-        for (size_t j = 0; j < tile_size_y; j++) {
-          for (size_t i = 0; i < tile_size_x; i++) {
-            const size_t ii =
-                static_cast<size_t>(exr_image.tiles[it].offset_x) *
-                    tile_size_x +
-                i;
-            const size_t jj =
-                static_cast<size_t>(exr_image.tiles[it].offset_y) *
-                    tile_size_y +
-                j;
-            const size_t idx = ii + jj * static_cast<size_t>(exr_image.width);
+  // A chunk is never larger than twice of its uncompressed size.
+  const size_t max_data_len = 65536 + 2 * static_cast<size_t>(reader->width) *
+                                          static_cast<size_t>(num_scanlines) *
+                                          reader->pixel_data_size;
 
-            // out of region check.
-            if (ii >= static_cast<size_t>(exr_image.width)) {
-              continue;
-            }
-            if (jj >= static_cast<size_t>(exr_image.height)) {
-              continue;
+#if TINYEXR_HAS_CXX11
+  std::atomic<bool> invalid_data(false);
+#else
+  bool invalid_data(false);
+#endif
+  size_t next_block = first_block;
+  std::string e;
+
+  // Chunks [block + 1, block + kStreamReadAhead] are being read in the
+  // background while chunk `block` is read and decoded.
+  const size_t kStreamReadAhead = 16;
+  for (size_t block = first_block;
+       block < (std::min)(first_block + kStreamReadAhead, last_block);
+       block++) {
+    reader->Prefetch(block);
+  }
+
+  // Each task takes the next chunk while holding the lock and decodes it
+  // after releasing the lock, so reading a chunk overlaps with decoding the
+  // previous ones. The chunk is read while holding the lock(so `read` is
+  // called sequentially in block order), or after releasing it when reading
+  // a file with pread().
+  tinyexr::ParallelFor(
+      static_cast<int>(last_block - first_block), reader->options,
+      [&](int) {
+        TINYEXR_CODEC_SCRATCH(scratch);
+        std::vector<unsigned char> &data = scratch.compressed;
+        int line_no = 0;
+        int data_len = 0;
+        const char *read_error = NULL;
+        {
+#if TINYEXR_HAS_CXX11
+          std::unique_lock<std::mutex> lock(reader->read_mutex);
+#endif
+          if (invalid_data) {
+            return;
+          }
+          size_t block = next_block++;
+
+          if (reader->ConcurrentRead()) {
+#if TINYEXR_HAS_CXX11
+            lock.unlock();
+#endif
+            if (block + kStreamReadAhead < last_block) {
+              reader->Prefetch(block + kStreamReadAhead);
             }
-            const size_t srcIdx = i + j * tile_size_x;
-            unsigned char **src = exr_image.tiles[it].images;
-            (*out_rgba)[4 * idx + 0] =
-                reinterpret_cast<float **>(src)[0][srcIdx];
-            (*out_rgba)[4 * idx + 1] =
-                reinterpret_cast<float **>(src)[0][srcIdx];
-            (*out_rgba)[4 * idx + 2] =
-                reinterpret_cast<float **>(src)[0][srcIdx];
-            (*out_rgba)[4 * idx + 3] =
-                reinterpret_cast<float **>(src)[0][srcIdx];
           }
+          read_error = reader->ReadChunk(block, max_data_len, &data, &line_no,
+                                         &data_len);
+        }
+        if (read_error) {
+#if TINYEXR_HAS_CXX11
+          std::lock_guard<std::mutex> lock(reader->read_mutex);
+#endif
+          if (!invalid_data) {
+            e = read_error;
+          }
+          invalid_data = true;
+          return;
         }
-      }
-    } else {
-      const size_t pixel_size = static_cast<size_t>(exr_image.width) *
-        static_cast<size_t>(exr_image.height);
-      for (size_t i = 0; i < pixel_size; i++) {
-        const float val = reinterpret_cast<float **>(exr_image.images)[0][i];
-        (*out_rgba)[4 * i + 0] = val;
-        (*out_rgba)[4 * i + 1] = val;
-        (*out_rgba)[4 * i + 2] = val;
-        (*out_rgba)[4 * i + 3] = val;
-      }
-    }
-
-  } else {
-    // TODO(syoyo): Support non RGBA image.
 
-    if (idxR == -1) {
-      tinyexr::SetErrorMessage("R channel not found", err);
+        // line_no may be negative.
+        tinyexr::tinyexr_int64 lno =
+            static_cast<tinyexr::tinyexr_int64>(line_no) -
+            static_cast<tinyexr::tinyexr_int64>(exr_header->data_window.min_y);
+        if ((lno < 0) || (lno >= reader->height)) {
+          invalid_data = true;
+          return;
+        }
+        int line = static_cast<int>(lno);
+        int n = (std::min)(num_scanlines, reader->height - line);
+
+        if (!tinyexr::DecodePixelData(
+                slices, &data.at(8), static_cast<size_t>(data_len),
+                exr_header->compression_type, exr_header->line_order,
+                reader->width, num_lines, line - first_line, n, 0,
+                reader->width, reader->pixel_data_size,
+                static_cast<size_t>(exr_header->num_custom_attributes),
+                exr_header->custom_attributes,
+                static_cast<size_t>(exr_header->num_channels),
+                exr_header->channels, reader->channel_offset_list)) {
+          invalid_data = true;
+        }
+        scratch.Trim();
+      });
 
-      // @todo { free exr_image }
-      return TINYEXR_ERROR_INVALID_DATA;
+  if (invalid_data) {
+    if (e.empty()) {
+      e = "Invalid/Corrupted data found when decoding pixels.";
     }
+    tinyexr::SetErrorMessage(e, err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
 
-    if (idxG == -1) {
-      tinyexr::SetErrorMessage("G channel not found", err);
-      // @todo { free exr_image }
-      return TINYEXR_ERROR_INVALID_DATA;
-    }
+  return TINYEXR_SUCCESS;
+}
 
-    if (idxB == -1) {
-      tinyexr::SetErrorMessage("B channel not found", err);
-      // @todo { free exr_image }
-      return TINYEXR_ERROR_INVALID_DATA;
-    }
+void FreeEXRStreamReader(EXRStreamReader *reader) { delete reader; }
 
-    (*out_rgba) = reinterpret_cast<float *>(
-        malloc(4 * sizeof(float) * static_cast<size_t>(exr_image.width) *
-               static_cast<size_t>(exr_image.height)));
+namespace tinyexr
+{
 
-    if (exr_header.tiled) {
-      const size_t tile_size_x = static_cast<size_t>(exr_header.tile_size_x);
-      const size_t tile_size_y = static_cast<size_t>(exr_header.tile_size_y);
-      for (int it = 0; it < exr_image.num_tiles; it++) {
-        for (size_t j = 0; j < tile_size_y; j++)
-          for (size_t i = 0; i < tile_size_x; i++) {
-            const size_t ii =
-                static_cast<size_t>(exr_image.tiles[it].offset_x) *
-                    tile_size_x +
-                i;
-            const size_t jj =
-                static_cast<size_t>(exr_image.tiles[it].offset_y) *
-                    tile_size_y +
-                j;
-            const size_t idx = ii + jj * static_cast<size_t>(exr_image.width);
+#ifdef __clang__
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wsign-conversion"
+#endif
 
-            // out of region check.
-            if (ii >= static_cast<size_t>(exr_image.width)) {
-              continue;
-            }
-            if (jj >= static_cast<size_t>(exr_image.height)) {
-              continue;
-            }
-            const size_t srcIdx = i + j * tile_size_x;
-            unsigned char **src = exr_image.tiles[it].images;
-            (*out_rgba)[4 * idx + 0] =
-                reinterpret_cast<float **>(src)[idxR][srcIdx];
-            (*out_rgba)[4 * idx + 1] =
-                reinterpret_cast<float **>(src)[idxG][srcIdx];
-            (*out_rgba)[4 * idx + 2] =
-                reinterpret_cast<float **>(src)[idxB][srcIdx];
-            if (idxA != -1) {
-              (*out_rgba)[4 * idx + 3] =
-                  reinterpret_cast<float **>(src)[idxA][srcIdx];
-            } else {
-              (*out_rgba)[4 * idx + 3] = 1.0;
-            }
-          }
+// Converts `n` pixels of `src_type` at `src`(native endian, stride of
+// `x_stride` bytes, no alignment requirement) to `dst_type` and stores them
+// to `dst` as uncompressed pixel data(little endian, no alignment
+// requirement). Inverse of `ConvertPixelLine`.
+static bool PackPixelLine(unsigned char *dst, int dst_type,
+                          const unsigned char *src, size_t x_stride,
+                          int src_type, size_t n) {
+  if ((dst_type != TINYEXR_PIXELTYPE_UINT) &&
+      (dst_type != TINYEXR_PIXELTYPE_HALF) &&
+      (dst_type != TINYEXR_PIXELTYPE_FLOAT)) {
+    return false;
+  }
+
+  if (src_type == dst_type) {
+    size_t type_size = (src_type == TINYEXR_PIXELTYPE_HALF)
+                           ? sizeof(unsigned short)
+                           : sizeof(unsigned int);
+#if TINYEXR_LITTLE_ENDIAN
+    if (x_stride == type_size) {
+      memcpy(dst, src, n * type_size);
+      return true;
+    }
+#endif
+    for (size_t u = 0; u < n; u++) {
+      if (type_size == sizeof(unsigned short)) {
+        unsigned short val;
+        memcpy(&val, src + u * x_stride, sizeof(unsigned short));
+        tinyexr::swap2(&val);
+        memcpy(dst + u * sizeof(unsigned short), &val, sizeof(unsigned short));
+      } else {
+        unsigned int val;
+        memcpy(&val, src + u * x_stride, sizeof(unsigned int));
+        tinyexr::swap4(&val);
+        memcpy(dst + u * sizeof(unsigned int), &val, sizeof(unsigned int));
       }
-    } else {
-      const size_t pixel_size = static_cast<size_t>(exr_image.width) *
-        static_cast<size_t>(exr_image.height);
-      for (size_t i = 0; i < pixel_size; i++) {
-        (*out_rgba)[4 * i + 0] =
-            reinterpret_cast<float **>(exr_image.images)[idxR][i];
-        (*out_rgba)[4 * i + 1] =
-            reinterpret_cast<float **>(exr_image.images)[idxG][i];
-        (*out_rgba)[4 * i + 2] =
-            reinterpret_cast<float **>(exr_image.images)[idxB][i];
-        if (idxA != -1) {
-          (*out_rgba)[4 * i + 3] =
-              reinterpret_cast<float **>(exr_image.images)[idxA][i];
-        } else {
-          (*out_rgba)[4 * i + 3] = 1.0;
+    }
+    return true;
+  }
+
+  if ((src_type == TINYEXR_PIXELTYPE_FLOAT) &&
+      (dst_type == TINYEXR_PIXELTYPE_HALF)) {
+    // Gather in small batches so that the vectorized conversion is also
+    // used for interleaved or unaligned source.
+    float buf[256];
+    const size_t kBatch = sizeof(buf) / sizeof(buf[0]);
+    for (size_t i = 0; i < n; i += kBatch) {
+      size_t m = (std::min)(kBatch, n - i);
+      const unsigned char *s = src + i * x_stride;
+      if (x_stride == sizeof(float)) {
+        memcpy(buf, s, m * sizeof(float));
+      } else {
+        for (size_t j = 0; j < m; j++) {
+          memcpy(&buf[j], s + j * x_stride, sizeof(float));
         }
       }
+      tinyexr::FloatToHalfLine(dst + i * sizeof(unsigned short), buf, m);
     }
+    return true;
   }
 
-  (*width) = exr_image.width;
-  (*height) = exr_image.height;
+  for (size_t u = 0; u < n; u++) {
+    const unsigned char *s = src + u * x_stride;
+    tinyexr::FP32 f32;
+    if (src_type == TINYEXR_PIXELTYPE_HALF) {
+      tinyexr::FP16 f16;
+      memcpy(&f16.u, s, sizeof(unsigned short));
+      f32 = tinyexr::half_to_float(f16);
+    } else if (src_type == TINYEXR_PIXELTYPE_FLOAT) {
+      memcpy(&f32.f, s, sizeof(float));
+    } else if (src_type == TINYEXR_PIXELTYPE_UINT) {
+      unsigned int val;
+      memcpy(&val, s, sizeof(unsigned int));
+      f32.f = static_cast<float>(val);
+    } else {
+      return false;
+    }
 
-  FreeEXRHeader(&exr_header);
-  FreeEXRImage(&exr_image);
+    if (dst_type == TINYEXR_PIXELTYPE_HALF) {
+      tinyexr::FP16 f16 = tinyexr::float_to_half_full(f32);
+      tinyexr::swap2(&f16.u);
+      memcpy(dst + u * sizeof(unsigned short), &f16.u, sizeof(unsigned short));
+    } else if (dst_type == TINYEXR_PIXELTYPE_FLOAT) {
+      tinyexr::swap4(&f32.u);
+      memcpy(dst + u * sizeof(float), &f32.u, sizeof(float));
+    } else {
+      unsigned int val = FloatToUInt(f32.f);
+      tinyexr::swap4(&val);
+      memcpy(dst + u * sizeof(unsigned int), &val, sizeof(unsigned int));
+    }
+  }
 
-  return TINYEXR_SUCCESS;
+  return true;
 }
 
-// Represents a read-only file mapped to an address space in memory.
-// If no memory-mapping API is available, falls back to allocating a buffer
-// with a copy of the file's data.
-struct MemoryMappedFile {
-  unsigned char *data;  // To the start of the file's data.
-  size_t size;          // The size of the file in bytes.
-#ifdef TINYEXR_USE_WIN32_MMAP
-  HANDLE windows_file;
-  HANDLE windows_file_mapping;
-#elif defined(TINYEXR_USE_POSIX_MMAP)
-  int posix_descriptor;
-#endif
-
-  // MemoryMappedFile's constructor tries to map memory to a file.
-  // If this succeeds, valid() will return true and all fields
-  // are usable; otherwise, valid() will return false.
-  MemoryMappedFile(const char *filename) {
-    data = NULL;
-    size = 0;
-#ifdef TINYEXR_USE_WIN32_MMAP
-    windows_file_mapping = NULL;
-    windows_file =
-        CreateFileW(tinyexr::UTF8ToWchar(filename).c_str(),  // lpFileName
-                    GENERIC_READ,                            // dwDesiredAccess
-                    FILE_SHARE_READ,                         // dwShareMode
-                    NULL,                     // lpSecurityAttributes
-                    OPEN_EXISTING,            // dwCreationDisposition
-                    FILE_ATTRIBUTE_READONLY,  // dwFlagsAndAttributes
-                    NULL);                    // hTemplateFile
-    if (windows_file == INVALID_HANDLE_VALUE) {
-      return;
+// Packs scanlines [line_no, line_no + num_lines) of `width` pixels from
+// `slices` into `dst` with the uncompressed layout of OpenEXR(see
+// `UnpackPixelData`). Pixel data is converted from `slices[c].pixel_type` to
+// `channels[c].requested_pixel_type`.
+static bool PackPixelData(unsigned char *dst,
+                          const EXRFrameBufferSlice *slices, int line_no,
+                          int width, int num_lines, size_t pixel_data_size,
+                          const std::vector<ChannelInfo> &channels,
+                          const std::vector<size_t> &channel_offset_list) {
+  const size_t line_size = static_cast<size_t>(width) * pixel_data_size;
+  for (size_t v = 0; v < static_cast<size_t>(num_lines); v++) {
+    unsigned char *line_ptr = dst + v * line_size;
+    size_t row = static_cast<size_t>(line_no) + v;
+    for (size_t c = 0; c < channels.size(); c++) {
+      if (!PackPixelLine(
+              line_ptr + channel_offset_list[c] * static_cast<size_t>(width),
+              channels[c].requested_pixel_type,
+              slices[c].base + row * slices[c].y_stride, slices[c].x_stride,
+              slices[c].pixel_type, static_cast<size_t>(width))) {
+        return false;
+      }
     }
+  }
+  return true;
+}
 
-    windows_file_mapping = CreateFileMapping(windows_file,  // hFile
-                                             NULL,  // lpFileMappingAttributes
-                                             PAGE_READONLY,  // flProtect
-                                             0,      // dwMaximumSizeHigh
-                                             0,      // dwMaximumSizeLow
-                                             NULL);  // lpName
-    if (windows_file_mapping == NULL) {
-      return;
+// Sets up source slices for planar `images`(pixel type of
+// `channels[c].pixel_type`, row stride = `row_pixels` pixels).
+// Slices are only read when encoding.
+static void SetupSourceSlices(EXRFrameBufferSlice *slices,
+                              const unsigned char *const *images,
+                              const std::vector<ChannelInfo> &channels,
+                              int row_pixels) {
+  for (size_t c = 0; c < channels.size(); c++) {
+    size_t type_size = (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF)
+                           ? sizeof(unsigned short)
+                           : sizeof(float);
+    slices[c].base = const_cast<unsigned char *>(images[c]);
+    slices[c].x_stride = type_size;
+    slices[c].y_stride = type_size * static_cast<size_t>(row_pixels);
+    slices[c].pixel_type = channels[c].pixel_type;
+    slices[c].pad0 = 0;
+  }
+}
+
+// Compresses uncompressed pixel data `buf`(`width` x `num_lines` pixels) and
+// appends it to `out_data`.
+// `compression_param` points to ZFPCompressionParam for ZFP, and the ZIP
+// compression level(int) for ZIP/ZIPS. NULL: default.
+static bool CompressPixelData(/* out */ std::vector<unsigned char>& out_data,
+                              const std::vector<unsigned char>& buf,
+                              int compression_type,
+                              int width,
+                              int num_lines,
+                              const std::vector<ChannelInfo>& channels,
+                              CodecScratch *codec_scratch,
+                              std::string *err,
+                              const void* compression_param)
+{
+  CodecScratch &scratch = *codec_scratch;
+  (void)width;
+  (void)num_lines;
+  (void)channels;
+
+  const EXRCodec *codec = FindCodec(compression_type);
+  if (codec) {
+    if (!codec->compress_func) {
+      if (err) {
+        (*err) += "Registered codec does not support compression.\n";
+      }
+      return false;
     }
 
-    data = reinterpret_cast<unsigned char *>(
-        MapViewOfFile(windows_file_mapping,  // hFileMappingObject
-                      FILE_MAP_READ,         // dwDesiredAccess
-                      0,                     // dwFileOffsetHigh
-                      0,                     // dwFileOffsetLow
-                      0));                   // dwNumberOfBytesToMap
-    if (!data) {
-      return;
+    // Channels in the file(i.e. with the requested pixel type).
+    std::vector<EXRChannelInfo> codec_channels(channels.size());
+    for (size_t c = 0; c < channels.size(); c++) {
+      EXRChannelInfo &dst_channel = codec_channels[c];
+      memset(&dst_channel, 0, sizeof(EXRChannelInfo));
+      strncpy(dst_channel.name, channels[c].name.c_str(), 255);
+      dst_channel.pixel_type = channels[c].requested_pixel_type;
+      dst_channel.x_sampling = channels[c].x_sampling;
+      dst_channel.y_sampling = channels[c].y_sampling;
+      dst_channel.p_linear = channels[c].p_linear;
+    }
+
+    EXRCodecChunk chunk;
+    chunk.width = width;
+    chunk.num_lines = num_lines;
+    chunk.num_channels = static_cast<int>(channels.size());
+    chunk.channels = codec_channels.empty() ? NULL : &codec_channels.at(0);
+
+    std::vector<unsigned char> &block = scratch.compressed;
+    block.resize(buf.size());
+    size_t outSize = 0;
+    if (buf.empty() ||
+        codec->compress_func(&block.at(0), &outSize, &buf.at(0), buf.size(),
+                        &chunk, codec->userdata) != 0) {
+      if (err) {
+        (*err) += "Registered codec failed to compress data.\n";
+      }
+      return false;
     }
 
-    LARGE_INTEGER windows_file_size = {};
-    if (!GetFileSizeEx(windows_file, &windows_file_size) ||
-        static_cast<ULONGLONG>(windows_file_size.QuadPart) >
-            std::numeric_limits<size_t>::max()) {
-      UnmapViewOfFile(data);
-      data = NULL;
-      return;
+    if ((outSize == 0) || (outSize >= buf.size())) {
+      // Store uncompressed data.
+      out_data.insert(out_data.end(), buf.begin(), buf.end());
+    } else {
+      out_data.insert(out_data.end(), block.begin(),
+                      block.begin() + static_cast<std::ptrdiff_t>(outSize));
     }
-    size = static_cast<size_t>(windows_file_size.QuadPart);
-#elif defined(TINYEXR_USE_POSIX_MMAP)
-    posix_descriptor = open(filename, O_RDONLY);
-    if (posix_descriptor == -1) {
-      return;
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_NONE) {
+    // 4 byte: scan line
+    // 4 byte: data size
+    // ~     : pixel data(uncompressed)
+    out_data.insert(out_data.end(), buf.begin(), buf.end());
+
+  } else if ((compression_type == TINYEXR_COMPRESSIONTYPE_ZIPS) ||
+    (compression_type == TINYEXR_COMPRESSIONTYPE_ZIP)) {
+    std::vector<unsigned char> &block = scratch.compressed;
+    block.resize(tinyexr::ZipCompressBound(buf.size()));
+    tinyexr::tinyexr_uint64 outSize = block.size();
+
+    int level = TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT;
+    if (compression_param) {
+      level = *static_cast<const int *>(compression_param);
     }
 
-    struct stat info;
-    if (fstat(posix_descriptor, &info) < 0) {
-      return;
+    if (!tinyexr::CompressZip(&block.at(0), outSize,
+                         reinterpret_cast<const unsigned char *>(&buf.at(0)),
+                         static_cast<unsigned long>(buf.size()),
+                         &scratch.tmp, level)) {
+      if (err) {
+        (*err) += "Zip compresssion failed.\n";
+      }
+      return false;
     }
-    // Make sure st_size is in the valid range for a size_t. The second case
-    // can only fail if a POSIX implementation defines off_t to be a larger
-    // type than size_t - for instance, compiling with _FILE_OFFSET_BITS=64
-    // on a 32-bit system. On current 64-bit systems, this check can never
-    // fail, so we turn off clang's Wtautological-type-limit-compare warning
-    // around this code.
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wtautological-type-limit-compare"
-#endif
-    if (info.st_size < 0 ||
-        info.st_size > std::numeric_limits<ssize_t>::max()) {
-      return;
+
+    // 4 byte: scan line
+    // 4 byte: data size
+    // ~     : pixel data(compressed)
+    unsigned int data_len = static_cast<unsigned int>(outSize);  // truncate
+
+    out_data.insert(out_data.end(), block.begin(), block.begin() + data_len);
+
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_RLE) {
+    // (buf.size() * 3) / 2 would be enough.
+    std::vector<unsigned char> &block = scratch.compressed;
+    block.resize((buf.size() * 3) / 2);
+
+    tinyexr::tinyexr_uint64 outSize = block.size();
+
+    if (!tinyexr::CompressRle(&block.at(0), outSize,
+                         reinterpret_cast<const unsigned char *>(&buf.at(0)),
+                         static_cast<unsigned long>(buf.size()),
+                         &scratch.tmp)) {
+      if (err) {
+        (*err) += "RLE compresssion failed.\n";
+      }
+      return false;
     }
-#ifdef __clang__
-#pragma clang diagnostic pop
-#endif
-    size = static_cast<size_t>(info.st_size);
 
-    data = reinterpret_cast<unsigned char *>(
-        mmap(0, size, PROT_READ, MAP_SHARED, posix_descriptor, 0));
-    if (data == MAP_FAILED) {
-      data = nullptr;
-      return;
+    // 4 byte: scan line
+    // 4 byte: data size
+    // ~     : pixel data(compressed)
+    unsigned int data_len = static_cast<unsigned int>(outSize);  // truncate
+    out_data.insert(out_data.end(), block.begin(), block.begin() + data_len);
+
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_PXR24) {
+    std::vector<unsigned char> &block = scratch.compressed;
+    block.resize(tinyexr::ZipCompressBound(buf.size()));
+    tinyexr::tinyexr_uint64 outSize = block.size();
+
+    int level = TINYEXR_ZIP_COMPRESSION_LEVEL_DEFAULT;
+    if (compression_param) {
+      level = *static_cast<const int *>(compression_param);
     }
-#else
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-      return;
+
+    if (buf.empty() || (level == TINYEXR_ZIP_COMPRESSION_LEVEL_STORE)) {
+      outSize = buf.size();
+    } else if (!tinyexr::CompressPxr24(&block.at(0), &outSize, &buf.at(0),
+                                       width, num_lines, channels,
+                                       &scratch.tmp, level)) {
+      if (err) {
+        (*err) += "PXR24 compresssion failed.\n";
+      }
+      return false;
     }
 
-    // Calling fseek(fp, 0, SEEK_END) isn't strictly-conforming C code, but
-    // since neither the WIN32 nor POSIX APIs are available in this branch, this
-    // is a reasonable fallback option.
-    if (fseek(fp, 0, SEEK_END) != 0) {
-      fclose(fp);
-      return;
+    if (outSize >= buf.size()) {
+      // Store uncompressed data.
+      out_data.insert(out_data.end(), buf.begin(), buf.end());
+    } else {
+      out_data.insert(out_data.end(), block.begin(),
+                      block.begin() + static_cast<std::ptrdiff_t>(outSize));
     }
-    const long ftell_result = ftell(fp);
-    if (ftell_result < 0) {
-      // Error from ftell
-      fclose(fp);
-      return;
+
+  } else if ((compression_type == TINYEXR_COMPRESSIONTYPE_B44) ||
+             (compression_type == TINYEXR_COMPRESSIONTYPE_B44A)) {
+    std::vector<unsigned char> &block = scratch.compressed;
+    block.resize(tinyexr::B44CompressBound(width, num_lines, channels));
+
+    size_t outSize = 0;
+    if (!buf.empty()) {
+      outSize = tinyexr::CompressB44(
+          &block.at(0), &buf.at(0), width, num_lines, channels,
+          compression_type == TINYEXR_COMPRESSIONTYPE_B44A);
     }
-    size = static_cast<size_t>(ftell_result);
-    if (fseek(fp, 0, SEEK_SET) != 0) {
-      fclose(fp);
-      size = 0;
-      return;
+
+    if (outSize >= buf.size()) {
+      // Store uncompressed data(e.g. a chunk without HALF channels).
+      out_data.insert(out_data.end(), buf.begin(), buf.end());
+    } else {
+      out_data.insert(out_data.end(), block.begin(),
+                      block.begin() + static_cast<std::ptrdiff_t>(outSize));
     }
 
-    data = reinterpret_cast<unsigned char *>(malloc(size));
-    if (!data) {
-      size = 0;
-      fclose(fp);
-      return;
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
+#if TINYEXR_USE_PIZ
+    unsigned int bufLen =
+      8192 + static_cast<unsigned int>(
+        2 * static_cast<unsigned int>(
+          buf.size()));  // @fixme { compute good bound. }
+    std::vector<unsigned char> &block = scratch.compressed;
+    block.resize(bufLen);
+    unsigned int outSize = static_cast<unsigned int>(block.size());
+
+    if (!CompressPiz(&block.at(0), &outSize,
+                reinterpret_cast<const unsigned char *>(&buf.at(0)),
+                buf.size(), channels, width, num_lines, &scratch.piz)) {
+      if (err) {
+        (*err) += "PIZ compresssion failed.\n";
+      }
+      return false;
     }
-    size_t read_bytes = fread(data, 1, size, fp);
-    if (read_bytes != size) {
-      // TODO: Try to read data until reading `size` bytes.
-      fclose(fp);
-      size = 0; 
-      data = nullptr;
-      return;
+
+    // 4 byte: scan line
+    // 4 byte: data size
+    // ~     : pixel data(compressed)
+    unsigned int data_len = outSize;
+    out_data.insert(out_data.end(), block.begin(), block.begin() + data_len);
+
+#else
+    if (err) {
+      (*err) += "PIZ compression is disabled in this build.\n";
     }
-    fclose(fp);
+    return false;
 #endif
-  }
+  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
+#if TINYEXR_USE_ZFP
+    const ZFPCompressionParam* zfp_compression_param = reinterpret_cast<const ZFPCompressionParam*>(compression_param);
+    std::vector<unsigned char> block;
+    unsigned int outSize;
 
-  // MemoryMappedFile's destructor closes all its handles.
-  ~MemoryMappedFile() {
-#ifdef TINYEXR_USE_WIN32_MMAP
-    if (data) {
-      (void)UnmapViewOfFile(data);
-      data = NULL;
-    }
+    tinyexr::CompressZfp(
+      &block, &outSize, reinterpret_cast<const float *>(&buf.at(0)),
+      width, num_lines, static_cast<int>(channels.size()), *zfp_compression_param);
 
-    if (windows_file_mapping != NULL) {
-      (void)CloseHandle(windows_file_mapping);
-    }
+    // 4 byte: scan line
+    // 4 byte: data size
+    // ~     : pixel data(compressed)
+    unsigned int data_len = outSize;
+    out_data.insert(out_data.end(), block.begin(), block.begin() + data_len);
 
-    if (windows_file != INVALID_HANDLE_VALUE) {
-      (void)CloseHandle(windows_file);
-    }
-#elif defined(TINYEXR_USE_POSIX_MMAP)
-    if (data) {
-      (void)munmap(data, size);
-      data = NULL;
+#else
+    if (err) {
+      (*err) += "ZFP compression is disabled in this build.\n";
     }
+    (void)compression_param;
+    return false;
+#endif
+  } else {
+    return false;
+  }
 
-    if (posix_descriptor != -1) {
-      (void)close(posix_descriptor);
+  return true;
+}
+
+// Encodes scanlines [line_no, line_no + num_lines) of `slices` as a chunk.
+// out_data must be allocated initially with the block-header size
+// of the current image(-part) type
+static bool EncodePixelData(/* out */ std::vector<unsigned char>& out_data,
+                            const EXRFrameBufferSlice* slices,
+                            int compression_type,
+                            int width, // for tiled : tile.width
+                            int line_no, // for tiled : 0
+                            int num_lines, // for tiled : tile.height
+                            size_t pixel_data_size,
+                            const std::vector<ChannelInfo>& channels,
+                            const std::vector<size_t>& channel_offset_list,
+                            std::string *err,
+                            const void* compression_param = 0) // see CompressPixelData
+{
+  size_t buf_size = static_cast<size_t>(width) *
+                  static_cast<size_t>(num_lines) *
+                  static_cast<size_t>(pixel_data_size);
+  TINYEXR_CODEC_SCRATCH(scratch);
+  std::vector<unsigned char> &buf = scratch.block;
+  buf.resize(buf_size);
+
+  if (!PackPixelData(buf.data(), slices, line_no, width, num_lines,
+                     pixel_data_size, channels, channel_offset_list)) {
+    if (err) {
+      (*err) += "Invalid requested_pixel_type.\n";
     }
-#else
-    if (data) {
-      (void)free(data);
+    return false;
+  }
+
+  bool ret = CompressPixelData(out_data, buf, compression_type, width,
+                               num_lines, channels, &scratch, err,
+                               compression_param);
+  scratch.Trim();
+  return ret;
+}
+
+static int EncodeTiledLevel(const EXRImage* level_image, const EXRHeader* exr_header,
+                            const std::vector<tinyexr::ChannelInfo>& channels,
+                            std::vector<std::vector<unsigned char> >& data_list,
+                            size_t start_index, // for data_list
+                            int num_x_tiles, int num_y_tiles,
+                            const std::vector<size_t>& channel_offset_list,
+                            int pixel_data_size,
+                            const void* compression_param, // see CompressPixelData
+                            const EXRParallelOptions* parallel_options,
+                            std::string* err) {
+  int num_tiles = num_x_tiles * num_y_tiles;
+  if (num_tiles != level_image->num_tiles) {
+    if (err) {
+      (*err) += "Invalid number of tiles in argument.\n";
     }
-    data = NULL;
-#endif
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  if ((exr_header->tile_size_x > level_image->width || exr_header->tile_size_y > level_image->height) &&
+      level_image->level_x == 0 && level_image->level_y == 0) {
+      if (err) {
+        (*err) += "Failed to encode tile data.\n";
+      }
+      return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+
+  const size_t num_channels = channels.size();
+  std::vector<EXRFrameBufferSlice> slices(static_cast<size_t>(num_tiles) *
+                                          num_channels);
+  for (size_t i = 0; i < static_cast<size_t>(num_tiles); i++) {
+    SetupSourceSlices(slices.data() + i * num_channels,
+                      static_cast<const unsigned char* const*>(
+                        level_image->tiles[i].images),
+                      channels, exr_header->tile_size_x);
   }
 
-  // A MemoryMappedFile cannot be copied or moved.
-  // Only check for this when compiling with C++11 or higher, since deleted
-  // function definitions were added then.
 #if TINYEXR_HAS_CXX11
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wc++98-compat"
-#endif
-  MemoryMappedFile(const MemoryMappedFile &) = delete;
-  MemoryMappedFile &operator=(const MemoryMappedFile &) = delete;
-  MemoryMappedFile(MemoryMappedFile &&other) noexcept = delete;
-  MemoryMappedFile &operator=(MemoryMappedFile &&other) noexcept = delete;
-#ifdef __clang__
-#pragma clang diagnostic pop
-#endif
+  std::atomic<bool> invalid_data(false);
+#else
+  bool invalid_data(false);
 #endif
 
-  // Returns whether this was successfully opened.
-  bool valid() const { return data; }
-};
+  ParallelFor(num_tiles, parallel_options, [&](int i) {
+    size_t tile_idx = static_cast<size_t>(i);
+    size_t data_idx = tile_idx + start_index;
 
-int LoadEXRImageFromFile(EXRImage *exr_image, const EXRHeader *exr_header,
-                         const char *filename, const char **err) {
-  if (exr_image == NULL) {
-    tinyexr::SetErrorMessage("Invalid argument for LoadEXRImageFromFile", err);
-    return TINYEXR_ERROR_INVALID_ARGUMENT;
-  }
+    int x_tile = i % num_x_tiles;
+    int y_tile = i / num_x_tiles;
 
-  MemoryMappedFile file(filename);
-  if (!file.valid()) {
-    tinyexr::SetErrorMessage("Cannot read file " + std::string(filename), err);
-    return TINYEXR_ERROR_CANT_OPEN_FILE;
+    EXRTile& tile = level_image->tiles[tile_idx];
+
+    data_list[data_idx].resize(5*sizeof(int));
+    size_t data_header_size = data_list[data_idx].size();
+    bool ret = EncodePixelData(data_list[data_idx],
+                               slices.data() + tile_idx * num_channels,
+                               exr_header->compression_type,
+                               tile.width,
+                               0,
+                               tile.height,
+                               pixel_data_size,
+                               channels,
+                               channel_offset_list,
+                               err, compression_param);
+    if (!ret) {
+      invalid_data = true;
+      return;
+    }
+    if (data_list[data_idx].size() <= data_header_size) {
+      invalid_data = true;
+      return;
+    }
+
+    int data_len = static_cast<int>(data_list[data_idx].size() - data_header_size);
+    //tileX, tileY, levelX, levelY // pixel_data_size(int)
+    memcpy(&data_list[data_idx][0], &x_tile, sizeof(int));
+    memcpy(&data_list[data_idx][4], &y_tile, sizeof(int));
+    memcpy(&data_list[data_idx][8], &level_image->level_x, sizeof(int));
+    memcpy(&data_list[data_idx][12], &level_image->level_y, sizeof(int));
+    memcpy(&data_list[data_idx][16], &data_len, sizeof(int));
+
+    swap4(reinterpret_cast<int*>(&data_list[data_idx][0]));
+    swap4(reinterpret_cast<int*>(&data_list[data_idx][4]));
+    swap4(reinterpret_cast<int*>(&data_list[data_idx][8]));
+    swap4(reinterpret_cast<int*>(&data_list[data_idx][12]));
+    swap4(reinterpret_cast<int*>(&data_list[data_idx][16]));
+
+  });
+
+  if (invalid_data) {
+    if (err) {
+      (*err) += "Failed to encode tile data.\n";
+    }
+    return TINYEXR_ERROR_INVALID_DATA;
   }
+  return TINYEXR_SUCCESS;
+}
+
+static int EncodeChunk(const EXRImage* exr_image, const EXRHeader* exr_header,
+                       const std::vector<ChannelInfo>& channels,
+                       int num_blocks,
+                       tinyexr_uint64 chunk_offset, // starting offset of current chunk
+                       bool is_multipart,
+                       OffsetData& offset_data, // output block offsets, must be initialized
+                       std::vector<std::vector<unsigned char> >& data_list, // output
+                       tinyexr_uint64& total_size, // output: ending offset of current chunk
+                       const EXRParallelOptions* parallel_options,
+                       std::string* err) {
+  int num_scanlines = NumScanlines(exr_header->compression_type);
 
-  if (file.size < 16) {
-    tinyexr::SetErrorMessage("File size too short : " + std::string(filename),
-                             err);
-    return TINYEXR_ERROR_INVALID_FILE;
-  }
+  data_list.resize(num_blocks);
 
-  return LoadEXRImageFromMemory(exr_image, exr_header, file.data, file.size,
-                                err);
-}
+  std::vector<size_t> channel_offset_list(
+    static_cast<size_t>(exr_header->num_channels));
 
-int LoadEXRImageFromMemory(EXRImage *exr_image, const EXRHeader *exr_header,
-                           const unsigned char *memory, const size_t size,
-                           const char **err) {
-  if (exr_image == NULL || memory == NULL ||
-      (size < tinyexr::kEXRVersionSize)) {
-    tinyexr::SetErrorMessage("Invalid argument for LoadEXRImageFromMemory",
-                             err);
-    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  int pixel_data_size = 0;
+  {
+    size_t channel_offset = 0;
+    for (size_t c = 0; c < static_cast<size_t>(exr_header->num_channels); c++) {
+      channel_offset_list[c] = channel_offset;
+      if (channels[c].requested_pixel_type == TINYEXR_PIXELTYPE_HALF) {
+        pixel_data_size += sizeof(unsigned short);
+        channel_offset += sizeof(unsigned short);
+      } else if (channels[c].requested_pixel_type ==
+                 TINYEXR_PIXELTYPE_FLOAT) {
+        pixel_data_size += sizeof(float);
+        channel_offset += sizeof(float);
+      } else if (channels[c].requested_pixel_type == TINYEXR_PIXELTYPE_UINT) {
+        pixel_data_size += sizeof(unsigned int);
+        channel_offset += sizeof(unsigned int);
+      } else {
+        if (err) {
+          (*err) += "Invalid requested_pixel_type.\n";
+        }
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
+    }
   }
 
-  if (exr_header->header_len == 0) {
-    tinyexr::SetErrorMessage("EXRHeader variable is not initialized.", err);
-    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  const void* compression_param = 0;
+  int zip_compression_level = exr_header->zip_compression_level;
+  if ((exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_ZIPS) ||
+      (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_ZIP) ||
+      (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_PXR24)) {
+    compression_param = &zip_compression_level;
   }
+#if TINYEXR_USE_ZFP
+  tinyexr::ZFPCompressionParam zfp_compression_param;
 
-  const unsigned char *head = memory;
-  const unsigned char *marker = reinterpret_cast<const unsigned char *>(
-      memory + exr_header->header_len +
-      8);  // +8 for magic number + version header.
-  return tinyexr::DecodeEXRImage(exr_image, exr_header, head, marker, size,
-                                 err);
-}
-
-namespace tinyexr
-{
+  // Use ZFP compression parameter from custom attributes(if such a parameter
+  // exists)
+  if (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
+    std::string e;
+    bool ret = tinyexr::FindZFPCompressionParam(
+      &zfp_compression_param, exr_header->custom_attributes,
+      exr_header->num_custom_attributes, &e);
 
-#ifdef __clang__
-#pragma clang diagnostic push
-#pragma clang diagnostic ignored "-Wsign-conversion"
+    if (!ret) {
+      // Use predefined compression parameter.
+      zfp_compression_param.type = 0;
+      zfp_compression_param.rate = 2;
+    }
+    compression_param = &zfp_compression_param;
+  }
 #endif
 
-// out_data must be allocated initially with the block-header size
-// of the current image(-part) type
-static bool EncodePixelData(/* out */ std::vector<unsigned char>& out_data,
-                            const unsigned char* const* images,
-                            int compression_type,
-                            int /*line_order*/,
-                            int width, // for tiled : tile.width
-                            int /*height*/, // for tiled : header.tile_size_y
-                            int x_stride, // for tiled : header.tile_size_x
-                            int line_no, // for tiled : 0
-                            int num_lines, // for tiled : tile.height
-                            size_t pixel_data_size,
-                            const std::vector<ChannelInfo>& channels,
-                            const std::vector<size_t>& channel_offset_list,
-                            std::string *err,
-                            const void* compression_param = 0) // zfp compression param
-{
-  size_t buf_size = static_cast<size_t>(width) *
-                  static_cast<size_t>(num_lines) *
-                  static_cast<size_t>(pixel_data_size);
-  //int last2bit = (buf_size & 3);
-  // buf_size must be multiple of four
-  //if(last2bit) buf_size += 4 - last2bit;
-  std::vector<unsigned char> buf(buf_size);
+  tinyexr_uint64 offset = chunk_offset;
+  tinyexr_uint64 doffset = is_multipart ? 4u : 0u;
 
-  size_t start_y = static_cast<size_t>(line_no);
-  for (size_t c = 0; c < channels.size(); c++) {
-    if (channels[c].pixel_type == TINYEXR_PIXELTYPE_HALF) {
-      if (channels[c].requested_pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
-        for (int y = 0; y < num_lines; y++) {
-          // Assume increasing Y
-          float *line_ptr = reinterpret_cast<float *>(&buf.at(
-            static_cast<size_t>(pixel_data_size * size_t(y) * size_t(width)) +
-            channel_offset_list[c] *
-            static_cast<size_t>(width)));
-          for (int x = 0; x < width; x++) {
-            tinyexr::FP16 h16;
-            h16.u = reinterpret_cast<const unsigned short * const *>(
-              images)[c][(y + start_y) * size_t(x_stride) + size_t(x)];
-
-            tinyexr::FP32 f32 = half_to_float(h16);
-
-            tinyexr::swap4(&f32.f);
-
-            // line_ptr[x] = f32.f;
-            tinyexr::cpy4(line_ptr + x, &(f32.f));
-          }
-        }
-      } else if (channels[c].requested_pixel_type == TINYEXR_PIXELTYPE_HALF) {
-        for (int y = 0; y < num_lines; y++) {
-          // Assume increasing Y
-          unsigned short *line_ptr = reinterpret_cast<unsigned short *>(
-            &buf.at(static_cast<size_t>(pixel_data_size * y *
-                                        width) +
-                    channel_offset_list[c] *
-                    static_cast<size_t>(width)));
-          for (int x = 0; x < width; x++) {
-            unsigned short val = reinterpret_cast<const unsigned short * const *>(
-              images)[c][(y + start_y) * x_stride + x];
-
-            tinyexr::swap2(&val);
-
-            // line_ptr[x] = val;
-            tinyexr::cpy2(line_ptr + x, &val);
-          }
+  if (exr_image->tiles) {
+    const EXRImage* level_image = exr_image;
+    size_t block_idx = 0;
+    //tinyexr::tinyexr_uint64 block_data_size = 0;
+    int num_levels = (exr_header->tile_level_mode != TINYEXR_TILE_RIPMAP_LEVELS) ?
+      offset_data.num_x_levels : (offset_data.num_x_levels * offset_data.num_y_levels);
+    for (int level_index = 0; level_index < num_levels; ++level_index) {
+      if (!level_image) {
+        if (err) {
+          (*err) += "Invalid number of tiled levels for EncodeChunk\n";
         }
-      } else {
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
+
+      int level_index_from_image = LevelIndex(level_image->level_x, level_image->level_y,
+                                    exr_header->tile_level_mode, offset_data.num_x_levels);
+      if (level_index_from_image < 0) {
         if (err) {
-          (*err) += "Invalid requested_pixel_type.\n";
+          (*err) += "Invalid tile level mode\n";
         }
-        return false;
+        return TINYEXR_ERROR_INVALID_DATA;
       }
 
-    } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
-      if (channels[c].requested_pixel_type == TINYEXR_PIXELTYPE_HALF) {
-        for (int y = 0; y < num_lines; y++) {
-          // Assume increasing Y
-          unsigned short *line_ptr = reinterpret_cast<unsigned short *>(
-            &buf.at(static_cast<size_t>(pixel_data_size * y *
-                                        width) +
-                    channel_offset_list[c] *
-                    static_cast<size_t>(width)));
-          for (int x = 0; x < width; x++) {
-            tinyexr::FP32 f32;
-            f32.f = reinterpret_cast<const float * const *>(
-              images)[c][(y + start_y) * x_stride + x];
-
-            tinyexr::FP16 h16;
-            h16 = float_to_half_full(f32);
-
-            tinyexr::swap2(reinterpret_cast<unsigned short *>(&h16.u));
-
-            // line_ptr[x] = h16.u;
-            tinyexr::cpy2(line_ptr + x, &(h16.u));
-          }
+      if (level_index_from_image != level_index) {
+        if (err) {
+          (*err) += "Incorrect level ordering in tiled image\n";
         }
-      } else if (channels[c].requested_pixel_type == TINYEXR_PIXELTYPE_FLOAT) {
-        for (int y = 0; y < num_lines; y++) {
-          // Assume increasing Y
-          float *line_ptr = reinterpret_cast<float *>(&buf.at(
-            static_cast<size_t>(pixel_data_size * y * width) +
-            channel_offset_list[c] *
-            static_cast<size_t>(width)));
-          for (int x = 0; x < width; x++) {
-            float val = reinterpret_cast<const float * const *>(
-              images)[c][(y + start_y) * x_stride + x];
-
-            tinyexr::swap4(&val);
-
-            // line_ptr[x] = val;
-            tinyexr::cpy4(line_ptr + x, &val);
-          }
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
+      int num_y_tiles = int(offset_data.offsets[level_index].size());
+      if (num_y_tiles <= 0) {
+        if (err) {
+          (*err) += "Invalid Y tile size\n";
         }
-      } else {
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
+
+      int num_x_tiles = int(offset_data.offsets[level_index][0].size());
+      if (num_x_tiles <= 0) {
         if (err) {
-          (*err) += "Invalid requested_pixel_type.\n";
+          (*err) += "Invalid X tile size\n";
         }
-        return false;
+        return TINYEXR_ERROR_INVALID_DATA;
       }
-    } else if (channels[c].pixel_type == TINYEXR_PIXELTYPE_UINT) {
-      for (int y = 0; y < num_lines; y++) {
-        // Assume increasing Y
-        unsigned int *line_ptr = reinterpret_cast<unsigned int *>(&buf.at(
-          static_cast<size_t>(pixel_data_size * y * width) +
-          channel_offset_list[c] * static_cast<size_t>(width)));
-        for (int x = 0; x < width; x++) {
-          unsigned int val = reinterpret_cast<const unsigned int * const *>(
-            images)[c][(y + start_y) * x_stride + x];
-
-          tinyexr::swap4(&val);
-
-          // line_ptr[x] = val;
-          tinyexr::cpy4(line_ptr + x, &val);
+
+      std::string e;
+      int ret = EncodeTiledLevel(level_image,
+                                  exr_header,
+                                  channels,
+                                  data_list,
+                                  block_idx,
+                                  num_x_tiles,
+                                  num_y_tiles,
+                                  channel_offset_list,
+                                  pixel_data_size,
+                                  compression_param,
+                                  parallel_options,
+                                  &e);
+      if (ret != TINYEXR_SUCCESS) {
+        if (!e.empty() && err) {
+          (*err) += e;
         }
+        return ret;
       }
+
+      for (size_t j = 0; j < static_cast<size_t>(num_y_tiles); ++j)
+        for (size_t i = 0; i < static_cast<size_t>(num_x_tiles); ++i) {
+          offset_data.offsets[level_index][j][i] = offset;
+          swap8(reinterpret_cast<tinyexr_uint64*>(&offset_data.offsets[level_index][j][i]));
+          offset += data_list[block_idx].size() + doffset;
+          //block_data_size += data_list[block_idx].size();
+          ++block_idx;
+        }
+      level_image = level_image->next_level;
     }
-  }
+    TINYEXR_CHECK_AND_RETURN_C(static_cast<int>(block_idx) == num_blocks, TINYEXR_ERROR_INVALID_DATA);
+    total_size = offset;
+  } else { // scanlines
+    std::vector<tinyexr::tinyexr_uint64>& offsets = offset_data.offsets[0][0];
 
-  if (compression_type == TINYEXR_COMPRESSIONTYPE_NONE) {
-    // 4 byte: scan line
-    // 4 byte: data size
-    // ~     : pixel data(uncompressed)
-    out_data.insert(out_data.end(), buf.begin(), buf.end());
+    std::vector<EXRFrameBufferSlice> slices(channels.size());
+    SetupSourceSlices(slices.data(),
+                      static_cast<const unsigned char* const*>(exr_image->images),
+                      channels, exr_image->width);
 
-  } else if ((compression_type == TINYEXR_COMPRESSIONTYPE_ZIPS) ||
-    (compression_type == TINYEXR_COMPRESSIONTYPE_ZIP)) {
-#if defined(TINYEXR_USE_MINIZ) && (TINYEXR_USE_MINIZ==1)
-    std::vector<unsigned char> block(mz_compressBound(
-      static_cast<unsigned long>(buf.size())));
-#elif TINYEXR_USE_STB_ZLIB
-    // there is no compressBound() function, so we use a value that
-    // is grossly overestimated, but should always work
-    std::vector<unsigned char> block(256 + 2 * buf.size());
-#elif defined(TINYEXR_USE_NANOZLIB) && (TINYEXR_USE_NANOZLIB == 1)
-    std::vector<unsigned char> block(nanoz_compressBound(
-      static_cast<unsigned long>(buf.size())));
+#if TINYEXR_HAS_CXX11
+    std::atomic<bool> invalid_data(false);
 #else
-    std::vector<unsigned char> block(
-      compressBound(static_cast<uLong>(buf.size())));
+    bool invalid_data(false);
 #endif
-    tinyexr::tinyexr_uint64 outSize = block.size();
-
-    if (!tinyexr::CompressZip(&block.at(0), outSize,
-                         reinterpret_cast<const unsigned char *>(&buf.at(0)),
-                         static_cast<unsigned long>(buf.size()))) {
-      if (err) {
-        (*err) += "Zip compresssion failed.\n";
-      }
-      return false;
-    }
-
-    // 4 byte: scan line
-    // 4 byte: data size
-    // ~     : pixel data(compressed)
-    unsigned int data_len = static_cast<unsigned int>(outSize);  // truncate
 
-    out_data.insert(out_data.end(), block.begin(), block.begin() + data_len);
-
-  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_RLE) {
-    // (buf.size() * 3) / 2 would be enough.
-    std::vector<unsigned char> block((buf.size() * 3) / 2);
+    ParallelFor(num_blocks, parallel_options, [&](int i) {
+      int start_y = num_scanlines * i;
+      int end_Y = (std::min)(num_scanlines * (i + 1), exr_image->height);
+      int num_lines = end_Y - start_y;
 
-    tinyexr::tinyexr_uint64 outSize = block.size();
+      data_list[i].resize(2*sizeof(int));
+      size_t data_header_size = data_list[i].size();
 
-    if (!tinyexr::CompressRle(&block.at(0), outSize,
-                         reinterpret_cast<const unsigned char *>(&buf.at(0)),
-                         static_cast<unsigned long>(buf.size()))) {
-      if (err) {
-        (*err) += "RLE compresssion failed.\n";
+      bool ret = EncodePixelData(data_list[i],
+                                 slices.data(),
+                                 exr_header->compression_type,
+                                 exr_image->width,
+                                 start_y,
+                                 num_lines,
+                                 pixel_data_size,
+                                 channels,
+                                 channel_offset_list,
+                                 err,
+                                 compression_param);
+      if (!ret) {
+        invalid_data = true;
+        return;
       }
-      return false;
-    }
-
-    // 4 byte: scan line
-    // 4 byte: data size
-    // ~     : pixel data(compressed)
-    unsigned int data_len = static_cast<unsigned int>(outSize);  // truncate
-    out_data.insert(out_data.end(), block.begin(), block.begin() + data_len);
+      if (data_list[i].size() <= data_header_size) {
+        invalid_data = true;
+        return;
+      }
+      int data_len = static_cast<int>(data_list[i].size() - data_header_size);
+      memcpy(&data_list[i][0], &start_y, sizeof(int));
+      memcpy(&data_list[i][4], &data_len, sizeof(int));
 
-  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
-#if TINYEXR_USE_PIZ
-    unsigned int bufLen =
-      8192 + static_cast<unsigned int>(
-        2 * static_cast<unsigned int>(
-          buf.size()));  // @fixme { compute good bound. }
-    std::vector<unsigned char> block(bufLen);
-    unsigned int outSize = static_cast<unsigned int>(block.size());
+      swap4(reinterpret_cast<int*>(&data_list[i][0]));
+      swap4(reinterpret_cast<int*>(&data_list[i][4]));
+    });
 
-    if (!CompressPiz(&block.at(0), &outSize,
-                reinterpret_cast<const unsigned char *>(&buf.at(0)),
-                buf.size(), channels, width, num_lines)) {
+    if (invalid_data) {
       if (err) {
-        (*err) += "PIZ compresssion failed.\n";
+        (*err) += "Failed to encode scanline data.\n";
       }
-      return false;
+      return TINYEXR_ERROR_INVALID_DATA;
     }
 
-    // 4 byte: scan line
-    // 4 byte: data size
-    // ~     : pixel data(compressed)
-    unsigned int data_len = outSize;
-    out_data.insert(out_data.end(), block.begin(), block.begin() + data_len);
-
-#else
-    if (err) {
-      (*err) += "PIZ compression is disabled in this build.\n";
+    for (size_t i = 0; i < static_cast<size_t>(num_blocks); i++) {
+      offsets[i] = offset;
+      tinyexr::swap8(reinterpret_cast<tinyexr::tinyexr_uint64 *>(&offsets[i]));
+      offset += data_list[i].size() + doffset;
     }
-    return false;
-#endif
-  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
-#if TINYEXR_USE_ZFP
-    const ZFPCompressionParam* zfp_compression_param = reinterpret_cast<const ZFPCompressionParam*>(compression_param);
-    std::vector<unsigned char> block;
-    unsigned int outSize;
 
-    tinyexr::CompressZfp(
-      &block, &outSize, reinterpret_cast<const float *>(&buf.at(0)),
-      width, num_lines, static_cast<int>(channels.size()), *zfp_compression_param);
+    total_size = static_cast<size_t>(offset);
+  }
+  return TINYEXR_SUCCESS;
+}
 
-    // 4 byte: scan line
-    // 4 byte: data size
-    // ~     : pixel data(compressed)
-    unsigned int data_len = outSize;
-    out_data.insert(out_data.end(), block.begin(), block.begin() + data_len);
+// Writes the magic number and the version field.
+static void WriteEXRVersion(std::vector<unsigned char>* memory, bool tiled,
+                            bool long_name, bool multipart) {
+  // Header
+  {
+    const char header[] = { 0x76, 0x2f, 0x31, 0x01 };
+    memory->insert(memory->end(), header, header + 4);
+  }
 
-#else
-    if (err) {
-      (*err) += "ZFP compression is disabled in this build.\n";
+  // Version
+  {
+    char marker[] = { 2, 0, 0, 0 };
+    /* @todo
+    if (exr_header->non_image) {
+    marker[1] |= 0x8;
     }
-    (void)compression_param;
-    return false;
-#endif
-  } else {
-    return false;
+    */
+    // tiled
+    if (tiled) {
+      marker[1] |= 0x2;
+    }
+    // long_name
+    if (long_name) {
+      marker[1] |= 0x4;
+    }
+    // multipart
+    if (multipart) {
+      marker[1] |= 0x10;
+    }
+    memory->insert(memory->end(), marker, marker + 4);
   }
-
-  return true;
 }
 
-static int EncodeTiledLevel(const EXRImage* level_image, const EXRHeader* exr_header,
-                            const std::vector<tinyexr::ChannelInfo>& channels,
-                            std::vector<std::vector<unsigned char> >& data_list,
-                            size_t start_index, // for data_list
-                            int num_x_tiles, int num_y_tiles,
-                            const std::vector<size_t>& channel_offset_list,
-                            int pixel_data_size,
-                            const void* compression_param, // must be set if zfp compression is enabled
-                            std::string* err) {
-  int num_tiles = num_x_tiles * num_y_tiles;
-  if (num_tiles != level_image->num_tiles) {
-    if (err) {
-      (*err) += "Invalid number of tiles in argument.\n";
+// Writes the attributes of a part(including the end of header) and returns
+// the channel list of the part to `channels`.
+// `partnames` is used to check the uniqueness of the part name and must be
+// non-NULL for multi-part file.
+static bool WriteEXRPartHeader(std::vector<unsigned char>* memory,
+                               const EXRHeader* exr_header,
+                               int width, int height,
+                               int display_width, int display_height,
+                               bool tiled, int chunk_count,
+                               std::set<std::string>* partnames,
+                               std::vector<ChannelInfo>* channels,
+                               std::string* err) {
+  //channels
+  {
+    std::vector<unsigned char> data;
+
+    channels->clear();
+    for (int c = 0; c < exr_header->num_channels; c++) {
+      tinyexr::ChannelInfo info;
+      info.p_linear = 0;
+      info.pixel_type = exr_header->pixel_types[c];
+      info.requested_pixel_type = exr_header->requested_pixel_types[c];
+      info.x_sampling = 1;
+      info.y_sampling = 1;
+      info.name = std::string(exr_header->channels[c].name);
+      channels->push_back(info);
     }
-    return TINYEXR_ERROR_INVALID_ARGUMENT;
-  }
 
-  if ((exr_header->tile_size_x > level_image->width || exr_header->tile_size_y > level_image->height) &&
-      level_image->level_x == 0 && level_image->level_y == 0) {
-      if (err) {
-        (*err) += "Failed to encode tile data.\n";
-      }
-      return TINYEXR_ERROR_INVALID_DATA;
+    tinyexr::WriteChannelInfo(data, *channels);
+
+    tinyexr::WriteAttributeToMemory(memory, "channels", "chlist", &data.at(0),
+                                    static_cast<int>(data.size()));
   }
 
+  {
+    int comp = exr_header->compression_type;
+    swap4(&comp);
+    WriteAttributeToMemory(
+      memory, "compression", "compression",
+      reinterpret_cast<const unsigned char*>(&comp), 1);
+  }
 
-#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
-  std::atomic<bool> invalid_data(false);
-#else
-  bool invalid_data(false);
-#endif
+  {
+    int data[4] = { 0, 0, width - 1, height - 1 };
+    swap4(&data[0]);
+    swap4(&data[1]);
+    swap4(&data[2]);
+    swap4(&data[3]);
+    WriteAttributeToMemory(
+      memory, "dataWindow", "box2i",
+      reinterpret_cast<const unsigned char*>(data), sizeof(int) * 4);
+
+    int data0[4] = { 0, 0, display_width - 1, display_height - 1 };
+    swap4(&data0[0]);
+    swap4(&data0[1]);
+    swap4(&data0[2]);
+    swap4(&data0[3]);
+    // Note: must be the same across parts (currently, using value from the first header)
+    WriteAttributeToMemory(
+      memory, "displayWindow", "box2i",
+      reinterpret_cast<const unsigned char*>(data0), sizeof(int) * 4);
+  }
 
-#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
-  std::vector<std::thread> workers;
-  std::atomic<int> tile_count(0);
+  {
+    unsigned char line_order = 0;  // @fixme { read line_order from EXRHeader }
+    WriteAttributeToMemory(memory, "lineOrder", "lineOrder",
+                           &line_order, 1);
+  }
 
-  int num_threads = std::max(1, int(std::thread::hardware_concurrency()));
-  if (num_threads > int(num_tiles)) {
-    num_threads = int(num_tiles);
+  {
+    // Note: must be the same across parts
+    float aspectRatio = 1.0f;
+    swap4(&aspectRatio);
+    WriteAttributeToMemory(
+      memory, "pixelAspectRatio", "float",
+      reinterpret_cast<const unsigned char*>(&aspectRatio), sizeof(float));
   }
 
-  for (int t = 0; t < num_threads; t++) {
-    workers.emplace_back(std::thread([&]() {
-      int i = 0;
-      while ((i = tile_count++) < num_tiles) {
+  {
+    float center[2] = { 0.0f, 0.0f };
+    swap4(&center[0]);
+    swap4(&center[1]);
+    WriteAttributeToMemory(
+      memory, "screenWindowCenter", "v2f",
+      reinterpret_cast<const unsigned char*>(center), 2 * sizeof(float));
+  }
 
+  {
+    float w = 1.0f;
+    swap4(&w);
+    WriteAttributeToMemory(memory, "screenWindowWidth", "float",
+                           reinterpret_cast<const unsigned char*>(&w),
+                           sizeof(float));
+  }
+
+  if (tiled) {
+    unsigned char tile_mode = static_cast<unsigned char>(exr_header->tile_level_mode & 0x3);
+    if (exr_header->tile_rounding_mode) tile_mode |= (1u << 4u);
+    //unsigned char data[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    unsigned int datai[3] = { 0, 0, 0 };
+    unsigned char* data = reinterpret_cast<unsigned char*>(&datai[0]);
+    datai[0] = static_cast<unsigned int>(exr_header->tile_size_x);
+    datai[1] = static_cast<unsigned int>(exr_header->tile_size_y);
+    data[8] = tile_mode;
+    swap4(reinterpret_cast<unsigned int*>(&data[0]));
+    swap4(reinterpret_cast<unsigned int*>(&data[4]));
+    WriteAttributeToMemory(
+      memory, "tiles", "tiledesc",
+      reinterpret_cast<const unsigned char*>(data), 9);
+  }
+
+  // must be present for multi-part files - according to spec.
+  if (partnames) {
+    // name
+    {
+      size_t len = 0;
+      if ((len = strlen(exr_header->name)) > 0) {
+        size_t num_names = partnames->size();
+#if TINYEXR_HAS_CXX11
+        partnames->emplace(exr_header->name);
 #else
-  // Use signed int since some OpenMP compiler doesn't allow unsigned type for
-  // `parallel for`
-#if TINYEXR_USE_OPENMP
-#pragma omp parallel for
+        partnames->insert(std::string(exr_header->name));
 #endif
-  for (int i = 0; i < num_tiles; i++) {
+        if (partnames->size() != num_names + 1) {
+          if (err) {
+            (*err) += "'name' attributes must be unique for a multi-part file";
+          }
+          return false;
+        }
+        WriteAttributeToMemory(
+          memory, "name", "string",
+          reinterpret_cast<const unsigned char*>(exr_header->name),
+          static_cast<int>(len));
+      } else {
+        if (err) {
+          (*err) += "Invalid 'name' attribute for a multi-part file";
+        }
+        return false;
+      }
+    }
+    // type
+    {
+      const char* type = "scanlineimage";
+      if (tiled) type = "tiledimage";
+      WriteAttributeToMemory(
+        memory, "type", "string",
+        reinterpret_cast<const unsigned char*>(type),
+        static_cast<int>(strlen(type)));
+    }
+    // chunkCount
+    {
+      WriteAttributeToMemory(
+        memory, "chunkCount", "int",
+        reinterpret_cast<const unsigned char*>(&chunk_count),
+        4);
+    }
+  }
 
-#endif
-    size_t tile_idx = static_cast<size_t>(i);
-    size_t data_idx = tile_idx + start_index;
+  // Custom attributes
+  if (exr_header->num_custom_attributes > 0) {
+    for (int j = 0; j < exr_header->num_custom_attributes; j++) {
+      tinyexr::WriteAttributeToMemory(
+        memory, exr_header->custom_attributes[j].name,
+        exr_header->custom_attributes[j].type,
+        reinterpret_cast<const unsigned char*>(
+          exr_header->custom_attributes[j].value),
+        exr_header->custom_attributes[j].size);
+    }
+  }
 
-    int x_tile = i % num_x_tiles;
-    int y_tile = i / num_x_tiles;
+  {  // end of header
+    memory->push_back(0);
+  }
 
-    EXRTile& tile = level_image->tiles[tile_idx];
+  return true;
+}
 
-    const unsigned char* const* images =
-      static_cast<const unsigned char* const*>(tile.images);
+// Destination of `SaveEXRNPartImage`: a malloc'ed memory block which grows
+// as needed, or a file.
+struct OutputStream {
+  unsigned char *memory;
+  size_t capacity;
+  FILE *fp;     // Writes to the file if not NULL
+  size_t size;  // Number of bytes written
 
-    data_list[data_idx].resize(5*sizeof(int));
-    size_t data_header_size = data_list[data_idx].size();
-    bool ret = EncodePixelData(data_list[data_idx],
-                               images,
-                               exr_header->compression_type,
-                               0, // increasing y
-                               tile.width,
-                               exr_header->tile_size_y,
-                               exr_header->tile_size_x,
-                               0,
-                               tile.height,
-                               pixel_data_size,
-                               channels,
-                               channel_offset_list,
-                               err, compression_param);
-    if (!ret) {
-      invalid_data = true;
-      continue;
+  OutputStream() : memory(NULL), capacity(0), fp(NULL), size(0) {}
+
+  // Makes room for `n` bytes in total(no-op for file output).
+  bool Reserve(size_t n) {
+    if (fp || (n <= capacity)) {
+      return true;
     }
-    if (data_list[data_idx].size() <= data_header_size) {
-      invalid_data = true;
-      continue;
+    unsigned char *p = static_cast<unsigned char *>(realloc(memory, n));
+    if (!p) {
+      return false;
     }
-
-    int data_len = static_cast<int>(data_list[data_idx].size() - data_header_size);
-    //tileX, tileY, levelX, levelY // pixel_data_size(int)
-    memcpy(&data_list[data_idx][0], &x_tile, sizeof(int));
-    memcpy(&data_list[data_idx][4], &y_tile, sizeof(int));
-    memcpy(&data_list[data_idx][8], &level_image->level_x, sizeof(int));
-    memcpy(&data_list[data_idx][12], &level_image->level_y, sizeof(int));
-    memcpy(&data_list[data_idx][16], &data_len, sizeof(int));
-
-    swap4(reinterpret_cast<int*>(&data_list[data_idx][0]));
-    swap4(reinterpret_cast<int*>(&data_list[data_idx][4]));
-    swap4(reinterpret_cast<int*>(&data_list[data_idx][8]));
-    swap4(reinterpret_cast<int*>(&data_list[data_idx][12]));
-    swap4(reinterpret_cast<int*>(&data_list[data_idx][16]));
-
-#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
+    memory = p;
+    capacity = n;
+    return true;
   }
-}));
-    }
 
-    for (auto &t : workers) {
-      t.join();
+  bool Write(const void *data, size_t n) {
+    if (n == 0) {
+      return true;
     }
-#else
-    }  // omp parallel
-#endif
+    if (fp) {
+      if (fwrite(data, 1, n, fp) != n) {
+        return false;
+      }
+    } else {
+      if ((size + n > capacity) &&
+          !Reserve((std::max)(size + n, capacity * 2))) {
+        return false;
+      }
+      memcpy(memory + size, data, n);
+    }
+    size += n;
+    return true;
+  }
 
-  if (invalid_data) {
-    if (err) {
-      (*err) += "Failed to encode tile data.\n";
+  // Overwrites bytes already written at `pos`. `pos` is in the header, so
+  // `long` is enough for fseek.
+  bool Rewrite(size_t pos, const void *data, size_t n) {
+    if ((n == 0) || (pos + n > size)) {
+      return n == 0;
     }
-    return TINYEXR_ERROR_INVALID_DATA;
+    if (fp) {
+      return (fseek(fp, static_cast<long>(pos), SEEK_SET) == 0) &&
+             (fwrite(data, 1, n, fp) == n) &&
+             (fseek(fp, 0, SEEK_END) == 0);
+    }
+    memcpy(memory + pos, data, n);
+    return true;
   }
-  return TINYEXR_SUCCESS;
-}
 
-static int NumScanlines(int compression_type) {
-  int num_scanlines = 1;
-  if (compression_type == TINYEXR_COMPRESSIONTYPE_ZIP) {
-    num_scanlines = 16;
-  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
-    num_scanlines = 32;
-  } else if (compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
-    num_scanlines = 16;
+  // Gives up the ownership of the memory block(trimmed to `size`).
+  unsigned char *Release() {
+    unsigned char *p = memory;
+    if (p && (size < capacity)) {
+      unsigned char *q = static_cast<unsigned char *>(realloc(p, size));
+      if (q) {
+        p = q;
+      }
+    }
+    memory = NULL;
+    capacity = 0;
+    return p;
   }
-  return num_scanlines;
-}
+};
 
-static int EncodeChunk(const EXRImage* exr_image, const EXRHeader* exr_header,
-                       const std::vector<ChannelInfo>& channels,
-                       int num_blocks,
-                       tinyexr_uint64 chunk_offset, // starting offset of current chunk
-                       bool is_multipart,
-                       OffsetData& offset_data, // output block offsets, must be initialized
-                       std::vector<std::vector<unsigned char> >& data_list, // output
-                       tinyexr_uint64& total_size, // output: ending offset of current chunk
-                       std::string* err) {
-  int num_scanlines = NumScanlines(exr_header->compression_type);
+// can save a single or multi-part image (no deep* formats)
+static int SaveEXRNPartImage(const EXRImage* exr_images,
+                             const EXRHeader** exr_headers,
+                             unsigned int num_parts,
+                             OutputStream* out,
+                             const EXRParallelOptions* parallel_options,
+                             const char** err) {
+  if (exr_images == NULL || exr_headers == NULL || num_parts == 0) {
+    SetErrorMessage("Invalid argument for SaveEXRNPartImageToMemory",
+                    err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+  {
+    for (unsigned int i = 0; i < num_parts; ++i) {
+      if (exr_headers[i]->compression_type < 0) {
+        SetErrorMessage("Invalid argument for SaveEXRNPartImageToMemory",
+                        err);
+        return TINYEXR_ERROR_INVALID_ARGUMENT;
+      }
+      if (FindCodec(exr_headers[i]->compression_type)) {
+        continue;
+      }
+#if !TINYEXR_USE_PIZ
+      if (exr_headers[i]->compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
+        SetErrorMessage("PIZ compression is not supported in this build",
+                        err);
+        return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
+      }
+#endif
+      if (exr_headers[i]->compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
+#if !TINYEXR_USE_ZFP
+        SetErrorMessage("ZFP compression is not supported in this build",
+                        err);
+        return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
+#else
+        // All channels must be fp32.
+        // No fp16 support in ZFP atm(as of 2023 June)
+        // https://github.com/LLNL/fpzip/issues/2
+        for (int c = 0; c < exr_headers[i]->num_channels; ++c) {
+          if (exr_headers[i]->requested_pixel_types[c] != TINYEXR_PIXELTYPE_FLOAT) {
+            SetErrorMessage("Pixel type must be FLOAT for ZFP compression",
+                            err);
+            return TINYEXR_ERROR_INVALID_ARGUMENT;
+          }
+        }
+#endif
+      }
+    }
+  }
 
-  data_list.resize(num_blocks);
+  std::vector<unsigned char> memory;
 
-  std::vector<size_t> channel_offset_list(
-    static_cast<size_t>(exr_header->num_channels));
+  // using value from the first header
+  tinyexr::WriteEXRVersion(&memory, num_parts == 1 && exr_images[0].tiles,
+                           exr_headers[0]->long_name != 0, num_parts > 1);
 
-  int pixel_data_size = 0;
-  {
-    size_t channel_offset = 0;
-    for (size_t c = 0; c < static_cast<size_t>(exr_header->num_channels); c++) {
-      channel_offset_list[c] = channel_offset;
-      if (channels[c].requested_pixel_type == TINYEXR_PIXELTYPE_HALF) {
-        pixel_data_size += sizeof(unsigned short);
-        channel_offset += sizeof(unsigned short);
-      } else if (channels[c].requested_pixel_type ==
-                 TINYEXR_PIXELTYPE_FLOAT) {
-        pixel_data_size += sizeof(float);
-        channel_offset += sizeof(float);
-      } else if (channels[c].requested_pixel_type == TINYEXR_PIXELTYPE_UINT) {
-        pixel_data_size += sizeof(unsigned int);
-        channel_offset += sizeof(unsigned int);
-      } else {
-        if (err) {
-          (*err) += "Invalid requested_pixel_type.\n";
+  int total_chunk_count = 0;
+  std::vector<int> chunk_count(num_parts);
+  std::vector<OffsetData> offset_data(num_parts);
+  for (unsigned int i = 0; i < num_parts; ++i) {
+    if (!exr_images[i].tiles) {
+      int num_scanlines = NumScanlines(exr_headers[i]->compression_type);
+      chunk_count[i] =
+        (exr_images[i].height + num_scanlines - 1) / num_scanlines;
+      InitSingleResolutionOffsets(offset_data[i], chunk_count[i]);
+      total_chunk_count += chunk_count[i];
+    } else {
+      {
+        std::vector<int> num_x_tiles, num_y_tiles;
+        if (!PrecalculateTileInfo(num_x_tiles, num_y_tiles, exr_headers[i])) {
+          SetErrorMessage("Failed to precalculate Tile info",
+                          err);
+          return TINYEXR_ERROR_INVALID_DATA;
         }
-        return TINYEXR_ERROR_INVALID_DATA;
+        int ntiles = InitTileOffsets(offset_data[i], exr_headers[i], num_x_tiles, num_y_tiles);
+        if (ntiles > 0) {
+          chunk_count[i] = ntiles;
+        } else {
+          SetErrorMessage("Failed to compute Tile offsets",
+                          err);
+          return TINYEXR_ERROR_INVALID_DATA;
+          
+        }
+        total_chunk_count += chunk_count[i];
+      }
+    }
+  }
+  // Write attributes to memory buffer.
+  std::vector< std::vector<tinyexr::ChannelInfo> > channels(num_parts);
+  {
+    std::set<std::string> partnames;
+    for (unsigned int i = 0; i < num_parts; ++i) {
+      std::string e;
+      if (!WriteEXRPartHeader(&memory, exr_headers[i],
+                              exr_images[i].width, exr_images[i].height,
+                              exr_images[0].width, exr_images[0].height,
+                              exr_images[i].tiles != NULL, chunk_count[i],
+                              (num_parts > 1) ? &partnames : NULL,
+                              &channels[i], &e)) {
+        SetErrorMessage(e, err);
+        return TINYEXR_ERROR_INVALID_ARGUMENT;
       }
     }
   }
+  if (num_parts > 1) {
+    // end of header list
+    memory.push_back(0);
+  }
 
-  const void* compression_param = 0;
-#if TINYEXR_USE_ZFP
-  tinyexr::ZFPCompressionParam zfp_compression_param;
+  if (!out->Write(memory.data(), memory.size())) {
+    SetErrorMessage("Cannot write a file", err);
+    return TINYEXR_ERROR_CANT_WRITE_FILE;
+  }
 
-  // Use ZFP compression parameter from custom attributes(if such a parameter
-  // exists)
+  // Reserve the offset tables. They are written after all chunks are
+  // encoded.
+  const size_t offset_table_pos = out->size;
   {
-    std::string e;
-    bool ret = tinyexr::FindZFPCompressionParam(
-      &zfp_compression_param, exr_header->custom_attributes,
-      exr_header->num_custom_attributes, &e);
-
-    if (!ret) {
-      // Use predefined compression parameter.
-      zfp_compression_param.type = 0;
-      zfp_compression_param.rate = 2;
+    std::vector<unsigned char> zeros(
+        size_t(total_chunk_count) * sizeof(tinyexr_uint64), 0);
+    if (!out->Write(zeros.data(), zeros.size())) {
+      SetErrorMessage("Cannot write a file", err);
+      return TINYEXR_ERROR_CANT_WRITE_FILE;
     }
-    compression_param = &zfp_compression_param;
   }
-#endif
 
-  tinyexr_uint64 offset = chunk_offset;
-  tinyexr_uint64 doffset = is_multipart ? 4u : 0u;
-
-  if (exr_image->tiles) {
-    const EXRImage* level_image = exr_image;
-    size_t block_idx = 0;
-    //tinyexr::tinyexr_uint64 block_data_size = 0;
-    int num_levels = (exr_header->tile_level_mode != TINYEXR_TILE_RIPMAP_LEVELS) ?
-      offset_data.num_x_levels : (offset_data.num_x_levels * offset_data.num_y_levels);
-    for (int level_index = 0; level_index < num_levels; ++level_index) {
-      if (!level_image) {
-        if (err) {
-          (*err) += "Invalid number of tiled levels for EncodeChunk\n";
-        }
-        return TINYEXR_ERROR_INVALID_DATA;
+  // Encode and write the chunks part by part, so that only compressed
+  // chunks of a part are held in memory. Each chunk is freed as soon as it
+  // is written.
+  for (unsigned int i = 0; i < num_parts; ++i) {
+    tinyexr_uint64 chunk_offset = out->size;
+    tinyexr_uint64 total_size = 0;
+    std::vector<std::vector<unsigned char> > data_list;
+    std::string e;
+    int ret = EncodeChunk(&exr_images[i], exr_headers[i],
+                          channels[i],
+                          chunk_count[i],
+                          // starting offset of current chunk after part-number
+                          chunk_offset,
+                          num_parts > 1,
+                          offset_data[i], // output: block offsets, must be initialized
+                          data_list, // output
+                          total_size, // output
+                          parallel_options,
+                          &e);
+    if (ret != TINYEXR_SUCCESS) {
+      if (!e.empty()) {
+        tinyexr::SetErrorMessage(e, err);
       }
+      return ret;
+    }
 
-      int level_index_from_image = LevelIndex(level_image->level_x, level_image->level_y,
-                                    exr_header->tile_level_mode, offset_data.num_x_levels);
-      if (level_index_from_image < 0) {
-        if (err) {
-          (*err) += "Invalid tile level mode\n";
-        }
-        return TINYEXR_ERROR_INVALID_DATA;
-      }
+    if (!out->Reserve(size_t(total_size))) {
+      tinyexr::SetErrorMessage("Cannot allocate memory for the output", err);
+      return TINYEXR_ERROR_SERIALIZATION_FAILED;
+    }
 
-      if (level_index_from_image != level_index) {
-        if (err) {
-          (*err) += "Incorrect level ordering in tiled image\n";
+    for (size_t j = 0; j < data_list.size(); ++j) {
+      if (num_parts > 1) {
+        unsigned int part_number = i;
+        swap4(&part_number);
+        if (!out->Write(&part_number, 4)) {
+          SetErrorMessage("Cannot write a file", err);
+          return TINYEXR_ERROR_CANT_WRITE_FILE;
         }
-        return TINYEXR_ERROR_INVALID_DATA;
       }
-      int num_y_tiles = int(offset_data.offsets[level_index].size());
-      if (num_y_tiles <= 0) {
-        if (err) {
-          (*err) += "Invalid Y tile size\n";
-        }
-        return TINYEXR_ERROR_INVALID_DATA;
+      if (!out->Write(data_list[j].data(), data_list[j].size())) {
+        SetErrorMessage("Cannot write a file", err);
+        return TINYEXR_ERROR_CANT_WRITE_FILE;
       }
+      std::vector<unsigned char>().swap(data_list[j]);
+    }
 
-      int num_x_tiles = int(offset_data.offsets[level_index][0].size());
-      if (num_x_tiles <= 0) {
-        if (err) {
-          (*err) += "Invalid X tile size\n";
-        }
-        return TINYEXR_ERROR_INVALID_DATA;
-      }
+    if (out->size != total_size) {
+      tinyexr::SetErrorMessage("Corrupted Part image chunk data.", err);
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+  }
 
-      std::string e;
-      int ret = EncodeTiledLevel(level_image,
-                                  exr_header,
-                                  channels,
-                                  data_list,
-                                  block_idx,
-                                  num_x_tiles,
-                                  num_y_tiles,
-                                  channel_offset_list,
-                                  pixel_data_size,
-                                  compression_param,
-                                  &e);
-      if (ret != TINYEXR_SUCCESS) {
-        if (!e.empty() && err) {
-          (*err) += e;
-        }
-        return ret;
+  // Writing offset data for chunks
+  std::vector<tinyexr_uint64> offset_table;
+  offset_table.reserve(size_t(total_chunk_count));
+  for (unsigned int i = 0; i < num_parts; ++i) {
+    for (size_t l = 0; l < offset_data[i].offsets.size(); ++l) {
+      for (size_t j = 0; j < offset_data[i].offsets[l].size(); ++j) {
+        offset_table.insert(offset_table.end(),
+                            offset_data[i].offsets[l][j].begin(),
+                            offset_data[i].offsets[l][j].end());
       }
-
-      for (size_t j = 0; j < static_cast<size_t>(num_y_tiles); ++j)
-        for (size_t i = 0; i < static_cast<size_t>(num_x_tiles); ++i) {
-          offset_data.offsets[level_index][j][i] = offset;
-          swap8(reinterpret_cast<tinyexr_uint64*>(&offset_data.offsets[level_index][j][i]));
-          offset += data_list[block_idx].size() + doffset;
-          //block_data_size += data_list[block_idx].size();
-          ++block_idx;
-        }
-      level_image = level_image->next_level;
     }
-    TINYEXR_CHECK_AND_RETURN_C(static_cast<int>(block_idx) == num_blocks, TINYEXR_ERROR_INVALID_DATA);
-    total_size = offset;
-  } else { // scanlines
-    std::vector<tinyexr::tinyexr_uint64>& offsets = offset_data.offsets[0][0];
+  }
+  if (offset_table.size() != size_t(total_chunk_count)) {
+    tinyexr::SetErrorMessage("Invalid offset bytes in Part image.", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+  if (!out->Rewrite(offset_table_pos, offset_table.data(),
+                    offset_table.size() * sizeof(tinyexr_uint64))) {
+    SetErrorMessage("Cannot write a file", err);
+    return TINYEXR_ERROR_CANT_WRITE_FILE;
+  }
 
-#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
-    std::atomic<bool> invalid_data(false);
-    std::vector<std::thread> workers;
-    std::atomic<int> block_count(0);
+  return TINYEXR_SUCCESS;
+}
+
+static size_t SaveEXRNPartImageToMemory(const EXRImage* exr_images,
+                                        const EXRHeader** exr_headers,
+                                        unsigned int num_parts,
+                                        unsigned char** memory_out,
+                                        const EXRParallelOptions* parallel_options,
+                                        const char** err) {
+  if (memory_out == NULL) {
+    SetErrorMessage("Invalid argument for SaveEXRNPartImageToMemory",
+                    err);
+    return 0;
+  }
 
-    int num_threads = std::min(std::max(1, int(std::thread::hardware_concurrency())), num_blocks);
+  OutputStream out;
+  if (SaveEXRNPartImage(exr_images, exr_headers, num_parts, &out,
+                        parallel_options, err) != TINYEXR_SUCCESS) {
+    free(out.memory);
+    return 0;
+  }
 
-    for (int t = 0; t < num_threads; t++) {
-      workers.emplace_back(std::thread([&]() {
-        int i = 0;
-        while ((i = block_count++) < num_blocks) {
+  (*memory_out) = out.Release();
+  return out.size;  // OK
+}
 
+// Opens `filename` for writing. Returns NULL on failure.
+static FILE *OpenFileForWriting(const char *filename) {
+  FILE *fp = NULL;
+#ifdef _WIN32
+#if defined(_MSC_VER) || (defined(MINGW_HAS_SECURE_API) && MINGW_HAS_SECURE_API) // MSVC, MinGW GCC, or Clang
+  errno_t errcode = _wfopen_s(&fp, UTF8ToWchar(filename).c_str(), L"wb");
+  if (errcode != 0) {
+    return NULL;
+  }
 #else
-    bool invalid_data(false);
-#if TINYEXR_USE_OPENMP
-#pragma omp parallel for
+  // Unknown compiler or MinGW without MINGW_HAS_SECURE_API.
+  fp = fopen(filename, "wb");
+#endif
+#else
+  fp = fopen(filename, "wb");
 #endif
-    for (int i = 0; i < num_blocks; i++) {
+  return fp;
+}
+
+// Encodes the image and writes it to a file directly, without assembling
+// the whole file in memory.
+static int SaveEXRNPartImageToFile(const EXRImage* exr_images,
+                                   const EXRHeader** exr_headers,
+                                   unsigned int num_parts,
+                                   const char* filename,
+                                   const EXRParallelOptions* parallel_options,
+                                   const char** err) {
+  OutputStream out;
+  out.fp = OpenFileForWriting(filename);
+  if (!out.fp) {
+    SetErrorMessage("Cannot write a file: " + std::string(filename), err);
+    return TINYEXR_ERROR_CANT_WRITE_FILE;
+  }
+
+  int ret = SaveEXRNPartImage(exr_images, exr_headers, num_parts, &out,
+                              parallel_options, err);
+  if ((ret != TINYEXR_SUCCESS) && (ret != TINYEXR_ERROR_CANT_WRITE_FILE)) {
+    ret = TINYEXR_ERROR_SERIALIZATION_FAILED;
+  }
 
+  if ((fclose(out.fp) != 0) && (ret == TINYEXR_SUCCESS)) {
+    SetErrorMessage("Cannot write a file", err);
+    ret = TINYEXR_ERROR_CANT_WRITE_FILE;
+  }
+
+  return ret;
+}
+
+#ifdef __clang__
+#pragma clang diagnostic pop
 #endif
-      int start_y = num_scanlines * i;
-      int end_Y = (std::min)(num_scanlines * (i + 1), exr_image->height);
-      int num_lines = end_Y - start_y;
 
-      const unsigned char* const* images =
-        static_cast<const unsigned char* const*>(exr_image->images);
+} // tinyexr
 
-      data_list[i].resize(2*sizeof(int));
-      size_t data_header_size = data_list[i].size();
+size_t SaveEXRImageToMemory(const EXRImage* exr_image,
+                             const EXRHeader* exr_header,
+                             unsigned char** memory_out, const char** err) {
+  return tinyexr::SaveEXRNPartImageToMemory(exr_image, &exr_header, 1, memory_out, NULL, err);
+}
 
-      bool ret = EncodePixelData(data_list[i],
-                                 images,
-                                 exr_header->compression_type,
-                                 0, // increasing y
-                                 exr_image->width,
-                                 exr_image->height,
-                                 exr_image->width,
-                                 start_y,
-                                 num_lines,
-                                 pixel_data_size,
-                                 channels,
-                                 channel_offset_list,
-                                 err,
-                                 compression_param);
-      if (!ret) {
-        invalid_data = true;
-        continue; // "break" cannot be used with OpenMP
-      }
-      if (data_list[i].size() <= data_header_size) {
-        invalid_data = true;
-        continue; // "break" cannot be used with OpenMP
-      }
-      int data_len = static_cast<int>(data_list[i].size() - data_header_size);
-      memcpy(&data_list[i][0], &start_y, sizeof(int));
-      memcpy(&data_list[i][4], &data_len, sizeof(int));
+size_t SaveEXRImageToMemoryWithOptions(const EXRImage* exr_image,
+                                       const EXRHeader* exr_header,
+                                       unsigned char** memory_out,
+                                       const EXRParallelOptions* options,
+                                       const char** err) {
+  return tinyexr::SaveEXRNPartImageToMemory(exr_image, &exr_header, 1, memory_out, options, err);
+}
+
+int SaveEXRImageToFile(const EXRImage *exr_image, const EXRHeader *exr_header,
+                       const char *filename, const char **err) {
+  return SaveEXRImageToFileWithOptions(exr_image, exr_header, filename, NULL,
+                                       err);
+}
 
-      swap4(reinterpret_cast<int*>(&data_list[i][0]));
-      swap4(reinterpret_cast<int*>(&data_list[i][4]));
-#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
-        }
-                                       }));
-    }
+int SaveEXRImageToFileWithOptions(const EXRImage *exr_image,
+                                  const EXRHeader *exr_header,
+                                  const char *filename,
+                                  const EXRParallelOptions *options,
+                                  const char **err) {
+  if (exr_image == NULL || filename == NULL ||
+      exr_header->compression_type < 0) {
+    tinyexr::SetErrorMessage("Invalid argument for SaveEXRImageToFile", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
-    for (auto &t : workers) {
-      t.join();
-    }
-#else
-    }  // omp parallel
+#if !TINYEXR_USE_PIZ
+  if ((exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) &&
+      !tinyexr::FindCodec(exr_header->compression_type)) {
+    tinyexr::SetErrorMessage("PIZ compression is not supported in this build",
+                             err);
+    return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
+  }
 #endif
 
-    if (invalid_data) {
-      if (err) {
-        (*err) += "Failed to encode scanline data.\n";
-      }
-      return TINYEXR_ERROR_INVALID_DATA;
+#if !TINYEXR_USE_ZFP
+  if ((exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) &&
+      !tinyexr::FindCodec(exr_header->compression_type)) {
+    tinyexr::SetErrorMessage("ZFP compression is not supported in this build",
+                             err);
+    return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
+  }
+#endif
+
+  return tinyexr::SaveEXRNPartImageToFile(exr_image, &exr_header, 1, filename,
+                                          options, err);
+}
+
+struct TEXRScanlineWriter {
+  TEXRScanlineWriter()
+      : fp(NULL), width(0), height(0), compression_type(0), num_scanlines(1),
+        next_y(0), failed(false), pixel_data_size(0), offset_table_pos(0),
+        file_pos(0), options(NULL), zip_compression_level(0),
+        compression_param(NULL) {}
+  ~TEXRScanlineWriter() {
+    if (fp) {
+      fclose(fp);
     }
+  }
 
-    for (size_t i = 0; i < static_cast<size_t>(num_blocks); i++) {
-      offsets[i] = offset;
-      tinyexr::swap8(reinterpret_cast<tinyexr::tinyexr_uint64 *>(&offsets[i]));
-      offset += data_list[i].size() + doffset;
+  // Writes a chunk(`chunk` has room for the chunk header) of the scanline
+  // block starting at `chunk_y`.
+  bool WriteChunk(int chunk_y, std::vector<unsigned char> *chunk) {
+    int data_len = static_cast<int>(chunk->size() - 2 * sizeof(int));
+    memcpy(&chunk->at(0), &chunk_y, sizeof(int));
+    memcpy(&chunk->at(4), &data_len, sizeof(int));
+    tinyexr::swap4(reinterpret_cast<int *>(&chunk->at(0)));
+    tinyexr::swap4(reinterpret_cast<int *>(&chunk->at(4)));
+
+    offsets[static_cast<size_t>(chunk_y / num_scanlines)] = file_pos;
+    if (fwrite(&chunk->at(0), 1, chunk->size(), fp) != chunk->size()) {
+      return false;
     }
+    file_pos += chunk->size();
+    return true;
+  }
 
-    total_size = static_cast<size_t>(offset);
+  FILE *fp;
+  int width;
+  int height;
+  int compression_type;
+  int num_scanlines;  // scanlines per chunk
+  int next_y;         // first scanline not written yet
+  bool failed;
+  size_t pixel_data_size;
+  std::vector<tinyexr::ChannelInfo> channels;
+  std::vector<size_t> channel_offset_list;
+  std::vector<tinyexr::tinyexr_uint64> offsets;
+  tinyexr::tinyexr_uint64 offset_table_pos;
+  tinyexr::tinyexr_uint64 file_pos;
+
+  // Uncompressed scanlines of the chunk not completed yet.
+  std::vector<unsigned char> pending;
+  std::vector<std::vector<unsigned char> > chunks;
+  tinyexr::CodecScratch scratch;
+
+  EXRParallelOptions parallel_options;
+  const EXRParallelOptions *options;  // NULL or &parallel_options
+  int zip_compression_level;
+#if TINYEXR_USE_ZFP
+  tinyexr::ZFPCompressionParam zfp_compression_param;
+#endif
+  const void *compression_param;
+};
+
+int CreateEXRScanlineWriter(EXRScanlineWriter **writer,
+                            const EXRHeader *exr_header, int width,
+                            int height, const char *filename,
+                            const EXRParallelOptions *options,
+                            const char **err) {
+  if (writer == NULL || exr_header == NULL || filename == NULL ||
+      width <= 0 || height <= 0 || exr_header->num_channels <= 0 ||
+      exr_header->channels == NULL || exr_header->pixel_types == NULL ||
+      exr_header->requested_pixel_types == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for CreateEXRScanlineWriter",
+                             err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
-  return TINYEXR_SUCCESS;
-}
 
-// can save a single or multi-part image (no deep* formats)
-static size_t SaveEXRNPartImageToMemory(const EXRImage* exr_images,
-                                        const EXRHeader** exr_headers,
-                                        unsigned int num_parts,
-                                        unsigned char** memory_out, const char** err) {
-  if (exr_images == NULL || exr_headers == NULL || num_parts == 0 ||
-      memory_out == NULL) {
-    SetErrorMessage("Invalid argument for SaveEXRNPartImageToMemory",
-                    err);
-    return 0;
+  if (exr_header->tiled) {
+    tinyexr::SetErrorMessage(
+        "Tiled image is not supported by the scanline writer", err);
+    return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
   }
-  {
-    for (unsigned int i = 0; i < num_parts; ++i) {
-      if (exr_headers[i]->compression_type < 0) {
-        SetErrorMessage("Invalid argument for SaveEXRNPartImageToMemory",
-                        err);
-        return 0;
-      }
+
+  // Registered codecs are not checked here.
+  if (!tinyexr::FindCodec(exr_header->compression_type)) {
+    switch (exr_header->compression_type) {
+      case TINYEXR_COMPRESSIONTYPE_NONE:
+      case TINYEXR_COMPRESSIONTYPE_RLE:
+      case TINYEXR_COMPRESSIONTYPE_ZIPS:
+      case TINYEXR_COMPRESSIONTYPE_ZIP:
+      case TINYEXR_COMPRESSIONTYPE_PXR24:
+      case TINYEXR_COMPRESSIONTYPE_B44:
+      case TINYEXR_COMPRESSIONTYPE_B44A:
+        break;
+      case TINYEXR_COMPRESSIONTYPE_PIZ:
 #if !TINYEXR_USE_PIZ
-      if (exr_headers[i]->compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
-        SetErrorMessage("PIZ compression is not supported in this build",
-                        err);
-        return 0;
-      }
+        tinyexr::SetErrorMessage(
+            "PIZ compression is not supported in this build", err);
+        return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
+#else
+        break;
 #endif
-      if (exr_headers[i]->compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
+      case TINYEXR_COMPRESSIONTYPE_ZFP:
 #if !TINYEXR_USE_ZFP
-        SetErrorMessage("ZFP compression is not supported in this build",
-                        err);
-        return 0;
+        tinyexr::SetErrorMessage(
+            "ZFP compression is not supported in this build", err);
+        return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
 #else
-        // All channels must be fp32.
-        // No fp16 support in ZFP atm(as of 2023 June)
-        // https://github.com/LLNL/fpzip/issues/2
-        for (int c = 0; c < exr_headers[i]->num_channels; ++c) {
-          if (exr_headers[i]->requested_pixel_types[c] != TINYEXR_PIXELTYPE_FLOAT) {
-            SetErrorMessage("Pixel type must be FLOAT for ZFP compression",
-                            err);
-            return 0;
+        for (int c = 0; c < exr_header->num_channels; ++c) {
+          if (exr_header->requested_pixel_types[c] != TINYEXR_PIXELTYPE_FLOAT) {
+            tinyexr::SetErrorMessage(
+                "Pixel type must be FLOAT for ZFP compression", err);
+            return TINYEXR_ERROR_INVALID_ARGUMENT;
           }
         }
+        break;
 #endif
-      }
+      default:
+        tinyexr::SetErrorMessage("Unsupported compression type", err);
+        return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
     }
   }
 
-  std::vector<unsigned char> memory;
+  TEXRScanlineWriter *w = new TEXRScanlineWriter();
+  w->width = width;
+  w->height = height;
+  w->compression_type = exr_header->compression_type;
+  w->num_scanlines = tinyexr::NumScanlines(exr_header->compression_type);
 
-  // Header
-  {
-    const char header[] = { 0x76, 0x2f, 0x31, 0x01 };
-    memory.insert(memory.end(), header, header + 4);
-  }
+  int num_chunks = (height + w->num_scanlines - 1) / w->num_scanlines;
+  w->offsets.resize(static_cast<size_t>(num_chunks), 0);
 
-  // Version
-  // using value from the first header
-  int long_name = exr_headers[0]->long_name;
+  std::vector<unsigned char> memory;
+  tinyexr::WriteEXRVersion(&memory, /* tiled */ false,
+                           exr_header->long_name != 0, /* multipart */ false);
   {
-    char marker[] = { 2, 0, 0, 0 };
-    /* @todo
-    if (exr_header->non_image) {
-    marker[1] |= 0x8;
-    }
-    */
-    // tiled
-    if (num_parts == 1 && exr_images[0].tiles) {
-      marker[1] |= 0x2;
-    }
-    // long_name
-    if (long_name) {
-      marker[1] |= 0x4;
-    }
-    // multipart
-    if (num_parts > 1) {
-      marker[1] |= 0x10;
+    std::string e;
+    if (!tinyexr::WriteEXRPartHeader(&memory, exr_header, width, height,
+                                     width, height, /* tiled */ false,
+                                     num_chunks, /* partnames */ NULL,
+                                     &w->channels, &e)) {
+      tinyexr::SetErrorMessage(e, err);
+      delete w;
+      return TINYEXR_ERROR_INVALID_ARGUMENT;
     }
-    memory.insert(memory.end(), marker, marker + 4);
   }
 
-  int total_chunk_count = 0;
-  std::vector<int> chunk_count(num_parts);
-  std::vector<OffsetData> offset_data(num_parts);
-  for (unsigned int i = 0; i < num_parts; ++i) {
-    if (!exr_images[i].tiles) {
-      int num_scanlines = NumScanlines(exr_headers[i]->compression_type);
-      chunk_count[i] =
-        (exr_images[i].height + num_scanlines - 1) / num_scanlines;
-      InitSingleResolutionOffsets(offset_data[i], chunk_count[i]);
-      total_chunk_count += chunk_count[i];
+  w->channel_offset_list.resize(w->channels.size());
+  for (size_t c = 0; c < w->channels.size(); c++) {
+    w->channel_offset_list[c] = w->pixel_data_size;
+    int pixel_type = w->channels[c].requested_pixel_type;
+    if (pixel_type == TINYEXR_PIXELTYPE_HALF) {
+      w->pixel_data_size += sizeof(unsigned short);
+    } else if ((pixel_type == TINYEXR_PIXELTYPE_FLOAT) ||
+               (pixel_type == TINYEXR_PIXELTYPE_UINT)) {
+      w->pixel_data_size += sizeof(float);
     } else {
-      {
-        std::vector<int> num_x_tiles, num_y_tiles;
-        if (!PrecalculateTileInfo(num_x_tiles, num_y_tiles, exr_headers[i])) {
-          SetErrorMessage("Failed to precalculate Tile info",
-                          err);
-          return TINYEXR_ERROR_INVALID_DATA;
-        }
-        int ntiles = InitTileOffsets(offset_data[i], exr_headers[i], num_x_tiles, num_y_tiles);
-        if (ntiles > 0) {
-          chunk_count[i] = ntiles;
-        } else {
-          SetErrorMessage("Failed to compute Tile offsets",
-                          err);
-          return TINYEXR_ERROR_INVALID_DATA;
-          
-        }
-        total_chunk_count += chunk_count[i];
-      }
+      tinyexr::SetErrorMessage("Invalid requested_pixel_type.", err);
+      delete w;
+      return TINYEXR_ERROR_INVALID_ARGUMENT;
     }
   }
-  // Write attributes to memory buffer.
-  std::vector< std::vector<tinyexr::ChannelInfo> > channels(num_parts);
-  {
-    std::set<std::string> partnames;
-    for (unsigned int i = 0; i < num_parts; ++i) {
-      //channels
-      {
-        std::vector<unsigned char> data;
-
-        for (int c = 0; c < exr_headers[i]->num_channels; c++) {
-          tinyexr::ChannelInfo info;
-          info.p_linear = 0;
-          info.pixel_type = exr_headers[i]->pixel_types[c];
-          info.requested_pixel_type = exr_headers[i]->requested_pixel_types[c];
-          info.x_sampling = 1;
-          info.y_sampling = 1;
-          info.name = std::string(exr_headers[i]->channels[c].name);
-          channels[i].push_back(info);
-        }
 
-        tinyexr::WriteChannelInfo(data, channels[i]);
+  w->zip_compression_level = exr_header->zip_compression_level;
+  if ((w->compression_type == TINYEXR_COMPRESSIONTYPE_ZIPS) ||
+      (w->compression_type == TINYEXR_COMPRESSIONTYPE_ZIP) ||
+      (w->compression_type == TINYEXR_COMPRESSIONTYPE_PXR24)) {
+    w->compression_param = &w->zip_compression_level;
+  }
 
-        tinyexr::WriteAttributeToMemory(&memory, "channels", "chlist", &data.at(0),
-                                        static_cast<int>(data.size()));
-      }
+#if TINYEXR_USE_ZFP
+  if (w->compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
+    // Use ZFP compression parameter from custom attributes(if such a
+    // parameter exists)
+    std::string e;
+    if (!tinyexr::FindZFPCompressionParam(
+            &w->zfp_compression_param, exr_header->custom_attributes,
+            exr_header->num_custom_attributes, &e)) {
+      // Use predefined compression parameter.
+      w->zfp_compression_param.type = 0;
+      w->zfp_compression_param.rate = 2;
+    }
+    w->compression_param = &w->zfp_compression_param;
+  }
+#endif
 
-      {
-        int comp = exr_headers[i]->compression_type;
-        swap4(&comp);
-        WriteAttributeToMemory(
-          &memory, "compression", "compression",
-          reinterpret_cast<const unsigned char*>(&comp), 1);
-      }
+  if (options) {
+    w->parallel_options = *options;
+    w->options = &w->parallel_options;
+  }
 
-      {
-        int data[4] = { 0, 0, exr_images[i].width - 1, exr_images[i].height - 1 };
-        swap4(&data[0]);
-        swap4(&data[1]);
-        swap4(&data[2]);
-        swap4(&data[3]);
-        WriteAttributeToMemory(
-          &memory, "dataWindow", "box2i",
-          reinterpret_cast<const unsigned char*>(data), sizeof(int) * 4);
-
-        int data0[4] = { 0, 0, exr_images[0].width - 1, exr_images[0].height - 1 };
-        swap4(&data0[0]);
-        swap4(&data0[1]);
-        swap4(&data0[2]);
-        swap4(&data0[3]);
-        // Note: must be the same across parts (currently, using value from the first header)
-        WriteAttributeToMemory(
-          &memory, "displayWindow", "box2i",
-          reinterpret_cast<const unsigned char*>(data0), sizeof(int) * 4);
-      }
+  // Reserve the offset table. It is filled in by `CloseEXRScanlineWriter`.
+  w->offset_table_pos = memory.size();
+  memory.resize(memory.size() +
+                sizeof(tinyexr::tinyexr_uint64) * w->offsets.size(), 0);
+  w->file_pos = memory.size();
 
-      {
-        unsigned char line_order = 0;  // @fixme { read line_order from EXRHeader }
-        WriteAttributeToMemory(&memory, "lineOrder", "lineOrder",
-                               &line_order, 1);
-      }
+  w->fp = tinyexr::OpenFileForWriting(filename);
+  if (!w->fp) {
+    tinyexr::SetErrorMessage("Cannot write a file: " + std::string(filename),
+                             err);
+    delete w;
+    return TINYEXR_ERROR_CANT_WRITE_FILE;
+  }
 
-      {
-        // Note: must be the same across parts
-        float aspectRatio = 1.0f;
-        swap4(&aspectRatio);
-        WriteAttributeToMemory(
-          &memory, "pixelAspectRatio", "float",
-          reinterpret_cast<const unsigned char*>(&aspectRatio), sizeof(float));
-      }
+  if (fwrite(&memory.at(0), 1, memory.size(), w->fp) != memory.size()) {
+    tinyexr::SetErrorMessage("Cannot write a file", err);
+    delete w;
+    return TINYEXR_ERROR_CANT_WRITE_FILE;
+  }
 
-      {
-        float center[2] = { 0.0f, 0.0f };
-        swap4(&center[0]);
-        swap4(&center[1]);
-        WriteAttributeToMemory(
-          &memory, "screenWindowCenter", "v2f",
-          reinterpret_cast<const unsigned char*>(center), 2 * sizeof(float));
-      }
+  (*writer) = w;
+  return TINYEXR_SUCCESS;
+}
 
-      {
-        float w = 1.0f;
-        swap4(&w);
-        WriteAttributeToMemory(&memory, "screenWindowWidth", "float",
-                               reinterpret_cast<const unsigned char*>(&w),
-                               sizeof(float));
-      }
-
-      if (exr_images[i].tiles) {
-        unsigned char tile_mode = static_cast<unsigned char>(exr_headers[i]->tile_level_mode & 0x3);
-        if (exr_headers[i]->tile_rounding_mode) tile_mode |= (1u << 4u);
-        //unsigned char data[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-        unsigned int datai[3] = { 0, 0, 0 };
-        unsigned char* data = reinterpret_cast<unsigned char*>(&datai[0]);
-        datai[0] = static_cast<unsigned int>(exr_headers[i]->tile_size_x);
-        datai[1] = static_cast<unsigned int>(exr_headers[i]->tile_size_y);
-        data[8] = tile_mode;
-        swap4(reinterpret_cast<unsigned int*>(&data[0]));
-        swap4(reinterpret_cast<unsigned int*>(&data[4]));
-        WriteAttributeToMemory(
-          &memory, "tiles", "tiledesc",
-          reinterpret_cast<const unsigned char*>(data), 9);
-      }
+int EXRScanlineWriterWriteScanlines(EXRScanlineWriter *writer, int y,
+                                    int num_lines,
+                                    const EXRFrameBufferSlice *slices,
+                                    const char **err) {
+  if (writer == NULL || slices == NULL || num_lines <= 0) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for EXRScanlineWriterWriteScanlines", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
-      // must be present for multi-part files - according to spec.
-      if (num_parts > 1) {
-        // name
-        {
-          size_t len = 0;
-          if ((len = strlen(exr_headers[i]->name)) > 0) {
-#if TINYEXR_HAS_CXX11
-            partnames.emplace(exr_headers[i]->name);
-#else
-            partnames.insert(std::string(exr_headers[i]->name));
-#endif
-            if (partnames.size() != i + 1) {
-              SetErrorMessage("'name' attributes must be unique for a multi-part file", err);
-              return 0;
-            }
-            WriteAttributeToMemory(
-              &memory, "name", "string",
-              reinterpret_cast<const unsigned char*>(exr_headers[i]->name),
-              static_cast<int>(len));
-          } else {
-            SetErrorMessage("Invalid 'name' attribute for a multi-part file", err);
-            return 0;
-          }
-        }
-        // type
-        {
-          const char* type = "scanlineimage";
-          if (exr_images[i].tiles) type = "tiledimage";
-          WriteAttributeToMemory(
-            &memory, "type", "string",
-            reinterpret_cast<const unsigned char*>(type),
-            static_cast<int>(strlen(type)));
-        }
-        // chunkCount
-        {
-          WriteAttributeToMemory(
-            &memory, "chunkCount", "int",
-            reinterpret_cast<const unsigned char*>(&chunk_count[i]),
-            4);
-        }
-      }
+  if (writer->failed) {
+    tinyexr::SetErrorMessage("Scanline writer is in error state", err);
+    return TINYEXR_ERROR_CANT_WRITE_FILE;
+  }
 
-      // Custom attributes
-      if (exr_headers[i]->num_custom_attributes > 0) {
-        for (int j = 0; j < exr_headers[i]->num_custom_attributes; j++) {
-          tinyexr::WriteAttributeToMemory(
-            &memory, exr_headers[i]->custom_attributes[j].name,
-            exr_headers[i]->custom_attributes[j].type,
-            reinterpret_cast<const unsigned char*>(
-              exr_headers[i]->custom_attributes[j].value),
-            exr_headers[i]->custom_attributes[j].size);
-        }
-      }
+  if (y != writer->next_y) {
+    tinyexr::SetErrorMessage(
+        "Scanlines must be written in increasing order without gaps", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
 
-      {  // end of header
-        memory.push_back(0);
-      }
-    }
+  if (num_lines > writer->height - y) {
+    tinyexr::SetErrorMessage("Scanlines exceed the data window", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
-  if (num_parts > 1) {
-    // end of header list
-    memory.push_back(0);
+
+  for (size_t c = 0; c < writer->channels.size(); c++) {
+    if ((slices[c].base == NULL) ||
+        ((slices[c].pixel_type != TINYEXR_PIXELTYPE_UINT) &&
+         (slices[c].pixel_type != TINYEXR_PIXELTYPE_HALF) &&
+         (slices[c].pixel_type != TINYEXR_PIXELTYPE_FLOAT))) {
+      tinyexr::SetErrorMessage("Invalid frame buffer slice", err);
+      return TINYEXR_ERROR_INVALID_ARGUMENT;
+    }
   }
 
-  tinyexr_uint64 chunk_offset = memory.size() + size_t(total_chunk_count) * sizeof(tinyexr_uint64);
+  const int width = writer->width;
+  const int height = writer->height;
+  const int num_scanlines = writer->num_scanlines;
+  const size_t line_size =
+      static_cast<size_t>(width) * writer->pixel_data_size;
+
+  // Limit the number of chunks encoded at a time so that compressed chunks
+  // waiting to be written do not hold much memory.
+  const size_t kMaxBytesInFlight = 64 * 1024 * 1024;
+  const int max_chunks = static_cast<int>((std::max)(
+      size_t(1), kMaxBytesInFlight /
+                     (line_size * static_cast<size_t>(num_scanlines))));
+
+  int line = 0;  // relative to `y`
+  while (line < num_lines) {
+    const int cur_y = y + line;
+    const int chunk_y = (cur_y / num_scanlines) * num_scanlines;
+    const int chunk_lines = (std::min)(num_scanlines, height - chunk_y);
+
+    if ((cur_y == chunk_y) && (num_lines - line >= chunk_lines)) {
+      // Encode complete chunks directly from `slices`.
+      int num_chunks = 0;
+      int end_y = cur_y;
+      while ((num_chunks < max_chunks) && (end_y < y + num_lines)) {
+        int n = (std::min)(num_scanlines, height - end_y);
+        if (end_y + n > y + num_lines) {
+          break;
+        }
+        end_y += n;
+        num_chunks++;
+      }
 
-  tinyexr_uint64 total_size = 0;
-  std::vector< std::vector< std::vector<unsigned char> > > data_lists(num_parts);
-  for (unsigned int i = 0; i < num_parts; ++i) {
-    std::string e;
-    int ret = EncodeChunk(&exr_images[i], exr_headers[i],
-                          channels[i],
-                          chunk_count[i],
-                          // starting offset of current chunk after part-number
-                          chunk_offset,
-                          num_parts > 1,
-                          offset_data[i], // output: block offsets, must be initialized
-                          data_lists[i], // output
-                          total_size, // output
-                          &e);
-    if (ret != TINYEXR_SUCCESS) {
-      if (!e.empty()) {
-        tinyexr::SetErrorMessage(e, err);
+      if (writer->chunks.size() < static_cast<size_t>(num_chunks)) {
+        writer->chunks.resize(static_cast<size_t>(num_chunks));
       }
-      return 0;
-    }
-    chunk_offset = total_size;
-  }
 
-  // Allocating required memory
-  if (total_size == 0) { // something went wrong
-    tinyexr::SetErrorMessage("Output memory size is zero", err);
-    return TINYEXR_ERROR_INVALID_DATA;
-  }
-  (*memory_out) = static_cast<unsigned char*>(malloc(size_t(total_size)));
+#if TINYEXR_HAS_CXX11
+      std::atomic<bool> invalid_data(false);
+#else
+      bool invalid_data(false);
+#endif
 
-  // Writing header
-  memcpy((*memory_out), &memory[0], memory.size());
-  unsigned char* memory_ptr = *memory_out + memory.size();
-  size_t sum = memory.size();
+      tinyexr::ParallelFor(num_chunks, writer->options, [&](int i) {
+        int start_y = cur_y + i * num_scanlines;
+        int n = (std::min)(num_scanlines, height - start_y);
+        std::vector<unsigned char> &chunk =
+            writer->chunks[static_cast<size_t>(i)];
+        chunk.resize(2 * sizeof(int));
+        if (!tinyexr::EncodePixelData(
+                chunk, slices, writer->compression_type, width, start_y - y,
+                n, writer->pixel_data_size, writer->channels,
+                writer->channel_offset_list, NULL,
+                writer->compression_param)) {
+          invalid_data = true;
+        }
+      });
 
-  // Writing offset data for chunks
-  for (unsigned int i = 0; i < num_parts; ++i) {
-    if (exr_images[i].tiles) {
-      const EXRImage* level_image = &exr_images[i];
-      int num_levels = (exr_headers[i]->tile_level_mode != TINYEXR_TILE_RIPMAP_LEVELS) ?
-        offset_data[i].num_x_levels : (offset_data[i].num_x_levels * offset_data[i].num_y_levels);
-      for (int level_index = 0; level_index < num_levels; ++level_index) {
-        for (size_t j = 0; j < offset_data[i].offsets[level_index].size(); ++j) {
-          size_t num_bytes = sizeof(tinyexr_uint64) * offset_data[i].offsets[level_index][j].size();
-          sum += num_bytes;
-          if (sum > total_size) {
-            tinyexr::SetErrorMessage("Invalid offset bytes in Tiled Part image.", err);
-            return TINYEXR_ERROR_INVALID_DATA;
-          }
+      if (invalid_data) {
+        writer->failed = true;
+        tinyexr::SetErrorMessage("Failed to encode scanline data.", err);
+        return TINYEXR_ERROR_INVALID_DATA;
+      }
 
-          memcpy(memory_ptr,
-                 reinterpret_cast<unsigned char*>(&offset_data[i].offsets[level_index][j][0]),
-                 num_bytes);
-          memory_ptr += num_bytes;
+      for (int i = 0; i < num_chunks; i++) {
+        if (!writer->WriteChunk(cur_y + i * num_scanlines,
+                                &writer->chunks[static_cast<size_t>(i)])) {
+          writer->failed = true;
+          tinyexr::SetErrorMessage("Cannot write a file", err);
+          return TINYEXR_ERROR_CANT_WRITE_FILE;
         }
-        level_image = level_image->next_level;
       }
+
+      line += end_y - cur_y;
     } else {
-      size_t num_bytes = sizeof(tinyexr::tinyexr_uint64) * static_cast<size_t>(chunk_count[i]);
-      sum += num_bytes;
-      if (sum > total_size) {
-        tinyexr::SetErrorMessage("Invalid offset bytes in Part image.", err);
+      // Accumulate scanlines of a partial chunk.
+      int n = (std::min)(num_lines - line, chunk_y + chunk_lines - cur_y);
+      if (cur_y == chunk_y) {
+        writer->pending.resize(line_size * static_cast<size_t>(chunk_lines));
+      }
+
+      if (!tinyexr::PackPixelData(
+              &writer->pending.at(line_size *
+                                  static_cast<size_t>(cur_y - chunk_y)),
+              slices, line, width, n, writer->pixel_data_size,
+              writer->channels, writer->channel_offset_list)) {
+        writer->failed = true;
+        tinyexr::SetErrorMessage("Failed to encode scanline data.", err);
         return TINYEXR_ERROR_INVALID_DATA;
       }
-      std::vector<tinyexr::tinyexr_uint64>& offsets = offset_data[i].offsets[0][0];
-      memcpy(memory_ptr, reinterpret_cast<unsigned char*>(&offsets[0]), num_bytes);
-      memory_ptr += num_bytes;
-    }
-  }
 
-  // Writing chunk data
-  for (unsigned int i = 0; i < num_parts; ++i) {
-    for (size_t j = 0; j < static_cast<size_t>(chunk_count[i]); ++j) {
-      if (num_parts > 1) {
-        sum += 4;
-        if (sum > total_size) {
-          tinyexr::SetErrorMessage("Buffer overrun in reading Part image chunk data.", err);
+      if (cur_y + n == chunk_y + chunk_lines) {
+        if (writer->chunks.empty()) {
+          writer->chunks.resize(1);
+        }
+        std::vector<unsigned char> &chunk = writer->chunks[0];
+        chunk.resize(2 * sizeof(int));
+        std::string e;
+        if (!tinyexr::CompressPixelData(
+                chunk, writer->pending, writer->compression_type, width,
+                chunk_lines, writer->channels, &writer->scratch, &e,
+                writer->compression_param)) {
+          writer->failed = true;
+          tinyexr::SetErrorMessage("Failed to encode scanline data. " + e,
+                                   err);
           return TINYEXR_ERROR_INVALID_DATA;
         }
-        unsigned int part_number = i;
-        swap4(&part_number);
-        memcpy(memory_ptr, &part_number, 4);
-        memory_ptr += 4;
-      }
-      sum += data_lists[i][j].size();
-      if (sum > total_size) {
-        tinyexr::SetErrorMessage("Buffer overrun in reading Part image chunk data.", err);
-        return TINYEXR_ERROR_INVALID_DATA;
+        if (!writer->WriteChunk(chunk_y, &chunk)) {
+          writer->failed = true;
+          tinyexr::SetErrorMessage("Cannot write a file", err);
+          return TINYEXR_ERROR_CANT_WRITE_FILE;
+        }
       }
-      memcpy(memory_ptr, &data_lists[i][j][0], data_lists[i][j].size());
-      memory_ptr += data_lists[i][j].size();
+
+      line += n;
     }
-  }
 
-  if (sum != total_size) {
-    tinyexr::SetErrorMessage("Corrupted Part image chunk data.", err);
-    return TINYEXR_ERROR_INVALID_DATA;
+    writer->next_y = y + line;
   }
 
-  return size_t(total_size);  // OK
-}
-
-#ifdef __clang__
-#pragma clang diagnostic pop
-#endif
-
-} // tinyexr
-
-size_t SaveEXRImageToMemory(const EXRImage* exr_image,
-                             const EXRHeader* exr_header,
-                             unsigned char** memory_out, const char** err) {
-  return tinyexr::SaveEXRNPartImageToMemory(exr_image, &exr_header, 1, memory_out, err);
+  return TINYEXR_SUCCESS;
 }
 
-int SaveEXRImageToFile(const EXRImage *exr_image, const EXRHeader *exr_header,
-                       const char *filename, const char **err) {
-  if (exr_image == NULL || filename == NULL ||
-      exr_header->compression_type < 0) {
-    tinyexr::SetErrorMessage("Invalid argument for SaveEXRImageToFile", err);
-    return TINYEXR_ERROR_INVALID_ARGUMENT;
-  }
-
-#if !TINYEXR_USE_PIZ
-  if (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_PIZ) {
-    tinyexr::SetErrorMessage("PIZ compression is not supported in this build",
-                             err);
-    return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
-  }
-#endif
-
-#if !TINYEXR_USE_ZFP
-  if (exr_header->compression_type == TINYEXR_COMPRESSIONTYPE_ZFP) {
-    tinyexr::SetErrorMessage("ZFP compression is not supported in this build",
-                             err);
-    return TINYEXR_ERROR_UNSUPPORTED_FEATURE;
-  }
-#endif
-
-  FILE *fp = NULL;
-#ifdef _WIN32
-#if defined(_MSC_VER) || (defined(MINGW_HAS_SECURE_API) && MINGW_HAS_SECURE_API) // MSVC, MinGW GCC, or Clang
-  errno_t errcode =
-      _wfopen_s(&fp, tinyexr::UTF8ToWchar(filename).c_str(), L"wb");
-  if (errcode != 0) {
-    tinyexr::SetErrorMessage("Cannot write a file: " + std::string(filename),
-                             err);
-    return TINYEXR_ERROR_CANT_WRITE_FILE;
-  }
-#else
-  // Unknown compiler or MinGW without MINGW_HAS_SECURE_API.
-  fp = fopen(filename, "wb");
-#endif
-#else
-  fp = fopen(filename, "wb");
-#endif
-  if (!fp) {
-    tinyexr::SetErrorMessage("Cannot write a file: " + std::string(filename),
+int CloseEXRScanlineWriter(EXRScanlineWriter *writer, const char **err) {
+  if (writer == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for CloseEXRScanlineWriter",
                              err);
-    return TINYEXR_ERROR_CANT_WRITE_FILE;
-  }
-
-  unsigned char *mem = NULL;
-  size_t mem_size = SaveEXRImageToMemory(exr_image, exr_header, &mem, err);
-  if (mem_size == 0) {
-    fclose(fp);
-    return TINYEXR_ERROR_SERIALIZATION_FAILED;
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  size_t written_size = 0;
-  if ((mem_size > 0) && mem) {
-    written_size = fwrite(mem, 1, mem_size, fp);
+  int ret = TINYEXR_SUCCESS;
+  if (writer->failed) {
+    tinyexr::SetErrorMessage("Scanline writer is in error state", err);
+    ret = TINYEXR_ERROR_CANT_WRITE_FILE;
+  } else if (writer->next_y != writer->height) {
+    tinyexr::SetErrorMessage("Not all scanlines were written", err);
+    ret = TINYEXR_ERROR_INVALID_DATA;
+  } else {
+    for (size_t i = 0; i < writer->offsets.size(); i++) {
+      tinyexr::swap8(&writer->offsets[i]);
+    }
+    // The offset table is right after the header, so `long` is enough.
+    if ((fseek(writer->fp, static_cast<long>(writer->offset_table_pos),
+               SEEK_SET) != 0) ||
+        (fwrite(&writer->offsets.at(0), sizeof(tinyexr::tinyexr_uint64),
+                writer->offsets.size(),
+                writer->fp) != writer->offsets.size())) {
+      tinyexr::SetErrorMessage("Cannot write a file", err);
+      ret = TINYEXR_ERROR_CANT_WRITE_FILE;
+    }
   }
-  free(mem);
-
-  fclose(fp);
 
-  if (written_size != mem_size) {
+  if (fclose(writer->fp) != 0 && ret == TINYEXR_SUCCESS) {
     tinyexr::SetErrorMessage("Cannot write a file", err);
-    return TINYEXR_ERROR_CANT_WRITE_FILE;
+    ret = TINYEXR_ERROR_CANT_WRITE_FILE;
   }
+  writer->fp = NULL;
 
-  return TINYEXR_SUCCESS;
+  delete writer;
+  return ret;
 }
 
 size_t SaveEXRMultipartImageToMemory(const EXRImage* exr_images,
                                      const EXRHeader** exr_headers,
                                      unsigned int num_parts,
                                      unsigned char** memory_out, const char** err) {
+  return SaveEXRMultipartImageToMemoryWithOptions(exr_images, exr_headers,
+                                                  num_parts, memory_out, NULL,
+                                                  err);
+}
+
+size_t SaveEXRMultipartImageToMemoryWithOptions(const EXRImage* exr_images,
+                                                const EXRHeader** exr_headers,
+                                                unsigned int num_parts,
+                                                unsigned char** memory_out,
+                                                const EXRParallelOptions* options,
+                                                const char** err) {
   if (exr_images == NULL || exr_headers == NULL || num_parts < 2 ||
       memory_out == NULL) {
     tinyexr::SetErrorMessage("Invalid argument for SaveEXRNPartImageToMemory",
                               err);
     return 0;
   }
-  return tinyexr::SaveEXRNPartImageToMemory(exr_images, exr_headers, num_parts, memory_out, err);
+  return tinyexr::SaveEXRNPartImageToMemory(exr_images, exr_headers, num_parts, memory_out, options, err);
 }
 
 int SaveEXRMultipartImageToFile(const EXRImage* exr_images,
@@ -8086,50 +13708,8 @@ int SaveEXRMultipartImageToFile(const EXRImage* exr_images,
     return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
-  FILE *fp = NULL;
-#ifdef _WIN32
-#if defined(_MSC_VER) || (defined(MINGW_HAS_SECURE_API) && MINGW_HAS_SECURE_API) // MSVC, MinGW GCC, or Clang.
-  errno_t errcode =
-    _wfopen_s(&fp, tinyexr::UTF8ToWchar(filename).c_str(), L"wb");
-  if (errcode != 0) {
-    tinyexr::SetErrorMessage("Cannot write a file: " + std::string(filename),
-                             err);
-    return TINYEXR_ERROR_CANT_WRITE_FILE;
-  }
-#else
-  // Unknown compiler or MinGW without MINGW_HAS_SECURE_API.
-  fp = fopen(filename, "wb");
-#endif
-#else
-  fp = fopen(filename, "wb");
-#endif
-  if (!fp) {
-    tinyexr::SetErrorMessage("Cannot write a file: " + std::string(filename),
-                             err);
-    return TINYEXR_ERROR_CANT_WRITE_FILE;
-  }
-
-  unsigned char *mem = NULL;
-  size_t mem_size = SaveEXRMultipartImageToMemory(exr_images, exr_headers, num_parts, &mem, err);
-  if (mem_size == 0) {
-    fclose(fp);
-    return TINYEXR_ERROR_SERIALIZATION_FAILED;
-  }
-
-  size_t written_size = 0;
-  if ((mem_size > 0) && mem) {
-    written_size = fwrite(mem, 1, mem_size, fp);
-  }
-  free(mem);
-
-  fclose(fp);
-
-  if (written_size != mem_size) {
-    tinyexr::SetErrorMessage("Cannot write a file", err);
-    return TINYEXR_ERROR_CANT_WRITE_FILE;
-  }
-
-  return TINYEXR_SUCCESS;
+  return tinyexr::SaveEXRNPartImageToFile(exr_images, exr_headers, num_parts,
+                                          filename, NULL, err);
 }
 
 int LoadDeepEXR(DeepImage *deep_image, const char *filename, const char **err) {
@@ -8328,6 +13908,9 @@ int LoadDeepEXR(DeepImage *deep_image, const char *filename, const char **err) {
         malloc(sizeof(int) * static_cast<size_t>(data_width)));
   }
 
+  // Work buffer for ZIP decompression, reused across scanlines.
+  std::vector<unsigned char> tmp_buf;
+
   for (size_t y = 0; y < static_cast<size_t>(num_blocks); y++) {
     const unsigned char *data_ptr =
         reinterpret_cast<const unsigned char *>(head + offsets[y]);
@@ -8367,7 +13950,7 @@ int LoadDeepEXR(DeepImage *deep_image, const char *filename, const char **err) {
       if (!tinyexr::DecompressZip(
               reinterpret_cast<unsigned char *>(&pixelOffsetTable.at(0)),
               &dstLen, data_ptr + 28,
-              static_cast<unsigned long>(packedOffsetTableSize))) {
+              static_cast<unsigned long>(packedOffsetTableSize), &tmp_buf)) {
         return false;
       }
 
@@ -8387,7 +13970,7 @@ int LoadDeepEXR(DeepImage *deep_image, const char *filename, const char **err) {
         if (!tinyexr::DecompressZip(
                 reinterpret_cast<unsigned char *>(&sample_data.at(0)), &dstLen,
                 data_ptr + 28 + packedOffsetTableSize,
-                static_cast<unsigned long>(packedSampleDataSize))) {
+                static_cast<unsigned long>(packedSampleDataSize), &tmp_buf)) {
           return false;
         }
         TINYEXR_CHECK_AND_RETURN_C(dstLen == static_cast<unsigned long>(unpackedSampleDataSize), TINYEXR_ERROR_INVALID_DATA);
@@ -8446,14 +14029,9 @@ int LoadDeepEXR(DeepImage *deep_image, const char *filename, const char **err) {
           data_offset +=
               sizeof(unsigned int) * static_cast<size_t>(samples_per_line);
         } else if (channels[c].pixel_type == 1) {  // half
-          for (size_t x = 0; x < static_cast<size_t>(samples_per_line); x++) {
-            tinyexr::FP16 f16;
-            const unsigned short *src_ptr = reinterpret_cast<unsigned short *>(
-                &sample_data.at(size_t(data_offset) + x * sizeof(short)));
-            tinyexr::cpy2(&(f16.u), src_ptr);
-            tinyexr::FP32 f32 = half_to_float(f16);
-            deep_image->image[c][y][x] = f32.f;
-          }
+          tinyexr::HalfToFloatLine(deep_image->image[c][y],
+                                   sample_data.data() + size_t(data_offset),
+                                   static_cast<size_t>(samples_per_line));
           data_offset += sizeof(short) * static_cast<size_t>(samples_per_line);
         } else {  // float
           for (size_t x = 0; x < static_cast<size_t>(samples_per_line); x++) {
@@ -8519,6 +14097,42 @@ void InitEXRHeader(EXRHeader *exr_header) {
   memset(exr_header, 0, sizeof(EXRHeader));
 }
 
+void InitEXRParallelOptions(EXRParallelOptions *options) {
+  if (options == NULL) {
+    return;
+  }
+
+  memset(options, 0, sizeof(EXRParallelOptions));
+}
+
+void EXRSetZipCodec(EXRDeflateFunc deflate_func, EXRInflateFunc inflate_func,
+                    void *userdata) {
+  tinyexr::g_zip_codec.deflate_func = deflate_func;
+  tinyexr::g_zip_codec.inflate_func = inflate_func;
+  tinyexr::g_zip_codec.userdata = userdata;
+}
+
+int EXRRegisterCodec(int compression_type, const EXRCodec *codec) {
+  if ((compression_type <= TINYEXR_COMPRESSIONTYPE_NONE) ||
+      (compression_type > 255)) {
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  EXRCodec &dst = tinyexr::g_codecs[compression_type];
+  if (codec == NULL) {
+    memset(&dst, 0, sizeof(EXRCodec));
+    return TINYEXR_SUCCESS;
+  }
+
+  if ((codec->lines_per_block < 1) ||
+      ((codec->compress_func == NULL) && (codec->decompress_func == NULL))) {
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  dst = *codec;
+  return TINYEXR_SUCCESS;
+}
+
 int FreeEXRHeader(EXRHeader *exr_header) {
   if (exr_header == NULL) {
     return TINYEXR_ERROR_INVALID_ARGUMENT;
@@ -8610,6 +14224,52 @@ int FreeEXRImage(EXRImage *exr_image) {
   return TINYEXR_SUCCESS;
 }
 
+EXRThreadPool *CreateEXRThreadPool(int num_threads) {
+#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
+  return reinterpret_cast<EXRThreadPool *>(
+      new tinyexr::ThreadPool(num_threads));
+#else
+  (void)num_threads;
+  return NULL;
+#endif
+}
+
+void FreeEXRThreadPool(EXRThreadPool *pool) {
+#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
+  if (pool == NULL) {
+    return;
+  }
+
+  tinyexr::ThreadPool *p = reinterpret_cast<tinyexr::ThreadPool *>(pool);
+  tinyexr::ThreadPool *expected = p;
+  tinyexr::g_thread_pool.compare_exchange_strong(expected, NULL);
+
+  delete p;
+#else
+  (void)pool;
+#endif
+}
+
+void EXRSetGlobalThreadPool(EXRThreadPool *pool) {
+#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
+  tinyexr::g_thread_pool.store(reinterpret_cast<tinyexr::ThreadPool *>(pool));
+#else
+  (void)pool;
+#endif
+}
+
+int EXRThreadPoolNumThreads(const EXRThreadPool *pool) {
+#if TINYEXR_HAS_CXX11 && (TINYEXR_USE_THREAD > 0)
+  if (pool == NULL) {
+    return tinyexr::GetThreadPool()->num_threads();
+  }
+  return reinterpret_cast<const tinyexr::ThreadPool *>(pool)->num_threads();
+#else
+  (void)pool;
+  return 1;
+#endif
+}
+
 int ParseEXRHeaderFromFile(EXRHeader *exr_header, const EXRVersion *exr_version,
                            const char *filename, const char **err) {
   if (exr_header == NULL || exr_version == NULL || filename == NULL) {
@@ -8856,18 +14516,43 @@ int ParseEXRVersionFromFile(EXRVersion *version, const char *filename) {
   return ParseEXRVersionFromMemory(version, buf, tinyexr::kEXRVersionSize);
 }
 
-int LoadEXRMultipartImageFromMemory(EXRImage *exr_images,
-                                    const EXRHeader **exr_headers,
-                                    unsigned int num_parts,
-                                    const unsigned char *memory,
-                                    const size_t size, const char **err) {
+namespace tinyexr {
+
+// `LoadEXRMultipartImagePartsFromMemory` for `memory` mapped by tinyexr:
+// `options->mmap_advice` is applied. NULL `part_indices` loads all parts.
+static int LoadMappedEXRMultipartImageParts(
+    EXRImage *exr_images, const EXRHeader **exr_headers,
+    unsigned int num_parts, const int *part_indices, unsigned int num_selected,
+    const unsigned char *memory, const size_t size,
+    const EXRParallelOptions *options, const char **err) {
   if (exr_images == NULL || exr_headers == NULL || num_parts == 0 ||
-      memory == NULL || (size <= tinyexr::kEXRVersionSize)) {
+      num_selected == 0 || memory == NULL ||
+      (size <= tinyexr::kEXRVersionSize)) {
     tinyexr::SetErrorMessage(
-        "Invalid argument for LoadEXRMultipartImageFromMemory()", err);
+        "Invalid argument for LoadEXRMultipartImagePartsFromMemory()", err);
     return TINYEXR_ERROR_INVALID_ARGUMENT;
   }
 
+  std::vector<int> all_parts;
+  if (part_indices == NULL) {
+    all_parts.resize(num_parts);
+    for (unsigned int i = 0; i < num_parts; i++) {
+      all_parts[i] = int(i);
+    }
+    part_indices = all_parts.data();
+    num_selected = num_parts;
+  }
+
+  std::vector<bool> selected(num_parts, false);
+  for (unsigned int k = 0; k < num_selected; k++) {
+    int i = part_indices[k];
+    if ((i < 0) || (i >= int(num_parts)) || selected[size_t(i)]) {
+      tinyexr::SetErrorMessage("Invalid or duplicated part index.", err);
+      return TINYEXR_ERROR_INVALID_ARGUMENT;
+    }
+    selected[size_t(i)] = true;
+  }
+
   // compute total header size.
   size_t total_header_size = 0;
   for (unsigned int i = 0; i < num_parts; i++) {
@@ -8895,12 +14580,29 @@ int LoadEXRMultipartImageFromMemory(EXRImage *exr_images,
   //   'unsigned int(4 bytes)' in OpenEXR implementation...
   //   http://www.openexr.com/openexrfilelayout.pdf
 
-  // Load chunk offset table.
-  std::vector<tinyexr::OffsetData> chunk_offset_table_list;
-  chunk_offset_table_list.reserve(num_parts);
+  // Load chunk offset table of the selected parts. Offset tables are stored
+  // in part order, and the table of a part has `chunk_count` entries, so the
+  // tables of the other parts are skipped without reading them.
+  std::vector<tinyexr::OffsetData> chunk_offset_table_list(num_parts);
   for (size_t i = 0; i < static_cast<size_t>(num_parts); i++) {
-    chunk_offset_table_list.resize(chunk_offset_table_list.size() + 1);
-    tinyexr::OffsetData& offset_data = chunk_offset_table_list.back();
+    if (exr_headers[i]->chunk_count < 0) {
+      tinyexr::SetErrorMessage("Invalid chunk count.", err);
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+    size_t table_size = size_t(exr_headers[i]->chunk_count) *
+                        sizeof(tinyexr::tinyexr_uint64);
+    if (size_t(reinterpret_cast<const unsigned char *>(marker) - memory) +
+            table_size > size) {
+      tinyexr::SetErrorMessage("Insufficient data size for offset table.",
+                               err);
+      return TINYEXR_ERROR_INVALID_DATA;
+    }
+    if (!selected[i]) {
+      marker += table_size;
+      continue;
+    }
+
+    tinyexr::OffsetData& offset_data = chunk_offset_table_list[i];
     if (!exr_headers[i]->tiled || exr_headers[i]->tile_level_mode == TINYEXR_TILE_ONE_LEVEL) {
       tinyexr::InitSingleResolutionOffsets(offset_data, size_t(exr_headers[i]->chunk_count));
       std::vector<tinyexr::tinyexr_uint64>& offset_table = offset_data.offsets[0][0];
@@ -8951,8 +14653,26 @@ int LoadEXRMultipartImageFromMemory(EXRImage *exr_images,
     }
   }
 
-  // Decode image.
-  for (size_t i = 0; i < static_cast<size_t>(num_parts); i++) {
+  // Hint the chunks of the selected parts before the 'part number' check
+  // below touches them.
+  const int advice = MmapAdvice(options);
+  ChunkAdvice chunk_advice(memory, size, advice);
+  if (advice != 0) {
+    std::vector<ChunkRange> ranges;
+    for (size_t k = 0; k < static_cast<size_t>(num_selected); k++) {
+      size_t i = size_t(part_indices[k]);
+      AppendChunkRanges(chunk_offset_table_list[i], exr_headers[i]->tiled != 0,
+                        0, size_t(exr_headers[i]->chunk_count), memory, size,
+                        &ranges);
+    }
+    chunk_advice.Begin(&ranges);
+  }
+
+  // Set up the selected parts.
+  std::vector<tinyexr::ChunkDecoder> decoders(num_selected);
+  std::vector<size_t> first_blocks(num_selected + 1, 0);
+  for (size_t k = 0; k < static_cast<size_t>(num_selected); k++) {
+    size_t i = size_t(part_indices[k]);
     tinyexr::OffsetData &offset_data = chunk_offset_table_list[i];
 
     // First check 'part number' is identical to 'i'
@@ -8974,8 +14694,37 @@ int LoadEXRMultipartImageFromMemory(EXRImage *exr_images,
         }
 
     std::string e;
-    int ret = tinyexr::DecodeChunk(&exr_images[i], exr_headers[i], offset_data,
-                                   memory, size, &e);
+    int ret = tinyexr::BeginDecodeChunk(
+        &decoders[k], &exr_images[i], exr_headers[i], offset_data, memory,
+        size, options, /* roi */ NULL, /* frame_buffer */ NULL, &e);
+    if (ret != TINYEXR_SUCCESS) {
+      if (!e.empty()) {
+        tinyexr::SetErrorMessage(e, err);
+      }
+      return ret;
+    }
+    first_blocks[k + 1] = first_blocks[k] + decoders[k].num_blocks;
+  }
+
+  if (first_blocks.back() > size_t(std::numeric_limits<int>::max())) {
+    tinyexr::SetErrorMessage("Too many chunks.", err);
+    return TINYEXR_ERROR_INVALID_DATA;
+  }
+
+  // Decode the blocks of all parts in one parallel loop, so that many small
+  // parts(e.g. one AOV per part) keep all threads busy.
+  tinyexr::ParallelFor(int(first_blocks.back()), options, [&](int n) {
+    size_t k = size_t(std::upper_bound(first_blocks.begin(),
+                                       first_blocks.end(), size_t(n)) -
+                      first_blocks.begin()) - 1;
+    tinyexr::DecodeChunkBlock(&decoders[k], size_t(n) - first_blocks[k]);
+  });
+
+  chunk_advice.End();
+
+  for (size_t k = 0; k < static_cast<size_t>(num_selected); k++) {
+    std::string e;
+    int ret = tinyexr::EndDecodeChunk(&decoders[k], &e);
     if (ret != TINYEXR_SUCCESS) {
       if (!e.empty()) {
         tinyexr::SetErrorMessage(e, err);
@@ -8987,6 +14736,99 @@ int LoadEXRMultipartImageFromMemory(EXRImage *exr_images,
   return TINYEXR_SUCCESS;
 }
 
+}  // namespace tinyexr
+
+int LoadEXRMultipartImageFromMemory(EXRImage *exr_images,
+                                    const EXRHeader **exr_headers,
+                                    unsigned int num_parts,
+                                    const unsigned char *memory,
+                                    const size_t size, const char **err) {
+  return LoadEXRMultipartImageFromMemoryWithOptions(
+      exr_images, exr_headers, num_parts, memory, size, NULL, err);
+}
+
+int LoadEXRMultipartImageFromMemoryWithOptions(
+    EXRImage *exr_images, const EXRHeader **exr_headers,
+    unsigned int num_parts, const unsigned char *memory, const size_t size,
+    const EXRParallelOptions *options, const char **err) {
+  if (exr_images == NULL || exr_headers == NULL || num_parts == 0 ||
+      memory == NULL || (size <= tinyexr::kEXRVersionSize)) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for LoadEXRMultipartImageFromMemory()", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  EXRParallelOptions memory_options;
+  return tinyexr::LoadMappedEXRMultipartImageParts(
+      exr_images, exr_headers, num_parts, /* part_indices */ NULL, num_parts,
+      memory, size, tinyexr::WithoutMmapAdvice(options, &memory_options), err);
+}
+
+int LoadEXRMultipartImagePartsFromMemory(
+    EXRImage *exr_images, const EXRHeader **exr_headers,
+    unsigned int num_parts, const int *part_indices, unsigned int num_selected,
+    const unsigned char *memory, const size_t size,
+    const EXRParallelOptions *options, const char **err) {
+  if (part_indices == NULL) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for LoadEXRMultipartImagePartsFromMemory()", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  EXRParallelOptions memory_options;
+  return tinyexr::LoadMappedEXRMultipartImageParts(
+      exr_images, exr_headers, num_parts, part_indices, num_selected, memory,
+      size, tinyexr::WithoutMmapAdvice(options, &memory_options), err);
+}
+
+int EXRFindPartByName(const EXRHeader **exr_headers, unsigned int num_parts,
+                      const char *name) {
+  if (exr_headers == NULL || name == NULL) {
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < num_parts; i++) {
+    if (strncmp(exr_headers[i]->name, name, 255) == 0) {
+      return int(i);
+    }
+  }
+  return -1;
+}
+
+int EXRFileLoadMultipartImage(const EXRFile *file, EXRImage *exr_images,
+                              const EXRHeader **exr_headers,
+                              unsigned int num_parts,
+                              const EXRParallelOptions *options,
+                              const char **err) {
+  if (file == NULL) {
+    tinyexr::SetErrorMessage("Invalid argument for EXRFileLoadMultipartImage",
+                             err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  return tinyexr::LoadMappedEXRMultipartImageParts(
+      exr_images, exr_headers, num_parts, /* part_indices */ NULL, num_parts,
+      file->file.data, file->file.size, options, err);
+}
+
+int EXRFileLoadMultipartImageParts(const EXRFile *file, EXRImage *exr_images,
+                                   const EXRHeader **exr_headers,
+                                   unsigned int num_parts,
+                                   const int *part_indices,
+                                   unsigned int num_selected,
+                                   const EXRParallelOptions *options,
+                                   const char **err) {
+  if (file == NULL || part_indices == NULL) {
+    tinyexr::SetErrorMessage(
+        "Invalid argument for EXRFileLoadMultipartImageParts", err);
+    return TINYEXR_ERROR_INVALID_ARGUMENT;
+  }
+
+  return tinyexr::LoadMappedEXRMultipartImageParts(
+      exr_images, exr_headers, num_parts, part_indices, num_selected,
+      file->file.data, file->file.size, options, err);
+}
+
 int LoadEXRMultipartImageFromFile(EXRImage *exr_images,
                                   const EXRHeader **exr_headers,
                                   unsigned int num_parts, const char *filename,